@@ -0,0 +1,270 @@
+/*
+ *    actors.c
+ */
+
+
+#include "actors.h"
+#include "context.h"
+#include "marshal.h"
+#include "analyze.h"
+#include "core.h"
+#include "jit.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+
+/*
+ * Intrusive multi-producer single-consumer queue of messages. Senders
+ * exchange the head and link the previous head to their message, the
+ * receiving actor alone follows the links from the tail. The stub keeps
+ * the queue from getting empty, so neither side ever takes a lock.
+ *
+ * A receiver which found no message sets waiting under the lock before it
+ * looks again, a sender checks it after queuing, so one of them sees the
+ * other and only the senders to a sleeping actor touch the lock.
+ */
+typedef struct mailbox
+{
+    Message *head;
+    Message *tail;
+    Message stub;
+    int waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int references;
+} Mailbox;
+
+/*
+ * Start of a spawned actor: the list of its procedure and arguments.
+ */
+typedef struct start
+{
+    Message *request;
+    Mailbox *mailbox;
+    bool jit;
+} Start;
+
+
+static Mailbox *create_mailbox(int references)
+{
+    Mailbox *mailbox = calloc(1, sizeof(Mailbox));
+
+    if (mailbox == NULL) {
+        FATAL("Not enough memory for mailbox");
+    }
+    mailbox->head = &mailbox->stub;
+    mailbox->tail = &mailbox->stub;
+    pthread_mutex_init(&mailbox->lock, NULL);
+    pthread_cond_init(&mailbox->wake, NULL);
+    mailbox->references = references;
+    return mailbox;
+}
+
+static void push(Mailbox *mailbox, Message *message)
+{
+    Message *prev;
+
+    __atomic_store_n(&message->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&mailbox->head, message, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, message, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns NULL only if the queue is empty. A sender which exchanged the
+ * head but hasn't linked its message yet is waited for.
+ */
+static Message *pop(Mailbox *mailbox)
+{
+    for (;;) {
+        Message *tail = mailbox->tail;
+        Message *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+        if (tail == &mailbox->stub) {
+            if (next == NULL) {
+                if (__atomic_load_n(&mailbox->head, __ATOMIC_SEQ_CST) == tail) {
+                    return NULL;
+                }
+                sched_yield();
+                continue;
+            }
+            mailbox->tail = next;
+            tail = next;
+            next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        }
+        if (next != NULL) {
+            mailbox->tail = next;
+            return tail;
+        }
+        if (__atomic_load_n(&mailbox->head, __ATOMIC_SEQ_CST) == tail) {
+            // The last message is taken by putting the stub behind it
+            push(mailbox, &mailbox->stub);
+            next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+            if (next != NULL) {
+                mailbox->tail = next;
+                return tail;
+            }
+        }
+        sched_yield();
+    }
+}
+
+static void deliver(Mailbox *mailbox, Message *message)
+{
+    push(mailbox, message);
+    if (__atomic_load_n(&mailbox->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&mailbox->lock);
+        pthread_cond_signal(&mailbox->wake);
+        pthread_mutex_unlock(&mailbox->lock);
+    }
+}
+
+static Message *take(Mailbox *mailbox)
+{
+    Message *message = pop(mailbox);
+
+    if (message == NULL) {
+        pthread_mutex_lock(&mailbox->lock);
+        __atomic_store_n(&mailbox->waiting, 1, __ATOMIC_SEQ_CST);
+        while ((message = pop(mailbox)) == NULL) {
+            pthread_cond_wait(&mailbox->wake, &mailbox->lock);
+        }
+        __atomic_store_n(&mailbox->waiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&mailbox->lock);
+    }
+    return message;
+}
+
+void actors_retain(struct mailbox *mailbox)
+{
+    __atomic_add_fetch(&mailbox->references, 1, __ATOMIC_RELAXED);
+}
+
+void actors_release(struct mailbox *mailbox)
+{
+    Message *message;
+
+    if (mailbox == NULL || __atomic_sub_fetch(&mailbox->references, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    while ((message = pop(mailbox)) != NULL) {
+        marshal_delete(message);
+    }
+    pthread_mutex_destroy(&mailbox->lock);
+    pthread_cond_destroy(&mailbox->wake);
+    free(mailbox);
+}
+
+Object *actors_create_handle(struct mailbox *mailbox)
+{
+    Actor *actor = (Actor*)object_create(OBJECT_TYPE_ACTOR);
+
+    actor->mailbox = mailbox;
+    return (Object*)actor;
+}
+
+static Mailbox *get_mailbox(void)
+{
+    if (_context->mailbox == NULL) {
+        _context->mailbox = create_mailbox(1);
+    }
+    return _context->mailbox;
+}
+
+static Actor *get_actor(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_ACTOR) {
+        throw("Wrong type of argument %s: expected actor",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return (Actor*)obj;
+}
+
+/*
+ * The actor ends with its procedure. Errors are reported by the thread
+ * and end only the actor.
+ */
+static void *run_actor(void *arg)
+{
+    Start *start = (Start*)arg;
+
+    context_enter(context_create());
+    _context->mailbox = start->mailbox;
+    if (start->jit) {
+        jit_enable();
+    }
+    gc_start();
+
+    if (try_and_catch_error() == ERROR_TYPE_NONE) {
+        List *request = (List*)marshal_read(start->request);
+
+        gc_push((Object*)request);
+        core_apply(request->item, analyze_get_list_size((Object*)request) - 1, request->next);
+    }
+    marshal_delete(start->request);
+    free(start);
+    context_destroy(_context);
+    return NULL;
+}
+
+Object *actors_spawn(Object *obj)
+{
+    Object *proc = ((List*)obj)->item;
+    Message *request;
+    Mailbox *mailbox;
+    Start *start;
+    pthread_t thread;
+
+    if (proc == NULL || (object_get_type(proc) != OBJECT_TYPE_PROCEDURE
+                         && object_get_type(proc) != OBJECT_TYPE_NATIVE)) {
+        throw("Wrong type of argument %s: expected procedure",
+              proc != NULL ? object_to_string(proc) : "#nil");
+    }
+    request = marshal_write(obj);
+    // One reference for the running actor, one for the handle
+    mailbox = create_mailbox(2);
+    start = malloc(sizeof(Start));
+    if (start == NULL) {
+        FATAL("Not enough memory for actor");
+    }
+    start->request = request;
+    start->mailbox = mailbox;
+    start->jit = jit_is_enabled();
+    if (pthread_create(&thread, NULL, &run_actor, start) != 0) {
+        FATAL("Can't start actor");
+    }
+    pthread_detach(thread);
+    return actors_create_handle(mailbox);
+}
+
+Object *actors_send(Object *obj)
+{
+    Actor *actor = get_actor(((List*)obj)->item);
+
+    deliver(actor->mailbox, marshal_write(((List*)obj)->next->item));
+    return NULL;
+}
+
+Object *actors_receive(Object *obj)
+{
+    Message *message = take(get_mailbox());
+    Object *res = marshal_read(message);
+
+    marshal_delete(message);
+    return res;
+}
+
+Object *actors_self(Object *obj)
+{
+    Mailbox *mailbox = get_mailbox();
+
+    actors_retain(mailbox);
+    return actors_create_handle(mailbox);
+}
@@ -0,0 +1,46 @@
+/*
+ *    actors.h
+ */
+
+
+#ifndef ACTORS_H
+#define ACTORS_H
+
+#include "types.h"
+
+struct mailbox;
+
+/*
+ * Actors are procedures running on their own threads, each in its own
+ * context. They share nothing and communicate by messages: send copies a
+ * value into a message and queues it, receive takes the oldest message
+ * of the current actor and reads the value into its heap, waiting while
+ * there is none. The main program is an actor too, see self.
+ *
+ * Every value is copied twice, serialized by the sender and rebuilt by the
+ * receiver, immutable ones too. Objects can't change owners, each context
+ * collects its own heap.
+ */
+Object *actors_spawn(Object *obj);
+
+Object *actors_send(Object *obj);
+
+Object *actors_receive(Object *obj);
+
+Object *actors_self(Object *obj);
+
+/*
+ * Mailboxes are shared by the handles of an actor in all contexts and by
+ * the context running it. The last reference deletes pending messages.
+ */
+void actors_retain(struct mailbox *mailbox);
+
+void actors_release(struct mailbox *mailbox);
+
+/*
+ * Creates a handle in the current context, which takes over a reference
+ * to the mailbox.
+ */
+Object *actors_create_handle(struct mailbox *mailbox);
+
+#endif // ACTORS_H
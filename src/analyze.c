@@ -0,0 +1,848 @@
+/*
+ *    analyze.c
+ */
+
+
+#include "analyze.h"
+#include "context.h"
+#include "numbers.h"
+#include "optimize.h"
+#include "records.h"
+#include "core.h"
+#include "env.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+static Node *analyze_expression(Object *exp, Scope *scope, bool tail);
+static Node *analyze_sequence(Object *seq, Scope *scope, bool tail);
+
+
+static Object *execute_constant(Node *node, Env *env)
+{
+    return node->value;
+}
+
+static Object *execute_variable(Node *node, Env *env)
+{
+    Object *obj = env_lookup_variable(env, (Unbound*)node->value);
+    if (obj == NULL) {
+        throw("Unbound variable %s", object_to_string(node->value));
+    }
+    return obj;
+}
+
+static Object *execute_definition(Node *node, Env *env)
+{
+    Object *obj = EXECUTE(node->nodes[0], env);
+    if (!env_define_variable(env, (Unbound*)node->value, obj)) {
+        throw("Can't define variable %s", object_to_string(node->value));
+    }
+    return obj;
+}
+
+static Object *execute_assignment(Node *node, Env *env)
+{
+    Object *obj = EXECUTE(node->nodes[0], env);
+    if (!env_set_variable(env, (Unbound*)node->value, obj)) {
+        throw("Can't assign variable %s", object_to_string(node->value));
+    }
+    return obj;
+}
+
+static Object *execute_if(Node *node, Env *env)
+{
+    if (core_object_to_bool(EXECUTE(node->nodes[0], env))) {
+        return EXECUTE(node->nodes[1], env);
+    }
+    return EXECUTE(node->nodes[2], env);
+}
+
+static Object *execute_cond(Node *node, Env *env)
+{
+    unsigned i;
+
+    // Clauses are stored as predicate and action, 'else' has no predicate
+    for (i = 0; i < node->size; i += 2) {
+        Node *pred = node->nodes[i];
+        if (pred == NULL || core_object_to_bool(EXECUTE(pred, env))) {
+            return EXECUTE(node->nodes[i + 1], env);
+        }
+    }
+    return NULL;
+}
+
+static Object *execute_sequence(Node *node, Env *env)
+{
+    const unsigned last = node->size - 1;
+    unsigned i;
+
+    for (i = 0; i < last; i++) {
+        EXECUTE(node->nodes[i], env);
+    }
+    return EXECUTE(node->nodes[last], env);
+}
+
+/*
+ * Runs the optimized expression until the bindings it relies on change.
+ */
+static Object *execute_guard(Node *node, Env *env)
+{
+    if (node->version == _context->env_version) {
+        return EXECUTE(node->nodes[0], env);
+    }
+    return EXECUTE(node->nodes[1], env);
+}
+
+static Object *execute_record_definition(Node *node, Env *env)
+{
+    return records_define(node->value, env);
+}
+
+static Object *execute_lambda(Node *node, Env *env)
+{
+    Proc *proc = (Proc*)object_create(OBJECT_TYPE_PROCEDURE);
+    proc->code = (Code*)node->value;
+    proc->env = env;
+    return (Object*)proc;
+}
+
+static Object *execute_delay(Node *node, Env *env)
+{
+    return core_create_promise(EXECUTE(node->nodes[0], env), NULL, NULL, NULL);
+}
+
+static Object *execute_cons_stream(Node *node, Env *env)
+{
+    Pair *pair;
+
+    gc_push(EXECUTE(node->nodes[0], env));
+    gc_push(EXECUTE(node->nodes[1], env));
+    pair = (Pair*)object_create(OBJECT_TYPE_PAIR);
+    pair->rest = gc_pop();
+    pair->first = gc_pop();
+    return (Object*)pair;
+}
+
+static Object *execute_call(Node *node, Env *env)
+{
+    unsigned i;
+
+    for (i = 0; i < node->size; i++) {
+        gc_push(EXECUTE(node->nodes[i], env));
+    }
+    return core_call(node->size - 1);
+}
+
+static Object *execute_tail_call(Node *node, Env *env)
+{
+    unsigned i;
+
+    for (i = 0; i < node->size; i++) {
+        gc_push(EXECUTE(node->nodes[i], env));
+    }
+    return core_tail_call(node->size - 1);
+}
+
+static void generalize(Node *node)
+{
+    node->execute = node->tail ? &execute_tail_call : &execute_call;
+    node->value = NULL;
+    _context->generic += 1;
+}
+
+static Object *apply_generic(Object *operator, Object *left, Object *right)
+{
+    gc_push(operator);
+    gc_push(left);
+    gc_push(right);
+    return core_call(2);
+}
+
+/*
+ * Call of a builtin numeric operator rewritten for integer operands. It is
+ * valid while the operator variable isn't assigned and operands are
+ * integers, otherwise the node turns into a generic call for good.
+ */
+static Object *execute_integer_operation(Node *node, Env *env, char operation)
+{
+    Object *operator = node->value;
+    Object *left;
+    Object *right;
+    int64_t a;
+    int64_t b;
+    int64_t res;
+
+    if (node->version != _context->env_version) {
+        if (EXECUTE(node->nodes[0], env) != operator) {
+            _context->specialized -= 1;
+            generalize(node);
+            return EXECUTE(node, env);
+        }
+        node->version = _context->env_version;
+    }
+
+    left = EXECUTE(node->nodes[1], env);
+    gc_push(left);
+    right = EXECUTE(node->nodes[2], env);
+    gc_pop();
+
+    if (left == NULL || right == NULL
+        || left->type != OBJECT_TYPE_INTEGER || right->type != OBJECT_TYPE_INTEGER) {
+        _context->specialized -= 1;
+        generalize(node);
+        return apply_generic(operator, left, right);
+    }
+
+    a = ((Integer*)left)->value;
+    b = ((Integer*)right)->value;
+    switch (operation) {
+    case '+':
+        if (__builtin_add_overflow(a, b, &res)) {
+            break;
+        }
+        return numbers_create_integer(res);
+    case '-':
+        if (__builtin_sub_overflow(a, b, &res)) {
+            break;
+        }
+        return numbers_create_integer(res);
+    case '*':
+        if (__builtin_mul_overflow(a, b, &res)) {
+            break;
+        }
+        return numbers_create_integer(res);
+    case '=':
+        return object_boolean(a == b);
+    case '<':
+        return object_boolean(a < b);
+    case '>':
+        return object_boolean(a > b);
+    default:
+        FATAL("Invalid operation %c", operation);
+    }
+    // Overflowing result is promoted by the builtin
+    return apply_generic(operator, left, right);
+}
+
+static Object *execute_integer_plus(Node *node, Env *env)
+{
+    return execute_integer_operation(node, env, '+');
+}
+
+static Object *execute_integer_minus(Node *node, Env *env)
+{
+    return execute_integer_operation(node, env, '-');
+}
+
+static Object *execute_integer_multiply(Node *node, Env *env)
+{
+    return execute_integer_operation(node, env, '*');
+}
+
+static Object *execute_integer_equal(Node *node, Env *env)
+{
+    return execute_integer_operation(node, env, '=');
+}
+
+static Object *execute_integer_less(Node *node, Env *env)
+{
+    return execute_integer_operation(node, env, '<');
+}
+
+static Object *execute_integer_greater(Node *node, Env *env)
+{
+    return execute_integer_operation(node, env, '>');
+}
+
+static const struct {
+    NativeFunction function;
+    Execute execute;
+} _specializations[] = {
+    { &numbers_plus, &execute_integer_plus },
+    { &numbers_minus, &execute_integer_minus },
+    { &numbers_multiply, &execute_integer_multiply },
+    { &numbers_equal, &execute_integer_equal },
+    { &numbers_less, &execute_integer_less },
+    { &numbers_greater, &execute_integer_greater }
+};
+
+/*
+ * Call of a record procedure with fields loaded and stored in place,
+ * valid while the operator variable isn't assigned.
+ */
+static Object *execute_record_call(Node *node, Env *env)
+{
+    RecordProc *proc = (RecordProc*)node->value;
+    Record *record;
+    Object *obj;
+    unsigned i;
+
+    if (node->version != _context->env_version) {
+        if (EXECUTE(node->nodes[0], env) != (Object*)proc) {
+            _context->specialized -= 1;
+            generalize(node);
+            return EXECUTE(node, env);
+        }
+        node->version = _context->env_version;
+    }
+
+    switch (proc->operation) {
+    case RECORD_ACCESSOR:
+        record = (Record*)EXECUTE(node->nodes[1], env);
+        if (records_is_instance((Object*)record, proc->type)) {
+            return record->slots[proc->fields[0]];
+        }
+        return records_apply(proc, 1, (Object**)&record);
+    case RECORD_PREDICATE:
+        obj = EXECUTE(node->nodes[1], env);
+        return object_boolean(records_is_instance(obj, proc->type));
+    case RECORD_MODIFIER:
+        record = (Record*)EXECUTE(node->nodes[1], env);
+        gc_push((Object*)record);
+        obj = EXECUTE(node->nodes[2], env);
+        gc_pop();
+        if (records_is_instance((Object*)record, proc->type)) {
+            record->slots[proc->fields[0]] = obj;
+            return NULL;
+        }
+        return records_apply(proc, 2, (Object*[]){ (Object*)record, obj });
+    default:
+        for (i = 1; i < node->size; i++) {
+            gc_push(EXECUTE(node->nodes[i], env));
+        }
+        obj = records_apply(proc, node->size - 1, gc_peek(node->size - 1));
+        gc_unwind(gc_depth() - (node->size - 1));
+        return obj;
+    }
+}
+
+/*
+ * First execution of a call with a top level operator. The node is
+ * rewritten according to the observed operator.
+ */
+static Object *execute_unspecialized_call(Node *node, Env *env)
+{
+    Object *operator = EXECUTE(node->nodes[0], env);
+    unsigned i;
+
+    if (operator != NULL && operator->type == OBJECT_TYPE_RECORD_PROCEDURE
+        && ((RecordProc*)operator)->argc == node->size - 1) {
+        node->execute = &execute_record_call;
+        node->value = operator;
+        node->version = _context->env_version;
+        _context->specialized += 1;
+        return EXECUTE(node, env);
+    }
+    if (operator != NULL && operator->type == OBJECT_TYPE_NATIVE && node->size == 3) {
+        NativeFunction function = ((Native*)operator)->native_function;
+
+        for (i = 0; i < sizeof(_specializations) / sizeof(*_specializations); i++) {
+            if (_specializations[i].function == function) {
+                node->execute = _specializations[i].execute;
+                node->value = operator;
+                node->version = _context->env_version;
+                _context->specialized += 1;
+                return EXECUTE(node, env);
+            }
+        }
+    }
+    generalize(node);
+    return EXECUTE(node, env);
+}
+
+
+static Node *node_create(Execute execute, Object *exp, Object *value, unsigned size)
+{
+    Node *node = malloc(sizeof(Node) + size * sizeof(Node*));
+    node->execute = execute;
+    node->exp = exp;
+    node->value = value;
+    node->tail = false;
+    node->version = 0;
+    node->size = size;
+    memset(node->nodes, 0, size * sizeof(Node*));
+    return node;
+}
+
+int analyze_get_list_size(Object *obj)
+{
+    List *list = (List*)obj;
+    int size = 0;
+
+    while (list != NULL) {
+        if (object_get_type((Object*)list) != OBJECT_TYPE_LIST) {
+            return -1;
+        }
+        size++;
+        list = list->next;
+    }
+    return size;
+}
+
+bool analyze_is_variable(Object *obj)
+{
+    return obj != NULL && object_get_type(obj) == OBJECT_TYPE_VARIABLE;
+}
+
+bool analyze_is_tagged_list(Object *exp, const char *tag)
+{
+    return exp != NULL && object_get_type(exp) == OBJECT_TYPE_LIST
+        && analyze_is_variable(((List*)exp)->item)
+        && strcmp(((Unbound*)((List*)exp)->item)->cstr, tag) == 0;
+}
+
+static void add_name(Scope *scope, const char *str)
+{
+    scope->names = realloc(scope->names, (scope->size + 1) * sizeof(char*));
+    scope->names[scope->size] = str;
+    scope->size += 1;
+}
+
+/*
+ * Procedures of a record type, the definition is checked later.
+ */
+static void collect_record_names(List *list, Scope *scope)
+{
+    List *spec;
+
+    if (analyze_get_list_size((Object*)list) < 4) {
+        return;
+    }
+    list = list->next->next;
+    if (analyze_get_list_size(list->item) > 0 && analyze_is_variable(((List*)list->item)->item)) {
+        add_name(scope, ((Unbound*)((List*)list->item)->item)->cstr);
+    }
+    for (list = list->next; list != NULL; list = list->next) {
+        if (analyze_is_variable(list->item)) {
+            add_name(scope, ((Unbound*)list->item)->cstr);
+        }
+        for (spec = (List*)list->item; analyze_get_list_size((Object*)spec) > 0;
+             spec = spec->next) {
+            if (spec != (List*)list->item && analyze_is_variable(spec->item)) {
+                add_name(scope, ((Unbound*)spec->item)->cstr);
+            }
+        }
+    }
+}
+
+/*
+ * Collects names of internal definitions of a lambda body, bodies of
+ * nested lambdas have their own scopes.
+ */
+static void collect_definitions(Object *exp, Scope *scope)
+{
+    List *list = (List*)exp;
+
+    if (exp == NULL || object_get_type(exp) != OBJECT_TYPE_LIST
+        || analyze_is_tagged_list(exp, "lambda")) {
+        return;
+    }
+    if (analyze_is_tagged_list(exp, "define-record-type")) {
+        collect_record_names(list, scope);
+        return;
+    }
+    if (analyze_is_tagged_list(exp, "define") && list->next != NULL
+        && object_get_type((Object*)list->next) == OBJECT_TYPE_LIST) {
+        Object *var = list->next->item;
+
+        if (analyze_is_variable(var)) {
+            add_name(scope, ((Unbound*)var)->cstr);
+        }
+        else if (var != NULL && object_get_type(var) == OBJECT_TYPE_LIST
+                 && analyze_is_variable(((List*)var)->item)) {
+            add_name(scope, ((Unbound*)((List*)var)->item)->cstr);
+            return;
+        }
+    }
+    while (list != NULL && object_get_type((Object*)list) == OBJECT_TYPE_LIST) {
+        collect_definitions(list->item, scope);
+        list = list->next;
+    }
+}
+
+void analyze_enter_scope(Scope *scope, Scope *next, List *args, Object *body)
+{
+    scope->args = args;
+    scope->names = NULL;
+    scope->size = 0;
+    scope->next = next;
+    collect_definitions(body, scope);
+}
+
+void analyze_leave_scope(Scope *scope)
+{
+    free(scope->names);
+}
+
+bool analyze_is_bound(Scope *scope, const char *str)
+{
+    List *list;
+    unsigned i;
+
+    for (; scope != NULL; scope = scope->next) {
+        for (list = scope->args; list != NULL; list = list->next) {
+            if (strcmp(((Unbound*)list->item)->cstr, str) == 0) {
+                return true;
+            }
+        }
+        for (i = 0; i < scope->size; i++) {
+            if (strcmp(scope->names[i], str) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Frame of a procedure may outlive the call only if it is captured by a
+ * procedure created inside of the body. Without lambdas and internal
+ * procedure definitions nothing can refer to it after the return.
+ */
+static bool is_capturing(Object *exp)
+{
+    List *list = (List*)exp;
+
+    if (exp == NULL || object_get_type(exp) != OBJECT_TYPE_LIST) {
+        return false;
+    }
+    if (analyze_is_tagged_list(exp, "lambda") || analyze_is_tagged_list(exp, "delay")
+        || analyze_is_tagged_list(exp, "cons-stream")) {
+        return true;
+    }
+    if (analyze_is_tagged_list(exp, "define") && list->next != NULL
+        && object_get_type((Object*)list->next) == OBJECT_TYPE_LIST
+        && list->next->item != NULL
+        && object_get_type(list->next->item) == OBJECT_TYPE_LIST) {
+        return true;
+    }
+    while (list != NULL && object_get_type((Object*)list) == OBJECT_TYPE_LIST) {
+        if (is_capturing(list->item)) {
+            return true;
+        }
+        list = list->next;
+    }
+    return false;
+}
+
+static Node *analyze_lambda(Object *exp, Object *args, Object *body, Scope *scope)
+{
+    Code *code;
+    List *list;
+    Scope inner;
+
+    if (analyze_get_list_size(args) < 0 || analyze_get_list_size(body) < 1) {
+        throw("Invalid lambda expression %s", object_to_string(exp));
+    }
+    for (list = (List*)args; list != NULL; list = list->next) {
+        if (!analyze_is_variable(list->item)) {
+            throw("Invalid argument %s of lambda expression", object_to_string(list->item));
+        }
+    }
+
+    code = (Code*)object_create(OBJECT_TYPE_CODE);
+    code->args = (Pair*)args;
+    code->body = body;
+    code->storage = is_capturing(body) ? STORAGE_HEAP : STORAGE_STACK;
+
+    analyze_enter_scope(&inner, scope, (List*)args, body);
+    code->node = analyze_sequence(body, &inner, true);
+    analyze_leave_scope(&inner);
+    return node_create(&execute_lambda, exp, (Object*)code, 0);
+}
+
+/*
+ * Delayed expression is the body of a procedure without arguments, it is
+ * called when the promise is forced.
+ */
+static Node *analyze_delay(Object *exp, List *args, Scope *scope)
+{
+    Node *node;
+
+    if (analyze_get_list_size((Object*)args) != 1) {
+        throw("Invalid delay expression %s", object_to_string(exp));
+    }
+    node = node_create(&execute_delay, exp, NULL, 1);
+    node->nodes[0] = analyze_lambda(exp, NULL, (Object*)args, scope);
+    return node;
+}
+
+static Node *analyze_cons_stream(Object *exp, List *args, Scope *scope)
+{
+    Node *node;
+
+    if (analyze_get_list_size((Object*)args) != 2) {
+        throw("Invalid cons-stream expression %s", object_to_string(exp));
+    }
+    node = node_create(&execute_cons_stream, exp, NULL, 2);
+    node->nodes[0] = analyze_expression(args->item, scope, false);
+    node->nodes[1] = analyze_delay(exp, args->next, scope);
+    return node;
+}
+
+static Node *analyze_definition(Object *exp, List *args, Scope *scope)
+{
+    Node *node;
+    Object *var;
+
+    if (analyze_get_list_size((Object*)args) < 2) {
+        throw("Invalid define pattern %s", object_to_string(exp));
+    }
+    var = args->item;
+
+    if (var != NULL && object_get_type(var) == OBJECT_TYPE_LIST) {
+        List *list = (List*)var;
+
+        if (!analyze_is_variable(list->item)) {
+            throw("Invalid define pattern %s", object_to_string(var));
+        }
+        node = node_create(&execute_definition, exp, list->item, 1);
+        node->nodes[0] = analyze_lambda(exp, (Object*)list->next, (Object*)args->next, scope);
+    }
+    else if (analyze_is_variable(var) && args->next->next == NULL) {
+        node = node_create(&execute_definition, exp, var, 1);
+        node->nodes[0] = analyze_expression(args->next->item, scope, false);
+    }
+    else {
+        throw("Invalid define pattern %s", object_to_string(exp));
+    }
+    return node;
+}
+
+static Node *analyze_assignment(Object *exp, List *args, Scope *scope)
+{
+    Node *node;
+
+    if (analyze_get_list_size((Object*)args) != 2 || !analyze_is_variable(args->item)) {
+        throw("Invalid set! pattern %s", object_to_string(exp));
+    }
+    node = node_create(&execute_assignment, exp, args->item, 1);
+    node->nodes[0] = analyze_expression(args->next->item, scope, false);
+    return node;
+}
+
+static Node *analyze_if(Object *exp, List *args, Scope *scope, bool tail)
+{
+    Node *node;
+
+    if (analyze_get_list_size((Object*)args) != 3) {
+        throw("Invalid pattern 'if' in %s", object_to_string(exp));
+    }
+    node = node_create(&execute_if, exp, NULL, 3);
+    node->nodes[0] = analyze_expression(args->item, scope, false);
+    node->nodes[1] = analyze_expression(args->next->item, scope, tail);
+    node->nodes[2] = analyze_expression(args->next->next->item, scope, tail);
+    return node;
+}
+
+static Node *analyze_cond(Object *exp, List *args, Scope *scope, bool tail)
+{
+    Node *node;
+    List *list;
+    int size = analyze_get_list_size((Object*)args);
+    unsigned i;
+
+    if (size < 1) {
+        throw("Invalid cond pattern in %s", object_to_string(exp));
+    }
+    node = node_create(&execute_cond, exp, NULL, size * 2);
+
+    for (i = 0, list = args; list != NULL; i += 2, list = list->next) {
+        List *clause = (List*)list->item;
+
+        if (analyze_get_list_size((Object*)clause) < 2) {
+            throw("Invalid cond pattern in %s", object_to_string(exp));
+        }
+        // If it is the last clause:
+        if (analyze_is_variable(clause->item)
+            && strcmp(((Unbound*)clause->item)->cstr, "else") == 0) {
+            if (list->next != NULL) {
+                throw("Invalid cond pattern in %s", object_to_string(exp));
+            }
+            node->nodes[i] = NULL;
+        }
+        else {
+            node->nodes[i] = analyze_expression(clause->item, scope, false);
+        }
+        node->nodes[i + 1] = analyze_sequence((Object*)clause->next, scope, tail);
+    }
+    return node;
+}
+
+static Node *analyze_sequence(Object *seq, Scope *scope, bool tail)
+{
+    Node *node;
+    List *list = (List*)seq;
+    int size = analyze_get_list_size(seq);
+    unsigned i;
+
+    if (size < 1) {
+        throw("Invalid sequence %s", seq != NULL ? object_to_string(seq) : "#nil");
+    }
+    if (size == 1) {
+        return analyze_expression(list->item, scope, tail);
+    }
+
+    node = node_create(&execute_sequence, seq, NULL, size);
+    for (i = 0; list != NULL; i++, list = list->next) {
+        node->nodes[i] = analyze_expression(list->item, scope, tail && list->next == NULL);
+    }
+    return node;
+}
+
+static Node *analyze_guard(Object *exp, Scope *scope, bool tail)
+{
+    Node *node = node_create(&execute_guard, exp, NULL, 2);
+    node->version = optimize_get_version(exp);
+    node->nodes[0] = analyze_expression(optimize_get_optimized(exp), scope, tail);
+    node->nodes[1] = analyze_expression(optimize_get_original(exp), scope, tail);
+    return node;
+}
+
+static Node *analyze_application(Object *exp, Scope *scope, bool tail)
+{
+    Node *node;
+    List *list = (List*)exp;
+    int size = analyze_get_list_size(exp);
+    unsigned i;
+
+    if (size < 1) {
+        throw("Invalid application %s", object_to_string(exp));
+    }
+
+    node = node_create(tail ? &execute_tail_call : &execute_call, exp, NULL, size);
+    node->tail = tail;
+    for (i = 0; list != NULL; i++, list = list->next) {
+        node->nodes[i] = analyze_expression(list->item, scope, false);
+    }
+    if (size >= 2 && analyze_is_variable(((List*)exp)->item)
+        && !analyze_is_bound(scope, ((Unbound*)((List*)exp)->item)->cstr)) {
+        node->execute = &execute_unspecialized_call;
+    }
+    return node;
+}
+
+static Node *analyze_expression(Object *exp, Scope *scope, bool tail)
+{
+    if (exp == NULL || (exp->type != OBJECT_TYPE_PAIR && exp->type != OBJECT_TYPE_UNBOUND)) {
+        return node_create(&execute_constant, exp, exp, 0);
+    }
+    else if (exp->type == OBJECT_TYPE_UNBOUND) {
+        return node_create(&execute_variable, exp, exp, 0);
+    }
+    else if (optimize_is_guard(exp)) {
+        return analyze_guard(exp, scope, tail);
+    }
+    else {
+        Object *operator = ((Pair*)exp)->first;
+        List *operands = (List*)((Pair*)exp)->rest;
+
+        if (operator == NULL
+            || (operator->type != OBJECT_TYPE_UNBOUND && operator->type != OBJECT_TYPE_PAIR)) {
+            throw("Invalid type to apply");
+        }
+        else if (operator->type == OBJECT_TYPE_UNBOUND) {
+            const char *str = ((Unbound*)operator)->cstr;
+
+            if (strcmp(str, "define") == 0) {
+                return analyze_definition(exp, operands, scope);
+            }
+            else if (strcmp(str, "set!") == 0) {
+                return analyze_assignment(exp, operands, scope);
+            }
+            else if (strcmp(str, "if") == 0) {
+                return analyze_if(exp, operands, scope, tail);
+            }
+            else if (strcmp(str, "cond") == 0) {
+                return analyze_cond(exp, operands, scope, tail);
+            }
+            else if (strcmp(str, "begin") == 0) {
+                return analyze_sequence((Object*)operands, scope, tail);
+            }
+            else if (strcmp(str, "delay") == 0) {
+                return analyze_delay(exp, operands, scope);
+            }
+            else if (strcmp(str, "cons-stream") == 0) {
+                return analyze_cons_stream(exp, operands, scope);
+            }
+            else if (strcmp(str, "define-record-type") == 0) {
+                records_check_definition(exp);
+                return node_create(&execute_record_definition, exp, exp, 0);
+            }
+            else if (strcmp(str, "lambda") == 0) {
+                if (analyze_get_list_size((Object*)operands) < 2) {
+                    throw("Invalid lambda expression %s", object_to_string(exp));
+                }
+                return analyze_lambda(exp, operands->item, (Object*)operands->next, scope);
+            }
+        }
+        return analyze_application(exp, scope, tail);
+    }
+}
+
+Code *analyze(Object *exp)
+{
+    Code *code = (Code*)object_create(OBJECT_TYPE_CODE);
+    code->body = exp;
+    code->node = analyze_expression(exp, NULL, false);
+    return code;
+}
+
+void analyze_procedure(Proc *proc)
+{
+    const bool started = gc_suspend();
+    Unbound *lambda = (Unbound*)object_create(OBJECT_TYPE_UNBOUND);
+    List *exp = (List*)object_create(OBJECT_TYPE_LIST);
+
+    lambda->cstr = malloc(sizeof("lambda"));
+    strcpy(lambda->cstr, "lambda");
+    exp->item = (Object*)lambda;
+    exp->next = (List*)object_create(OBJECT_TYPE_LIST);
+    exp->next->item = (Object*)proc->code->args;
+    exp->next->next = (List*)proc->code->body;
+    proc->code = (Code*)analyze(optimize((Object*)exp, proc->env))->node->value;
+    gc_resume(started);
+}
+
+unsigned analyze_get_specialized_sites(void)
+{
+    return _context->specialized;
+}
+
+unsigned analyze_get_generic_sites(void)
+{
+    return _context->generic;
+}
+
+void node_mark(Node *node)
+{
+    unsigned i;
+
+    if (node != NULL) {
+        object_mark(node->exp);
+        object_mark(node->value);
+        for (i = 0; i < node->size; i++) {
+            node_mark(node->nodes[i]);
+        }
+    }
+}
+
+void node_delete(Node *node)
+{
+    unsigned i;
+
+    if (node != NULL) {
+        for (i = 0; i < node->size; i++) {
+            node_delete(node->nodes[i]);
+        }
+        free(node);
+    }
+}
@@ -0,0 +1,83 @@
+/*
+ *    analyze.h
+ */
+
+
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include "types.h"
+
+struct node;
+
+/*
+ * Variables bound by the lambdas enclosing an expression: arguments and
+ * internal definitions. Anything else refers to the top level environment.
+ */
+typedef struct scope
+{
+    List *args;
+    const char **names;
+    unsigned size;
+    struct scope *next;
+} Scope;
+
+typedef Object *(*Execute)(struct node *node, Env *env);
+
+/*
+ * Expression converted once into an execution node. Operands are extracted
+ * and validated during the analysis, so executing a node never looks at the
+ * shape of the source expression again.
+ */
+typedef struct node
+{
+    Execute execute;
+    Object *exp;
+    Object *value;
+    bool tail;
+    unsigned version;
+    unsigned size;
+    struct node *nodes[];
+} Node;
+
+#define EXECUTE(NODE,ENV) ((NODE)->execute((NODE), (ENV)))
+
+/*
+ * Analysis creates objects, so it must run while the GC is stopped.
+ */
+Code *analyze(Object *exp);
+
+/*
+ * Procedures read from messages and images have code with the arguments
+ * and the body but without a node. They are optimized and analyzed on the
+ * first call, so procedures which are never called cost nothing.
+ */
+void analyze_procedure(Proc *proc);
+
+unsigned analyze_get_specialized_sites(void);
+
+unsigned analyze_get_generic_sites(void);
+
+/*
+ * Scope of a lambda body with the given arguments.
+ */
+void analyze_enter_scope(Scope *scope, Scope *next, List *args, Object *body);
+
+void analyze_leave_scope(Scope *scope);
+
+bool analyze_is_bound(Scope *scope, const char *str);
+
+/*
+ * Returns number of items in a proper list or -1 for anything else.
+ */
+int analyze_get_list_size(Object *obj);
+
+bool analyze_is_variable(Object *obj);
+
+bool analyze_is_tagged_list(Object *exp, const char *tag);
+
+void node_mark(Node *node);
+
+void node_delete(Node *node);
+
+#endif // ANALYZE_H
@@ -0,0 +1,504 @@
+/*
+ *    bignum.c
+ */
+
+
+#include "bignum.h"
+#include "debug.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define DIGIT_BITS 32
+#define DECIMAL_BASE 1000000000u
+#define DECIMAL_DIGITS 9
+
+
+static Digit *allocate(unsigned size)
+{
+    Digit *digits = calloc(size > 0 ? size : 1, sizeof(Digit));
+    if (digits == NULL) {
+        FATAL("Can't allocate %u digits", size);
+    }
+    return digits;
+}
+
+static unsigned trim(const Digit *digits, unsigned size)
+{
+    while (size > 0 && digits[size - 1] == 0) {
+        size--;
+    }
+    return size;
+}
+
+static void set(Big *res, bool negative, Digit *digits, unsigned size)
+{
+    res->size = trim(digits, size);
+    res->negative = res->size > 0 && negative;
+    res->digits = digits;
+}
+
+static int compare_magnitudes(const Digit *a, unsigned an, const Digit *b, unsigned bn)
+{
+    an = trim(a, an);
+    bn = trim(b, bn);
+    if (an != bn) {
+        return an < bn ? -1 : 1;
+    }
+    while (an-- > 0) {
+        if (a[an] != b[an]) {
+            return a[an] < b[an] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * x += y, the sum must fit into xn digits.
+ */
+static void add_in_place(Digit *x, unsigned xn, const Digit *y, unsigned yn)
+{
+    uint64_t carry = 0;
+    unsigned i;
+
+    yn = trim(y, yn);
+    for (i = 0; i < yn; i++) {
+        carry += (uint64_t)x[i] + y[i];
+        x[i] = (Digit)carry;
+        carry >>= DIGIT_BITS;
+    }
+    for (; carry != 0 && i < xn; i++) {
+        carry += x[i];
+        x[i] = (Digit)carry;
+        carry >>= DIGIT_BITS;
+    }
+}
+
+/*
+ * x -= y, where x is not less than y.
+ */
+static void subtract_in_place(Digit *x, unsigned xn, const Digit *y, unsigned yn)
+{
+    int64_t borrow = 0;
+    unsigned i;
+
+    yn = trim(y, yn);
+    for (i = 0; i < yn; i++) {
+        borrow += (int64_t)x[i] - y[i];
+        x[i] = (Digit)borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+    for (; borrow != 0 && i < xn; i++) {
+        borrow += x[i];
+        x[i] = (Digit)borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+}
+
+static void multiply_schoolbook(Digit *r, const Digit *a, unsigned an, const Digit *b, unsigned bn)
+{
+    unsigned i;
+    unsigned j;
+
+    memset(r, 0, (an + bn) * sizeof(Digit));
+    for (i = 0; i < an; i++) {
+        uint64_t carry = 0;
+
+        if (a[i] == 0) {
+            continue;
+        }
+        for (j = 0; j < bn; j++) {
+            carry += (uint64_t)a[i] * b[j] + r[i + j];
+            r[i + j] = (Digit)carry;
+            carry >>= DIGIT_BITS;
+        }
+        r[i + bn] = (Digit)carry;
+    }
+}
+
+/*
+ * Writes an + bn digits of the product into r. With a = a1 * B^m + a0 and
+ * b = b1 * B^m + b0 the product is z2 * B^2m + z1 * B^m + z0, where z1 is
+ * (a0 + a1)(b0 + b1) - z2 - z0: three multiplications instead of four.
+ */
+static void multiply(Digit *r, const Digit *a, unsigned an, const Digit *b, unsigned bn)
+{
+    unsigned m;
+    unsigned sn;
+    unsigned tn;
+    Digit *s;
+    Digit *t;
+    Digit *z1;
+
+    if (an < bn) {
+        const Digit *digits = a;
+        unsigned size = an;
+        a = b;
+        an = bn;
+        b = digits;
+        bn = size;
+    }
+    if (bn < BIGNUM_KARATSUBA_THRESHOLD) {
+        multiply_schoolbook(r, a, an, b, bn);
+        return;
+    }
+
+    m = an / 2;
+    if (bn <= m) {
+        // Only the longer operand is split: a0 * b + a1 * b * B^m
+        Digit *high = allocate(an - m + bn);
+
+        multiply(r, a, m, b, bn);
+        memset(r + m + bn, 0, (an - m) * sizeof(Digit));
+        multiply(high, a + m, an - m, b, bn);
+        add_in_place(r + m, an + bn - m, high, an - m + bn);
+        free(high);
+        return;
+    }
+
+    sn = an - m + 1;
+    tn = (m > bn - m ? m : bn - m) + 1;
+    s = allocate(sn);
+    t = allocate(tn);
+    z1 = allocate(sn + tn);
+
+    memcpy(s, a + m, (an - m) * sizeof(Digit));
+    add_in_place(s, sn, a, m);
+    memcpy(t, b, m * sizeof(Digit));
+    add_in_place(t, tn, b + m, bn - m);
+    multiply(z1, s, trim(s, sn), t, trim(t, tn));
+    memset(z1 + trim(s, sn) + trim(t, tn), 0,
+           (sn + tn - trim(s, sn) - trim(t, tn)) * sizeof(Digit));
+
+    multiply(r, a, m, b, m);
+    multiply(r + 2 * m, a + m, an - m, b + m, bn - m);
+    subtract_in_place(z1, sn + tn, r, 2 * m);
+    subtract_in_place(z1, sn + tn, r + 2 * m, an + bn - 2 * m);
+    add_in_place(r + m, an + bn - m, z1, sn + tn);
+
+    free(s);
+    free(t);
+    free(z1);
+}
+
+static Digit divide_by_digit(Digit *q, const Digit *a, unsigned an, Digit divisor)
+{
+    uint64_t rest = 0;
+
+    while (an-- > 0) {
+        rest = (rest << DIGIT_BITS) | a[an];
+        q[an] = (Digit)(rest / divisor);
+        rest %= divisor;
+    }
+    return (Digit)rest;
+}
+
+/*
+ * Long division of magnitudes, Knuth's algorithm D. The quotient has
+ * an - bn + 1 digits and the remainder bn digits; bn > 1 and an >= bn.
+ */
+static void divide_magnitudes(Digit *q, Digit *r, const Digit *a, unsigned an,
+                              const Digit *b, unsigned bn)
+{
+    const uint64_t base = (uint64_t)1 << DIGIT_BITS;
+    Digit *u = allocate(an + 1);
+    Digit *v = allocate(bn);
+    unsigned shift = __builtin_clz(b[bn - 1]);
+    int i;
+    int j;
+
+    // Normalize, so the highest digit of the divisor has the top bit set
+    for (i = bn - 1; i > 0; i--) {
+        v[i] = shift ? (b[i] << shift) | (b[i - 1] >> (DIGIT_BITS - shift)) : b[i];
+    }
+    v[0] = b[0] << shift;
+    u[an] = shift ? a[an - 1] >> (DIGIT_BITS - shift) : 0;
+    for (i = an - 1; i > 0; i--) {
+        u[i] = shift ? (a[i] << shift) | (a[i - 1] >> (DIGIT_BITS - shift)) : a[i];
+    }
+    u[0] = a[0] << shift;
+
+    for (j = an - bn; j >= 0; j--) {
+        uint64_t numerator = ((uint64_t)u[j + bn] << DIGIT_BITS) | u[j + bn - 1];
+        uint64_t qhat = numerator / v[bn - 1];
+        uint64_t rhat = numerator % v[bn - 1];
+        int64_t borrow = 0;
+        int64_t t;
+
+        while (qhat >= base || qhat * v[bn - 2] > ((rhat << DIGIT_BITS) | u[j + bn - 2])) {
+            qhat -= 1;
+            rhat += v[bn - 1];
+            if (rhat >= base) {
+                break;
+            }
+        }
+        // Multiply and subtract
+        for (i = 0; i < (int)bn; i++) {
+            uint64_t p = qhat * v[i];
+            t = u[i + j] - borrow - (int64_t)(p & 0xFFFFFFFF);
+            u[i + j] = (Digit)t;
+            borrow = (int64_t)(p >> DIGIT_BITS) - (t >> DIGIT_BITS);
+        }
+        t = u[j + bn] - borrow;
+        u[j + bn] = (Digit)t;
+
+        q[j] = (Digit)qhat;
+        if (t < 0) {
+            // The estimate was one too large, add the divisor back
+            uint64_t carry = 0;
+
+            q[j] -= 1;
+            for (i = 0; i < (int)bn; i++) {
+                carry += (uint64_t)u[i + j] + v[i];
+                u[i + j] = (Digit)carry;
+                carry >>= DIGIT_BITS;
+            }
+            u[j + bn] += (Digit)carry;
+        }
+    }
+
+    if (r != NULL) {
+        for (i = 0; i < (int)bn - 1; i++) {
+            r[i] = shift ? (u[i] >> shift) | (u[i + 1] << (DIGIT_BITS - shift)) : u[i];
+        }
+        r[bn - 1] = u[bn - 1] >> shift;
+    }
+    free(u);
+    free(v);
+}
+
+void bignum_from_integer(Big *res, int64_t value)
+{
+    uint64_t magnitude = value < 0 ? (uint64_t)-(value + 1) + 1 : (uint64_t)value;
+    Digit *digits = allocate(2);
+
+    digits[0] = (Digit)magnitude;
+    digits[1] = (Digit)(magnitude >> DIGIT_BITS);
+    set(res, value < 0, digits, 2);
+}
+
+bool bignum_from_cstr(Big *res, const char *str)
+{
+    bool negative = false;
+    unsigned length;
+    unsigned size = 1;
+    Digit *digits;
+
+    if (*str == '-' || *str == '+') {
+        negative = *str == '-';
+        str++;
+    }
+    length = strlen(str);
+    if (length == 0) {
+        return false;
+    }
+    // Each digit holds more than 9 decimal ones
+    digits = allocate(length / DECIMAL_DIGITS + 1);
+
+    while (*str != 0) {
+        Digit chunk = 0;
+        Digit scale = 1;
+        uint64_t carry;
+        unsigned i;
+
+        for (i = 0; i < DECIMAL_DIGITS && *str != 0; i++, str++) {
+            if (*str < '0' || *str > '9') {
+                free(digits);
+                return false;
+            }
+            chunk = chunk * 10 + (*str - '0');
+            scale *= 10;
+        }
+        carry = chunk;
+        for (i = 0; i < size; i++) {
+            carry += (uint64_t)digits[i] * scale;
+            digits[i] = (Digit)carry;
+            carry >>= DIGIT_BITS;
+        }
+        if (carry != 0) {
+            digits[size++] = (Digit)carry;
+        }
+    }
+    set(res, negative, digits, size);
+    return true;
+}
+
+bool bignum_to_integer(const Big *big, int64_t *value)
+{
+    uint64_t magnitude = 0;
+
+    if (big->size > 2) {
+        return false;
+    }
+    if (big->size > 0) {
+        magnitude = big->digits[0];
+    }
+    if (big->size > 1) {
+        magnitude |= (uint64_t)big->digits[1] << DIGIT_BITS;
+    }
+    if (!big->negative && magnitude <= INT64_MAX) {
+        *value = (int64_t)magnitude;
+        return true;
+    }
+    if (big->negative && magnitude <= (uint64_t)INT64_MAX + 1) {
+        *value = magnitude == (uint64_t)INT64_MAX + 1 ? INT64_MIN : -(int64_t)magnitude;
+        return true;
+    }
+    return false;
+}
+
+double bignum_to_double(const Big *big)
+{
+    double res = 0;
+    unsigned i = big->size;
+
+    while (i-- > 0) {
+        res = res * 4294967296.0 + big->digits[i];
+    }
+    return big->negative ? -res : res;
+}
+
+char *bignum_to_cstr(const Big *big)
+{
+    unsigned size = big->size;
+    Digit *digits = allocate(size);
+    Digit *chunks = allocate(size * 2 + 1);
+    unsigned count = 0;
+    char *str = malloc(size * 2 * DECIMAL_DIGITS + DECIMAL_DIGITS + 2);
+    char *it = str;
+
+    memcpy(digits, big->digits, size * sizeof(Digit));
+    while (size > 0) {
+        chunks[count++] = divide_by_digit(digits, digits, size, DECIMAL_BASE);
+        size = trim(digits, size);
+    }
+    if (big->negative) {
+        *it++ = '-';
+    }
+    if (count == 0) {
+        *it++ = '0';
+    }
+    else {
+        it += sprintf(it, "%u", chunks[--count]);
+        while (count-- > 0) {
+            it += sprintf(it, "%09u", chunks[count]);
+        }
+    }
+    *it = 0;
+    free(digits);
+    free(chunks);
+    return str;
+}
+
+static void add_signed(Big *res, const Big *a, const Big *b, bool negate)
+{
+    bool negative = b->negative != negate;
+    unsigned size = (a->size > b->size ? a->size : b->size) + 1;
+    Digit *digits = allocate(size);
+
+    if (a->negative == negative) {
+        memcpy(digits, a->digits, a->size * sizeof(Digit));
+        add_in_place(digits, size, b->digits, b->size);
+        set(res, negative, digits, size);
+    }
+    else if (compare_magnitudes(a->digits, a->size, b->digits, b->size) >= 0) {
+        memcpy(digits, a->digits, a->size * sizeof(Digit));
+        subtract_in_place(digits, size, b->digits, b->size);
+        set(res, a->negative, digits, size);
+    }
+    else {
+        memcpy(digits, b->digits, b->size * sizeof(Digit));
+        subtract_in_place(digits, size, a->digits, a->size);
+        set(res, negative, digits, size);
+    }
+}
+
+void bignum_add(Big *res, const Big *a, const Big *b)
+{
+    add_signed(res, a, b, false);
+}
+
+void bignum_subtract(Big *res, const Big *a, const Big *b)
+{
+    add_signed(res, a, b, true);
+}
+
+void bignum_multiply(Big *res, const Big *a, const Big *b)
+{
+    unsigned size = a->size + b->size;
+    Digit *digits = allocate(size);
+
+    if (a->size > 0 && b->size > 0) {
+        multiply(digits, a->digits, a->size, b->digits, b->size);
+    }
+    set(res, a->negative != b->negative, digits, size);
+}
+
+void bignum_divide(Big *quotient, Big *remainder, const Big *a, const Big *b)
+{
+    Digit *q;
+    Digit *r;
+    unsigned qn;
+
+    assert(b->size > 0);
+    if (compare_magnitudes(a->digits, a->size, b->digits, b->size) < 0) {
+        if (quotient != NULL) {
+            set(quotient, false, allocate(1), 0);
+        }
+        if (remainder != NULL) {
+            bignum_copy(remainder, a);
+        }
+        return;
+    }
+
+    qn = a->size - b->size + 1;
+    q = allocate(qn);
+    r = allocate(b->size);
+    if (b->size == 1) {
+        r[0] = divide_by_digit(q, a->digits, a->size, b->digits[0]);
+    }
+    else {
+        divide_magnitudes(q, r, a->digits, a->size, b->digits, b->size);
+    }
+
+    if (quotient != NULL) {
+        set(quotient, a->negative != b->negative, q, qn);
+    }
+    else {
+        free(q);
+    }
+    if (remainder != NULL) {
+        set(remainder, a->negative, r, b->size);
+    }
+    else {
+        free(r);
+    }
+}
+
+int bignum_compare(const Big *a, const Big *b)
+{
+    int res;
+
+    if (a->negative != b->negative) {
+        return a->negative ? -1 : 1;
+    }
+    res = compare_magnitudes(a->digits, a->size, b->digits, b->size);
+    return a->negative ? -res : res;
+}
+
+void bignum_copy(Big *res, const Big *big)
+{
+    Digit *digits = allocate(big->size);
+
+    memcpy(digits, big->digits, big->size * sizeof(Digit));
+    set(res, big->negative, digits, big->size);
+}
+
+void bignum_free(Big *big)
+{
+    free(big->digits);
+    big->digits = NULL;
+    big->size = 0;
+}
@@ -0,0 +1,69 @@
+/*
+ *    bignum.h
+ */
+
+
+#ifndef BIGNUM_H
+#define BIGNUM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Operands with this number of digits and more are multiplied with the
+ * Karatsuba algorithm, shorter ones with the schoolbook one.
+ */
+#define BIGNUM_KARATSUBA_THRESHOLD 32
+
+typedef uint32_t Digit;
+
+/*
+ * Arbitrary precision integer: sign and magnitude stored as little-endian
+ * digits without leading zeros. Zero has no digits and is never negative.
+ * Results of the operations own newly allocated digits.
+ */
+typedef struct big
+{
+    bool negative;
+    unsigned size;
+    Digit *digits;
+} Big;
+
+void bignum_from_integer(Big *res, int64_t value);
+
+/*
+ * Parses optionally signed decimal number, returns false on invalid input.
+ */
+bool bignum_from_cstr(Big *res, const char *str);
+
+/*
+ * Returns false if the number doesn't fit into 64-bit integer.
+ */
+bool bignum_to_integer(const Big *big, int64_t *value);
+
+double bignum_to_double(const Big *big);
+
+/*
+ * Returns decimal representation allocated with malloc.
+ */
+char *bignum_to_cstr(const Big *big);
+
+void bignum_add(Big *res, const Big *a, const Big *b);
+
+void bignum_subtract(Big *res, const Big *a, const Big *b);
+
+void bignum_multiply(Big *res, const Big *a, const Big *b);
+
+/*
+ * Truncating division, the remainder has sign of the dividend. Divisor
+ * must not be zero; either of results may be NULL.
+ */
+void bignum_divide(Big *quotient, Big *remainder, const Big *a, const Big *b);
+
+int bignum_compare(const Big *a, const Big *b);
+
+void bignum_copy(Big *res, const Big *big);
+
+void bignum_free(Big *big);
+
+#endif // BIGNUM_H
@@ -0,0 +1,450 @@
+/*
+ *    cache.c
+ */
+
+
+#define _DEFAULT_SOURCE
+
+#include "cache.h"
+#include "marshal.h"
+#include "parser.h"
+#include "context.h"
+#include "error.h"
+#include "gc.h"
+#include "debug.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define CACHE_MAGIC "LISPFRM"
+
+
+typedef struct header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t pointer_size;
+    uint64_t source;
+    uint64_t count;
+    // Hash of the entries, a damaged file isn't replayed
+    uint64_t checksum;
+} Header;
+
+/*
+ * Entries follow the header, each is its text and its marshalled form,
+ * both preceded by their lengths.
+ */
+typedef struct entry
+{
+    uint64_t hash;
+    const char *text;
+    size_t length;
+    Message form;
+    bool used;
+    // Parsed by this run rather than mapped
+    bool owned;
+} Entry;
+
+struct cache
+{
+    char *path;
+    uint64_t source;
+    bool current;
+    // Mapped file and its entries, indexed by the hashes of their texts
+    void *data;
+    size_t size;
+    Entry *entries;
+    size_t count;
+    size_t *index;
+    size_t capacity;
+    size_t next;
+    // Forms of this run in order, those which missed own their text and
+    // their message
+    Entry *forms;
+    size_t forms_count;
+    size_t forms_capacity;
+};
+
+
+static uint64_t hash_bytes(uint64_t hash, const char *data, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * The script is hashed with the version, so a new version doesn't replay
+ * an old cache.
+ */
+static bool hash_source(const char *path, uint64_t *hash)
+{
+    FILE *file = fopen(path, "rb");
+    char block[4096];
+    size_t read;
+
+    if (file == NULL) {
+        return false;
+    }
+    *hash = hash_bytes(0xcbf29ce484222325ULL, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    *hash = (*hash ^ CACHE_VERSION) * 0x100000001b3ULL;
+    while ((read = fread(block, 1, sizeof(block), file)) > 0) {
+        *hash = hash_bytes(*hash, block, read);
+    }
+    fclose(file);
+    return true;
+}
+
+static uint64_t hash_entry(uint64_t hash, const Entry *entry)
+{
+    uint64_t length = entry->length;
+    uint64_t form_length = entry->form.length;
+
+    hash = hash_bytes(hash, (const char*)&length, sizeof(length));
+    hash = hash_bytes(hash, entry->text, entry->length);
+    hash = hash_bytes(hash, (const char*)&form_length, sizeof(form_length));
+    return hash_bytes(hash, entry->form.data, entry->form.length);
+}
+
+static Entry *find_entry(Cache *cache, uint64_t hash, const char *text, size_t length)
+{
+    size_t i;
+
+    if (cache->capacity == 0) {
+        return NULL;
+    }
+    for (i = hash & (cache->capacity - 1); cache->index[i] != 0; i = (i + 1) & (cache->capacity - 1)) {
+        Entry *entry = &cache->entries[cache->index[i] - 1];
+
+        if (entry->hash == hash && entry->length == length
+            && memcmp(entry->text, text, length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static bool read_length(const char **data, const char *end, size_t *length)
+{
+    uint64_t value;
+
+    if ((size_t)(end - *data) < sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, *data, sizeof(value));
+    *data += sizeof(value);
+    if (value > (uint64_t)(end - *data)) {
+        return false;
+    }
+    *length = value;
+    return true;
+}
+
+/*
+ * Files which aren't valid caches of this version or whose entries don't
+ * match their checksum are ignored, they are replaced when the cache is
+ * closed.
+ */
+static void load(Cache *cache)
+{
+    const int fd = open(cache->path, O_RDONLY);
+    const Header *header;
+    const char *data;
+    const char *end;
+    struct stat st;
+    size_t i;
+
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+        close(fd);
+        return;
+    }
+    cache->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache->data == MAP_FAILED) {
+        cache->data = NULL;
+        return;
+    }
+    cache->size = st.st_size;
+
+    header = (const Header*)cache->data;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+        || header->version != CACHE_VERSION || header->pointer_size != sizeof(void*)
+        || header->count > cache->size / (2 * sizeof(uint64_t))
+        || hash_bytes(0xcbf29ce484222325ULL, (const char*)cache->data + sizeof(Header),
+                      cache->size - sizeof(Header)) != header->checksum) {
+        return;
+    }
+    cache->entries = calloc(header->count, sizeof(Entry));
+    for (cache->capacity = 16; cache->capacity < 2 * header->count; cache->capacity *= 2);
+    cache->index = calloc(cache->capacity, sizeof(size_t));
+    if (cache->entries == NULL || cache->index == NULL) {
+        FATAL("Not enough memory for cache");
+    }
+
+    data = (const char*)cache->data + sizeof(Header);
+    end = (const char*)cache->data + cache->size;
+    for (i = 0; i < header->count; i++) {
+        Entry *entry = &cache->entries[i];
+
+        if (!read_length(&data, end, &entry->length)) {
+            break;
+        }
+        entry->text = data;
+        data += entry->length;
+        if (!read_length(&data, end, &entry->form.length)) {
+            break;
+        }
+        entry->form.data = (char*)data;
+        data += entry->form.length;
+        entry->hash = hash_bytes(0xcbf29ce484222325ULL, entry->text, entry->length);
+    }
+    if (i < header->count || data != end) {
+        memset(cache->index, 0, cache->capacity * sizeof(size_t));
+        return;
+    }
+    cache->count = header->count;
+    for (i = 0; i < cache->count; i++) {
+        const Entry *entry = &cache->entries[i];
+        size_t j = entry->hash & (cache->capacity - 1);
+
+        while (cache->index[j] != 0) {
+            j = (j + 1) & (cache->capacity - 1);
+        }
+        cache->index[j] = i + 1;
+    }
+    cache->current = header->source == cache->source;
+}
+
+Cache *cache_open(const char *dir, const char *path)
+{
+    char real[PATH_MAX];
+    Cache *cache;
+    uint64_t name;
+
+    if (realpath(path, real) == NULL) {
+        return NULL;
+    }
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Can't create cache %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    cache = calloc(1, sizeof(Cache));
+    if (cache == NULL || (cache->path = malloc(strlen(dir) + 32)) == NULL) {
+        FATAL("Not enough memory for cache");
+    }
+    name = hash_bytes(0xcbf29ce484222325ULL, real, strlen(real));
+    sprintf(cache->path, "%s/%016llx.forms", dir, (unsigned long long)name);
+    if (hash_source(real, &cache->source)) {
+        load(cache);
+    }
+    return cache;
+}
+
+bool cache_is_current(Cache *cache)
+{
+    return cache->current;
+}
+
+/*
+ * Forms are read as untrusted data. One which can't be read is parsed from
+ * its text instead.
+ */
+static Object *read_form(const Entry *entry)
+{
+    const bool started = gc_suspend();
+    char *volatile text = NULL;
+    Object *obj = NULL;
+    jmp_buf error;
+    Error status;
+
+    gc_resume(started);
+    memcpy(error, _context->error, sizeof(jmp_buf));
+    if ((status = try_and_catch_error()) == ERROR_TYPE_NONE) {
+        obj = marshal_read_file(&entry->form);
+    }
+    else if ((status = try_and_catch_error()) == ERROR_TYPE_NONE) {
+        // Reading stopped while the collections were suspended
+        gc_resume(started);
+        text = strndup(entry->text, entry->length);
+        if (text == NULL) {
+            FATAL("Not enough memory for cache");
+        }
+        obj = parser_create_object_from_string(text);
+    }
+    memcpy(_context->error, error, sizeof(jmp_buf));
+    free(text);
+    if (status != ERROR_TYPE_NONE) {
+        longjmp(_context->error, (int)status);
+    }
+    return obj;
+}
+
+bool cache_next(Cache *cache, Object **form)
+{
+    if (cache->next == cache->count) {
+        return false;
+    }
+    *form = read_form(&cache->entries[cache->next++]);
+    return true;
+}
+
+static void add_form(Cache *cache, const Entry *entry)
+{
+    if (cache->forms_count == cache->forms_capacity) {
+        cache->forms_capacity = cache->forms_capacity > 0 ? 2 * cache->forms_capacity : 64;
+        cache->forms = realloc(cache->forms, cache->forms_capacity * sizeof(Entry));
+        if (cache->forms == NULL) {
+            FATAL("Not enough memory for cache");
+        }
+    }
+    cache->forms[cache->forms_count++] = *entry;
+}
+
+/*
+ * Texts are found without the blanks around them, which the reader leaves
+ * between forms.
+ */
+Object *cache_parse(Cache *cache, const char *text)
+{
+    size_t length = strlen(text);
+    Entry *entry;
+    Entry form;
+    Message *message;
+    Object *obj;
+
+    while (isspace((unsigned char)*text)) {
+        text++;
+        length--;
+    }
+    while (length > 0 && isspace((unsigned char)text[length - 1])) {
+        length--;
+    }
+
+    memset(&form, 0, sizeof(form));
+    form.hash = hash_bytes(0xcbf29ce484222325ULL, text, length);
+    entry = find_entry(cache, form.hash, text, length);
+    if (entry != NULL) {
+        entry->used = true;
+        add_form(cache, entry);
+        return read_form(entry);
+    }
+
+    obj = parser_create_object_from_string(text);
+    message = marshal_write(obj);
+    form.text = strndup(text, length);
+    form.length = length;
+    form.form = *message;
+    form.used = true;
+    form.owned = true;
+    free(message);
+    if (form.text == NULL) {
+        FATAL("Not enough memory for cache");
+    }
+    add_form(cache, &form);
+    return obj;
+}
+
+static bool write_entry(FILE *file, const Entry *entry)
+{
+    uint64_t length = entry->length;
+    uint64_t form_length = entry->form.length;
+
+    return fwrite(&length, sizeof(length), 1, file) == 1
+        && fwrite(entry->text, 1, entry->length, file) == entry->length
+        && fwrite(&form_length, sizeof(form_length), 1, file) == 1
+        && fwrite(entry->form.data, 1, entry->form.length, file) == entry->form.length;
+}
+
+/*
+ * The file is written aside and renamed over the old one, so a concurrent
+ * run reads either of them whole. A run which stopped early keeps the
+ * forms it didn't get to for the next one.
+ */
+static void save(Cache *cache, bool complete)
+{
+    char *temporary = malloc(strlen(cache->path) + 32);
+    Header header;
+    FILE *file;
+    bool written;
+    size_t i;
+
+    if (temporary == NULL) {
+        FATAL("Not enough memory for cache");
+    }
+    sprintf(temporary, "%s.%ld", cache->path, (long)getpid());
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.pointer_size = sizeof(void*);
+    header.source = complete ? cache->source : 0;
+    header.count = cache->forms_count;
+    header.checksum = 0xcbf29ce484222325ULL;
+    for (i = 0; i < cache->forms_count; i++) {
+        header.checksum = hash_entry(header.checksum, &cache->forms[i]);
+    }
+    for (i = 0; !complete && i < cache->count; i++) {
+        if (!cache->entries[i].used) {
+            header.count += 1;
+            header.checksum = hash_entry(header.checksum, &cache->entries[i]);
+        }
+    }
+
+    file = fopen(temporary, "wb");
+    if (file == NULL) {
+        free(temporary);
+        return;
+    }
+    written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (i = 0; written && i < cache->forms_count; i++) {
+        written = write_entry(file, &cache->forms[i]);
+    }
+    for (i = 0; written && !complete && i < cache->count; i++) {
+        if (!cache->entries[i].used) {
+            written = write_entry(file, &cache->entries[i]);
+        }
+    }
+    if (fclose(file) != 0 || !written || rename(temporary, cache->path) != 0) {
+        fprintf(stderr, "Can't write cache %s\n", cache->path);
+        unlink(temporary);
+    }
+    free(temporary);
+}
+
+void cache_close(Cache *cache, bool complete)
+{
+    size_t i;
+
+    if (!cache->current) {
+        save(cache, complete);
+    }
+    for (i = 0; i < cache->forms_count; i++) {
+        if (cache->forms[i].owned) {
+            free((char*)cache->forms[i].text);
+            free(cache->forms[i].form.data);
+        }
+    }
+    if (cache->data != NULL) {
+        munmap(cache->data, cache->size);
+    }
+    free(cache->forms);
+    free(cache->entries);
+    free(cache->index);
+    free(cache->path);
+    free(cache);
+}
@@ -0,0 +1,51 @@
+/*
+ *    cache.h
+ */
+
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "types.h"
+
+#include <stdbool.h>
+
+/*
+ * Incremented whenever the layout of cache files or of messages changes.
+ */
+#define CACHE_VERSION 2
+
+/*
+ * Parsed top level forms of a script kept in a directory between runs.
+ * Every script has its own file there, named by the hash of its path.
+ * Forms are found by their text, so the forms which didn't change are
+ * reused when others did. The file also keeps the hash of the whole
+ * script, so an unchanged script is replayed without reading it.
+ *
+ * Analyzed code depends on the bindings at the time of the analysis and
+ * refers to the functions of the process, so only parsed forms are kept.
+ */
+typedef struct cache Cache;
+
+Cache *cache_open(const char *dir, const char *path);
+
+/*
+ * True if the script is the one whose forms are cached, cache_next then
+ * returns them in order.
+ */
+bool cache_is_current(Cache *cache);
+
+bool cache_next(Cache *cache, Object **form);
+
+/*
+ * Returns the parsed form of the text, from the cache if it is there.
+ */
+Object *cache_parse(Cache *cache, const char *text);
+
+/*
+ * Writes the forms used by the run if they differ from the cached ones.
+ * Only a run which got through the whole script may be replayed.
+ */
+void cache_close(Cache *cache, bool complete);
+
+#endif // CACHE_H
@@ -0,0 +1,59 @@
+/*
+ *    context.c
+ */
+
+
+#include "context.h"
+#include "actors.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+__thread Context *_context = NULL;
+
+Context *context_create(void)
+{
+    Context *context = calloc(1, sizeof(Context));
+
+    if (context == NULL) {
+        FATAL("Not enough memory for context");
+    }
+    writer_init(&context->output, STDOUT_FILENO);
+    return context;
+}
+
+void context_destroy(Context *context)
+{
+    Context *current = _context;
+    unsigned i;
+
+    // Finalizers run in the context owning the objects
+    _context = context;
+    writer_flush(&context->output);
+    for (i = 0; i < context->objects; i++) {
+        object_delete(context->heap[i]);
+    }
+    for (i = 0; i < context->frames_size; i++) {
+        object_delete((Object*)context->frames[i]);
+    }
+    actors_release(context->mailbox);
+    // The name of the guard is static
+    free(context->guard);
+    if (context->perf_map != NULL) {
+        fclose(context->perf_map);
+    }
+    free(context->heap);
+    free(context->marks);
+    free(context->stack);
+    free(context->frames);
+    free(context);
+    _context = current != context ? current : NULL;
+}
+
+void context_enter(Context *context)
+{
+    _context = context;
+}
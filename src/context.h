@@ -0,0 +1,85 @@
+/*
+ *    context.h
+ */
+
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "types.h"
+#include "writer.h"
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Whole mutable state of an interpreter. Every thread runs the context it
+ * entered last, so independent interpreters can run on separate threads.
+ * Objects must not be shared between contexts: each context collects only
+ * its own heap.
+ */
+typedef struct context
+{
+    // Roots and objects of the garbage collector
+    Object **stack;
+    unsigned stack_size;
+    unsigned stack_used;
+    Object **heap;
+    unsigned capacity;
+    unsigned objects;
+    // Marks of the shared objects, a bit for every granule of the addresses
+    // from the first of them
+    unsigned char *marks;
+    size_t marks_size;
+    uintptr_t shared_base;
+    bool started;
+    // Incremented whenever a variable bound to a procedure is assigned
+    unsigned env_version;
+    // Frames of procedures which don't capture their environment
+    Env **frames;
+    unsigned frames_size;
+    unsigned frames_used;
+    // Target of thrown errors and their messages
+    jmp_buf error;
+    char message[STRING_MAX_LENGTH];
+    // Result of object_to_string
+    char string[STRING_MAX_LENGTH];
+    // Arguments of the pending tail call
+    unsigned tail_argc;
+    // Budget of every evaluation in calls and milliseconds, zero is unlimited
+    unsigned long fuel_limit;
+    unsigned long time_limit;
+    // Calls left until the budget of the running evaluation is checked, the
+    // fuel not handed out to them yet and the deadline in nanoseconds
+    long steps;
+    unsigned long fuel;
+    uint64_t deadline;
+    // Statistics of the analyzer and the optimizer
+    unsigned specialized;
+    unsigned generic;
+    unsigned folded;
+    unsigned inlined;
+    Unbound *guard;
+    // Compiled code sets the bailout flag of the context compiling it
+    bool jit_enabled;
+    bool jit_bailout;
+    FILE *perf_map;
+    Writer output;
+    // Mailbox of the actor running the context, created on first use
+    struct mailbox *mailbox;
+} Context;
+
+extern __thread Context *_context;
+
+Context *context_create(void);
+
+/*
+ * Deletes all objects of the context and flushes its output.
+ */
+void context_destroy(Context *context);
+
+void context_enter(Context *context);
+
+#endif // CONTEXT_H
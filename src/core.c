@@ -1,378 +1,228 @@
 
 
+#define _DEFAULT_SOURCE
+
 #include "core.h"
+#include "context.h"
+#include "analyze.h"
+#include "jit.h"
+#include "optimize.h"
+#include "records.h"
 #include "env.h"
 #include "gc.h"
 #include "error.h"
 #include "debug.h"
 
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 
 #define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
 
-typedef enum context {
-    CONTEXT_UNKNOWN,
-    CONTEXT_APPLICATION,
-    CONTEXT_EVALUATION,
-    CONTEXT_RETURN,
-    CONTEXT_LAST
-} Context;
-
-static Object *apply(Object *proc, Object *args, Env *env);
-static Object *eval(Object *exp, Env *env, Context ctx);
-
-
-static Object *lookup_variable(Object *exp, Env *env)
-{
-    GC_BEGIN;
-    GC_PUSH2(exp, env);
-
-    Object *obj = env_lookup_variable(env, (Unbound*)exp);
-    if (obj == NULL) {
-        throw("Unbound variable %s", object_to_string(exp));
-    }
+/*
+ * Marker returned by a call in tail position. The operator and arguments
+ * of the call are left on the GC stack and applied by the caller's loop.
+ */
+static Object _tail_call;
 
-    GC_END;
-    return obj;
-}
 
-static Object *list_of_values(Object *args, Env *env, Context ctx)
+static Env *extend_environment(Proc *proc, unsigned argc)
 {
-    List *res;
-    GC_BEGIN;
-    GC_PUSH2(args, env);
-
-    if (args != NULL) {
-        assert(object_get_type(args) == OBJECT_TYPE_LIST);
-
-        List *list = (List*)args;
-        List **ptr = &res;
-        do {
-            *ptr = (List*)object_create(OBJECT_TYPE_LIST);
-            GC_PUSH1(*ptr);
-            (*ptr)->item = eval(list->item, env, CONTEXT_EVALUATION);
-            GC_PUSH1((*ptr)->item);
-
-            list = list->next;
-            ptr = &(*ptr)->next;
-        } while (list != NULL);
+    Code *code = proc->code;
+    Env *env = code->storage == STORAGE_STACK
+        ? env_push_frame(proc->env) : env_extend(proc->env);
+    Object **args = gc_peek(argc);
+    List *list = (List*)code->args;
+    unsigned i;
+
+    for (i = 0; i < argc && list != NULL; i++, list = list->next) {
+        if (!env_define_variable(env, (Unbound*)list->item, args[i])) {
+            throw("Can't extend environment with variable %s",
+                  object_to_string(list->item));
+        }
     }
-    else {
-        res = (List*)object_create(OBJECT_TYPE_LIST);
+    if (i != argc || list != NULL) {
+        throw("Wrong number of arguments");
     }
-    GC_END;
-    return (Object*)res;
+    return env;
 }
 
-static Object *eval_definition(Object *args, Env *env, Context ctx)
+static Object *list_of_values(unsigned argc)
 {
-    Object *var = ((Pair*)args)->first;
-    Object *exp = (Object*)((Pair*)args)->rest;
-    Object *obj;
-    GC_BEGIN;
-    GC_PUSH2(args, env);
-
-    if (object_get_type(var) == OBJECT_TYPE_LIST) {
-        Proc *proc;
-        List *list = (List*)var;
-
-        if (list->item == NULL || object_get_type(list->item) != OBJECT_TYPE_VARIABLE) {
-            throw("Invalid define pattern  %s", object_to_string((Object*)list));
+    List *res = NULL;
+    List **ptr = &res;
+    unsigned i;
+
+    for (i = 0; i < argc; i++) {
+        *ptr = (List*)object_create(OBJECT_TYPE_LIST);
+        if (i == 0) {
+            gc_push((Object*)res);
         }
-
-        proc = (Proc*)object_create(OBJECT_TYPE_PROCEDURE);
-        proc->args = (Pair*)list->next;
-        proc->body = (Pair*)exp;
-        proc->env = env;
-
-        var = list->item;
-        obj = (Object*)proc;
-    }
-    else {
-        exp = ((Pair*)exp)->first;
-        obj = eval(exp, env, CONTEXT_EVALUATION);
+        // The list is on the top of the stack now
+        (*ptr)->item = gc_peek(argc + 1)[i];
+        ptr = &(*ptr)->next;
     }
-    GC_PUSH1(obj);
-
-    if (!env_define_variable(env, (Unbound*)var, obj)) {
-        throw("Can't define variable %s", object_to_string(obj));
-    }
-    return obj;
+    return (Object*)res;
 }
 
-static Object *eval_assignment(Object *args, Env *env, Context ctx)
+static void check_native_args(Native *proc, unsigned argc)
 {
-    Object *var = ((Pair*)args)->first;
-    Object *exp = ((Pair*)((Pair*)args)->rest)->first;
-    Object *obj = eval(exp, env, CONTEXT_EVALUATION);
-    GC_BEGIN;
-    GC_PUSH2(args, env);
-
-    if (!env_set_variable(env, (Unbound*)var, obj)) {
-        throw("Can't assign variable %s", object_to_string(obj));
+    if ((proc->rst == 0 && argc > proc->req) || argc < proc->req) {
+        throw("Invalid args number %u", argc);
     }
-    GC_END;
-    return obj;
 }
 
-static Object *eval_if(Object *args, Env *env, Context ctx)
+Object *core_call(unsigned argc)
 {
-    List *list = (List*)args;
-    Object *obj;
-    GC_BEGIN;
-    GC_PUSH2(args, env);
+    const unsigned depth = gc_depth() - argc - 1;
+    Object *operator;
+    Object *res;
 
-    if (core_get_list_size((Object*)list) != 3) {
-        throw("Invalid pattern 'if' in %s", object_to_string(args));
-    }
+    for (;;) {
+        if (--_context->steps < 0) {
+            core_check_budget();
+        }
+        operator = *gc_peek(argc + 1);
 
-    obj = eval(list->item, env, CONTEXT_EVALUATION);
-    GC_PUSH1(obj);
+        if (operator != NULL && operator->type == OBJECT_TYPE_PROCEDURE) {
+            Proc *proc = (Proc*)operator;
+            Env *env;
 
-    if (core_object_to_bool(obj)) {
-        obj = eval(list->next->item, env, ctx);
-    }
-    else {
-        obj = eval(list->next->next->item, env, ctx);
-    }
-    GC_END;
-    return obj;
-}
+            if (proc->code->node == NULL) {
+                analyze_procedure(proc);
+            }
+            if (jit_is_enabled()) {
+                if (proc->jit == NULL) {
+                    jit_count_call(proc);
+                }
+                if (proc->jit != NULL && jit_execute(proc, argc, &res)) {
+                    break;
+                }
+            }
+            env = extend_environment(proc, argc);
 
-static Object *eval_cond(Object *args, Env *env, Context ctx)
-{
-    List *list = (List*)args;
-    List *clause;
-    Object *pred;
-    Object *action;
-    Object *res;
-    GC_BEGIN;
-    GC_PUSH2(args, env);
+            gc_unwind(depth);
+            gc_push((Object*)proc);
+            gc_push((Object*)env);
 
-    do {
-        clause = (List*)list->item;
-        if (clause == NULL || object_get_type((Object*)clause) != OBJECT_TYPE_LIST) {
-            throw("Invalid cond pattern in %s", object_to_string(args));
-            res = NULL;
-            break;
-        }
-        pred = clause->item;
-        action = clause->next->item;
-        // If it is the last clause:
-        if (pred != NULL && object_get_type((Object*)pred) == OBJECT_TYPE_UNBOUND
-            && strcmp(((Unbound*)pred)->cstr, "else") == 0) {
-
-            if (list->next == NULL) {
-                res = eval(action, env, ctx);
-                break;
+            res = EXECUTE(proc->code->node, env);
+            if (proc->code->storage == STORAGE_STACK) {
+                env_pop_frame(env);
             }
-            else {
-                throw("Invalid cond pattern in %s", object_to_string(args));
-                res = NULL;
+            if (res != &_tail_call) {
                 break;
             }
+            // Tail call is on the top of the stack
+            argc = _context->tail_argc;
         }
-        else  {
-            pred = eval((Object*)pred, env, CONTEXT_EVALUATION);
-            GC_PUSH1(pred);
-            if (core_object_to_bool(pred) != false) {
-                res = eval(action, env, ctx);
-                break;
-            }
+        else if (operator != NULL && operator->type == OBJECT_TYPE_NATIVE) {
+            check_native_args((Native*)operator, argc);
+            res = ((Native*)operator)->native_function(list_of_values(argc));
+            break;
         }
-        list = list->next;
-    } while (list != NULL);
-    GC_END;
+        else if (operator != NULL && operator->type == OBJECT_TYPE_RECORD_PROCEDURE) {
+            res = records_apply((RecordProc*)operator, argc, gc_peek(argc));
+            break;
+        }
+        else {
+            throw("Invalid type to apply %s",
+                  operator != NULL ? object_to_string(operator) : "#nil");
+        }
+    }
+    gc_unwind(depth);
     return res;
 }
 
-static void change_environment(Env *env, Pair *args, Pair *vals)
+Object *core_apply(Object *operator, unsigned argc, List *args)
 {
-    GC_BEGIN;
-    GC_PUSH3(env, args, vals);
+    List *list;
 
-    do {
-        if (!env_set_variable(env, (Unbound*)args->first, vals->first)) {
-            throw("Can't change environment with variable %s",
-                  object_to_string(args->first));
-        }
-        args = (Pair*)args->rest;
-        vals = (Pair*)vals->rest;
-    } while (args != NULL && vals != NULL);
-    assert(args == vals);
-    GC_END;
+    if (operator != NULL && operator->type == OBJECT_TYPE_NATIVE) {
+        check_native_args((Native*)operator, argc);
+        return ((Native*)operator)->native_function((Object*)args);
+    }
+    gc_push(operator);
+    for (list = args; list != NULL; list = list->next) {
+        gc_push(list->item);
+    }
+    return core_call(argc);
 }
 
-static Object *eval_sequence(Object *seq, Env *env, Context ctx, Proc *proc)
+Object *core_tail_call(unsigned argc)
 {
-    Object *obj;
-    List *list = (List*)seq;
-    GC_BEGIN;
-begin:
-    GC_PUSH3(seq, env, proc);
-
-    do {
-
-        if (list->next != NULL || ctx != CONTEXT_APPLICATION) {
-            obj = eval(list->item, env, ctx);
-            GC_PUSH1(obj);
-        }
-        else { // Tail recursive optimization
-            ctx = CONTEXT_RETURN;
-            obj = eval(list->item, env, ctx);
-            GC_PUSH1(obj);
-
-            // If obj is a function call
-            ctx = CONTEXT_APPLICATION;
-            if (obj != NULL && obj->type == OBJECT_TYPE_PAIR
-                && ((Pair*)obj)->first->type == OBJECT_TYPE_UNBOUND) {
-                Object *proc_next = eval(((Pair*)obj)->first, env, ctx);
-                GC_PUSH1(proc_next);
-                Object *args = list_of_values(((Pair*)obj)->rest, env, ctx);
-                GC_PUSH1(args);
-
-                if (proc_next != (Object*)proc) {
-                    obj = apply(proc_next, args, env);
-                }
-                else {
-                    change_environment(env, proc->args, (Pair*)args);
-                    list = (List*)seq;
-                    GC_END;
-                    goto begin;
-                }
-            }
-        }
-        list = list->next;
-    } while (list != NULL);
-
-    GC_END;
-    return obj;
+    _context->tail_argc = argc;
+    return &_tail_call;
 }
 
-static Object *make_procedure(Object *exp, Env *env)
+Object *core_create_promise(Object *thunk, PromiseStep step, Object *first, Object *second)
 {
-    Proc *proc = NULL;
-    List *list = (List*)exp;
-    Object *args = list->item;
-    Object *body = (Object*)list->next;
-    GC_BEGIN;
-    GC_PUSH2(exp, env);
-
-    if (object_get_type(args) != OBJECT_TYPE_PAIR
-        || object_get_type(body) != OBJECT_TYPE_PAIR) {
-        throw("Invalid lambda expression");
-    }
-
-    proc = (Proc*)object_create(OBJECT_TYPE_PROCEDURE);
-    proc->args = (Pair*)args;
-    proc->body = (Pair*)body;
-    proc->env = env;
-
-    GC_END;
-    return (Object*)proc;
+    Promise *promise;
+
+    gc_push(thunk);
+    gc_push(first);
+    gc_push(second);
+    promise = (Promise*)object_create(OBJECT_TYPE_PROMISE);
+    promise->thunk = thunk;
+    promise->step = step;
+    promise->first = first;
+    promise->second = second;
+    gc_unwind(gc_depth() - 3);
+    return (Object*)promise;
 }
 
-static Env *extend_environment(Pair *args, Pair *vals, Env *env)
+Object *core_force(Object *obj)
 {
-    GC_BEGIN;
-    GC_PUSH3(args, vals, env);
-
-    env = env_extend(env);
-    GC_PUSH1(env);
-
-    do {
-        if (!env_define_variable(env, (Unbound*)args->first, vals->first)) {
-            throw("Can't extend environment with variable %s",
-                  object_to_string(args->first));
-        }
-        args = (Pair*)args->rest;
-        vals = (Pair*)vals->rest;
-    } while (args != NULL && vals != NULL);
+    Promise *promise = (Promise*)obj;
+    Object *res;
 
-    if (args != vals) {
-        throw("Wrong number of arguments");
+    if (obj == NULL || obj->type != OBJECT_TYPE_PROMISE) {
+        return obj;
     }
-
-    GC_END;
-    return env;
-}
-
-static Object *apply(Object *operator, Object *args, Env *env)
-{
-    Object *res = NULL;
-    GC_BEGIN;
-    GC_PUSH3(operator, args, env);
-
-    if (operator->type == OBJECT_TYPE_PROCEDURE) {
-        Proc *proc = (Proc*)operator;
-        res = eval_sequence((Object*)proc->body,
-                            extend_environment(proc->args, (Pair*)args, env),
-                            CONTEXT_APPLICATION, proc);
+    if (promise->forced) {
+        return promise->value;
     }
-    else if (operator->type == OBJECT_TYPE_NATIVE) {
-        Native *proc = (Native*)operator;
-        unsigned num_of_args = core_get_list_size(args);
-        if ((proc->rst == 0 && num_of_args > proc->req) || num_of_args < proc->req) {
-            throw("Invalid args number %u", num_of_args);
-        }
-        res = proc->native_function(args);
+    gc_push(obj);
+    if (promise->step != NULL) {
+        res = promise->step(promise);
     }
-    GC_END;
-    return res;
+    else {
+        gc_push(promise->thunk);
+        res = core_call(0);
+    }
+    gc_pop();
+    // The thunk may have forced the promise itself, the first value wins
+    if (!promise->forced) {
+        promise->forced = true;
+        promise->value = res;
+        promise->thunk = NULL;
+        promise->step = NULL;
+        promise->first = NULL;
+        promise->second = NULL;
+    }
+    return promise->value;
 }
 
-static Object *eval(Object *exp, Env *env, Context ctx)
+void core_release_arguments(Object *args)
 {
-    Object *obj = NULL;
-    GC_BEGIN;
-    GC_PUSH2(exp, env);
+    List *list = (List*)args;
+    unsigned argc = 0;
+    Object **slots;
+    unsigned i;
 
-    if (exp == NULL) {
-        obj = NULL;
+    // Lists passed by core_apply belong to the caller
+    if (gc_depth() == 0 || *gc_peek(1) != args) {
+        return;
     }
-    else if (exp->type != OBJECT_TYPE_PAIR) {
-        obj = exp->type != OBJECT_TYPE_UNBOUND ? exp : lookup_variable(exp, env);
+    for (; list != NULL; list = list->next) {
+        argc++;
     }
-    else {
-        Object *operator = ((Pair*)exp)->first;
-        Object *operands = ((Pair*)exp)->rest;
-
-        if (operator->type != OBJECT_TYPE_UNBOUND) {
-            throw("Invalid type to apply");
-        }
-        else {
-            const char *str = ((Unbound*)operator)->cstr;
-
-            if (strcmp(str, "define") == 0) {
-                obj = eval_definition(operands, env, ctx);
-            }
-            else if (strcmp(str, "set!") == 0) {
-                obj = eval_assignment(operands, env, ctx);
-            }
-            else if (strcmp(str, "if") == 0) {
-                obj = eval_if(operands, env, ctx);
-            }
-            else if (strcmp(str, "cond") == 0) {
-                obj = eval_cond(operands, env, ctx);
-            }
-            else if (strcmp(str, "begin") == 0) {
-                obj = eval_sequence(operands, env, ctx, NULL);
-            }
-            else if (strcmp(str, "lambda") == 0) {
-                obj = make_procedure(operands, env);
-            }
-            else {
-                obj = (ctx == CONTEXT_RETURN) ? exp
-                    : apply(eval(operator, env, ctx),
-                            list_of_values(operands, env, ctx), env);
-            }
-        }
+    slots = gc_peek(argc + 1);
+    for (i = 0; i < argc; i++) {
+        slots[i] = NULL;
     }
-    GC_END;
-    return obj;
 }
 
 unsigned core_get_list_size(Object *obj)
@@ -393,15 +243,33 @@ bool core_object_to_bool(Object *obj)
     if (obj != NULL) {
         switch (obj->type) {
         case OBJECT_TYPE_INTEGER:
-            return ((Integer*)obj)->value;
+            return ((Integer*)obj)->value != 0;
+        case OBJECT_TYPE_BIGNUM:
+            return true;
+        case OBJECT_TYPE_FLONUM:
+            return ((Flonum*)obj)->value != 0;
         case OBJECT_TYPE_BOOLEAN:
             return ((Boolean*)obj)->value;
         case OBJECT_TYPE_STRING:
-            return strlen(((String*)obj)->cstr);
+            return ((String*)obj)->length > 0;
         case OBJECT_TYPE_LIST:
             return core_get_list_size(obj) > 0;
         case OBJECT_TYPE_PROCEDURE:
         case OBJECT_TYPE_NATIVE:
+        case OBJECT_TYPE_F64VECTOR:
+        case OBJECT_TYPE_I64VECTOR:
+        case OBJECT_TYPE_VECTOR:
+        case OBJECT_TYPE_HASH_TABLE:
+        case OBJECT_TYPE_MAP:
+        case OBJECT_TYPE_RECORD_TYPE:
+        case OBJECT_TYPE_RECORD:
+        case OBJECT_TYPE_RECORD_PROCEDURE:
+        case OBJECT_TYPE_STRING_BUILDER:
+        case OBJECT_TYPE_PORT:
+        case OBJECT_TYPE_PROMISE:
+        case OBJECT_TYPE_TRANSDUCER:
+        case OBJECT_TYPE_FUTURE:
+        case OBJECT_TYPE_ACTOR:
             return obj != NULL;
         default:
             throw("Can't cast %s to bool", object_to_string(obj));
@@ -421,16 +289,108 @@ Object *core_object_to_bool_object(Object *obj)
     return (Object*)res;
 }
 
+static uint64_t get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void core_set_budget(unsigned long fuel, unsigned long milliseconds)
+{
+    _context->fuel_limit = fuel;
+    _context->time_limit = milliseconds;
+}
+
+/*
+ * Steps are handed out in slices of the fuel, so it is counted exactly
+ * while the clock is read only once a slice.
+ */
+void core_check_budget(void)
+{
+    Context *context = _context;
+    unsigned long slice = context->time_limit > 0 ? CORE_DEADLINE_INTERVAL : LONG_MAX;
+
+    // A waiting thread keeps the steps it has
+    if (context->steps >= 0) {
+        slice = context->steps + 1;
+    }
+    else if (context->fuel_limit > 0) {
+        if (context->fuel == 0) {
+            throw_exception(ERROR_TYPE_BUDGET, "Evaluation ran out of fuel after %lu calls",
+                            context->fuel_limit);
+        }
+        if (context->fuel < slice) {
+            slice = context->fuel;
+        }
+        context->fuel -= slice;
+    }
+    if (context->time_limit > 0 && get_time() >= context->deadline) {
+        throw_exception(ERROR_TYPE_BUDGET, "Evaluation exceeded its time limit of %lu ms",
+                        context->time_limit);
+    }
+    // The call which ran out of steps takes the first of them
+    context->steps = slice - 1;
+}
+
+void core_save_budget(Budget *budget)
+{
+    budget->fuel_limit = _context->fuel_limit;
+    budget->time_limit = _context->time_limit;
+    // Steps handed out but not taken yet go back to the fuel
+    budget->fuel = _context->fuel + (_context->fuel_limit > 0 && _context->steps > 0
+                                     ? (unsigned long)_context->steps : 0);
+    budget->deadline = _context->deadline;
+}
+
+void core_restore_budget(const Budget *budget)
+{
+    _context->fuel_limit = budget->fuel_limit;
+    _context->time_limit = budget->time_limit;
+    _context->fuel = budget->fuel;
+    _context->deadline = budget->deadline;
+    _context->steps = 0;
+}
+
+/*
+ * An aborted evaluation stops the collector before passing the error on,
+ * the objects its caller creates next have no roots until they are
+ * evaluated.
+ */
 Object *core_eval(Object *exp, Env *env)
 {
-    Object *obj;
+    Object *obj = NULL;
+    Code *code;
+    jmp_buf error;
+    Error status;
     assert(env != NULL);
+    // Roots and frames left by an aborted evaluation are not reachable anymore
+    gc_unwind(0);
+    env_reset_frames();
+    // The first call takes the steps of the new budget
+    _context->fuel = _context->fuel_limit;
+    if (_context->time_limit > 0) {
+        _context->deadline = get_time() + (uint64_t)_context->time_limit * 1000000;
+    }
+    _context->steps = 0;
+    code = analyze(optimize(exp, env));
     GC_BEGIN;
-    GC_PUSH2(exp, env);
+    GC_PUSH2(code, env);
+    memcpy(error, _context->error, sizeof(jmp_buf));
     gc_start();
-    obj =  eval(exp, env, CONTEXT_EVALUATION);
-    GC_PUSH1(obj);
-    gc_stop();
+    if ((status = try_and_catch_error()) == ERROR_TYPE_NONE) {
+        obj = EXECUTE(code->node, env);
+        GC_PUSH1(obj);
+        gc_stop();
+    }
+    else {
+        gc_suspend();
+    }
+    memcpy(_context->error, error, sizeof(jmp_buf));
+    if (status != ERROR_TYPE_NONE) {
+        longjmp(_context->error, (int)status);
+    }
     GC_END;
     return obj;
 }
@@ -6,7 +6,12 @@
 #include "types.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
+/*
+ * Calls between readings of the clock when an evaluation has a deadline.
+ */
+#define CORE_DEADLINE_INTERVAL 4096
 
 unsigned core_get_list_size(Object *obj);
 
@@ -16,4 +21,76 @@ Object *core_object_to_object(Object *obj);
 
 Object *core_eval(Object *exp, Env *env);
 
+/*
+ * What is left of the budget of a running evaluation.
+ */
+typedef struct budget
+{
+    unsigned long fuel_limit;
+    unsigned long time_limit;
+    unsigned long fuel;
+    uint64_t deadline;
+} Budget;
+
+/*
+ * Limits every following evaluation of the context to the number of calls
+ * and to the milliseconds, zero leaves either unlimited. An evaluation
+ * which exceeds its budget is aborted with an error of the budget
+ * component, the environment keeps the definitions it completed. Tasks
+ * submitted by an evaluation run under what is left of its budget and
+ * waiting for them is interrupted at the deadline. Waiting in receive
+ * isn't interrupted.
+ */
+void core_set_budget(unsigned long fuel, unsigned long milliseconds);
+
+/*
+ * Safe points decrement the steps of the context and call this when they
+ * run out. It hands out the next steps or throws if the budget is spent.
+ * Called with steps left, as by threads waiting for a task, it only checks
+ * the deadline.
+ */
+void core_check_budget(void);
+
+void core_save_budget(Budget *budget);
+
+/*
+ * Makes the budget that of the running evaluation, until it is restored.
+ */
+void core_restore_budget(const Budget *budget);
+
+/*
+ * Applies the operator to arguments pushed after it on the GC stack
+ * and removes all of them from the stack.
+ */
+Object *core_call(unsigned argc);
+
+Object *core_tail_call(unsigned argc);
+
+/*
+ * Applies the operator to argc values of a list owned and rooted by the
+ * caller. Natives get the list itself, so calls in a loop don't allocate
+ * argument lists; natives must not keep it.
+ */
+Object *core_apply(Object *operator, unsigned argc, List *args);
+
+/*
+ * Promise of the value of the thunk or of the step, which finds its
+ * arguments in the promise.
+ */
+Object *core_create_promise(Object *thunk, PromiseStep step, Object *first, Object *second);
+
+/*
+ * Returns the memoized value of a promise, forcing it first if needed.
+ * Other objects are returned as they are.
+ */
+Object *core_force(Object *obj);
+
+/*
+ * Clears the GC stack references to the arguments of the native being
+ * called. The argument list is left as their only root, so the native can
+ * replace items by the values it still needs. Nothing is cleared if the
+ * list isn't on the top of the GC stack, as when it comes from core_apply.
+ */
+void core_release_arguments(Object *args);
+
 #endif
@@ -1,6 +1,7 @@
 
 
 #include "debug.h"
+#include "writer.h"
 #include <execinfo.h>
 #include <stdio.h>
 
@@ -29,6 +30,7 @@ void dump_backtrace(void)
 
 void assert_with_backtrace(const char *msg, const char *file, int line)
 {
+    writer_flush(writer_stdout());
     printf("Assertion failed!\n");
     dump_backtrace();
     __assert(msg, file, line);
@@ -45,7 +45,9 @@ void assert_with_backtrace(const char *msg, const char *file, int line);
 
 #define assert(EX) (void)((EX) || (assert_with_backtrace (#EX, __FILE__, __LINE__),0))
 
-#define OBJECT_DUMP(OBJ) do { printf("%s:%d:%s: ", __FILE__, __LINE__, __func__);\
-                              object_dump((Object*)OBJ); printf("\n"); } while (0)
+#define OBJECT_DUMP(OBJ) do { writer_flush(writer_stdout());\
+                              printf("%s:%d:%s: ", __FILE__, __LINE__, __func__); fflush(stdout);\
+                              object_dump((Object*)OBJ); writer_putc(writer_stdout(), '\n');\
+                              writer_flush(writer_stdout()); } while (0)
 
 #endif // DEBUG_H
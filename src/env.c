@@ -1,12 +1,17 @@
 
 
 #include "env.h"
+#include "context.h"
 #include "debug.h"
 
 #include <string.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 
+#define ENV_INDEX_MIN_FRAMES 16
+
+
 static char *create_equal_string(const char *str)
 {
     const unsigned len = strlen(str);
@@ -26,6 +31,83 @@ static Object *create_native(const char *name, unsigned req, unsigned rst, Nativ
     return (Object*)obj;
 }
 
+static uint64_t hash_name(const char *str)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *str != 0; str++) {
+        hash = (hash ^ (unsigned char)*str) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void index_frame(Env *env, Frame *frame)
+{
+    const unsigned mask = env->capacity - 1;
+    unsigned i = hash_name(frame->cstr) & mask;
+
+    while (env->index[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+    env->index[i] = frame;
+}
+
+static void rebuild_index(Env *env, unsigned capacity)
+{
+    Frame *frame;
+
+    free(env->index);
+    env->index = calloc(capacity, sizeof(Frame*));
+    if (env->index == NULL) {
+        FATAL("Not enough memory for %u bindings", capacity);
+    }
+    env->capacity = capacity;
+    for (frame = env->frame; frame != NULL; frame = frame->next) {
+        index_frame(env, frame);
+    }
+}
+
+/*
+ * Environments with many bindings, like the top level and the prelude,
+ * index their frames by name in an open addressing table, so definitions
+ * and lookups don't walk all of them.
+ */
+static void add_frame(Env *env, Frame *frame)
+{
+    frame->next = env->frame;
+    env->frame = frame;
+    env->count += 1;
+    if (env->index != NULL && env->count * 2 <= env->capacity) {
+        index_frame(env, frame);
+    }
+    else if (env->count >= ENV_INDEX_MIN_FRAMES) {
+        rebuild_index(env, env->capacity ? env->capacity * 2 : ENV_INDEX_MIN_FRAMES * 4);
+    }
+}
+
+static Frame *find_frame(Env *env, const char *str)
+{
+    Frame *frame;
+
+    if (env->index != NULL) {
+        const unsigned mask = env->capacity - 1;
+        unsigned i = hash_name(str) & mask;
+
+        for (; (frame = env->index[i]) != NULL; i = (i + 1) & mask) {
+            if (strcmp(str, frame->cstr) == 0) {
+                return frame;
+            }
+        }
+        return NULL;
+    }
+    for (frame = env->frame; frame != NULL; frame = frame->next) {
+        if (strcmp(str, frame->cstr) == 0) {
+            return frame;
+        }
+    }
+    return NULL;
+}
+
 Env *env_extend(Env *env)
 {
     Env *newEnv = (Env*)object_create(OBJECT_TYPE_ENVIRONMENT);
@@ -33,6 +115,70 @@ Env *env_extend(Env *env)
     return newEnv;
 }
 
+/*
+ * Frames of procedures which don't capture their environment are taken
+ * from this stack instead of the heap. They are reused between calls and
+ * never registered in the GC.
+ */
+Env *env_push_frame(Env *env)
+{
+    Env *frame;
+
+    if (!(_context->frames_used < _context->frames_size)) {
+        unsigned size = _context->frames_size ? _context->frames_size * 2 : 64;
+        Env **frames = realloc(_context->frames, size * sizeof(Env*));
+        if (frames == NULL) {
+            FATAL("Not enough memory for %u frames", size);
+        }
+        while (_context->frames_size < size) {
+            frames[_context->frames_size] =
+                (Env*)object_create_unmanaged(OBJECT_TYPE_ENVIRONMENT);
+            _context->frames_size += 1;
+        }
+        _context->frames = frames;
+    }
+    frame = _context->frames[_context->frames_used];
+    _context->frames_used += 1;
+    frame->next = env;
+    return frame;
+}
+
+void env_pop_frame(Env *frame)
+{
+    assert(_context->frames_used > 0);
+    assert(_context->frames[_context->frames_used - 1] == frame);
+    _context->frames_used -= 1;
+    frame->object.finalize((Object*)frame);
+    frame->frame = NULL;
+    frame->next = NULL;
+}
+
+void env_reset_frames(void)
+{
+    env_unwind_frames(0);
+}
+
+unsigned env_get_frames_depth(void)
+{
+    return _context->frames_used;
+}
+
+void env_unwind_frames(unsigned depth)
+{
+    while (_context->frames_used > depth) {
+        env_pop_frame(_context->frames[_context->frames_used - 1]);
+    }
+}
+
+void env_unmark_frames(void)
+{
+    unsigned i;
+    // Stale roots of an aborted evaluation may still mark unused frames
+    for (i = 0; i < _context->frames_size; i++) {
+        _context->frames[i]->object.marked = false;
+    }
+}
+
 bool env_add_native_function(
     Env *env, const char *name, unsigned req, unsigned rst, NativeFunction function)
 {
@@ -42,8 +188,7 @@ bool env_add_native_function(
         frame = malloc(sizeof(Frame));
         frame->cstr = create_equal_string(name);
         frame->object = create_native(name, req, rst, function);
-        frame->next = env->frame;
-        env->frame = frame;
+        add_frame(env, frame);
         return true;
     }
     return false;
@@ -51,50 +196,73 @@ bool env_add_native_function(
 
 Object *env_lookup_variable_str(Env *env, const char *str)
 {
-    while (env != NULL) {
-        Frame *frame = env->frame;
+    for (; env != NULL; env = env->next) {
+        Frame *frame = find_frame(env, str);
 
-        while (frame != NULL) {
-            if (strcmp(str, frame->cstr) == 0) {
-                return frame->object;
-            }
-            frame = frame->next;
+        if (frame != NULL) {
+            return frame->object;
         }
-        env = env->next;
     }
     return NULL;
 }
 
+static bool is_procedure(Object *obj)
+{
+    return obj != NULL && (object_get_type(obj) == OBJECT_TYPE_PROCEDURE
+                           || object_get_type(obj) == OBJECT_TYPE_NATIVE
+                           || object_get_type(obj) == OBJECT_TYPE_RECORD_PROCEDURE);
+}
+
 bool env_define_variable_str(Env *env, const char *str, Object *val)
 {
-    Frame *frame = env->frame;
-    while (frame != NULL) {
-        if (strcmp(str, frame->cstr) == 0) {
-            return false;
-        }
-        frame = frame->next;
+    Frame *frame;
+
+    if (env->object.frozen || find_frame(env, str) != NULL) {
+        return false;
+    }
+    // Definitions on top of the prelude shadow its procedures
+    if (env->next != NULL && env->next->object.frozen
+        && is_procedure(env_lookup_variable_str(env->next, str))) {
+        _context->env_version += 1;
     }
     frame = malloc(sizeof(Frame));
     frame->cstr = create_equal_string(str);
     frame->object = val;
-    frame->next = env->frame;
-    env->frame = frame;
+    add_frame(env, frame);
     return true;
 }
 
+/*
+ * Assignments of the frozen prelude's bindings define them again on top of
+ * it, so they shadow the prelude for the program alone.
+ */
 bool env_set_variable_str(Env *env, const char *str, Object *val)
 {
-    Frame *frame = env->frame;
-    while (frame != NULL) {
-        if (strcmp(str, frame->cstr) == 0) {
+    Env *top = NULL;
+
+    for (; env != NULL; top = env, env = env->next) {
+        Frame *frame;
+
+        if (env->object.frozen) {
+            return top != NULL && env_lookup_variable_str(env, str) != NULL
+                && env_define_variable_str(top, str, val);
+        }
+        if ((frame = find_frame(env, str)) != NULL) {
+            if (is_procedure(frame->object)) {
+                _context->env_version += 1;
+            }
             frame->object = val;
             return true;
         }
-        frame = frame->next;
     }
     return false;
 }
 
+bool env_is_top_level(Env *env)
+{
+    return env->next == NULL || env->next->object.frozen;
+}
+
 Object *env_lookup_variable(Env *env, Unbound *var)
 {
     assert(env != NULL);
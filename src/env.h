@@ -9,9 +9,29 @@
 
 Env *env_extend(Env *env);
 
+Env *env_push_frame(Env *env);
+
+void env_pop_frame(Env *frame);
+
+void env_reset_frames(void);
+
+/*
+ * Pops frames left above the depth by an aborted evaluation.
+ */
+unsigned env_get_frames_depth(void);
+
+void env_unwind_frames(unsigned depth);
+
+void env_unmark_frames(void);
+
 bool env_add_native_function(
     Env *env, const char *name, unsigned req, unsigned rst, NativeFunction function);
 
+/*
+ * Top level environments have no parent other than the frozen prelude.
+ */
+bool env_is_top_level(Env *env);
+
 Object *env_lookup_variable(Env *env, Unbound *var);
 
 bool env_define_variable(Env *env, Unbound *var, Object *val);
@@ -6,7 +6,9 @@
 
 
 #include "error.h"
+#include "context.h"
 #include "types.h"
+#include "writer.h"
 #include "debug.h"
 
 #include <assert.h>
@@ -15,17 +17,39 @@
 #include <stdio.h>
 
 
-jmp_buf _env;
-
-static char _msg[STRING_MAX_LENGTH];
-
 static const char *_messages[] = {
     "none",
     "unknown",
     "parser",
-    "core"
+    "core",
+    "budget"
 };
 
+/*
+ * Messages follow the output buffered so far on the same writer, so they
+ * are captured with it.
+ */
+static void print_message(const char *format, va_list args)
+{
+    Writer *writer = writer_stdout();
+    char message[4 * STRING_MAX_LENGTH];
+    int length = vsnprintf(message, sizeof(message), format, args);
+
+    if (length > 0) {
+        writer_write(writer, message, (size_t)length < sizeof(message) ? (size_t)length : sizeof(message) - 1);
+    }
+    writer_putc(writer, '\n');
+}
+
+static void print_string(const char *str)
+{
+    Writer *writer = writer_stdout();
+
+    writer_puts(writer, "Invalid string: '");
+    writer_puts(writer, str);
+    writer_puts(writer, "'\n");
+}
+
 const char *error_to_string(Error error)
 {
     assert(error > 0);
@@ -37,10 +61,10 @@ void throw_exception(Error error, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
-    vprintf(format, args);
+    print_message(format, args);
     va_end(args);
-    printf("\n");
-    longjmp(_env, (int)error);
+    writer_flush(writer_stdout());
+    longjmp(_context->error, (int)error);
 }
 
 void throw_exception_str(Error error,
@@ -50,16 +74,16 @@ void throw_exception_str(Error error,
     va_list args;
 
     len  = len + 1 > STRING_MAX_LENGTH ? STRING_MAX_LENGTH : len;
-    memcpy(_msg, str, len);
-    _msg[len] = 0;
+    memcpy(_context->message, str, len);
+    _context->message[len] = 0;
 
     va_start(args, format);
-    vprintf(format, args);
+    print_message(format, args);
     va_end(args);
-    printf("\n");
 
-    printf("Invalid string: '%s'\n", _msg);
-    longjmp(_env, (int)error);
+    print_string(_context->message);
+    writer_flush(writer_stdout());
+    longjmp(_context->error, (int)error);
 }
 
 void throw_exception_buf(Error error,
@@ -70,14 +94,14 @@ void throw_exception_buf(Error error,
     unsigned len = end - begin;
 
     len  = len + 1 > STRING_MAX_LENGTH ? STRING_MAX_LENGTH : len;
-    memcpy(_msg, begin, len);
-    _msg[len] = 0;
+    memcpy(_context->message, begin, len);
+    _context->message[len] = 0;
 
     va_start(args, format);
-    vprintf(format, args);
+    print_message(format, args);
     va_end(args);
-    printf("\n");
 
-    printf("Invalid string: '%s'\n", _msg);
-    longjmp(_env, (int)error);
+    print_string(_context->message);
+    writer_flush(writer_stdout());
+    longjmp(_context->error, (int)error);
 }
@@ -8,6 +8,8 @@
 #ifndef ERRORS_H
 #define ERRORS_H
 
+#include "context.h"
+
 #include <setjmp.h>
 
 typedef enum error {
@@ -15,14 +17,13 @@ typedef enum error {
     ERROR_TYPE_UNKNOWN,
     ERROR_TYPE_PARSER,
     ERROR_TYPE_CORE,
+    ERROR_TYPE_BUDGET,
     ERROR_TYPE_LAST
 } Error;
 
-extern jmp_buf _env;
-
 const char *error_to_string(Error error);
 
-#define try_and_catch_error() (Error)setjmp(_env)
+#define try_and_catch_error() (Error)setjmp(_context->error)
 
 void throw_exception(Error error, const char *format, ...);
 
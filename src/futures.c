@@ -0,0 +1,591 @@
+/*
+ *    futures.c
+ */
+
+
+#define _DEFAULT_SOURCE
+
+#include "futures.h"
+#include "context.h"
+#include "marshal.h"
+#include "analyze.h"
+#include "core.h"
+#include "jit.h"
+#include "env.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+#define CHUNKS_PER_WORKER 4
+
+
+typedef enum task_state
+{
+    TASK_QUEUED,
+    TASK_DONE,
+    TASK_FAILED,
+    TASK_ABORTED
+} TaskState;
+
+/*
+ * Request is the list of a procedure and its arguments. A mapping task
+ * applies the procedure to each argument and replies with the list of
+ * results. It runs under what was left of the budget of the evaluation
+ * submitting it and is aborted when that is spent. The task is freed by
+ * the last of its two owners.
+ */
+typedef struct task
+{
+    Message *request;
+    Message *reply;
+    Budget budget;
+    bool mapping;
+    int state;
+    int references;
+} Task;
+
+/*
+ * Chase-Lev deque: the owner pushes and pops at the bottom, thieves take
+ * from the top. Only the last task is contended, by a CAS on the top.
+ */
+typedef struct deque
+{
+    int64_t top;
+    int64_t bottom;
+    Task *tasks[FUTURES_DEQUE_SIZE];
+} Deque;
+
+typedef struct worker
+{
+    pthread_t thread;
+    unsigned index;
+    Deque deque;
+} Worker;
+
+/*
+ * Queued counts tasks in all deques, idle workers sleep while it is zero.
+ * Finished tasks are announced to the threads waiting for them.
+ */
+static struct pool
+{
+    pthread_once_t once;
+    unsigned size;
+    bool jit;
+    Worker *workers;
+    Deque shared;
+    pthread_mutex_t shared_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    int queued;
+} _pool = {
+    .once = PTHREAD_ONCE_INIT,
+    .shared_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+static __thread Worker *_worker = NULL;
+
+
+static bool deque_push(Deque *deque, Task *task)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if (bottom - top >= FUTURES_DEQUE_SIZE) {
+        return false;
+    }
+    __atomic_store_n(&deque->tasks[bottom & (FUTURES_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static Task *deque_pop(Deque *deque)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    int64_t top;
+    Task *task;
+
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    task = __atomic_load_n(&deque->tasks[bottom & (FUTURES_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+static Task *deque_steal(Deque *deque)
+{
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    int64_t bottom;
+    Task *task;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return NULL;
+    }
+    task = __atomic_load_n(&deque->tasks[top & (FUTURES_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return task;
+}
+
+static Task *create_task(Message *request, bool mapping)
+{
+    Task *task = malloc(sizeof(Task));
+
+    if (task == NULL) {
+        FATAL("Not enough memory for task");
+    }
+    task->request = request;
+    task->reply = NULL;
+    core_save_budget(&task->budget);
+    task->mapping = mapping;
+    task->state = TASK_QUEUED;
+    task->references = 2;
+    return task;
+}
+
+void futures_release(struct task *task)
+{
+    if (task != NULL && __atomic_sub_fetch(&task->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        marshal_delete(task->request);
+        marshal_delete(task->reply);
+        free(task);
+    }
+}
+
+static TaskState get_state(Task *task)
+{
+    return (TaskState)__atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+}
+
+static Task *take(void)
+{
+    Task *task;
+    unsigned start;
+    unsigned i;
+
+    if (_worker != NULL) {
+        task = deque_pop(&_worker->deque);
+        start = _worker->index + 1;
+    }
+    else {
+        pthread_mutex_lock(&_pool.shared_lock);
+        task = deque_pop(&_pool.shared);
+        pthread_mutex_unlock(&_pool.shared_lock);
+        start = 0;
+    }
+    // The shared deque is the last victim
+    for (i = 0; task == NULL && i <= _pool.size; i++) {
+        unsigned victim = (start + i) % (_pool.size + 1);
+        task = deque_steal(victim < _pool.size ? &_pool.workers[victim].deque : &_pool.shared);
+    }
+    if (task != NULL) {
+        __atomic_sub_fetch(&_pool.queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return task;
+}
+
+static Object *map_items(List *request)
+{
+    List *args = (List*)object_create(OBJECT_TYPE_LIST);
+    List *last = NULL;
+    List *items;
+
+    gc_push((Object*)args);
+    gc_push(NULL);
+    for (items = request->next; items != NULL; items = items->next) {
+        List *list;
+
+        args->item = items->item;
+        gc_push(core_apply(request->item, 1, args));
+        list = (List*)object_create(OBJECT_TYPE_LIST);
+        list->item = gc_pop();
+        if (last == NULL) {
+            *gc_peek(1) = (Object*)list;
+        }
+        else {
+            last->next = list;
+        }
+        last = list;
+    }
+    return *gc_peek(1);
+}
+
+/*
+ * Runs the task in the current context, which may be in the middle of an
+ * evaluation, so a failure unwinds only the state the task left and the
+ * budget of the evaluation is restored.
+ */
+static void run_task(Task *task)
+{
+    const unsigned depth = gc_depth();
+    const unsigned frames = env_get_frames_depth();
+    const bool started = gc_suspend();
+    Message *volatile reply = NULL;
+    TaskState state = TASK_DONE;
+    jmp_buf error;
+    Budget budget;
+    Error status;
+
+    // Reading the request may fail while the collections are suspended
+    gc_resume(started);
+    core_save_budget(&budget);
+    core_restore_budget(&task->budget);
+    memcpy(error, _context->error, sizeof(jmp_buf));
+    if ((status = try_and_catch_error()) == ERROR_TYPE_NONE) {
+        List *request = (List*)marshal_read(task->request);
+
+        gc_push((Object*)request);
+        reply = marshal_write(task->mapping
+                              ? map_items(request)
+                              : core_apply(request->item, analyze_get_list_size((Object*)request) - 1,
+                                           request->next));
+    }
+    else {
+        state = status == ERROR_TYPE_BUDGET ? TASK_ABORTED : TASK_FAILED;
+    }
+    memcpy(_context->error, error, sizeof(jmp_buf));
+    core_restore_budget(&budget);
+    gc_resume(started);
+    gc_unwind(depth);
+    env_unwind_frames(frames);
+
+    marshal_delete(task->request);
+    task->request = NULL;
+    task->reply = reply;
+    pthread_mutex_lock(&_pool.lock);
+    __atomic_store_n(&task->state, state, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&_pool.done);
+    pthread_mutex_unlock(&_pool.lock);
+    futures_release(task);
+}
+
+static void *run_worker(void *arg)
+{
+    _worker = (Worker*)arg;
+    context_enter(context_create());
+    if (_pool.jit) {
+        jit_enable();
+    }
+    gc_start();
+
+    for (;;) {
+        Task *task = take();
+
+        if (task != NULL) {
+            run_task(task);
+            writer_flush(writer_stdout());
+            continue;
+        }
+        pthread_mutex_lock(&_pool.lock);
+        while (__atomic_load_n(&_pool.queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&_pool.wake, &_pool.lock);
+        }
+        pthread_mutex_unlock(&_pool.lock);
+    }
+    return NULL;
+}
+
+/*
+ * Threads don't survive a fork, a forked process starts a pool of its own
+ * on its first task. The pool is idle when the server forks its workers.
+ */
+static void reset_pool(void)
+{
+    const pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    free(_pool.workers);
+    _pool.workers = NULL;
+    _pool.size = 0;
+    memset(&_pool.shared, 0, sizeof(Deque));
+    pthread_mutex_init(&_pool.shared_lock, NULL);
+    pthread_mutex_init(&_pool.lock, NULL);
+    pthread_cond_init(&_pool.wake, NULL);
+    pthread_cond_init(&_pool.done, NULL);
+    _pool.queued = 0;
+    _pool.once = once;
+}
+
+static void start_pool(void)
+{
+    long size = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned i;
+
+    pthread_atfork(NULL, NULL, &reset_pool);
+
+    _pool.size = size < 1 ? 1 : size > FUTURES_MAX_WORKERS ? FUTURES_MAX_WORKERS : size;
+    _pool.jit = jit_is_enabled();
+    _pool.workers = calloc(_pool.size, sizeof(Worker));
+    if (_pool.workers == NULL) {
+        FATAL("Not enough memory for %u workers", _pool.size);
+    }
+    for (i = 0; i < _pool.size; i++) {
+        _pool.workers[i].index = i;
+        if (pthread_create(&_pool.workers[i].thread, NULL, &run_worker, &_pool.workers[i]) != 0) {
+            FATAL("Can't start worker %u", i);
+        }
+        pthread_detach(_pool.workers[i].thread);
+    }
+}
+
+static void submit(Task *task)
+{
+    bool pushed;
+
+    pthread_once(&_pool.once, &start_pool);
+    if (_worker != NULL) {
+        pushed = deque_push(&_worker->deque, task);
+    }
+    else {
+        pthread_mutex_lock(&_pool.shared_lock);
+        pushed = deque_push(&_pool.shared, task);
+        pthread_mutex_unlock(&_pool.shared_lock);
+    }
+    if (!pushed) {
+        run_task(task);
+        return;
+    }
+    pthread_mutex_lock(&_pool.lock);
+    __atomic_add_fetch(&_pool.queued, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&_pool.wake);
+    pthread_mutex_unlock(&_pool.lock);
+}
+
+/*
+ * An evaluation with a deadline wakes up to check it and throws when it
+ * has passed, the task runs on until its own budget is spent.
+ */
+static void wait_task(Task *task)
+{
+    while (get_state(task) == TASK_QUEUED) {
+        Task *other = take();
+
+        if (other != NULL) {
+            run_task(other);
+            continue;
+        }
+        core_check_budget();
+        pthread_mutex_lock(&_pool.lock);
+        if (get_state(task) == TASK_QUEUED
+            && __atomic_load_n(&_pool.queued, __ATOMIC_SEQ_CST) == 0) {
+            if (_context->time_limit > 0) {
+                struct timespec until;
+
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_nsec += FUTURES_WAIT_INTERVAL * 1000000L;
+                until.tv_sec += until.tv_nsec / 1000000000L;
+                until.tv_nsec %= 1000000000L;
+                pthread_cond_timedwait(&_pool.done, &_pool.lock, &until);
+            }
+            else {
+                pthread_cond_wait(&_pool.done, &_pool.lock);
+            }
+        }
+        pthread_mutex_unlock(&_pool.lock);
+    }
+}
+
+static void check_state(TaskState state, const char *name)
+{
+    switch (state) {
+    case TASK_ABORTED:
+        throw_exception(ERROR_TYPE_BUDGET, "%s ran out of the budget of its evaluation", name);
+    case TASK_FAILED:
+        throw("%s failed", name);
+    default:
+        break;
+    }
+}
+
+static Object *get_procedure(Object *obj)
+{
+    if (obj == NULL || (object_get_type(obj) != OBJECT_TYPE_PROCEDURE
+                        && object_get_type(obj) != OBJECT_TYPE_NATIVE
+                        && object_get_type(obj) != OBJECT_TYPE_RECORD_PROCEDURE)) {
+        throw("Wrong type of argument %s: expected procedure",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return obj;
+}
+
+static Future *get_future(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_FUTURE) {
+        throw("Wrong type of argument %s: expected future",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return (Future*)obj;
+}
+
+Object *futures_future(Object *obj)
+{
+    Message *request;
+    Future *future;
+
+    get_procedure(((List*)obj)->item);
+    request = marshal_write(obj);
+    future = (Future*)object_create(OBJECT_TYPE_FUTURE);
+    future->task = create_task(request, false);
+    submit(future->task);
+    return (Object*)future;
+}
+
+Object *futures_touch(Object *obj)
+{
+    Future *future = get_future(((List*)obj)->item);
+    Task *task = future->task;
+
+    if (!future->touched) {
+        wait_task(task);
+        check_state(get_state(task), "Future");
+        future->value = marshal_read(task->reply);
+        future->touched = true;
+        future->task = NULL;
+        futures_release(task);
+    }
+    return future->value;
+}
+
+/*
+ * Requests of the chunks are written while the earlier chunks already run.
+ * If an argument can't be copied, the submitted tasks are released before
+ * the error is passed on.
+ */
+static unsigned submit_chunks(Object *proc, List *items, unsigned size, Task **tasks)
+{
+    const unsigned depth = gc_depth();
+    volatile unsigned count = 0;
+    jmp_buf error;
+    Error status;
+
+    memcpy(error, _context->error, sizeof(jmp_buf));
+    if ((status = try_and_catch_error()) == ERROR_TYPE_NONE) {
+        while (items != NULL) {
+            List *request = (List*)object_create(OBJECT_TYPE_LIST);
+            List *last = request;
+            unsigned i;
+
+            request->item = proc;
+            gc_push((Object*)request);
+            for (i = 0; i < size && items != NULL; i++, items = items->next) {
+                last->next = (List*)object_create(OBJECT_TYPE_LIST);
+                last = last->next;
+                last->item = items->item;
+            }
+            tasks[count] = create_task(marshal_write((Object*)request), true);
+            gc_unwind(depth);
+            submit(tasks[count]);
+            count += 1;
+        }
+    }
+    memcpy(_context->error, error, sizeof(jmp_buf));
+    if (status != ERROR_TYPE_NONE) {
+        unsigned i;
+
+        for (i = 0; i < count; i++) {
+            futures_release(tasks[i]);
+        }
+        free(tasks);
+        longjmp(_context->error, (int)status);
+    }
+    return count;
+}
+
+Object *futures_parallel_map(Object *obj)
+{
+    List *list = (List*)obj;
+    Object *proc = get_procedure(list->item);
+    int length = analyze_get_list_size(list->next->item);
+    const unsigned depth = gc_depth();
+    List *last = NULL;
+    volatile TaskState failure = TASK_DONE;
+    volatile unsigned i = 0;
+    Task **tasks;
+    unsigned chunks;
+    unsigned size;
+    jmp_buf error;
+    Error status;
+
+    if (length < 0) {
+        throw("Wrong type of argument %s: expected list", object_to_string(list->next->item));
+    }
+    if (length == 0) {
+        return NULL;
+    }
+    pthread_once(&_pool.once, &start_pool);
+    chunks = _pool.size * CHUNKS_PER_WORKER;
+    size = (length + chunks - 1) / chunks;
+    tasks = malloc(((length + size - 1) / size) * sizeof(Task*));
+    if (tasks == NULL) {
+        FATAL("Not enough memory for tasks");
+    }
+    chunks = submit_chunks(proc, (List*)list->next->item, size, tasks);
+
+    gc_push(NULL);
+    memcpy(error, _context->error, sizeof(jmp_buf));
+    if ((status = try_and_catch_error()) != ERROR_TYPE_NONE) {
+        // The deadline passed while waiting, the tasks left are abandoned
+        memcpy(_context->error, error, sizeof(jmp_buf));
+        for (; i < chunks; i++) {
+            futures_release(tasks[i]);
+        }
+        free(tasks);
+        gc_unwind(depth);
+        longjmp(_context->error, (int)status);
+    }
+    for (; i < chunks; i++) {
+        wait_task(tasks[i]);
+        if (failure == TASK_DONE && get_state(tasks[i]) == TASK_DONE) {
+            List *res = (List*)marshal_read(tasks[i]->reply);
+
+            if (last == NULL) {
+                *gc_peek(gc_depth() - depth) = (Object*)res;
+            }
+            else {
+                last->next = res;
+            }
+            for (last = res; last->next != NULL; last = last->next);
+        }
+        else if (failure == TASK_DONE) {
+            failure = get_state(tasks[i]);
+        }
+        futures_release(tasks[i]);
+    }
+    memcpy(_context->error, error, sizeof(jmp_buf));
+    free(tasks);
+    if (failure != TASK_DONE) {
+        gc_unwind(depth);
+        check_state(failure, "Task of parallel-map");
+    }
+    obj = *gc_peek(1);
+    gc_unwind(depth);
+    return obj;
+}
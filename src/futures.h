@@ -0,0 +1,53 @@
+/*
+ *    futures.h
+ */
+
+
+#ifndef FUTURES_H
+#define FUTURES_H
+
+#include "types.h"
+
+/*
+ * Capacity of a task deque, a power of two. A thread whose deque is full
+ * runs the new task itself.
+ */
+#define FUTURES_DEQUE_SIZE 4096
+
+#define FUTURES_MAX_WORKERS 256
+
+/*
+ * Milliseconds between checks of the deadline by a thread waiting for a
+ * task.
+ */
+#define FUTURES_WAIT_INTERVAL 10
+
+/*
+ * Tasks run on a pool of worker threads started on the first use, one per
+ * processor. Each worker evaluates in its own context, so procedures and
+ * their arguments are copied into its heap and results are copied back.
+ * Assignments made by a task are not visible to other threads.
+ *
+ * Workers take tasks from their own Chase-Lev deques and steal from the
+ * others when they run out. Threads outside of the pool put their tasks
+ * into a shared deque. A thread waiting for a task runs other tasks
+ * meanwhile.
+ */
+Object *futures_future(Object *obj);
+
+/*
+ * Returns the value of a future, throws if its procedure failed.
+ */
+Object *futures_touch(Object *obj);
+
+/*
+ * Maps the procedure over a list in chunks running in parallel.
+ */
+Object *futures_parallel_map(Object *obj);
+
+/*
+ * Drops the reference of a future to its task.
+ */
+void futures_release(struct task *task);
+
+#endif // FUTURES_H
@@ -1,99 +1,223 @@
 
 
 #include "gc.h"
+#include "context.h"
+#include "env.h"
 #include "error.h"
 #include "debug.h"
 
+#include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
 
-typedef struct stack {
-    Object *item;
-    struct stack *next;
-} Stack;
-
-static Stack *_stack;
-static Object *_heap[GC_OBJECT_MAX_NUMBER];
-static unsigned _objects = 0;
-static bool _started = false;
+static void gc_grow(void)
+{
+    unsigned capacity = _context->capacity ? _context->capacity * 2 : GC_OBJECT_MAX_NUMBER;
+    Object **heap = realloc(_context->heap, capacity * sizeof(Object*));
+    if (heap == NULL) {
+        FATAL("Not enough memory for %u objects", capacity);
+    }
+    _context->heap = heap;
+    _context->capacity = capacity;
+}
 
 void gc_start()
 {
-    _started = true;
+    _context->started = true;
     gc_clean();
 }
 
 void gc_stop()
 {
     gc_clean();
-    _started = false;
+    _context->started = false;
+}
+
+bool gc_suspend(void)
+{
+    const bool started = _context->started;
+    _context->started = false;
+    return started;
+}
+
+void gc_resume(bool started)
+{
+    _context->started = started;
 }
 
 void gc_add(Object *obj)
 {
-    if (!(_objects < GC_OBJECT_MAX_NUMBER)) {
-        ERROR("Not enough memory! Force GC!");
-        gc_force();
-    }
-    else {
-        gc_clean();
+    gc_clean();
+    if (!(_context->objects < _context->capacity)) {
+        gc_grow();
     }
-    _heap[_objects] = obj;
-    _objects += 1;
+    _context->heap[_context->objects] = obj;
+    _context->objects += 1;
 }
 
 void gc_clean(void)
 {
-    if (_started && _objects > (GC_OBJECT_MAX_NUMBER * 2 / 3)) {
+    if (_context->started && _context->objects > (_context->capacity * 2 / 3)) {
         gc_force();
+        // Keep the collection amortized when most of the heap is alive
+        if (_context->objects > _context->capacity / 2) {
+            gc_grow();
+        }
+    }
+}
+
+static size_t find_mark(Object *obj)
+{
+    return ((uintptr_t)obj - _context->shared_base) / GC_MARK_GRANULE;
+}
+
+static bool is_marked_shared(Object *obj)
+{
+    const size_t bit = find_mark(obj);
+
+    return (_context->marks[bit / 8] >> (bit % 8)) & 1;
+}
+
+bool gc_mark_shared(Object *obj)
+{
+    const size_t bit = find_mark(obj);
+
+    if ((_context->marks[bit / 8] >> (bit % 8)) & 1) {
+        return false;
+    }
+    _context->marks[bit / 8] |= 1 << (bit % 8);
+    return true;
+}
+
+/*
+ * Objects spread too far apart for a bitmap are not shared, they are only
+ * marked in place.
+ */
+void gc_share(Object *root)
+{
+    uintptr_t first = UINTPTR_MAX;
+    uintptr_t last = 0;
+    size_t size;
+    unsigned i;
+
+    gc_push(root);
+    gc_force();
+    gc_pop();
+    for (i = 0; i < _context->objects; i++) {
+        const uintptr_t address = (uintptr_t)_context->heap[i];
+
+        first = address < first ? address : first;
+        last = address > last ? address : last;
+    }
+    if (_context->objects == 0 || _context->marks != NULL) {
+        return;
+    }
+    size = (last - first) / GC_MARK_GRANULE / 8 + 1;
+    if (size > (size_t)_context->objects * GC_MARK_MAX_BYTES) {
+        return;
+    }
+    _context->marks = calloc(size, 1);
+    if (_context->marks == NULL) {
+        FATAL("Not enough memory for %zu marks", size * 8);
+    }
+    _context->marks_size = size;
+    _context->shared_base = first;
+    for (i = 0; i < _context->objects; i++) {
+        _context->heap[i]->shared = true;
     }
 }
 
 void gc_force(void)
 {
-    const unsigned num = _objects;
-    Stack *stack = _stack;
+    const unsigned num = _context->objects;
     unsigned i;
-    Object *tmp[GC_OBJECT_MAX_NUMBER];
 
-    while (stack != NULL) {
-        object_mark(stack->item);
-        stack = stack->next;
+    for (i = 0; i < _context->stack_used; i++) {
+        object_mark(_context->stack[i]);
     }
 
-    _objects = 0;
+    _context->objects = 0;
     for (i = 0; i < num; i++) {
-        assert(_heap[i] != NULL);
+        Object *obj = _context->heap[i];
+
+        assert(obj != NULL);
+
+        if (obj->marked || (obj->shared && is_marked_shared(obj))) {
+            // Shared objects are not written, the table is cleared instead
+            if (obj->marked) {
+                obj->marked = false;
+            }
+            _context->heap[_context->objects] = obj;
+            _context->objects += 1;
+        }
+        else {
+            object_delete(obj);
+        }
+    }
+    if (_context->marks != NULL) {
+        memset(_context->marks, 0, _context->marks_size);
+    }
+    // Stack frames are not on the heap, so the sweep doesn't reset them
+    env_unmark_frames();
+}
+
+void gc_freeze(Object *root)
+{
+    const unsigned num = _context->objects;
+    unsigned i;
 
-        if (_heap[i]->marked) {
-            _heap[i]->marked = false;
-            tmp[_objects] = _heap[i];
-            _objects += 1;
+    object_mark(root);
+
+    _context->objects = 0;
+    for (i = 0; i < num; i++) {
+        if (_context->heap[i]->marked) {
+            _context->heap[i]->frozen = true;
         }
         else {
-            object_delete(_heap[i]);
+            _context->heap[_context->objects] = _context->heap[i];
+            _context->objects += 1;
         }
     }
-    memcpy(_heap, tmp, _objects * sizeof(Object*));
+    env_unmark_frames();
 }
 
 void gc_push(Object *obj)
 {
-    Stack *stack = malloc(sizeof(Stack));
-    stack->item = obj;
-    stack->next = _stack;
-    _stack = stack;
+    if (!(_context->stack_used < _context->stack_size)) {
+        unsigned size = _context->stack_size ? _context->stack_size * 2 : GC_OBJECT_MAX_NUMBER;
+        Object **stack = realloc(_context->stack, size * sizeof(Object*));
+        if (stack == NULL) {
+            FATAL("Not enough memory for %u roots", size);
+        }
+        _context->stack = stack;
+        _context->stack_size = size;
+    }
+    _context->stack[_context->stack_used] = obj;
+    _context->stack_used += 1;
 }
 
 Object *gc_pop(void)
 {
-    assert(_stack != NULL);
-    Object *obj = NULL;
-    Stack *stack = _stack;
-    obj = stack->item;
-    _stack = stack->next;
-    free(stack);
-    return obj;
+    assert(_context->stack_used > 0);
+    _context->stack_used -= 1;
+    return _context->stack[_context->stack_used];
+}
+
+Object **gc_peek(unsigned num)
+{
+    assert(num <= _context->stack_used);
+    return _context->stack + _context->stack_used - num;
+}
+
+unsigned gc_depth(void)
+{
+    return _context->stack_used;
+}
+
+void gc_unwind(unsigned depth)
+{
+    assert(depth <= _context->stack_used);
+    _context->stack_used = depth;
 }
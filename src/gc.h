@@ -12,6 +12,17 @@
 
 #define GC_OBJECT_MAX_NUMBER 128
 
+/*
+ * Bytes of the addresses of shared objects per bit of their marks. Objects
+ * are larger, so no two of them share a bit.
+ */
+#define GC_MARK_GRANULE 32
+
+/*
+ * Largest bitmap of marks per shared object.
+ */
+#define GC_MARK_MAX_BYTES 64
+
 void gc_start();
 
 void gc_stop();
@@ -22,10 +33,47 @@ void gc_clean(void);
 
 void gc_force(void);
 
+/*
+ * Takes the objects reachable from the root out of the heap. They stay
+ * marked, so no collection of any context traces or frees them again and
+ * threads or forked processes share them without writing to them. Frozen
+ * objects must not be modified afterwards.
+ */
+void gc_freeze(Object *root);
+
+/*
+ * Collects the heap and flags the objects reachable from the root as
+ * shared before the process forks. The processes keep marks of shared
+ * objects in a bitmap instead of writing them into the objects, so their
+ * pages stay shared until they are modified. Garbage is collected first,
+ * freeing it later would write all over the shared pages. Sharing happens
+ * once, later objects are marked in place.
+ */
+void gc_share(Object *root);
+
+/*
+ * Returns false if the shared object is marked already.
+ */
+bool gc_mark_shared(Object *obj);
+
+/*
+ * Stops collections without collecting and returns whether they were
+ * running, gc_resume restores the state.
+ */
+bool gc_suspend(void);
+
+void gc_resume(bool started);
+
 void gc_push(Object *obj);
 
 Object *gc_pop(void);
 
+Object **gc_peek(unsigned num);
+
+unsigned gc_depth(void);
+
+void gc_unwind(unsigned depth);
+
 
 #define GC_BEGIN unsigned _pushed_ = 0
 
@@ -0,0 +1,312 @@
+/*
+ *    hash.c
+ */
+
+
+#include "hash.h"
+#include "numbers.h"
+#include "core.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+/*
+ * Tables grow when they are more than 80% full.
+ */
+#define HASH_LOAD_NUMERATOR 4
+#define HASH_LOAD_DENOMINATOR 5
+
+
+static uint64_t mix(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+static uint64_t hash_bytes(const void *data, size_t size)
+{
+    const unsigned char *ptr = data;
+    uint64_t res = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        res = (res ^ ptr[i]) * 0x100000001b3ULL;
+    }
+    return res;
+}
+
+uint64_t hash_object(Object *key)
+{
+    uint64_t res;
+
+    switch (key != NULL ? object_get_type(key) : OBJECT_TYPE_NONE) {
+    case OBJECT_TYPE_INTEGER:
+        res = mix((uint64_t)((Integer*)key)->value);
+        break;
+    case OBJECT_TYPE_BIGNUM: {
+        Big *big = &((Bignum*)key)->value;
+        res = hash_bytes(big->digits, big->size * sizeof(Digit)) ^ big->negative;
+        break;
+    }
+    case OBJECT_TYPE_FLONUM: {
+        // Zeros of both signs and NaNs of any payload have one hash
+        double value = ((Flonum*)key)->value;
+        value = value == 0 ? 0 : value != value ? NAN : value;
+        res = mix(hash_bytes(&value, sizeof(value)));
+        break;
+    }
+    case OBJECT_TYPE_STRING:
+        res = hash_bytes(((String*)key)->cstr, ((String*)key)->length);
+        break;
+    default:
+        res = mix((uint64_t)(uintptr_t)key);
+        break;
+    }
+    // Zero marks empty slots
+    return res != 0 ? res : 1;
+}
+
+bool hash_is_equal(Object *a, Object *b)
+{
+    if (a == b) {
+        return true;
+    }
+    if (a == NULL || b == NULL || object_get_type(a) != object_get_type(b)) {
+        return false;
+    }
+    switch (object_get_type(a)) {
+    case OBJECT_TYPE_INTEGER:
+        return ((Integer*)a)->value == ((Integer*)b)->value;
+    case OBJECT_TYPE_BIGNUM:
+        return bignum_compare(&((Bignum*)a)->value, &((Bignum*)b)->value) == 0;
+    case OBJECT_TYPE_FLONUM:
+        return ((Flonum*)a)->value == ((Flonum*)b)->value
+            || (((Flonum*)a)->value != ((Flonum*)a)->value
+                && ((Flonum*)b)->value != ((Flonum*)b)->value);
+    case OBJECT_TYPE_STRING:
+        return ((String*)a)->length == ((String*)b)->length
+            && memcmp(((String*)a)->cstr, ((String*)b)->cstr, ((String*)a)->length) == 0;
+    default:
+        return false;
+    }
+}
+
+static HashTable *get_table(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_HASH_TABLE) {
+        throw("Wrong type of argument %s: expected hash table",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return (HashTable*)obj;
+}
+
+static HashEntry *allocate_entries(size_t capacity)
+{
+    HashEntry *entries = calloc(capacity, sizeof(HashEntry));
+
+    if (entries == NULL) {
+        throw("Not enough memory for hash table of capacity %zu", capacity);
+    }
+    return entries;
+}
+
+static size_t distance(const HashTable *table, size_t index, uint64_t hash)
+{
+    return (index - (size_t)hash) & (table->capacity - 1);
+}
+
+static HashEntry *lookup(HashTable *table, Object *key, uint64_t hash)
+{
+    const size_t mask = table->capacity - 1;
+    size_t index = (size_t)hash & mask;
+    size_t dist;
+
+    // Robin Hood order ends the search at a richer entry
+    for (dist = 0; table->entries[index].hash != 0; dist++) {
+        HashEntry *entry = &table->entries[index];
+
+        if (distance(table, index, entry->hash) < dist) {
+            break;
+        }
+        if (entry->hash == hash && hash_is_equal(entry->key, key)) {
+            return entry;
+        }
+        index = (index + 1) & mask;
+    }
+    return NULL;
+}
+
+/*
+ * Inserts an entry whose key isn't in the table, poorer entries take
+ * slots of richer ones.
+ */
+static void insert(HashTable *table, HashEntry entry)
+{
+    const size_t mask = table->capacity - 1;
+    size_t index = (size_t)entry.hash & mask;
+    size_t dist = 0;
+
+    while (table->entries[index].hash != 0) {
+        size_t other = distance(table, index, table->entries[index].hash);
+
+        if (other < dist) {
+            HashEntry tmp = table->entries[index];
+            table->entries[index] = entry;
+            entry = tmp;
+            dist = other;
+        }
+        index = (index + 1) & mask;
+        dist++;
+    }
+    table->entries[index] = entry;
+    table->count++;
+}
+
+static void resize(HashTable *table, size_t capacity)
+{
+    HashEntry *entries = table->entries;
+    size_t size = table->capacity;
+    size_t i;
+
+    table->entries = allocate_entries(capacity);
+    table->capacity = capacity;
+    table->count = 0;
+    for (i = 0; i < size; i++) {
+        if (entries[i].hash != 0) {
+            insert(table, entries[i]);
+        }
+    }
+    free(entries);
+}
+
+/*
+ * Entries after the removed one move a slot back until an empty slot or
+ * an entry in its home slot.
+ */
+static void erase(HashTable *table, HashEntry *entry)
+{
+    const size_t mask = table->capacity - 1;
+    size_t index = entry - table->entries;
+    size_t next = (index + 1) & mask;
+
+    while (table->entries[next].hash != 0
+           && distance(table, next, table->entries[next].hash) > 0) {
+        table->entries[index] = table->entries[next];
+        index = next;
+        next = (next + 1) & mask;
+    }
+    table->entries[index].hash = 0;
+    table->entries[index].key = NULL;
+    table->entries[index].value = NULL;
+    table->count--;
+}
+
+Object *hash_make_table(Object *obj)
+{
+    List *list = (List*)obj;
+    size_t capacity = HASH_MIN_CAPACITY;
+    HashEntry *entries;
+    HashTable *table;
+
+    if (list != NULL) {
+        int64_t size = numbers_to_fixnum(list->item);
+
+        // The capacity would overflow before reaching a larger size
+        if (size > 0 && (uint64_t)size > SIZE_MAX / HASH_LOAD_NUMERATOR / sizeof(HashEntry)) {
+            throw("Not enough memory for hash table of size %" PRId64, size);
+        }
+        while (size > 0
+               && capacity * HASH_LOAD_NUMERATOR / HASH_LOAD_DENOMINATOR < (uint64_t)size) {
+            capacity *= 2;
+        }
+    }
+    entries = allocate_entries(capacity);
+    table = (HashTable*)object_create(OBJECT_TYPE_HASH_TABLE);
+    table->entries = entries;
+    table->capacity = capacity;
+    return (Object*)table;
+}
+
+Object *hash_ref(Object *obj)
+{
+    List *list = (List*)obj;
+    HashTable *table = get_table(list->item);
+    Object *key = list->next->item;
+    HashEntry *entry = lookup(table, key, hash_object(key));
+
+    if (entry != NULL) {
+        return entry->value;
+    }
+    if (list->next->next == NULL) {
+        throw("Key %s not found", key != NULL ? object_to_string(key) : "#nil");
+    }
+    return list->next->next->item;
+}
+
+Object *hash_set(Object *obj)
+{
+    List *list = (List*)obj;
+    HashTable *table = get_table(list->item);
+    HashEntry entry = { hash_object(list->next->item), list->next->item, list->next->next->item };
+    HashEntry *found = lookup(table, entry.key, entry.hash);
+
+    if (found != NULL) {
+        found->value = entry.value;
+        return NULL;
+    }
+    if ((table->count + 1) * HASH_LOAD_DENOMINATOR > table->capacity * HASH_LOAD_NUMERATOR) {
+        resize(table, table->capacity * 2);
+    }
+    insert(table, entry);
+    return NULL;
+}
+
+Object *hash_remove(Object *obj)
+{
+    List *list = (List*)obj;
+    HashTable *table = get_table(list->item);
+    Object *key = list->next->item;
+    HashEntry *entry = lookup(table, key, hash_object(key));
+
+    if (entry != NULL) {
+        erase(table, entry);
+    }
+    return NULL;
+}
+
+Object *hash_count(Object *obj)
+{
+    return numbers_create_integer(get_table(((List*)obj)->item)->count);
+}
+
+Object *hash_for_each(Object *obj)
+{
+    List *list = (List*)obj;
+    HashTable *table = get_table(list->item);
+    Object *proc = list->next->item;
+    size_t i;
+
+    // Entries are read again after each call, which may resize the table
+    for (i = 0; i < table->capacity; i++) {
+        if (table->entries[i].hash != 0) {
+            gc_push(proc);
+            gc_push(table->entries[i].key);
+            gc_push(table->entries[i].value);
+            core_call(2);
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,38 @@
+/*
+ *    hash.h
+ */
+
+
+#ifndef HASH_H
+#define HASH_H
+
+#include "types.h"
+
+#define HASH_MIN_CAPACITY 8
+
+/*
+ * Keys are compared as numbers by type and value, as strings by contents
+ * and as other objects by identity. Flonums equal as numbers are the same
+ * key, as are all NaNs. Hashes are never zero.
+ */
+uint64_t hash_object(Object *key);
+
+bool hash_is_equal(Object *a, Object *b);
+
+/*
+ * hash-ref without a default value throws if the key is missing. Changes
+ * of the table from hash-for-each procedure may skip or repeat entries.
+ */
+Object *hash_make_table(Object *obj);
+
+Object *hash_ref(Object *obj);
+
+Object *hash_set(Object *obj);
+
+Object *hash_remove(Object *obj);
+
+Object *hash_count(Object *obj);
+
+Object *hash_for_each(Object *obj);
+
+#endif // HASH_H
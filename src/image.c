@@ -0,0 +1,165 @@
+/*
+ *    image.c
+ */
+
+
+#include "image.h"
+#include "marshal.h"
+#include "context.h"
+#include "error.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+#define IMAGE_MAGIC "LISPIMG"
+
+
+typedef struct header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t pointer_size;
+    uint64_t prelude;
+    uint64_t length;
+    // Hash of the bindings, a damaged image isn't read
+    uint64_t checksum;
+} Header;
+
+
+static uint64_t hash_bytes(const char *data, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Natives are found by their names, so the names of the prelude identify
+ * the programs which can read an image.
+ */
+static uint64_t hash_prelude(Env *env)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; env != NULL; env = env->next) {
+        Frame *frame;
+
+        if (!env->object.frozen) {
+            continue;
+        }
+        for (frame = env->frame; frame != NULL; frame = frame->next) {
+            const char *str;
+
+            for (str = frame->cstr; *str != 0; str++) {
+                hash = (hash ^ (unsigned char)*str) * 0x100000001b3ULL;
+            }
+            hash = (hash ^ 0) * 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+void image_save(const char *path, Env *env)
+{
+    Message *message = marshal_write_environment(env);
+    Header header;
+    FILE *file;
+    bool written;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.pointer_size = sizeof(void*);
+    header.prelude = hash_prelude(env);
+    header.length = message->length;
+    header.checksum = hash_bytes(message->data, message->length);
+
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        marshal_delete(message);
+        throw("Can't open image %s: %s", path, strerror(errno));
+    }
+    written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(message->data, 1, message->length, file) == message->length;
+    marshal_delete(message);
+    if (fclose(file) != 0 || !written) {
+        unlink(path);
+        throw("Can't write image %s", path);
+    }
+}
+
+/*
+ * The image is mapped and read in one pass, it is unmapped before any
+ * error is passed on.
+ */
+void image_load(const char *path, Env *env)
+{
+    const int fd = open(path, O_RDONLY);
+    const char *volatile problem = NULL;
+    struct stat st;
+    const Header *header;
+    Message message;
+    void *data;
+    jmp_buf error;
+
+    if (fd < 0) {
+        throw("Can't open image %s: %s", path, strerror(errno));
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+        close(fd);
+        throw("Invalid image %s", path);
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw("Can't map image %s: %s", path, strerror(errno));
+    }
+
+    header = (const Header*)data;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) {
+        problem = "Invalid image %s";
+    }
+    else if (header->version != IMAGE_VERSION || header->pointer_size != sizeof(void*)
+             || header->prelude != hash_prelude(env)) {
+        problem = "Image %s was saved by another version";
+    }
+    else if (header->length != st.st_size - sizeof(Header)) {
+        problem = "Image %s is truncated";
+    }
+    else if (header->checksum != hash_bytes((const char*)data + sizeof(Header), header->length)) {
+        problem = "Image %s is damaged";
+    }
+    if (problem != NULL) {
+        munmap(data, st.st_size);
+        throw(problem, path);
+    }
+
+    memset(&message, 0, sizeof(message));
+    message.data = (char*)data + sizeof(Header);
+    message.length = header->length;
+    memcpy(error, _context->error, sizeof(jmp_buf));
+    problem = "Invalid image %s";
+    if (try_and_catch_error() == ERROR_TYPE_NONE) {
+        marshal_read_environment(&message, env);
+        problem = NULL;
+    }
+    memcpy(_context->error, error, sizeof(jmp_buf));
+    munmap(data, st.st_size);
+    if (problem != NULL) {
+        throw(problem, path);
+    }
+}
@@ -0,0 +1,32 @@
+/*
+ *    image.h
+ */
+
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "types.h"
+
+/*
+ * Incremented whenever the layout of images changes.
+ */
+#define IMAGE_VERSION 3
+
+/*
+ * Images keep the definitions of a loaded program, so another run starts
+ * from them without parsing and evaluating its sources again. They are
+ * rejected by programs of another version or with other natives.
+ * Promises, ports and actors can't be saved, a program which binds them
+ * fails with the name of the binding and writes no image.
+ */
+void image_save(const char *path, Env *env);
+
+/*
+ * Defines the bindings of the image in the environment, which extends the
+ * prelude. Damaged images are rejected, the bindings are read as untrusted
+ * data.
+ */
+void image_load(const char *path, Env *env);
+
+#endif // IMAGE_H
@@ -0,0 +1,902 @@
+/*
+ *    jit.c
+ */
+
+
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+#include "context.h"
+#include "core.h"
+#include "analyze.h"
+#include "numbers.h"
+#include "optimize.h"
+#include "env.h"
+#include "gc.h"
+#include "debug.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+/*
+ * Template compiler of hot procedures into x86-64 machine code. Compiled
+ * code works with raw fixnums: arguments are checked to be fixnums on
+ * entry, otherwise the call is left to the interpreter. Supported are
+ * integer constants and arguments, builtin + - * = < >, if, cond, begin,
+ * calls of the procedure itself and calls of other natives in tail
+ * position. Self calls in tail position become jumps. Self calls and
+ * jumps are safe points counting the steps of the evaluation budget, as
+ * calls in the interpreter do.
+ *
+ * Arithmetic overflow bails out: the stack is reset to the entry stub and
+ * the whole call is repeated by the interpreter, which promotes results
+ * to bignums. It is safe as compiled code has no side effects before the
+ * final native call.
+ */
+
+typedef enum kind {
+    KIND_NONE,
+    KIND_INTEGER,
+    KIND_BOOLEAN,
+    KIND_OBJECT
+} Kind;
+
+typedef enum call {
+    CALL_INVALID,
+    CALL_ADDITION,
+    CALL_SUBTRACTION,
+    CALL_MULTIPLICATION,
+    CALL_EQUAL,
+    CALL_LESS,
+    CALL_GREATER,
+    CALL_SELF,
+    CALL_NATIVE
+} Call;
+
+typedef int64_t (*JitFunction)(int64_t *args);
+
+typedef struct jit
+{
+    JitFunction function;
+    void *memory;
+    size_t size;
+    Kind kind;
+    unsigned argc;
+    unsigned version;
+} Jit;
+
+typedef struct compiler
+{
+    Proc *proc;
+    List *args;
+    unsigned argc;
+    Kind kind;
+    uint8_t *code;
+    size_t size;
+    size_t capacity;
+    size_t bailout;
+    size_t body;
+    size_t start;
+    bool failed;
+} Compiler;
+
+
+static Object *jit_box_integer(int64_t value)
+{
+    Integer *obj = (Integer*)object_create(OBJECT_TYPE_INTEGER);
+    obj->value = value;
+    return (Object*)obj;
+}
+
+static Object *jit_box_boolean(int64_t value)
+{
+    return object_boolean(value != 0);
+}
+
+static Object *jit_call_native(Object *native, int64_t *args, unsigned kinds, unsigned argc)
+{
+    unsigned i;
+
+    gc_push(native);
+    for (i = 0; i < argc; i++) {
+        gc_push(kinds & (1u << i) ? jit_box_boolean(args[i]) : jit_box_integer(args[i]));
+    }
+    return core_call(argc);
+}
+
+static void emit(Compiler *c, const uint8_t *bytes, size_t len)
+{
+    if (c->size + len > c->capacity) {
+        c->capacity = (c->size + len) * 2;
+        c->code = realloc(c->code, c->capacity);
+    }
+    memcpy(c->code + c->size, bytes, len);
+    c->size += len;
+}
+
+#define EMIT(C, ...) do { const uint8_t _bytes_[] = { __VA_ARGS__ };   \
+                          emit((C), _bytes_, sizeof(_bytes_)); } while (0)
+
+static void emit_u32(Compiler *c, uint32_t value)
+{
+    EMIT(c, value, value >> 8, value >> 16, value >> 24);
+}
+
+static void emit_u64(Compiler *c, uint64_t value)
+{
+    emit_u32(c, (uint32_t)value);
+    emit_u32(c, (uint32_t)(value >> 32));
+}
+
+static void patch(Compiler *c, size_t at, size_t target)
+{
+    uint32_t rel = (uint32_t)(target - (at + 4));
+    c->code[at] = rel;
+    c->code[at + 1] = rel >> 8;
+    c->code[at + 2] = rel >> 16;
+    c->code[at + 3] = rel >> 24;
+}
+
+/*
+ * Emits jz or jmp with an empty offset and returns its position.
+ */
+static size_t emit_jz(Compiler *c)
+{
+    EMIT(c, 0x48, 0x85, 0xC0);              // test rax, rax
+    EMIT(c, 0x0F, 0x84);                    // jz rel32
+    emit_u32(c, 0);
+    return c->size - 4;
+}
+
+static size_t emit_jmp(Compiler *c)
+{
+    EMIT(c, 0xE9);                          // jmp rel32
+    emit_u32(c, 0);
+    return c->size - 4;
+}
+
+static int32_t get_argument_offset(unsigned index)
+{
+    return -16 - 8 * (int32_t)index;
+}
+
+static void emit_load_argument(Compiler *c, unsigned index)
+{
+    EMIT(c, 0x48, 0x8B, 0x85);              // mov rax, [rbp + disp32]
+    emit_u32(c, (uint32_t)get_argument_offset(index));
+}
+
+static void emit_store_argument(Compiler *c, unsigned index)
+{
+    EMIT(c, 0x48, 0x89, 0x85);              // mov [rbp + disp32], rax
+    emit_u32(c, (uint32_t)get_argument_offset(index));
+}
+
+static void emit_constant(Compiler *c, int64_t value)
+{
+    EMIT(c, 0x48, 0xB8);                    // mov rax, imm64
+    emit_u64(c, (uint64_t)value);
+}
+
+/*
+ * Calls a C function with the stack aligned as the ABI requires.
+ */
+static void emit_helper_call(Compiler *c, void *function)
+{
+    EMIT(c, 0x48, 0x89, 0xE3);              // mov rbx, rsp
+    EMIT(c, 0x48, 0x83, 0xE4, 0xF0);        // and rsp, -16
+    EMIT(c, 0x48, 0xB8);                    // mov rax, imm64
+    emit_u64(c, (uint64_t)(uintptr_t)function);
+    EMIT(c, 0xFF, 0xD0);                    // call rax
+    EMIT(c, 0x48, 0x89, 0xDC);              // mov rsp, rbx
+}
+
+/*
+ * Entry stub keeps the stack pointer in r12 for the bail-out, which is
+ * emitted right after it.
+ */
+static void emit_entry(Compiler *c)
+{
+    size_t call;
+
+    EMIT(c, 0x55);                          // push rbp
+    EMIT(c, 0x48, 0x89, 0xE5);              // mov rbp, rsp
+    EMIT(c, 0x53);                          // push rbx
+    EMIT(c, 0x41, 0x54);                    // push r12
+    EMIT(c, 0x49, 0x89, 0xE4);              // mov r12, rsp
+    EMIT(c, 0xE8);                          // call body
+    emit_u32(c, 0);
+    call = c->size - 4;
+    EMIT(c, 0x41, 0x5C);                    // pop r12
+    EMIT(c, 0x5B);                          // pop rbx
+    EMIT(c, 0x5D);                          // pop rbp
+    EMIT(c, 0xC3);                          // ret
+
+    c->bailout = c->size;
+    EMIT(c, 0x4C, 0x89, 0xE4);              // mov rsp, r12
+    EMIT(c, 0x48, 0xB8);                    // mov rax, imm64
+    emit_u64(c, (uint64_t)(uintptr_t)&_context->jit_bailout);
+    EMIT(c, 0xC6, 0x00, 0x01);              // mov byte [rax], 1
+    EMIT(c, 0x41, 0x5C);                    // pop r12
+    EMIT(c, 0x5B);                          // pop rbx
+    EMIT(c, 0x5D);                          // pop rbp
+    EMIT(c, 0xC3);                          // ret
+
+    c->body = c->size;
+    patch(c, call, c->body);
+}
+
+static void emit_jo_bailout(Compiler *c)
+{
+    EMIT(c, 0x0F, 0x80);                    // jo rel32
+    emit_u32(c, 0);
+    patch(c, c->size - 4, c->bailout);
+}
+
+/*
+ * Decrements the steps and lets the interpreter check the budget when
+ * they run out. No values are kept in registers across calls, so the
+ * check clobbers nothing, and a spent budget throws out of compiled code
+ * as errors of natives do.
+ */
+static void emit_safe_point(Compiler *c)
+{
+    size_t skip;
+
+    EMIT(c, 0x48, 0xB8);                    // mov rax, imm64
+    emit_u64(c, (uint64_t)(uintptr_t)&_context->steps);
+    EMIT(c, 0x48, 0xFF, 0x08);              // dec qword [rax]
+    EMIT(c, 0x0F, 0x89);                    // jns rel32
+    emit_u32(c, 0);
+    skip = c->size - 4;
+    emit_helper_call(c, &core_check_budget);
+    patch(c, skip, c->size);
+}
+
+static void emit_prologue(Compiler *c)
+{
+    unsigned i;
+
+    EMIT(c, 0x55);                          // push rbp
+    EMIT(c, 0x48, 0x89, 0xE5);              // mov rbp, rsp
+    EMIT(c, 0x53);                          // push rbx
+    EMIT(c, 0x48, 0x81, 0xEC);              // sub rsp, imm32
+    emit_u32(c, 8 * c->argc);
+    for (i = 0; i < c->argc; i++) {
+        EMIT(c, 0x48, 0x8B, 0x87);          // mov rax, [rdi + disp32]
+        emit_u32(c, 8 * i);
+        emit_store_argument(c, i);
+    }
+    c->start = c->size;
+}
+
+static void emit_epilogue(Compiler *c)
+{
+    EMIT(c, 0x48, 0x8D, 0x65, 0xF8);        // lea rsp, [rbp - 8]
+    EMIT(c, 0x5B);                          // pop rbx
+    EMIT(c, 0x5D);                          // pop rbp
+    EMIT(c, 0xC3);                          // ret
+}
+
+static int get_argument_index(Compiler *c, Object *var)
+{
+    List *list;
+    int i = 0;
+
+    for (list = c->args; list != NULL; list = list->next, i++) {
+        if (strcmp(((Unbound*)list->item)->cstr, ((Unbound*)var)->cstr) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static Call classify_call(Compiler *c, Object *exp, Object **operator)
+{
+    List *list = (List*)exp;
+    Object *obj;
+    NativeFunction function;
+
+    if (analyze_get_list_size(exp) < 1 || !analyze_is_variable(list->item)
+        || get_argument_index(c, list->item) >= 0) {
+        return CALL_INVALID;
+    }
+    obj = env_lookup_variable(c->proc->env, (Unbound*)list->item);
+    *operator = obj;
+
+    if (obj == (Object*)c->proc) {
+        return CALL_SELF;
+    }
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_NATIVE) {
+        return CALL_INVALID;
+    }
+    function = ((Native*)obj)->native_function;
+    if (function == &numbers_plus) {
+        return CALL_ADDITION;
+    }
+    else if (function == &numbers_minus) {
+        return CALL_SUBTRACTION;
+    }
+    else if (function == &numbers_multiply) {
+        return CALL_MULTIPLICATION;
+    }
+    else if (function == &numbers_equal) {
+        return CALL_EQUAL;
+    }
+    else if (function == &numbers_less) {
+        return CALL_LESS;
+    }
+    else if (function == &numbers_greater) {
+        return CALL_GREATER;
+    }
+    return CALL_NATIVE;
+}
+
+static Kind merge(Kind a, Kind b)
+{
+    if (a == KIND_NONE || a == b) {
+        return b;
+    }
+    if (b == KIND_NONE) {
+        return a;
+    }
+    return KIND_OBJECT;
+}
+
+/*
+ * Kind of values returned from tail positions of the expression.
+ */
+static Kind get_result_kind(Compiler *c, Object *exp)
+{
+    Object *operator;
+    List *list;
+    Kind kind = KIND_NONE;
+
+    exp = optimize_select(exp);
+    if (exp == NULL) {
+        return KIND_OBJECT;
+    }
+    switch (object_get_type(exp)) {
+    case OBJECT_TYPE_INTEGER:
+        return KIND_INTEGER;
+    case OBJECT_TYPE_BOOLEAN:
+        return KIND_BOOLEAN;
+    case OBJECT_TYPE_VARIABLE:
+        return get_argument_index(c, exp) >= 0 ? KIND_INTEGER : KIND_OBJECT;
+    case OBJECT_TYPE_LIST:
+        break;
+    default:
+        return KIND_OBJECT;
+    }
+
+    list = (List*)exp;
+    if (analyze_is_tagged_list(exp, "if") && analyze_get_list_size(exp) == 4) {
+        return merge(get_result_kind(c, list->next->next->item),
+                     get_result_kind(c, list->next->next->next->item));
+    }
+    if (analyze_is_tagged_list(exp, "cond") || analyze_is_tagged_list(exp, "begin")) {
+        for (list = list->next; list != NULL; list = list->next) {
+            if (analyze_is_tagged_list(exp, "begin")) {
+                kind = get_result_kind(c, list->item);
+            }
+            else if (analyze_get_list_size(list->item) >= 2) {
+                List *clause = (List*)list->item;
+                while (clause->next != NULL) {
+                    clause = clause->next;
+                }
+                kind = merge(kind, get_result_kind(c, clause->item));
+            }
+        }
+        return kind;
+    }
+    switch (classify_call(c, exp, &operator)) {
+    case CALL_ADDITION:
+    case CALL_SUBTRACTION:
+    case CALL_MULTIPLICATION:
+        return KIND_INTEGER;
+    case CALL_EQUAL:
+    case CALL_LESS:
+    case CALL_GREATER:
+        return KIND_BOOLEAN;
+    case CALL_SELF:
+        return KIND_NONE;
+    default:
+        return KIND_OBJECT;
+    }
+}
+
+static Kind compile_value(Compiler *c, Object *exp);
+static void compile_tail(Compiler *c, Object *exp);
+
+static Kind fail(Compiler *c)
+{
+    c->failed = true;
+    return KIND_NONE;
+}
+
+/*
+ * Evaluates arguments of a call onto the machine stack, the first one is
+ * on the top. Returns bit mask of boolean arguments.
+ */
+static unsigned compile_arguments(Compiler *c, List *args, unsigned argc, bool integers)
+{
+    unsigned kinds = 0;
+    int i;
+
+    if (argc > 32) {
+        fail(c);
+        return 0;
+    }
+    for (i = argc - 1; i >= 0 && !c->failed; i--) {
+        List *list = args;
+        Kind kind;
+        int j;
+
+        for (j = 0; j < i; j++) {
+            list = list->next;
+        }
+        kind = compile_value(c, list->item);
+        if (kind == KIND_BOOLEAN && !integers) {
+            kinds |= 1u << i;
+        }
+        else if (kind != KIND_INTEGER) {
+            fail(c);
+        }
+        EMIT(c, 0x50);                      // push rax
+    }
+    return kinds;
+}
+
+static bool is_valid_arity(Object *operator, unsigned argc)
+{
+    Native *native = (Native*)operator;
+    return !((native->rst == 0 && argc > native->req) || argc < native->req);
+}
+
+static Kind compile_call(Compiler *c, Object *exp)
+{
+    Object *operator = NULL;
+    List *list = ((List*)exp)->next;
+    unsigned argc = analyze_get_list_size(exp) - 1;
+    Call call = classify_call(c, exp, &operator);
+    Kind kind;
+
+    switch (call) {
+    case CALL_ADDITION:
+    case CALL_SUBTRACTION:
+    case CALL_MULTIPLICATION:
+        if (argc == 1 && call == CALL_SUBTRACTION) {
+            return fail(c);
+        }
+        if (!is_valid_arity(operator, argc) || compile_value(c, list->item) != KIND_INTEGER) {
+            return fail(c);
+        }
+        for (list = list->next; list != NULL; list = list->next) {
+            EMIT(c, 0x50);                  // push rax
+            if (compile_value(c, list->item) != KIND_INTEGER) {
+                return fail(c);
+            }
+            EMIT(c, 0x48, 0x89, 0xC1);      // mov rcx, rax
+            EMIT(c, 0x58);                  // pop rax
+            if (call == CALL_ADDITION) {
+                EMIT(c, 0x48, 0x01, 0xC8);  // add rax, rcx
+            }
+            else if (call == CALL_SUBTRACTION) {
+                EMIT(c, 0x48, 0x29, 0xC8);  // sub rax, rcx
+            }
+            else {
+                EMIT(c, 0x48, 0x0F, 0xAF, 0xC1);    // imul rax, rcx
+            }
+            emit_jo_bailout(c);
+        }
+        return KIND_INTEGER;
+    case CALL_EQUAL:
+    case CALL_LESS:
+    case CALL_GREATER:
+        if (argc != 2 || compile_value(c, list->item) != KIND_INTEGER) {
+            return fail(c);
+        }
+        EMIT(c, 0x50);                      // push rax
+        if (compile_value(c, list->next->item) != KIND_INTEGER) {
+            return fail(c);
+        }
+        EMIT(c, 0x48, 0x89, 0xC1);          // mov rcx, rax
+        EMIT(c, 0x58);                      // pop rax
+        EMIT(c, 0x48, 0x39, 0xC8);          // cmp rax, rcx
+        if (call == CALL_EQUAL) {
+            EMIT(c, 0x0F, 0x94, 0xC0);      // sete al
+        }
+        else if (call == CALL_LESS) {
+            EMIT(c, 0x0F, 0x9C, 0xC0);      // setl al
+        }
+        else {
+            EMIT(c, 0x0F, 0x9F, 0xC0);      // setg al
+        }
+        EMIT(c, 0x0F, 0xB6, 0xC0);          // movzx eax, al
+        return KIND_BOOLEAN;
+    case CALL_SELF:
+        kind = c->kind;
+        if (argc != c->argc || (kind != KIND_INTEGER && kind != KIND_BOOLEAN)) {
+            return fail(c);
+        }
+        compile_arguments(c, list, argc, true);
+        emit_safe_point(c);
+        EMIT(c, 0x48, 0x89, 0xE7);          // mov rdi, rsp
+        EMIT(c, 0xE8);                      // call rel32
+        emit_u32(c, 0);
+        patch(c, c->size - 4, c->body);
+        EMIT(c, 0x48, 0x81, 0xC4);          // add rsp, imm32
+        emit_u32(c, 8 * argc);
+        return kind;
+    default:
+        return fail(c);
+    }
+}
+
+static Kind compile_value(Compiler *c, Object *exp)
+{
+    List *list;
+    size_t jump;
+    size_t end;
+    Kind kind;
+    int index;
+
+    exp = optimize_select(exp);
+    list = (List*)exp;
+    if (c->failed || exp == NULL) {
+        return fail(c);
+    }
+    switch (object_get_type(exp)) {
+    case OBJECT_TYPE_INTEGER:
+        emit_constant(c, ((Integer*)exp)->value);
+        return KIND_INTEGER;
+    case OBJECT_TYPE_BOOLEAN:
+        emit_constant(c, ((Boolean*)exp)->value ? 1 : 0);
+        return KIND_BOOLEAN;
+    case OBJECT_TYPE_VARIABLE:
+        index = get_argument_index(c, exp);
+        if (index < 0) {
+            return fail(c);
+        }
+        emit_load_argument(c, index);
+        return KIND_INTEGER;
+    case OBJECT_TYPE_LIST:
+        break;
+    default:
+        return fail(c);
+    }
+
+    if (analyze_is_tagged_list(exp, "if")) {
+        if (analyze_get_list_size(exp) != 4) {
+            return fail(c);
+        }
+        compile_value(c, list->next->item);
+        jump = emit_jz(c);
+        kind = compile_value(c, list->next->next->item);
+        end = emit_jmp(c);
+        patch(c, jump, c->size);
+        if (compile_value(c, list->next->next->next->item) != kind) {
+            return fail(c);
+        }
+        patch(c, end, c->size);
+        return kind;
+    }
+    if (analyze_is_tagged_list(exp, "begin")) {
+        if (analyze_get_list_size(exp) < 2) {
+            return fail(c);
+        }
+        for (list = list->next; list->next != NULL; list = list->next) {
+            compile_value(c, list->item);
+        }
+        return compile_value(c, list->item);
+    }
+    if (analyze_is_tagged_list(exp, "cond")) {
+        // Value of cond without matching clause can't be represented
+        return fail(c);
+    }
+    if (analyze_is_tagged_list(exp, "define") || analyze_is_tagged_list(exp, "set!")
+        || analyze_is_tagged_list(exp, "lambda")) {
+        return fail(c);
+    }
+    return compile_call(c, exp);
+}
+
+static void compile_result(Compiler *c, Object *exp)
+{
+    Kind kind = compile_value(c, exp);
+
+    if (c->kind == KIND_OBJECT) {
+        EMIT(c, 0x48, 0x89, 0xC7);          // mov rdi, rax
+        if (kind == KIND_INTEGER) {
+            emit_helper_call(c, &jit_box_integer);
+        }
+        else {
+            emit_helper_call(c, &jit_box_boolean);
+        }
+    }
+    else if (kind != c->kind) {
+        fail(c);
+    }
+    emit_epilogue(c);
+}
+
+static void compile_tail_call(Compiler *c, Object *exp)
+{
+    Object *operator = NULL;
+    List *list = ((List*)exp)->next;
+    unsigned argc = analyze_get_list_size(exp) - 1;
+    unsigned kinds;
+    unsigned i;
+
+    switch (classify_call(c, exp, &operator)) {
+    case CALL_SELF:
+        if (argc != c->argc) {
+            fail(c);
+            break;
+        }
+        compile_arguments(c, list, argc, true);
+        for (i = 0; i < argc; i++) {
+            EMIT(c, 0x58);                  // pop rax
+            emit_store_argument(c, i);
+        }
+        emit_safe_point(c);
+        patch(c, emit_jmp(c), c->start);
+        break;
+    case CALL_NATIVE:
+        if (c->kind != KIND_OBJECT || !is_valid_arity(operator, argc)) {
+            fail(c);
+            break;
+        }
+        kinds = compile_arguments(c, list, argc, false);
+        EMIT(c, 0x48, 0xBF);                // mov rdi, imm64
+        emit_u64(c, (uint64_t)(uintptr_t)operator);
+        EMIT(c, 0x48, 0x89, 0xE6);          // mov rsi, rsp
+        EMIT(c, 0xBA);                      // mov edx, imm32
+        emit_u32(c, kinds);
+        EMIT(c, 0xB9);                      // mov ecx, imm32
+        emit_u32(c, argc);
+        emit_helper_call(c, &jit_call_native);
+        emit_epilogue(c);
+        break;
+    default:
+        compile_result(c, exp);
+        break;
+    }
+}
+
+static void compile_tail(Compiler *c, Object *exp)
+{
+    List *list;
+    size_t jump;
+
+    exp = optimize_select(exp);
+    list = (List*)exp;
+    if (c->failed) {
+        return;
+    }
+    if (exp == NULL || object_get_type(exp) != OBJECT_TYPE_LIST) {
+        compile_result(c, exp);
+    }
+    else if (analyze_is_tagged_list(exp, "if")) {
+        if (analyze_get_list_size(exp) != 4) {
+            fail(c);
+            return;
+        }
+        compile_value(c, list->next->item);
+        jump = emit_jz(c);
+        compile_tail(c, list->next->next->item);
+        patch(c, jump, c->size);
+        compile_tail(c, list->next->next->next->item);
+    }
+    else if (analyze_is_tagged_list(exp, "cond")) {
+        for (list = list->next; list != NULL && !c->failed; list = list->next) {
+            List *clause = (List*)list->item;
+            List *action;
+
+            if (analyze_get_list_size((Object*)clause) < 2) {
+                fail(c);
+                return;
+            }
+            if (analyze_is_variable(clause->item)
+                && strcmp(((Unbound*)clause->item)->cstr, "else") == 0) {
+                jump = 0;
+            }
+            else {
+                compile_value(c, clause->item);
+                jump = emit_jz(c);
+            }
+            for (action = clause->next; action->next != NULL; action = action->next) {
+                compile_value(c, action->item);
+            }
+            compile_tail(c, action->item);
+            if (jump == 0) {
+                return;
+            }
+            patch(c, jump, c->size);
+        }
+        // None of the clauses matched
+        fail(c);
+    }
+    else if (analyze_is_tagged_list(exp, "begin")) {
+        if (analyze_get_list_size(exp) < 2) {
+            fail(c);
+            return;
+        }
+        for (list = list->next; list->next != NULL; list = list->next) {
+            compile_value(c, list->item);
+        }
+        compile_tail(c, list->item);
+    }
+    else {
+        compile_tail_call(c, exp);
+    }
+}
+
+static const char *get_procedure_name(Proc *proc)
+{
+    Frame *frame;
+
+    for (frame = proc->env->frame; frame != NULL; frame = frame->next) {
+        if (frame->object == (Object*)proc) {
+            return frame->cstr;
+        }
+    }
+    return "lambda";
+}
+
+/*
+ * Entries cover the emitted code only, not the rest of its pages.
+ */
+static void write_perf_map(Jit *jit, size_t size, const char *name)
+{
+    char path[64];
+
+    if (_context->perf_map == NULL) {
+        sprintf(path, "/tmp/perf-%d.map", (int)getpid());
+        _context->perf_map = fopen(path, "a");
+        if (_context->perf_map == NULL) {
+            return;
+        }
+    }
+    fprintf(_context->perf_map, "%lx %lx scheme:%s\n",
+            (unsigned long)(uintptr_t)jit->memory, (unsigned long)size, name);
+    fflush(_context->perf_map);
+}
+
+static Jit *compile(Proc *proc)
+{
+    Code *code = proc->code;
+    Compiler c;
+    Jit *jit = NULL;
+    List *body;
+    int argc = analyze_get_list_size((Object*)code->args);
+
+    // Compiled code resolves variables of the top level environment only once
+    if (!env_is_top_level(proc->env) || argc < 0) {
+        return NULL;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.proc = proc;
+    c.args = (List*)code->args;
+    c.argc = argc;
+
+    for (body = (List*)code->body; body->next != NULL; body = body->next);
+    c.kind = get_result_kind(&c, body->item);
+    if (c.kind == KIND_NONE) {
+        c.kind = KIND_INTEGER;
+    }
+
+    emit_entry(&c);
+    emit_prologue(&c);
+    for (body = (List*)code->body; body->next != NULL; body = body->next) {
+        compile_value(&c, body->item);
+    }
+    compile_tail(&c, body->item);
+
+    if (!c.failed) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t size = (c.size + page - 1) / page * page;
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (memory != MAP_FAILED) {
+            memcpy(memory, c.code, c.size);
+            if (mprotect(memory, size, PROT_READ | PROT_EXEC) == 0) {
+                jit = malloc(sizeof(Jit));
+                jit->function = (JitFunction)memory;
+                jit->memory = memory;
+                jit->size = size;
+                jit->kind = c.kind;
+                jit->argc = c.argc;
+                jit->version = _context->env_version;
+                write_perf_map(jit, c.size, get_procedure_name(proc));
+            }
+            else {
+                munmap(memory, size);
+            }
+        }
+    }
+    free(c.code);
+    return jit;
+}
+
+void jit_enable(void)
+{
+#if defined(__x86_64__)
+    _context->jit_enabled = true;
+#else
+    WARNING("JIT is supported on x86-64 only");
+#endif
+}
+
+bool jit_is_enabled(void)
+{
+    return _context->jit_enabled;
+}
+
+void jit_count_call(Proc *proc)
+{
+    proc->calls += 1;
+    if (proc->calls == JIT_CALL_THRESHOLD) {
+        proc->jit = compile(proc);
+    }
+}
+
+bool jit_execute(Proc *proc, unsigned argc, Object **res)
+{
+    Jit *jit = proc->jit;
+    Object **args = gc_peek(argc);
+    int64_t values[argc + 1];
+    int64_t value;
+    unsigned i;
+
+    // Operators resolved during the compilation might have been reassigned
+    if (jit->version != _context->env_version) {
+        jit_delete(jit);
+        proc->jit = NULL;
+        proc->calls = 0;
+        return false;
+    }
+    if (argc != jit->argc) {
+        return false;
+    }
+    for (i = 0; i < argc; i++) {
+        if (args[i] == NULL || args[i]->type != OBJECT_TYPE_INTEGER) {
+            return false;
+        }
+        values[i] = ((Integer*)args[i])->value;
+    }
+
+    value = jit->function(values);
+    if (_context->jit_bailout) {
+        _context->jit_bailout = false;
+        return false;
+    }
+
+    switch (jit->kind) {
+    case KIND_BOOLEAN:
+        *res = jit_box_boolean(value);
+        break;
+    case KIND_OBJECT:
+        *res = (Object*)(uintptr_t)value;
+        break;
+    default:
+        *res = jit_box_integer(value);
+        break;
+    }
+    return true;
+}
+
+void jit_delete(Jit *jit)
+{
+    if (jit != NULL) {
+        munmap(jit->memory, jit->size);
+        free(jit);
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ *    jit.h
+ */
+
+
+#ifndef JIT_H
+#define JIT_H
+
+#include "types.h"
+
+#include <stdbool.h>
+
+#define JIT_CALL_THRESHOLD 1000
+
+struct jit;
+
+void jit_enable(void);
+
+bool jit_is_enabled(void);
+
+/*
+ * Counts a call of the procedure and compiles it when it becomes hot.
+ */
+void jit_count_call(Proc *proc);
+
+/*
+ * Runs compiled code of the procedure with arguments from the top of the
+ * GC stack. Returns false if the procedure has to be interpreted instead.
+ */
+bool jit_execute(Proc *proc, unsigned argc, Object **res);
+
+void jit_delete(struct jit *jit);
+
+#endif // JIT_H
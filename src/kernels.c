@@ -0,0 +1,681 @@
+/*
+ *    kernels.c
+ */
+
+
+#include "kernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+
+/*
+ * Scalar kernels, also used for tails of the vectorized loops.
+ */
+
+static double scalar_f64_sum(const double *a, size_t n)
+{
+    double res = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        res += a[i];
+    }
+    return res;
+}
+
+static double scalar_f64_dot(const double *a, const double *b, size_t n)
+{
+    double res = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        res += a[i] * b[i];
+    }
+    return res;
+}
+
+static void scalar_f64_add(double *res, const double *a, const double *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        res[i] = a[i] + b[i];
+    }
+}
+
+static void scalar_f64_mul(double *res, const double *a, const double *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        res[i] = a[i] * b[i];
+    }
+}
+
+static void scalar_f64_scale(double *res, const double *a, double k, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        res[i] = a[i] * k;
+    }
+}
+
+static double scalar_f64_min(const double *a, size_t n)
+{
+    double res = a[0];
+    size_t i;
+
+    for (i = 1; i < n; i++) {
+        res = a[i] < res ? a[i] : res;
+    }
+    return res;
+}
+
+static double scalar_f64_max(const double *a, size_t n)
+{
+    double res = a[0];
+    size_t i;
+
+    for (i = 1; i < n; i++) {
+        res = a[i] > res ? a[i] : res;
+    }
+    return res;
+}
+
+static void scalar_f64_prefix_sum(double *res, const double *a, size_t n)
+{
+    double sum = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        sum += a[i];
+        res[i] = sum;
+    }
+}
+
+static bool scalar_i64_sum(int64_t *res, const int64_t *a, size_t n)
+{
+    int64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (__builtin_add_overflow(sum, a[i], &sum)) {
+            return false;
+        }
+    }
+    *res = sum;
+    return true;
+}
+
+static bool scalar_i64_dot(int64_t *res, const int64_t *a, const int64_t *b, size_t n)
+{
+    int64_t sum = 0;
+    int64_t product;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (__builtin_mul_overflow(a[i], b[i], &product)
+            || __builtin_add_overflow(sum, product, &sum)) {
+            return false;
+        }
+    }
+    *res = sum;
+    return true;
+}
+
+static bool scalar_i64_add(int64_t *res, const int64_t *a, const int64_t *b, size_t n)
+{
+    bool overflow = false;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        overflow |= __builtin_add_overflow(a[i], b[i], &res[i]);
+    }
+    return !overflow;
+}
+
+static bool scalar_i64_mul(int64_t *res, const int64_t *a, const int64_t *b, size_t n)
+{
+    bool overflow = false;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        overflow |= __builtin_mul_overflow(a[i], b[i], &res[i]);
+    }
+    return !overflow;
+}
+
+static bool scalar_i64_scale(int64_t *res, const int64_t *a, int64_t k, size_t n)
+{
+    bool overflow = false;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        overflow |= __builtin_mul_overflow(a[i], k, &res[i]);
+    }
+    return !overflow;
+}
+
+static int64_t scalar_i64_min(const int64_t *a, size_t n)
+{
+    int64_t res = a[0];
+    size_t i;
+
+    for (i = 1; i < n; i++) {
+        res = a[i] < res ? a[i] : res;
+    }
+    return res;
+}
+
+static int64_t scalar_i64_max(const int64_t *a, size_t n)
+{
+    int64_t res = a[0];
+    size_t i;
+
+    for (i = 1; i < n; i++) {
+        res = a[i] > res ? a[i] : res;
+    }
+    return res;
+}
+
+static bool scalar_i64_prefix_sum(int64_t *res, const int64_t *a, size_t n)
+{
+    int64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (__builtin_add_overflow(sum, a[i], &sum)) {
+            return false;
+        }
+        res[i] = sum;
+    }
+    return true;
+}
+
+static const Kernels _scalar = {
+    "scalar",
+    &scalar_f64_sum,
+    &scalar_f64_dot,
+    &scalar_f64_add,
+    &scalar_f64_mul,
+    &scalar_f64_scale,
+    &scalar_f64_min,
+    &scalar_f64_max,
+    &scalar_f64_prefix_sum,
+    &scalar_i64_sum,
+    &scalar_i64_dot,
+    &scalar_i64_add,
+    &scalar_i64_mul,
+    &scalar_i64_scale,
+    &scalar_i64_min,
+    &scalar_i64_max,
+    &scalar_i64_prefix_sum
+};
+
+#ifdef KERNELS_X86
+
+/*
+ * SSE2 kernels, two lanes. Signed overflow of a lane sum r = a + b shows
+ * in the sign bit of (a ^ r) & (b ^ r).
+ */
+
+static double sse2_f64_sum(const double *a, size_t n)
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    double lanes[2];
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+    }
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    return lanes[0] + lanes[1] + scalar_f64_sum(a + i, n - i);
+}
+
+static double sse2_f64_dot(const double *a, const double *b, size_t n)
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    double lanes[2];
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    return lanes[0] + lanes[1] + scalar_f64_dot(a + i, b + i, n - i);
+}
+
+static void sse2_f64_add(double *res, const double *a, const double *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(res + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    scalar_f64_add(res + i, a + i, b + i, n - i);
+}
+
+static void sse2_f64_mul(double *res, const double *a, const double *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(res + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    scalar_f64_mul(res + i, a + i, b + i, n - i);
+}
+
+static void sse2_f64_scale(double *res, const double *a, double k, size_t n)
+{
+    __m128d factor = _mm_set1_pd(k);
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(res + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+    }
+    scalar_f64_scale(res + i, a + i, k, n - i);
+}
+
+static double sse2_f64_min(const double *a, size_t n)
+{
+    __m128d acc;
+    double lanes[2];
+    size_t i;
+
+    if (n < 2) {
+        return scalar_f64_min(a, n);
+    }
+    acc = _mm_loadu_pd(a);
+    for (i = 2; i + 2 <= n; i += 2) {
+        acc = _mm_min_pd(acc, _mm_loadu_pd(a + i));
+    }
+    _mm_storeu_pd(lanes, acc);
+    lanes[0] = lanes[1] < lanes[0] ? lanes[1] : lanes[0];
+    return i < n && a[i] < lanes[0] ? a[i] : lanes[0];
+}
+
+static double sse2_f64_max(const double *a, size_t n)
+{
+    __m128d acc;
+    double lanes[2];
+    size_t i;
+
+    if (n < 2) {
+        return scalar_f64_max(a, n);
+    }
+    acc = _mm_loadu_pd(a);
+    for (i = 2; i + 2 <= n; i += 2) {
+        acc = _mm_max_pd(acc, _mm_loadu_pd(a + i));
+    }
+    _mm_storeu_pd(lanes, acc);
+    lanes[0] = lanes[1] > lanes[0] ? lanes[1] : lanes[0];
+    return i < n && a[i] > lanes[0] ? a[i] : lanes[0];
+}
+
+static void sse2_f64_prefix_sum(double *res, const double *a, size_t n)
+{
+    __m128d carry = _mm_setzero_pd();
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        // [x0, x1] + [0, x0]
+        x = _mm_add_pd(x, _mm_unpacklo_pd(_mm_setzero_pd(), x));
+        x = _mm_add_pd(x, carry);
+        _mm_storeu_pd(res + i, x);
+        carry = _mm_unpackhi_pd(x, x);
+    }
+    if (i < n) {
+        res[i] = a[i] + _mm_cvtsd_f64(carry);
+    }
+}
+
+static bool sse2_i64_sum(int64_t *res, const int64_t *a, size_t n)
+{
+    __m128i acc = _mm_setzero_si128();
+    __m128i overflow = _mm_setzero_si128();
+    int64_t lanes[2];
+    int64_t tail;
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i sum = _mm_add_epi64(acc, x);
+        overflow = _mm_or_si128(overflow, _mm_and_si128(_mm_xor_si128(acc, sum),
+                                                        _mm_xor_si128(x, sum)));
+        acc = sum;
+    }
+    if (_mm_movemask_pd(_mm_castsi128_pd(overflow)) != 0) {
+        return false;
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return scalar_i64_sum(&tail, a + i, n - i)
+        && !__builtin_add_overflow(lanes[0], lanes[1], res)
+        && !__builtin_add_overflow(*res, tail, res);
+}
+
+static bool sse2_i64_add(int64_t *res, const int64_t *a, const int64_t *b, size_t n)
+{
+    __m128i overflow = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i sum = _mm_add_epi64(x, y);
+        overflow = _mm_or_si128(overflow, _mm_and_si128(_mm_xor_si128(x, sum),
+                                                        _mm_xor_si128(y, sum)));
+        _mm_storeu_si128((__m128i*)(res + i), sum);
+    }
+    return _mm_movemask_pd(_mm_castsi128_pd(overflow)) == 0
+        && scalar_i64_add(res + i, a + i, b + i, n - i);
+}
+
+static const Kernels _sse2 = {
+    "sse2",
+    &sse2_f64_sum,
+    &sse2_f64_dot,
+    &sse2_f64_add,
+    &sse2_f64_mul,
+    &sse2_f64_scale,
+    &sse2_f64_min,
+    &sse2_f64_max,
+    &sse2_f64_prefix_sum,
+    &sse2_i64_sum,
+    &scalar_i64_dot,
+    &sse2_i64_add,
+    &scalar_i64_mul,
+    &scalar_i64_scale,
+    &scalar_i64_min,
+    &scalar_i64_max,
+    &scalar_i64_prefix_sum
+};
+
+/*
+ * AVX2 kernels, four lanes.
+ */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static double avx2_horizontal_sum(__m256d x)
+{
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(x), _mm256_extractf128_pd(x, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+AVX2 static double avx2_f64_sum(const double *a, size_t n)
+{
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+    }
+    return avx2_horizontal_sum(_mm256_add_pd(acc0, acc1)) + scalar_f64_sum(a + i, n - i);
+}
+
+AVX2 static double avx2_f64_dot(const double *a, const double *b, size_t n)
+{
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                 _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                                 _mm256_loadu_pd(b + i + 4)));
+    }
+    return avx2_horizontal_sum(_mm256_add_pd(acc0, acc1)) + scalar_f64_dot(a + i, b + i, n - i);
+}
+
+AVX2 static void avx2_f64_add(double *res, const double *a, const double *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(res + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    scalar_f64_add(res + i, a + i, b + i, n - i);
+}
+
+AVX2 static void avx2_f64_mul(double *res, const double *a, const double *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(res + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    scalar_f64_mul(res + i, a + i, b + i, n - i);
+}
+
+AVX2 static void avx2_f64_scale(double *res, const double *a, double k, size_t n)
+{
+    __m256d factor = _mm256_set1_pd(k);
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(res + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+    }
+    scalar_f64_scale(res + i, a + i, k, n - i);
+}
+
+AVX2 static double avx2_f64_min(const double *a, size_t n)
+{
+    __m256d acc;
+    double lanes[4];
+    size_t i;
+
+    if (n < 4) {
+        return scalar_f64_min(a, n);
+    }
+    acc = _mm256_loadu_pd(a);
+    for (i = 4; i + 4 <= n; i += 4) {
+        acc = _mm256_min_pd(acc, _mm256_loadu_pd(a + i));
+    }
+    _mm256_storeu_pd(lanes, acc);
+    lanes[0] = scalar_f64_min(lanes, 4);
+    return i < n ? scalar_f64_min((double[]){ lanes[0], scalar_f64_min(a + i, n - i) }, 2)
+        : lanes[0];
+}
+
+AVX2 static double avx2_f64_max(const double *a, size_t n)
+{
+    __m256d acc;
+    double lanes[4];
+    size_t i;
+
+    if (n < 4) {
+        return scalar_f64_max(a, n);
+    }
+    acc = _mm256_loadu_pd(a);
+    for (i = 4; i + 4 <= n; i += 4) {
+        acc = _mm256_max_pd(acc, _mm256_loadu_pd(a + i));
+    }
+    _mm256_storeu_pd(lanes, acc);
+    lanes[0] = scalar_f64_max(lanes, 4);
+    return i < n ? scalar_f64_max((double[]){ lanes[0], scalar_f64_max(a + i, n - i) }, 2)
+        : lanes[0];
+}
+
+AVX2 static void avx2_f64_prefix_sum(double *res, const double *a, size_t n)
+{
+    __m256d zero = _mm256_setzero_pd();
+    __m256d carry = zero;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        // Shift lanes by one and by two elements and add
+        __m256d t = _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1);
+        x = _mm256_add_pd(x, t);
+        t = _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3);
+        x = _mm256_add_pd(_mm256_add_pd(x, t), carry);
+        _mm256_storeu_pd(res + i, x);
+        carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    for (; i < n; i++) {
+        res[i] = (i > 0 ? res[i - 1] : 0) + a[i];
+    }
+}
+
+AVX2 static bool avx2_i64_sum(int64_t *res, const int64_t *a, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    __m256i overflow = _mm256_setzero_si256();
+    int64_t lanes[4];
+    int64_t tail;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i sum = _mm256_add_epi64(acc, x);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(acc, sum),
+                                                              _mm256_xor_si256(x, sum)));
+        acc = sum;
+    }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(overflow)) != 0) {
+        return false;
+    }
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return scalar_i64_sum(res, lanes, 4)
+        && scalar_i64_sum(&tail, a + i, n - i)
+        && !__builtin_add_overflow(*res, tail, res);
+}
+
+AVX2 static bool avx2_i64_add(int64_t *res, const int64_t *a, const int64_t *b, size_t n)
+{
+    __m256i overflow = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i sum = _mm256_add_epi64(x, y);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(x, sum),
+                                                              _mm256_xor_si256(y, sum)));
+        _mm256_storeu_si256((__m256i*)(res + i), sum);
+    }
+    return _mm256_movemask_pd(_mm256_castsi256_pd(overflow)) == 0
+        && scalar_i64_add(res + i, a + i, b + i, n - i);
+}
+
+AVX2 static int64_t avx2_i64_min(const int64_t *a, size_t n)
+{
+    __m256i acc;
+    int64_t lanes[5];
+    size_t i;
+
+    if (n < 4) {
+        return scalar_i64_min(a, n);
+    }
+    acc = _mm256_loadu_si256((const __m256i*)a);
+    for (i = 4; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        acc = _mm256_blendv_epi8(acc, x, _mm256_cmpgt_epi64(acc, x));
+    }
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    lanes[4] = i < n ? scalar_i64_min(a + i, n - i) : lanes[0];
+    return scalar_i64_min(lanes, 5);
+}
+
+AVX2 static int64_t avx2_i64_max(const int64_t *a, size_t n)
+{
+    __m256i acc;
+    int64_t lanes[5];
+    size_t i;
+
+    if (n < 4) {
+        return scalar_i64_max(a, n);
+    }
+    acc = _mm256_loadu_si256((const __m256i*)a);
+    for (i = 4; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        acc = _mm256_blendv_epi8(acc, x, _mm256_cmpgt_epi64(x, acc));
+    }
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    lanes[4] = i < n ? scalar_i64_max(a + i, n - i) : lanes[0];
+    return scalar_i64_max(lanes, 5);
+}
+
+static const Kernels _avx2 = {
+    "avx2",
+    &avx2_f64_sum,
+    &avx2_f64_dot,
+    &avx2_f64_add,
+    &avx2_f64_mul,
+    &avx2_f64_scale,
+    &avx2_f64_min,
+    &avx2_f64_max,
+    &avx2_f64_prefix_sum,
+    &avx2_i64_sum,
+    &scalar_i64_dot,
+    &avx2_i64_add,
+    &scalar_i64_mul,
+    &scalar_i64_scale,
+    &avx2_i64_min,
+    &avx2_i64_max,
+    &scalar_i64_prefix_sum
+};
+
+/*
+ * AVX2 needs support of the processor and saving of YMM registers by the
+ * operating system.
+ */
+static bool has_avx2(void)
+{
+    unsigned eax, ebx, ecx, edx;
+    unsigned xcr0;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+        || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return false;
+    }
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+    if ((xcr0 & 0x6) != 0x6) {
+        return false;
+    }
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2);
+}
+
+static bool has_sse2(void)
+{
+    unsigned eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2);
+}
+
+#endif // KERNELS_X86
+
+const Kernels *kernels_get(void)
+{
+    // Every context selects the same table, so concurrent stores agree
+    static const Kernels *_kernels = NULL;
+
+    if (_kernels == NULL) {
+        const Kernels *kernels = &_scalar;
+#ifdef KERNELS_X86
+        if (has_avx2()) {
+            kernels = &_avx2;
+        }
+        else if (has_sse2()) {
+            kernels = &_sse2;
+        }
+#endif
+        _kernels = kernels;
+    }
+    return _kernels;
+}
@@ -0,0 +1,42 @@
+/*
+ *    kernels.h
+ */
+
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Loops over contiguous numeric arrays. Implementations are chosen once
+ * with cpuid: AVX2, SSE2 or portable scalar code. Minimum and maximum
+ * require non-empty arrays. Integer kernels return false on overflow and
+ * leave results unspecified then.
+ */
+typedef struct kernels
+{
+    const char *name;
+    double (*f64_sum)(const double *a, size_t n);
+    double (*f64_dot)(const double *a, const double *b, size_t n);
+    void (*f64_add)(double *res, const double *a, const double *b, size_t n);
+    void (*f64_mul)(double *res, const double *a, const double *b, size_t n);
+    void (*f64_scale)(double *res, const double *a, double k, size_t n);
+    double (*f64_min)(const double *a, size_t n);
+    double (*f64_max)(const double *a, size_t n);
+    void (*f64_prefix_sum)(double *res, const double *a, size_t n);
+    bool (*i64_sum)(int64_t *res, const int64_t *a, size_t n);
+    bool (*i64_dot)(int64_t *res, const int64_t *a, const int64_t *b, size_t n);
+    bool (*i64_add)(int64_t *res, const int64_t *a, const int64_t *b, size_t n);
+    bool (*i64_mul)(int64_t *res, const int64_t *a, const int64_t *b, size_t n);
+    bool (*i64_scale)(int64_t *res, const int64_t *a, int64_t k, size_t n);
+    int64_t (*i64_min)(const int64_t *a, size_t n);
+    int64_t (*i64_max)(const int64_t *a, size_t n);
+    bool (*i64_prefix_sum)(int64_t *res, const int64_t *a, size_t n);
+} Kernels;
+
+const Kernels *kernels_get(void);
+
+#endif // KERNELS_H
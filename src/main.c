@@ -6,8 +6,26 @@
 
 
 #include "parser.h"
+#include "analyze.h"
+#include "numbers.h"
+#include "vectors.h"
+#include "hash.h"
+#include "maps.h"
+#include "text.h"
+#include "ports.h"
+#include "streams.h"
+#include "sequences.h"
+#include "futures.h"
+#include "image.h"
+#include "cache.h"
+#include "server.h"
+#include "actors.h"
+#include "jit.h"
+#include "optimize.h"
 #include "core.h"
+#include "context.h"
 #include "env.h"
+#include "gc.h"
 #include "error.h"
 #include "debug.h"
 
@@ -16,7 +34,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-#define INPUT_BUFFER_MAX_SIZE 256
+#define INPUT_BUFFER_INITIAL_SIZE 256
 
 #define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
 
@@ -64,97 +82,6 @@ static Object *cdr(Object *obj)
 
 }
 
-static Object *plus(Object *obj)
-{
-    Integer *ans;
-    List *list = (List*)obj;
-
-    ans = (Integer*)object_create(OBJECT_TYPE_INTEGER);
-
-    while (list != NULL) {
-        if (object_get_type(list->item) != OBJECT_TYPE_INTEGER) {
-            throw("Wrong type of argument %s: expected numeric",
-                  object_to_string(list->item));            
-        }
-        ans->value += ((Integer*)list->item)->value;
-        list = list->next;
-    }
-    return (Object*)ans;
-}
-
-static Object *minus(Object *obj)
-{
-    Integer *ans;
-    List *list = (List*)obj;
-
-    ans = (Integer*)object_create(OBJECT_TYPE_INTEGER);
-
-    if (object_get_type(list->item) != OBJECT_TYPE_INTEGER) {
-        throw("Wrong type of argument %s: expected numeric",
-              object_to_string(list->item));            
-    }
-    ans->value = ((Integer*)list->item)->value;
-    list = list->next;
-
-    while (list != NULL) {
-        if (object_get_type(list->item) != OBJECT_TYPE_INTEGER) {
-            throw("Wrong type of argument %s: expected numeric",
-                  object_to_string(list->item));            
-        }
-        ans->value -= ((Integer*)list->item)->value;
-        list = list->next;
-    }
-    return (Object*)ans;
-}
-
-static Object *equal(Object *obj)
-{
-    Boolean *ans = (Boolean*)object_create(OBJECT_TYPE_BOOLEAN);
-    List *list = (List*)obj;
-    int prevVar;
-    bool isPrevVarInit = false;
-
-    ans->value = true;
-
-    while (list != NULL) {
-        if (object_get_type(list->item) != OBJECT_TYPE_INTEGER) {
-            throw("Wrong type of argument %s: expected numeric",
-                  object_to_string(list->item));            
-            list->item->type = OBJECT_TYPE_INTEGER;
-        }
-        if (!isPrevVarInit) {
-            prevVar = ((Integer*)list->item)->value;
-            isPrevVarInit = true;
-        }
-        else if (prevVar != ((Integer*)list->item)->value) {
-            ans->value = false;
-            break;
-        }
-        list = list->next;
-    }
-    return (Object*)ans;
-}
-
-static Object *greater(Object *obj)
-{
-    Boolean *ans = (Boolean*)object_create(OBJECT_TYPE_BOOLEAN);
-    List *list = (List*)obj;
-    Integer *left = (Integer*)list->item;
-    Integer *right = (Integer*)list->next->item;
-    ans->value = left->value > right->value;
-    return (Object*)ans;
-}
-
-static Object *less(Object *obj)
-{
-    Boolean *ans = (Boolean*)object_create(OBJECT_TYPE_BOOLEAN);
-    List *list = (List*)obj;
-    Integer *left = (Integer*)list->item;
-    Integer *right = (Integer*)list->next->item;
-    ans->value = left->value < right->value;
-    return (Object*)ans;
-}
-
 static Object *display(Object *obj)
 {
     List *list = (List*)obj;
@@ -162,22 +89,36 @@ static Object *display(Object *obj)
         object_dump(list->item);
         list = list->next;
     }
-    printf("\n");
+    writer_putc(writer_stdout(), '\n');
     return NULL;
 }
 
-static size_t read_buffer(FILE *file, char *buf, size_t len)
+/*
+ * Appends the next line to the buffer of length len, the buffer grows to
+ * hold forms of any size.
+ */
+static size_t read_buffer(FILE *file, char **buf, size_t *capacity, size_t len)
 {
     char *line = NULL;
     size_t size = 0;
     ssize_t read;
 
     read = getline(&line, &size, file);
-    memcpy(buf, line, len);
-    size -= read;
+    if (read < 0) {
+        free(line);
+        return len;
+    }
+    if (len + read + 1 > *capacity) {
+        while (len + read + 1 > *capacity) {
+            *capacity *= 2;
+        }
+        *buf = (char*)realloc(*buf, *capacity);
+    }
+    memcpy(*buf + len, line, read);
+    (*buf)[len + read] = 0;
 
     free(line);
-    return read < len ? read : len;
+    return len + read;
 }
 
 static int is_expression_complete(const char *line, size_t len)
@@ -195,50 +136,283 @@ static int is_expression_complete(const char *line, size_t len)
     return counter == 0;
 }
 
-int main(int argc, char *argv[])
+static void usage(const char *name)
 {
-    size_t size;
-    ssize_t read;
-    Error error;
-    Object *object;
+    fprintf(stderr, "Usage: %s [--stats] [--jit] [--fuel CALLS] [--timeout MS] [--image IMAGE] [--save-image IMAGE]\n"
+            "       [--cache DIR] [--serve SOCKET [--isolate] [--workers N] | --connect SOCKET] [FILE]\n", name);
+}
 
-    FILE *file = argc == 2 ? fopen(argv[1], "r") : stdin;
-    char *buffer = (char*)malloc(INPUT_BUFFER_MAX_SIZE);
+static void print_statistics(void)
+{
+    fprintf(stderr, "Specialized sites: %u\n", analyze_get_specialized_sites());
+    fprintf(stderr, "Generic sites: %u\n", analyze_get_generic_sites());
+    fprintf(stderr, "Folded expressions: %u\n", optimize_get_folded());
+    fprintf(stderr, "Inlined calls: %u\n", optimize_get_inlined());
+}
+
+/*
+ * Global environment shared by the instances. It is frozen once built,
+ * definitions of a program go to an environment extending it. That
+ * environment isn't frozen: procedures are analyzed and compiled in place
+ * on their first calls and later forms may define or assign its bindings,
+ * so futures and actors still get copies of the library procedures.
+ */
+static Env *create_prelude(void)
+{
     Env *env = env_extend(NULL);
 
     env_add_native_function(env, "cons", 2, 0, cons);
     env_add_native_function(env, "car", 1, 0, car);
     env_add_native_function(env, "cdr", 1, 0, cdr);
-    env_add_native_function(env, "+", 1, 1, plus);
-    env_add_native_function(env, "-", 1, 1, minus);
-    env_add_native_function(env, "=", 1, 1, equal);
-    env_add_native_function(env, ">", 2, 0, greater);
-    env_add_native_function(env, "<", 2, 0, less);
+    env_add_native_function(env, "+", 1, 1, numbers_plus);
+    env_add_native_function(env, "-", 1, 1, numbers_minus);
+    env_add_native_function(env, "*", 1, 1, numbers_multiply);
+    env_add_native_function(env, "/", 1, 1, numbers_divide);
+    env_add_native_function(env, "quotient", 2, 0, numbers_quotient);
+    env_add_native_function(env, "remainder", 2, 0, numbers_remainder);
+    env_add_native_function(env, "=", 1, 1, numbers_equal);
+    env_add_native_function(env, ">", 2, 0, numbers_greater);
+    env_add_native_function(env, "<", 2, 0, numbers_less);
     env_add_native_function(env, "display", 1, 1, display);
+    env_add_native_function(env, "string-length", 1, 0, text_string_length);
+    env_add_native_function(env, "string-append", 0, 1, text_string_append);
+    env_add_native_function(env, "make-string-builder", 0, 1, text_make_string_builder);
+    env_add_native_function(env, "string-builder-append!", 1, 1, text_string_builder_append);
+    env_add_native_function(env, "string-builder-length", 1, 0, text_string_builder_length);
+    env_add_native_function(env, "string-builder->string", 1, 0, text_string_builder_to_string);
+    env_add_native_function(env, "open-input-file", 1, 0, ports_open_input_file);
+    env_add_native_function(env, "open-output-file", 1, 0, ports_open_output_file);
+    env_add_native_function(env, "read-line", 1, 0, ports_read_line);
+    env_add_native_function(env, "read-char", 1, 0, ports_read_char);
+    env_add_native_function(env, "read-string", 2, 0, ports_read_string);
+    env_add_native_function(env, "eof-object?", 1, 0, ports_is_eof_object);
+    env_add_native_function(env, "write-string", 1, 1, ports_write_string);
+    env_add_native_function(env, "close-port", 1, 0, ports_close_port);
+    env_add_native_function(env, "map", 2, 0, sequences_map);
+    env_add_native_function(env, "filter", 2, 0, sequences_filter);
+    env_add_native_function(env, "fold", 3, 0, sequences_fold);
+    env_add_native_function(env, "mapping", 1, 0, sequences_mapping);
+    env_add_native_function(env, "filtering", 1, 0, sequences_filtering);
+    env_add_native_function(env, "compose", 0, 1, sequences_compose);
+    env_add_native_function(env, "sequence-transduce", 4, 0, sequences_transduce);
+    env_add_native_function(env, "force", 1, 0, streams_force);
+    env_add_native_function(env, "make-promise", 1, 0, streams_make_promise);
+    env_add_native_function(env, "promise?", 1, 0, streams_is_promise);
+    env_add_native_function(env, "stream-car", 1, 0, streams_stream_car);
+    env_add_native_function(env, "stream-cdr", 1, 0, streams_stream_cdr);
+    env_add_native_function(env, "stream-map", 2, 0, streams_stream_map);
+    env_add_native_function(env, "stream-filter", 2, 0, streams_stream_filter);
+    env_add_native_function(env, "stream-take", 2, 0, streams_stream_take);
+    env_add_native_function(env, "stream-fold", 3, 0, streams_stream_fold);
+    env_add_native_function(env, "future", 1, 1, futures_future);
+    env_add_native_function(env, "touch", 1, 0, futures_touch);
+    env_add_native_function(env, "parallel-map", 2, 0, futures_parallel_map);
+    env_add_native_function(env, "spawn", 1, 1, actors_spawn);
+    env_add_native_function(env, "send", 2, 0, actors_send);
+    env_add_native_function(env, "receive", 0, 0, actors_receive);
+    env_add_native_function(env, "self", 0, 0, actors_self);
+    env_add_native_function(env, "make-hash-table", 0, 1, hash_make_table);
+    env_add_native_function(env, "hash-ref", 2, 1, hash_ref);
+    env_add_native_function(env, "hash-set!", 3, 0, hash_set);
+    env_add_native_function(env, "hash-remove!", 2, 0, hash_remove);
+    env_add_native_function(env, "hash-count", 1, 0, hash_count);
+    env_add_native_function(env, "hash-for-each", 2, 0, hash_for_each);
+    env_add_native_function(env, "make-map", 0, 0, maps_make_map);
+    env_add_native_function(env, "map-assoc", 3, 0, maps_assoc);
+    env_add_native_function(env, "map-dissoc", 2, 0, maps_dissoc);
+    env_add_native_function(env, "map-get", 2, 1, maps_get);
+    env_add_native_function(env, "map-count", 1, 0, maps_count);
+    env_add_native_function(env, "make-vector", 1, 1, vectors_make_vector);
+    env_add_native_function(env, "vector", 0, 1, vectors_vector);
+    env_add_native_function(env, "vector-length", 1, 0, vectors_vector_length);
+    env_add_native_function(env, "vector-ref", 2, 0, vectors_vector_ref);
+    env_add_native_function(env, "vector-set!", 3, 0, vectors_vector_set);
+    env_add_native_function(env, "list->vector", 1, 0, vectors_list_to_vector);
+    env_add_native_function(env, "vector->list", 1, 0, vectors_vector_to_list);
+    env_add_native_function(env, "vector-sort!", 1, 1, vectors_vector_sort);
+    env_add_native_function(env, "make-f64vector", 1, 1, vectors_make_f64vector);
+    env_add_native_function(env, "f64vector", 0, 1, vectors_f64vector);
+    env_add_native_function(env, "f64vector-length", 1, 0, vectors_f64vector_length);
+    env_add_native_function(env, "f64vector-ref", 2, 0, vectors_f64vector_ref);
+    env_add_native_function(env, "f64vector-set!", 3, 0, vectors_f64vector_set);
+    env_add_native_function(env, "f64vector-sum", 1, 0, vectors_f64vector_sum);
+    env_add_native_function(env, "f64vector-dot", 2, 0, vectors_f64vector_dot);
+    env_add_native_function(env, "f64vector-add", 2, 0, vectors_f64vector_add);
+    env_add_native_function(env, "f64vector-mul", 2, 0, vectors_f64vector_mul);
+    env_add_native_function(env, "f64vector-scale", 2, 0, vectors_f64vector_scale);
+    env_add_native_function(env, "f64vector-min", 1, 0, vectors_f64vector_min);
+    env_add_native_function(env, "f64vector-max", 1, 0, vectors_f64vector_max);
+    env_add_native_function(env, "f64vector-prefix-sum", 1, 0, vectors_f64vector_prefix_sum);
+    env_add_native_function(env, "make-i64vector", 1, 1, vectors_make_i64vector);
+    env_add_native_function(env, "i64vector", 0, 1, vectors_i64vector);
+    env_add_native_function(env, "i64vector-length", 1, 0, vectors_i64vector_length);
+    env_add_native_function(env, "i64vector-ref", 2, 0, vectors_i64vector_ref);
+    env_add_native_function(env, "i64vector-set!", 3, 0, vectors_i64vector_set);
+    env_add_native_function(env, "i64vector-sum", 1, 0, vectors_i64vector_sum);
+    env_add_native_function(env, "i64vector-dot", 2, 0, vectors_i64vector_dot);
+    env_add_native_function(env, "i64vector-add", 2, 0, vectors_i64vector_add);
+    env_add_native_function(env, "i64vector-mul", 2, 0, vectors_i64vector_mul);
+    env_add_native_function(env, "i64vector-scale", 2, 0, vectors_i64vector_scale);
+    env_add_native_function(env, "i64vector-min", 1, 0, vectors_i64vector_min);
+    env_add_native_function(env, "i64vector-max", 1, 0, vectors_i64vector_max);
+    env_add_native_function(env, "i64vector-prefix-sum", 1, 0, vectors_i64vector_prefix_sum);
+    return env;
+}
+
+int main(int argc, char *argv[])
+{
+    ssize_t read;
+    Error error;
+    Object *object;
+    const char *path = NULL;
+    const char *image = NULL;
+    const char *saved_image = NULL;
+    const char *cache_dir = NULL;
+    const char *served = NULL;
+    const char *connected = NULL;
+    Cache *cache = NULL;
+    Client *client = NULL;
+    bool isolate = false;
+    unsigned workers = 0;
+    unsigned long fuel = 0;
+    unsigned long timeout = 0;
+    bool failed = false;
+    bool statistics = false;
+    int i;
+
+    context_enter(context_create());
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            statistics = true;
+        }
+        else if (strcmp(argv[i], "--jit") == 0) {
+            jit_enable();
+        }
+        else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            fuel = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            timeout = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc) {
+            saved_image = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            served = argv[++i];
+        }
+        else if (strcmp(argv[i], "--isolate") == 0) {
+            isolate = true;
+        }
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+            connected = argv[++i];
+        }
+        else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        }
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((served != NULL && connected != NULL) || ((isolate || workers > 0) && served == NULL)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    // Every top level form and every request of a server has its own budget
+    core_set_budget(fuel, timeout);
+    if (connected != NULL && (client = server_connect(connected)) == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    // A server loads the file into its environment, it reads no input
+    FILE *file = path != NULL ? fopen(path, "r") : served == NULL ? stdin : NULL;
+    size_t capacity = INPUT_BUFFER_INITIAL_SIZE;
+    char *buffer = (char*)malloc(capacity);
+    Env *prelude = create_prelude();
+    Env *env;
+
+    gc_freeze((Object*)prelude);
+    env = env_extend(prelude);
+    if (image != NULL) {
+        if (try_and_catch_error() != ERROR_TYPE_NONE) {
+            return EXIT_FAILURE;
+        }
+        image_load(image, env);
+    }
+    if (cache_dir != NULL && file != NULL && file != stdin) {
+        cache = cache_open(cache_dir, path);
+    }
+    if (cache != NULL && cache_is_current(cache)) {
+        // The forms of an unchanged script are replayed without reading it
+        fclose(file);
+        file = NULL;
+        if ((error = try_and_catch_error()) != ERROR_TYPE_NONE) {
+            printf("Catched error in component %s.\n", error_to_string(error));
+            fflush(stdout);
+            cache_close(cache, false);
+            free(buffer);
+            writer_flush(writer_stdout());
+            if (statistics) {
+                print_statistics();
+            }
+            return EXIT_FAILURE;
+        }
+        while (cache_next(cache, &object)) {
+            core_eval(object, env);
+        }
+    }
 
     while (file != NULL && !feof(file)) {
-        memset(buffer, 0, INPUT_BUFFER_MAX_SIZE);
-        size = INPUT_BUFFER_MAX_SIZE;
+        buffer[0] = 0;
         read = 0;
 
         if (file == stdin) {
-            printf("\nREPL ]=>");
+            writer_puts(writer_stdout(), "\nREPL ]=>");
+            writer_flush(writer_stdout());
         }
-        while (!feof(file) && size > 0) {
-            read += read_buffer(file, buffer + read, size - read);
+        while (!feof(file)) {
+            read = read_buffer(file, &buffer, &capacity, read);
 
             if (read > 1 && is_expression_complete(buffer, read) && strlen(buffer) > 0) {
+                if (client != NULL) {
+                    // Forms are sent without waiting for the responses to
+                    // the previous ones, unless they are typed
+                    if (!server_send(client, buffer)
+                        || (file == stdin && !server_receive(client))) {
+                        failed = true;
+                    }
+                    break;
+                }
                 error = try_and_catch_error();
                 if (error != ERROR_TYPE_NONE) {
                     printf("Catched error in component %s.\n", error_to_string(error));
+                    fflush(stdout);
                     if (file != stdin) {
                         fclose(file);
+                        if (cache != NULL) {
+                            cache_close(cache, false);
+                        }
                         free(buffer);
+                        writer_flush(writer_stdout());
+                        if (statistics) {
+                            print_statistics();
+                        }
                         return EXIT_FAILURE;
                     }
                 }
                 else {
-                    object = core_eval(parser_create_object_from_string(buffer), env);
+                    object = cache != NULL ? cache_parse(cache, buffer)
+                        : parser_create_object_from_string(buffer);
+                    object = core_eval(object, env);
                     if (file == stdin) {
                         object_dump(object);
                     }
@@ -249,8 +423,31 @@ int main(int argc, char *argv[])
     }
 
     free(buffer);
+    writer_flush(writer_stdout());
     if (file != NULL && file != stdin) {
         fclose(file);
     }
-    return EXIT_SUCCESS;
+    if (cache != NULL) {
+        cache_close(cache, true);
+    }
+    if (client != NULL && !server_disconnect(client)) {
+        failed = true;
+    }
+    if (served != NULL) {
+        if (try_and_catch_error() != ERROR_TYPE_NONE) {
+            return EXIT_FAILURE;
+        }
+        server_run(served, env, isolate, workers);
+    }
+    if (saved_image != NULL) {
+        if (try_and_catch_error() != ERROR_TYPE_NONE) {
+            return EXIT_FAILURE;
+        }
+        image_save(saved_image, env);
+    }
+    if (statistics) {
+        print_statistics();
+    }
+    context_destroy(_context);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
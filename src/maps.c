@@ -0,0 +1,362 @@
+/*
+ *    maps.c
+ */
+
+
+#include "maps.h"
+#include "hash.h"
+#include "numbers.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+#define HASH_BITS 64
+
+
+static uint32_t fragment_bit(uint64_t hash, unsigned shift)
+{
+    return (uint32_t)1 << ((hash >> shift) & ((1 << MAPS_FRAGMENT_BITS) - 1));
+}
+
+static unsigned data_index(const MapNode *node, uint32_t bit)
+{
+    return 2 * __builtin_popcount(node->datamap & (bit - 1));
+}
+
+static unsigned node_index(const MapNode *node, uint32_t bit)
+{
+    return 2 * __builtin_popcount(node->datamap) + __builtin_popcount(node->nodemap & (bit - 1));
+}
+
+/*
+ * New nodes stay on the GC stack until the whole update is done, the
+ * caller unwinds it.
+ */
+static MapNode *create_node(uint32_t datamap, uint32_t nodemap, unsigned size)
+{
+    Object **slots = calloc(size > 0 ? size : 1, sizeof(Object*));
+    MapNode *node;
+
+    if (slots == NULL) {
+        throw("Not enough memory for map node of size %u", size);
+    }
+    node = (MapNode*)object_create(OBJECT_TYPE_MAP_NODE);
+    node->datamap = datamap;
+    node->nodemap = nodemap;
+    node->size = size;
+    node->slots = slots;
+    gc_push((Object*)node);
+    return node;
+}
+
+static MapNode *copy_node(MapNode *node)
+{
+    MapNode *res = create_node(node->datamap, node->nodemap, node->size);
+    memcpy(res->slots, node->slots, node->size * sizeof(Object*));
+    return res;
+}
+
+static MapNode *insert_entry(MapNode *node, uint32_t bit, unsigned index,
+                             Object *key, Object *value)
+{
+    MapNode *res = create_node(node->datamap | bit, node->nodemap, node->size + 2);
+
+    memcpy(res->slots, node->slots, index * sizeof(Object*));
+    res->slots[index] = key;
+    res->slots[index + 1] = value;
+    memcpy(res->slots + index + 2, node->slots + index, (node->size - index) * sizeof(Object*));
+    return res;
+}
+
+static MapNode *remove_entry(MapNode *node, uint32_t bit, unsigned index)
+{
+    MapNode *res = create_node(node->datamap & ~bit, node->nodemap, node->size - 2);
+
+    memcpy(res->slots, node->slots, index * sizeof(Object*));
+    memcpy(res->slots + index, node->slots + index + 2,
+           (node->size - index - 2) * sizeof(Object*));
+    return res;
+}
+
+/*
+ * Node holding two entries whose hashes are equal up to the shift.
+ */
+static MapNode *merge_entries(unsigned shift, uint64_t hash1, Object *key1, Object *value1,
+                              uint64_t hash2, Object *key2, Object *value2)
+{
+    uint32_t bit1;
+    uint32_t bit2;
+    MapNode *res;
+
+    if (shift >= HASH_BITS) {
+        res = create_node(0, 0, 4);
+    }
+    else if ((bit1 = fragment_bit(hash1, shift)) == (bit2 = fragment_bit(hash2, shift))) {
+        MapNode *child = merge_entries(shift + MAPS_FRAGMENT_BITS,
+                                       hash1, key1, value1, hash2, key2, value2);
+        res = create_node(0, bit1, 1);
+        res->slots[0] = (Object*)child;
+        return res;
+    }
+    else {
+        res = create_node(bit1 | bit2, 0, 4);
+        if (bit2 < bit1) {
+            res->slots[0] = key2;
+            res->slots[1] = value2;
+            res->slots[2] = key1;
+            res->slots[3] = value1;
+            return res;
+        }
+    }
+    res->slots[0] = key1;
+    res->slots[1] = value1;
+    res->slots[2] = key2;
+    res->slots[3] = value2;
+    return res;
+}
+
+static MapNode *assoc_collision(MapNode *node, Object *key, Object *value, bool *added)
+{
+    MapNode *res;
+    unsigned i;
+
+    for (i = 0; i < node->size; i += 2) {
+        if (hash_is_equal(node->slots[i], key)) {
+            if (node->slots[i + 1] == value) {
+                return node;
+            }
+            res = copy_node(node);
+            res->slots[i + 1] = value;
+            return res;
+        }
+    }
+    *added = true;
+    return insert_entry(node, 0, node->size, key, value);
+}
+
+static MapNode *assoc(MapNode *node, unsigned shift, uint64_t hash,
+                      Object *key, Object *value, bool *added)
+{
+    uint32_t bit;
+    unsigned index;
+    MapNode *res;
+
+    if (shift >= HASH_BITS) {
+        return assoc_collision(node, key, value, added);
+    }
+    bit = fragment_bit(hash, shift);
+
+    if (node->datamap & bit) {
+        Object *other;
+        MapNode *child;
+        unsigned position;
+        unsigned i;
+        unsigned j;
+
+        index = data_index(node, bit);
+        other = node->slots[index];
+        if (hash_is_equal(other, key)) {
+            if (node->slots[index + 1] == value) {
+                return node;
+            }
+            res = copy_node(node);
+            res->slots[index + 1] = value;
+            return res;
+        }
+        // The entry moves down into a new child together with the key
+        *added = true;
+        child = merge_entries(shift + MAPS_FRAGMENT_BITS, hash_object(other), other,
+                              node->slots[index + 1], hash, key, value);
+        res = create_node(node->datamap & ~bit, node->nodemap | bit, node->size - 1);
+        position = node_index(res, bit);
+        for (i = 0, j = 0; i < node->size; i++) {
+            if (j == position) {
+                res->slots[j++] = (Object*)child;
+            }
+            if (i != index && i != index + 1) {
+                res->slots[j++] = node->slots[i];
+            }
+        }
+        if (j == position) {
+            res->slots[j] = (Object*)child;
+        }
+        return res;
+    }
+    if (node->nodemap & bit) {
+        MapNode *child;
+
+        index = node_index(node, bit);
+        child = assoc((MapNode*)node->slots[index], shift + MAPS_FRAGMENT_BITS,
+                      hash, key, value, added);
+        if (child == (MapNode*)node->slots[index]) {
+            return node;
+        }
+        res = copy_node(node);
+        res->slots[index] = (Object*)child;
+        return res;
+    }
+    *added = true;
+    return insert_entry(node, bit, data_index(node, bit), key, value);
+}
+
+static MapNode *dissoc(MapNode *node, unsigned shift, uint64_t hash, Object *key)
+{
+    uint32_t bit;
+    unsigned index;
+
+    if (shift >= HASH_BITS) {
+        for (index = 0; index < node->size; index += 2) {
+            if (hash_is_equal(node->slots[index], key)) {
+                return remove_entry(node, 0, index);
+            }
+        }
+        return node;
+    }
+    bit = fragment_bit(hash, shift);
+
+    if (node->datamap & bit) {
+        index = data_index(node, bit);
+        if (!hash_is_equal(node->slots[index], key)) {
+            return node;
+        }
+        return remove_entry(node, bit, index);
+    }
+    if (node->nodemap & bit) {
+        MapNode *child;
+        MapNode *res;
+
+        index = node_index(node, bit);
+        child = dissoc((MapNode*)node->slots[index], shift + MAPS_FRAGMENT_BITS, hash, key);
+        if (child == (MapNode*)node->slots[index]) {
+            return node;
+        }
+        if (child->nodemap == 0 && child->size == 2) {
+            // The last entry of the child replaces it
+            unsigned position = data_index(node, bit);
+            unsigned i;
+            unsigned j;
+
+            res = create_node(node->datamap | bit, node->nodemap & ~bit, node->size + 1);
+            for (i = 0, j = 0; i < node->size; i++) {
+                if (i == position) {
+                    res->slots[j++] = child->slots[0];
+                    res->slots[j++] = child->slots[1];
+                }
+                if (i != index) {
+                    res->slots[j++] = node->slots[i];
+                }
+            }
+            return res;
+        }
+        res = copy_node(node);
+        res->slots[index] = (Object*)child;
+        return res;
+    }
+    return node;
+}
+
+static Object **find(MapNode *node, uint64_t hash, Object *key)
+{
+    unsigned shift;
+    unsigned index;
+
+    for (shift = 0; shift < HASH_BITS; shift += MAPS_FRAGMENT_BITS) {
+        uint32_t bit = fragment_bit(hash, shift);
+
+        if (node->datamap & bit) {
+            index = data_index(node, bit);
+            return hash_is_equal(node->slots[index], key) ? &node->slots[index + 1] : NULL;
+        }
+        if (!(node->nodemap & bit)) {
+            return NULL;
+        }
+        node = (MapNode*)node->slots[node_index(node, bit)];
+    }
+    for (index = 0; index < node->size; index += 2) {
+        if (hash_is_equal(node->slots[index], key)) {
+            return &node->slots[index + 1];
+        }
+    }
+    return NULL;
+}
+
+static Map *get_map(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_MAP) {
+        throw("Wrong type of argument %s: expected map",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return (Map*)obj;
+}
+
+static Object *create_map(MapNode *root, size_t count, unsigned depth)
+{
+    Map *map = (Map*)object_create(OBJECT_TYPE_MAP);
+    map->root = root;
+    map->count = count;
+    gc_unwind(depth);
+    return (Object*)map;
+}
+
+Object *maps_make_map(Object *obj)
+{
+    const unsigned depth = gc_depth();
+    return create_map(create_node(0, 0, 0), 0, depth);
+}
+
+Object *maps_assoc(Object *obj)
+{
+    List *list = (List*)obj;
+    Map *map = get_map(list->item);
+    Object *key = list->next->item;
+    const unsigned depth = gc_depth();
+    bool added = false;
+    MapNode *root = assoc(map->root, 0, hash_object(key), key, list->next->next->item, &added);
+
+    if (root == map->root) {
+        return (Object*)map;
+    }
+    return create_map(root, map->count + added, depth);
+}
+
+Object *maps_dissoc(Object *obj)
+{
+    List *list = (List*)obj;
+    Map *map = get_map(list->item);
+    Object *key = list->next->item;
+    const unsigned depth = gc_depth();
+    MapNode *root = dissoc(map->root, 0, hash_object(key), key);
+
+    if (root == map->root) {
+        return (Object*)map;
+    }
+    return create_map(root, map->count - 1, depth);
+}
+
+Object *maps_get(Object *obj)
+{
+    List *list = (List*)obj;
+    Map *map = get_map(list->item);
+    Object *key = list->next->item;
+    Object **value = find(map->root, hash_object(key), key);
+
+    if (value != NULL) {
+        return *value;
+    }
+    if (list->next->next == NULL) {
+        throw("Key %s not found", key != NULL ? object_to_string(key) : "#nil");
+    }
+    return list->next->next->item;
+}
+
+Object *maps_count(Object *obj)
+{
+    return numbers_create_integer(get_map(((List*)obj)->item)->count);
+}
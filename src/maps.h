@@ -0,0 +1,31 @@
+/*
+ *    maps.h
+ */
+
+
+#ifndef MAPS_H
+#define MAPS_H
+
+#include "types.h"
+
+/*
+ * Bits of the hash consumed by a level of the trie.
+ */
+#define MAPS_FRAGMENT_BITS 5
+
+/*
+ * Persistent maps compare keys like hash tables. map-assoc and map-dissoc
+ * return new maps and copy only nodes on the path to the key, map-get
+ * without a default value throws if the key is missing.
+ */
+Object *maps_make_map(Object *obj);
+
+Object *maps_assoc(Object *obj);
+
+Object *maps_dissoc(Object *obj);
+
+Object *maps_get(Object *obj);
+
+Object *maps_count(Object *obj);
+
+#endif // MAPS_H
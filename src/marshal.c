@@ -0,0 +1,1061 @@
+/*
+ *    marshal.c
+ */
+
+
+#include "marshal.h"
+#include "analyze.h"
+#include "optimize.h"
+#include "numbers.h"
+#include "vectors.h"
+#include "text.h"
+#include "hash.h"
+#include "maps.h"
+#include "actors.h"
+#include "records.h"
+#include "env.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+#define MESSAGE_MIN_CAPACITY 64
+#define REFERENCES_MIN_CAPACITY 64
+
+
+typedef enum tag
+{
+    TAG_NIL,
+    TAG_TRUE,
+    TAG_FALSE,
+    TAG_INTEGER,
+    TAG_BIGNUM,
+    TAG_FLONUM,
+    TAG_STRING,
+    TAG_SYMBOL,
+    TAG_LIST,
+    TAG_VECTOR,
+    TAG_F64VECTOR,
+    TAG_I64VECTOR,
+    TAG_HASH_TABLE,
+    TAG_MAP,
+    TAG_PROCEDURE,
+    TAG_ENVIRONMENT,
+    TAG_NATIVE,
+    TAG_ACTOR,
+    TAG_SHARED,
+    TAG_PRELUDE,
+    TAG_REFERENCE,
+    TAG_RECORD_TYPE,
+    TAG_RECORD,
+    TAG_RECORD_PROCEDURE
+} Tag;
+
+/*
+ * Objects with identity are numbered in the order they are written, later
+ * occurrences are written as references. The table finds the numbers, the
+ * array keeps the order. Both are allocated with the first such object,
+ * plain data needs neither.
+ */
+typedef struct marshal
+{
+    Message *message;
+    Object **objects;
+    unsigned count;
+    unsigned size;
+    Object **keys;
+    unsigned *indices;
+    unsigned capacity;
+    Object *failed;
+    // Name of the binding of the object which can't be copied
+    const char *binding;
+    // Images refer to the prelude by names instead of addresses
+    bool image;
+} Marshal;
+
+typedef struct unmarshal
+{
+    const char *data;
+    size_t position;
+    size_t length;
+    Object **objects;
+    unsigned count;
+    unsigned size;
+    Env *prelude;
+    // Files may be damaged or crafted, their tags can't hold addresses
+    bool file;
+} Unmarshal;
+
+/*
+ * Names of the bindings already written for a procedure.
+ */
+typedef struct names
+{
+    const char **items;
+    unsigned count;
+    unsigned size;
+} Names;
+
+
+static void *allocate(void *ptr, size_t size)
+{
+    void *res = realloc(ptr, size);
+
+    if (res == NULL) {
+        FATAL("Not enough memory for message of %zu bytes", size);
+    }
+    return res;
+}
+
+static void put(Marshal *m, const void *data, size_t length)
+{
+    Message *message = m->message;
+
+    if (message->length + length > message->capacity) {
+        size_t capacity = message->capacity;
+
+        while (message->length + length > capacity) {
+            capacity *= 2;
+        }
+        message->data = allocate(message->data, capacity);
+        message->capacity = capacity;
+    }
+    memcpy(message->data + message->length, data, length);
+    message->length += length;
+}
+
+static void put_tag(Marshal *m, Tag tag)
+{
+    char byte = (char)tag;
+    put(m, &byte, 1);
+}
+
+static void put_u64(Marshal *m, uint64_t value)
+{
+    put(m, &value, sizeof(value));
+}
+
+/*
+ * Strings are written with the terminating zero, so names can be used in
+ * place.
+ */
+static void put_string(Marshal *m, const char *str, size_t length)
+{
+    put_u64(m, length);
+    put(m, str, length);
+    put(m, "", 1);
+}
+
+static size_t hash_pointer(const Object *obj)
+{
+    return (size_t)(((uintptr_t)obj >> 4) * 0x9E3779B97F4A7C15ULL);
+}
+
+static unsigned find_slot(Marshal *m, const Object *obj)
+{
+    unsigned mask = m->capacity - 1;
+    unsigned i = hash_pointer(obj) & mask;
+
+    while (m->keys[i] != NULL && m->keys[i] != obj) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void rebuild(Marshal *m, unsigned capacity)
+{
+    unsigned i;
+
+    free(m->keys);
+    free(m->indices);
+    m->keys = calloc(capacity, sizeof(Object*));
+    m->indices = allocate(NULL, capacity * sizeof(unsigned));
+    m->capacity = capacity;
+    if (m->keys == NULL) {
+        FATAL("Not enough memory for %u references", capacity);
+    }
+    for (i = 0; i < m->count; i++) {
+        unsigned slot = find_slot(m, m->objects[i]);
+        m->keys[slot] = m->objects[i];
+        m->indices[slot] = i;
+    }
+}
+
+static void remember(Marshal *m, Object *obj)
+{
+    unsigned slot;
+
+    if (m->count == m->size) {
+        m->size = m->size ? m->size * 2 : REFERENCES_MIN_CAPACITY;
+        m->objects = allocate(m->objects, m->size * sizeof(Object*));
+    }
+    m->objects[m->count] = obj;
+    m->count += 1;
+    if (m->count * 2 > m->capacity) {
+        rebuild(m, m->capacity ? m->capacity * 2 : REFERENCES_MIN_CAPACITY);
+        return;
+    }
+    slot = find_slot(m, obj);
+    m->keys[slot] = obj;
+    m->indices[slot] = m->count - 1;
+}
+
+static bool write_object(Marshal *m, Object *obj);
+
+static bool write_list(Marshal *m, Object *obj)
+{
+    Object *tail = obj;
+    uint64_t count = 0;
+
+    for (; tail != NULL && tail->type == OBJECT_TYPE_LIST; tail = (Object*)((List*)tail)->next) {
+        count += 1;
+    }
+    put_tag(m, TAG_LIST);
+    put_u64(m, count);
+    for (; obj != tail; obj = (Object*)((List*)obj)->next) {
+        if (!write_object(m, ((List*)obj)->item)) {
+            return false;
+        }
+    }
+    return write_object(m, tail);
+}
+
+static bool write_map_node(Marshal *m, MapNode *node)
+{
+    // Collision nodes have neither data nor node bits
+    unsigned data = node->datamap != 0 || node->nodemap != 0
+        ? 2 * __builtin_popcount(node->datamap) : node->size;
+    unsigned i;
+
+    for (i = 0; i < node->size; i++) {
+        if (i >= data) {
+            if (!write_map_node(m, (MapNode*)node->slots[i])) {
+                return false;
+            }
+        }
+        else if (!write_object(m, node->slots[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_name(Names *names, const char *str)
+{
+    unsigned i;
+
+    for (i = 0; i < names->count; i++) {
+        if (strcmp(names->items[i], str) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static Env *find_prelude(Env *env)
+{
+    while (env != NULL && !env->object.frozen) {
+        env = env->next;
+    }
+    return env;
+}
+
+/*
+ * Procedures read from an image extend the prelude of the reader, so they
+ * need no copies of its bindings.
+ */
+static bool is_prelude_binding(Env *env, const char *str, Object *value)
+{
+    Env *prelude = find_prelude(env);
+
+    return prelude != NULL && env_lookup_variable_str(prelude, str) == value;
+}
+
+/*
+ * The innermost binding of an object which can't be copied is reported.
+ */
+static bool write_binding(Marshal *m, const char *str, Object *value)
+{
+    put_tag(m, TAG_SYMBOL);
+    put_string(m, str, strlen(str));
+    if (!write_object(m, value)) {
+        if (m->binding == NULL) {
+            m->binding = str;
+        }
+        return false;
+    }
+    return true;
+}
+
+static void add_name(Names *names, const char *str)
+{
+    if (names->count == names->size) {
+        names->size = names->size ? names->size * 2 : 16;
+        names->items = allocate(names->items, names->size * sizeof(char*));
+    }
+    names->items[names->count++] = str;
+}
+
+/*
+ * Writes bindings of the variables mentioned anywhere in the expression.
+ * Arguments of the procedure hide the variables of the same names.
+ */
+static bool write_bindings(Marshal *m, Env *env, Object *exp, Names *names)
+{
+    exp = optimize_is_guard(exp) ? optimize_get_original(exp) : exp;
+
+    if (exp != NULL && exp->type == OBJECT_TYPE_LIST) {
+        List *list;
+
+        for (list = (List*)exp; list != NULL; list = list->next) {
+            if (!write_bindings(m, env, list->item, names)) {
+                return false;
+            }
+            if (list->next != NULL && list->next->object.type != OBJECT_TYPE_LIST) {
+                return write_bindings(m, env, (Object*)list->next, names);
+            }
+        }
+    }
+    else if (exp != NULL && exp->type == OBJECT_TYPE_UNBOUND) {
+        const char *str = ((Unbound*)exp)->cstr;
+        Object *value;
+
+        if (is_name(names, str) || (value = env_lookup_variable_str(env, str)) == NULL
+            || (m->image && is_prelude_binding(env, str, value))) {
+            return true;
+        }
+        add_name(names, str);
+        return write_binding(m, str, value);
+    }
+    return true;
+}
+
+static bool write_procedure(Marshal *m, Proc *proc)
+{
+    Names names = { NULL, 0, 0 };
+    Object *args;
+    bool written;
+
+    remember(m, (Object*)proc);
+    put_tag(m, TAG_PROCEDURE);
+    if (!write_object(m, (Object*)proc->env)
+        || !write_object(m, (Object*)proc->code->args)
+        || !write_object(m, proc->code->body)) {
+        return false;
+    }
+    for (args = (Object*)proc->code->args; args != NULL && args->type == OBJECT_TYPE_LIST;
+         args = (Object*)((List*)args)->next) {
+        if (((List*)args)->item != NULL && ((List*)args)->item->type == OBJECT_TYPE_UNBOUND) {
+            add_name(&names, ((Unbound*)((List*)args)->item)->cstr);
+        }
+    }
+    if (args != NULL && args->type == OBJECT_TYPE_UNBOUND) {
+        add_name(&names, ((Unbound*)args)->cstr);
+    }
+    written = write_bindings(m, proc->env, proc->code->body, &names);
+    free(names.items);
+    put_tag(m, TAG_NIL);
+    return written;
+}
+
+/*
+ * Constructors store to the fields of their arguments, accessors and
+ * modifiers use one field and predicates none.
+ */
+static unsigned get_fields_count(RecordOperation operation, unsigned argc)
+{
+    return operation == RECORD_CONSTRUCTOR ? argc : operation == RECORD_PREDICATE ? 0 : 1;
+}
+
+static bool write_record_procedure(Marshal *m, RecordProc *proc)
+{
+    unsigned i;
+
+    remember(m, (Object*)proc);
+    put_tag(m, TAG_RECORD_PROCEDURE);
+    put_string(m, proc->cstr, strlen(proc->cstr));
+    put_u64(m, proc->operation);
+    put_u64(m, proc->argc);
+    for (i = 0; i < get_fields_count(proc->operation, proc->argc); i++) {
+        put_u64(m, proc->fields[i]);
+    }
+    return write_object(m, (Object*)proc->type);
+}
+
+static bool write_object(Marshal *m, Object *obj)
+{
+    unsigned slot;
+    size_t i;
+
+    if (obj == NULL) {
+        put_tag(m, TAG_NIL);
+        return true;
+    }
+    if (m->count > 0 && m->keys[slot = find_slot(m, obj)] == obj) {
+        put_tag(m, TAG_REFERENCE);
+        put_u64(m, m->indices[slot]);
+        return true;
+    }
+
+    switch (obj->type) {
+    case OBJECT_TYPE_INTEGER:
+        put_tag(m, TAG_INTEGER);
+        put_u64(m, (uint64_t)((Integer*)obj)->value);
+        return true;
+    case OBJECT_TYPE_BIGNUM: {
+        const Big *big = &((Bignum*)obj)->value;
+
+        put_tag(m, TAG_BIGNUM);
+        put_u64(m, big->negative);
+        put_u64(m, big->size);
+        put(m, big->digits, big->size * sizeof(Digit));
+        return true;
+    }
+    case OBJECT_TYPE_FLONUM:
+        put_tag(m, TAG_FLONUM);
+        put(m, &((Flonum*)obj)->value, sizeof(double));
+        return true;
+    case OBJECT_TYPE_BOOLEAN:
+        put_tag(m, ((Boolean*)obj)->value ? TAG_TRUE : TAG_FALSE);
+        return true;
+    case OBJECT_TYPE_STRING:
+        put_tag(m, TAG_STRING);
+        put_string(m, ((String*)obj)->cstr, ((String*)obj)->length);
+        return true;
+    case OBJECT_TYPE_UNBOUND:
+        put_tag(m, TAG_SYMBOL);
+        put_string(m, ((Unbound*)obj)->cstr, strlen(((Unbound*)obj)->cstr));
+        return true;
+    case OBJECT_TYPE_LIST:
+        // Code of procedures is written without the optimizer's guards
+        if (optimize_is_guard(obj)) {
+            return write_object(m, optimize_get_original(obj));
+        }
+        return write_list(m, obj);
+    case OBJECT_TYPE_VECTOR:
+        remember(m, obj);
+        put_tag(m, TAG_VECTOR);
+        put_u64(m, ((Vector*)obj)->length);
+        for (i = 0; i < ((Vector*)obj)->length; i++) {
+            if (!write_object(m, ((Vector*)obj)->items[i])) {
+                return false;
+            }
+        }
+        return true;
+    case OBJECT_TYPE_F64VECTOR:
+        remember(m, obj);
+        put_tag(m, TAG_F64VECTOR);
+        put_u64(m, ((F64Vector*)obj)->length);
+        put(m, ((F64Vector*)obj)->data, ((F64Vector*)obj)->length * sizeof(double));
+        return true;
+    case OBJECT_TYPE_I64VECTOR:
+        remember(m, obj);
+        put_tag(m, TAG_I64VECTOR);
+        put_u64(m, ((I64Vector*)obj)->length);
+        put(m, ((I64Vector*)obj)->data, ((I64Vector*)obj)->length * sizeof(int64_t));
+        return true;
+    case OBJECT_TYPE_HASH_TABLE: {
+        HashTable *table = (HashTable*)obj;
+
+        // Hashes of keys compared by identity differ in the copy
+        remember(m, obj);
+        put_tag(m, TAG_HASH_TABLE);
+        put_u64(m, table->count);
+        for (i = 0; i < table->capacity; i++) {
+            if (table->entries[i].hash != 0
+                && (!write_object(m, table->entries[i].key)
+                    || !write_object(m, table->entries[i].value))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case OBJECT_TYPE_MAP:
+        remember(m, obj);
+        put_tag(m, TAG_MAP);
+        put_u64(m, ((Map*)obj)->count);
+        return write_map_node(m, ((Map*)obj)->root);
+    case OBJECT_TYPE_PROCEDURE:
+        return write_procedure(m, (Proc*)obj);
+    case OBJECT_TYPE_RECORD_TYPE: {
+        RecordType *type = (RecordType*)obj;
+
+        remember(m, obj);
+        put_tag(m, TAG_RECORD_TYPE);
+        put_u64(m, type->id);
+        put_string(m, type->cstr, strlen(type->cstr));
+        put_u64(m, type->size);
+        for (i = 0; i < type->size; i++) {
+            put_string(m, type->fields[i], strlen(type->fields[i]));
+        }
+        return true;
+    }
+    case OBJECT_TYPE_RECORD:
+        // The reader needs the type to create the record
+        put_tag(m, TAG_RECORD);
+        if (!write_object(m, (Object*)((Record*)obj)->type)) {
+            return false;
+        }
+        remember(m, obj);
+        for (i = 0; i < ((Record*)obj)->type->size; i++) {
+            if (!write_object(m, ((Record*)obj)->slots[i])) {
+                return false;
+            }
+        }
+        return true;
+    case OBJECT_TYPE_RECORD_PROCEDURE:
+        return write_record_procedure(m, (RecordProc*)obj);
+    case OBJECT_TYPE_ENVIRONMENT:
+        // Only the identity, the bindings are written with the procedures
+        remember(m, obj);
+        put_tag(m, TAG_ENVIRONMENT);
+        return true;
+    case OBJECT_TYPE_NATIVE: {
+        Native *native = (Native*)obj;
+
+        // Natives of the prelude are passed as they are, images name them
+        if (obj->frozen && m->image) {
+            put_tag(m, TAG_PRELUDE);
+            put_string(m, native->cstr, strlen(native->cstr));
+            return true;
+        }
+        if (obj->frozen) {
+            put_tag(m, TAG_SHARED);
+            put(m, &obj, sizeof(Object*));
+            return true;
+        }
+        // Addresses of other natives are valid only in this process
+        if (m->image) {
+            m->failed = obj;
+            return false;
+        }
+        // Functions are shared by all threads of the process
+        remember(m, obj);
+        put_tag(m, TAG_NATIVE);
+        put_string(m, native->cstr, strlen(native->cstr));
+        put_u64(m, native->req);
+        put_u64(m, native->rst);
+        put(m, &native->native_function, sizeof(NativeFunction));
+        return true;
+    }
+    case OBJECT_TYPE_ACTOR: {
+        Message *message = m->message;
+        struct mailbox *mailbox = ((Actor*)obj)->mailbox;
+
+        if (m->image) {
+            m->failed = obj;
+            return false;
+        }
+        // Mailboxes are shared by all threads of the process
+        message->mailboxes = allocate(message->mailboxes,
+                                      (message->mailboxes_count + 1) * sizeof(struct mailbox*));
+        message->mailboxes[message->mailboxes_count++] = mailbox;
+        actors_retain(mailbox);
+        put_tag(m, TAG_ACTOR);
+        put(m, &mailbox, sizeof(struct mailbox*));
+        return true;
+    }
+    default:
+        m->failed = obj;
+        return false;
+    }
+}
+
+static void begin_message(Marshal *m, bool image)
+{
+    memset(m, 0, sizeof(Marshal));
+    m->image = image;
+    m->message = allocate(NULL, sizeof(Message));
+    m->message->length = 0;
+    m->message->mailboxes = NULL;
+    m->message->mailboxes_count = 0;
+    m->message->next = NULL;
+    m->message->capacity = MESSAGE_MIN_CAPACITY;
+    m->message->data = allocate(NULL, MESSAGE_MIN_CAPACITY);
+}
+
+static Message *end_message(Marshal *m, bool written)
+{
+    free(m->objects);
+    free(m->keys);
+    free(m->indices);
+    if (!written && m->binding != NULL) {
+        marshal_delete(m->message);
+        throw("Can't copy %s of binding %s", object_to_string(m->failed), m->binding);
+    }
+    if (!written) {
+        marshal_delete(m->message);
+        throw("Can't copy %s", object_to_string(m->failed));
+    }
+    return m->message;
+}
+
+Message *marshal_write(Object *obj)
+{
+    Marshal m;
+
+    begin_message(&m, false);
+    return end_message(&m, write_object(&m, obj));
+}
+
+/*
+ * The environment is numbered first and written as the bindings of its own
+ * frame, procedures defined in it refer to it by the number. Bindings are
+ * written in the order of their definitions, so procedures usually refer
+ * to the ones they call instead of writing them nested.
+ */
+Message *marshal_write_environment(Env *env)
+{
+    Frame **frames = allocate(NULL, (env->count + 1) * sizeof(Frame*));
+    Frame *frame;
+    unsigned count = 0;
+    bool written = true;
+    Marshal m;
+
+    for (frame = env->frame; frame != NULL; frame = frame->next) {
+        frames[count++] = frame;
+    }
+    begin_message(&m, true);
+    remember(&m, (Object*)env);
+    while (written && count > 0) {
+        count -= 1;
+        written = write_binding(&m, frames[count]->cstr, frames[count]->object);
+    }
+    free(frames);
+    put_tag(&m, TAG_NIL);
+    return end_message(&m, written);
+}
+
+static const char *get(Unmarshal *u, size_t length)
+{
+    const char *ptr = u->data + u->position;
+
+    if (length > u->length - u->position) {
+        throw("Message is truncated");
+    }
+    u->position += length;
+    return ptr;
+}
+
+static Tag get_tag(Unmarshal *u)
+{
+    return (Tag)*get(u, 1);
+}
+
+static uint64_t get_u64(Unmarshal *u)
+{
+    uint64_t value;
+    memcpy(&value, get(u, sizeof(value)), sizeof(value));
+    return value;
+}
+
+/*
+ * Counts of items are checked against the data left before anything is
+ * allocated for them, each item takes at least the size.
+ */
+static uint64_t get_count(Unmarshal *u, size_t size)
+{
+    uint64_t count = get_u64(u);
+
+    if (count > (u->length - u->position) / size) {
+        throw("Message is truncated");
+    }
+    return count;
+}
+
+static const char *get_string(Unmarshal *u, size_t *length)
+{
+    const char *str;
+
+    *length = get_count(u, 1);
+    str = get(u, *length + 1);
+    if (str[*length] != 0) {
+        throw("Invalid string in message");
+    }
+    return str;
+}
+
+static unsigned reserve(Unmarshal *u, Object *obj)
+{
+    if (u->count == u->size) {
+        u->size = u->size ? u->size * 2 : REFERENCES_MIN_CAPACITY;
+        u->objects = allocate(u->objects, u->size * sizeof(Object*));
+    }
+    u->objects[u->count] = obj;
+    return u->count++;
+}
+
+static char *copy_string(const char *str, size_t length)
+{
+    char *res = allocate(NULL, length + 1);
+    memcpy(res, str, length + 1);
+    return res;
+}
+
+static Object *create_symbol(const char *str, size_t length)
+{
+    Unbound *symbol = (Unbound*)object_create(OBJECT_TYPE_UNBOUND);
+    symbol->cstr = copy_string(str, length);
+    return (Object*)symbol;
+}
+
+static List *create_list(Object *item, List *next)
+{
+    List *list = (List*)object_create(OBJECT_TYPE_LIST);
+    list->item = item;
+    list->next = next;
+    return list;
+}
+
+static Object *read_object(Unmarshal *u);
+
+static Object *read_list(Unmarshal *u)
+{
+    uint64_t count = get_count(u, 1);
+    List *res = NULL;
+    List *last = NULL;
+
+    for (; count > 0; count--) {
+        List *list = create_list(read_object(u), NULL);
+
+        if (last == NULL) {
+            res = list;
+        }
+        else {
+            last->next = list;
+        }
+        last = list;
+    }
+    if (last == NULL) {
+        return read_object(u);
+    }
+    last->next = (List*)read_object(u);
+    return (Object*)res;
+}
+
+static Object *read_hash_table(Unmarshal *u)
+{
+    uint64_t count = get_count(u, 2);
+    Object *table = hash_make_table((Object*)create_list(numbers_create_integer(count), NULL));
+    List *args = create_list(table, create_list(NULL, create_list(NULL, NULL)));
+
+    reserve(u, table);
+    for (; count > 0; count--) {
+        args->next->item = read_object(u);
+        args->next->next->item = read_object(u);
+        hash_set((Object*)args);
+    }
+    return table;
+}
+
+static Object *read_map(Unmarshal *u)
+{
+    uint64_t count = get_count(u, 2);
+    unsigned index = reserve(u, NULL);
+    List *args = create_list(maps_make_map(NULL), create_list(NULL, create_list(NULL, NULL)));
+
+    for (; count > 0; count--) {
+        args->next->item = read_object(u);
+        args->next->next->item = read_object(u);
+        args->item = maps_assoc((Object*)args);
+    }
+    u->objects[index] = args->item;
+    return args->item;
+}
+
+static void read_bindings(Unmarshal *u, Env *env)
+{
+    Tag tag;
+
+    while ((tag = get_tag(u)) == TAG_SYMBOL) {
+        size_t length;
+        const char *str = get_string(u, &length);
+
+        env_define_variable_str(env, str, read_object(u));
+    }
+    if (tag != TAG_NIL) {
+        throw("Invalid message tag %d", (int)tag);
+    }
+}
+
+/*
+ * The procedure is numbered before its bindings are read, so they may
+ * refer to it. The environment of the copied bindings becomes the top
+ * level environment of the procedure, its code is analyzed there on the
+ * first call. Procedures which shared an environment share the copy too,
+ * so a call the optimizer inlines from one into another finds the bindings
+ * of both.
+ */
+static Object *read_procedure(Unmarshal *u)
+{
+    Proc *proc = (Proc*)object_create(OBJECT_TYPE_PROCEDURE);
+    Code *code = (Code*)object_create(OBJECT_TYPE_CODE);
+
+    reserve(u, (Object*)proc);
+    proc->env = (Env*)read_object(u);
+    if (proc->env == NULL || proc->env->object.type != OBJECT_TYPE_ENVIRONMENT) {
+        throw("Invalid procedure in message");
+    }
+    code->args = (Pair*)read_object(u);
+    code->body = read_object(u);
+    proc->code = code;
+    read_bindings(u, proc->env);
+    return (Object*)proc;
+}
+
+/*
+ * Types read from an image are new in this process, types sent by another
+ * thread keep their identifiers.
+ */
+static Object *read_record_type(Unmarshal *u)
+{
+    RecordType *type = (RecordType*)object_create(OBJECT_TYPE_RECORD_TYPE);
+    const char *str;
+    uint64_t size;
+    size_t length;
+
+    reserve(u, (Object*)type);
+    type->id = get_u64(u);
+    if (u->prelude != NULL) {
+        type->id = records_create_id();
+    }
+    str = get_string(u, &length);
+    type->cstr = copy_string(str, length);
+    size = get_u64(u);
+    if (size > u->length - u->position) {
+        throw("Message is truncated");
+    }
+    type->fields = allocate(NULL, (size > 0 ? size : 1) * sizeof(char*));
+    for (; type->size < size; type->size++) {
+        str = get_string(u, &length);
+        type->fields[type->size] = copy_string(str, length);
+    }
+    return (Object*)type;
+}
+
+static RecordType *read_type_of_record(Unmarshal *u)
+{
+    Object *type = read_object(u);
+
+    if (type == NULL || type->type != OBJECT_TYPE_RECORD_TYPE) {
+        throw("Invalid record type in message");
+    }
+    return (RecordType*)type;
+}
+
+static Object *read_record(Unmarshal *u)
+{
+    RecordType *type = read_type_of_record(u);
+    Record *record = (Record*)object_create_record(type);
+    unsigned i;
+
+    reserve(u, (Object*)record);
+    for (i = 0; i < type->size; i++) {
+        record->slots[i] = read_object(u);
+    }
+    return (Object*)record;
+}
+
+static Object *read_record_procedure(Unmarshal *u)
+{
+    RecordProc *proc = (RecordProc*)object_create(OBJECT_TYPE_RECORD_PROCEDURE);
+    unsigned count;
+    const char *str;
+    size_t length;
+    unsigned i;
+
+    reserve(u, (Object*)proc);
+    str = get_string(u, &length);
+    proc->cstr = copy_string(str, length);
+    proc->operation = get_u64(u);
+    proc->argc = get_u64(u);
+    if (proc->operation > RECORD_MODIFIER || proc->argc > u->length - u->position) {
+        throw("Invalid record procedure in message");
+    }
+    count = get_fields_count(proc->operation, proc->argc);
+    proc->fields = allocate(NULL, (count > 0 ? count : 1) * sizeof(unsigned));
+    for (i = 0; i < count; i++) {
+        proc->fields[i] = get_u64(u);
+    }
+    proc->type = read_type_of_record(u);
+    for (i = 0; i < count; i++) {
+        if (proc->fields[i] >= proc->type->size) {
+            throw("Invalid record procedure in message");
+        }
+    }
+    return (Object*)proc;
+}
+
+static Object *read_object(Unmarshal *u)
+{
+    Tag tag = get_tag(u);
+    Object *obj;
+    uint64_t length;
+    size_t size;
+    const char *str;
+
+    if (u->file && (tag == TAG_NATIVE || tag == TAG_SHARED || tag == TAG_ACTOR)) {
+        throw("Invalid message tag %d", (int)tag);
+    }
+    switch (tag) {
+    case TAG_NIL:
+        return NULL;
+    case TAG_TRUE:
+        return object_boolean(true);
+    case TAG_FALSE:
+        return object_boolean(false);
+    case TAG_INTEGER:
+        return numbers_create_integer((int64_t)get_u64(u));
+    case TAG_BIGNUM: {
+        Big big;
+
+        big.negative = get_u64(u) != 0;
+        big.size = get_count(u, sizeof(Digit));
+        big.digits = allocate(NULL, big.size > 0 ? big.size * sizeof(Digit) : 1);
+        memcpy(big.digits, get(u, big.size * sizeof(Digit)), big.size * sizeof(Digit));
+        return numbers_create_exact(&big);
+    }
+    case TAG_FLONUM: {
+        double value;
+
+        memcpy(&value, get(u, sizeof(double)), sizeof(double));
+        return numbers_create_flonum(value);
+    }
+    case TAG_STRING:
+        str = get_string(u, &size);
+        return text_create_string(str, size);
+    case TAG_SYMBOL:
+        str = get_string(u, &size);
+        return create_symbol(str, size);
+    case TAG_LIST:
+        return read_list(u);
+    case TAG_VECTOR: {
+        size_t i;
+
+        length = get_count(u, 1);
+        obj = vectors_create(OBJECT_TYPE_VECTOR, length);
+        reserve(u, obj);
+        for (i = 0; i < length; i++) {
+            ((Vector*)obj)->items[i] = read_object(u);
+        }
+        return obj;
+    }
+    case TAG_F64VECTOR:
+        length = get_count(u, sizeof(double));
+        obj = vectors_create(OBJECT_TYPE_F64VECTOR, length);
+        reserve(u, obj);
+        memcpy(((F64Vector*)obj)->data, get(u, length * sizeof(double)), length * sizeof(double));
+        return obj;
+    case TAG_I64VECTOR:
+        length = get_count(u, sizeof(int64_t));
+        obj = vectors_create(OBJECT_TYPE_I64VECTOR, length);
+        reserve(u, obj);
+        memcpy(((I64Vector*)obj)->data, get(u, length * sizeof(int64_t)), length * sizeof(int64_t));
+        return obj;
+    case TAG_HASH_TABLE:
+        return read_hash_table(u);
+    case TAG_MAP:
+        return read_map(u);
+    case TAG_PROCEDURE:
+        return read_procedure(u);
+    case TAG_RECORD_TYPE:
+        return read_record_type(u);
+    case TAG_RECORD:
+        return read_record(u);
+    case TAG_RECORD_PROCEDURE:
+        return read_record_procedure(u);
+    case TAG_ENVIRONMENT:
+        obj = (Object*)env_extend(u->prelude);
+        reserve(u, obj);
+        return obj;
+    case TAG_NATIVE: {
+        Native *native = (Native*)object_create(OBJECT_TYPE_NATIVE);
+
+        str = get_string(u, &size);
+        native->cstr = copy_string(str, size);
+        native->req = get_u64(u);
+        native->rst = get_u64(u);
+        memcpy(&native->native_function, get(u, sizeof(NativeFunction)), sizeof(NativeFunction));
+        reserve(u, (Object*)native);
+        return (Object*)native;
+    }
+    case TAG_SHARED:
+        memcpy(&obj, get(u, sizeof(Object*)), sizeof(Object*));
+        return obj;
+    case TAG_PRELUDE:
+        str = get_string(u, &size);
+        obj = u->prelude != NULL ? env_lookup_variable_str(u->prelude, str) : NULL;
+        if (obj == NULL || obj->type != OBJECT_TYPE_NATIVE) {
+            throw("Unknown native %s", str);
+        }
+        return obj;
+    case TAG_ACTOR: {
+        struct mailbox *mailbox;
+
+        memcpy(&mailbox, get(u, sizeof(struct mailbox*)), sizeof(struct mailbox*));
+        actors_retain(mailbox);
+        return actors_create_handle(mailbox);
+    }
+    case TAG_REFERENCE:
+        length = get_u64(u);
+        if (length >= u->count) {
+            throw("Invalid message reference %u", (unsigned)length);
+        }
+        return u->objects[length];
+    default:
+        throw("Invalid message tag %d", (int)tag);
+        return NULL;
+    }
+}
+
+static Object *read_message(const Message *message, bool file)
+{
+    Unmarshal u = { message->data, 0, message->length, NULL, 0, 0, NULL, file };
+    const bool started = gc_suspend();
+    Object *res = read_object(&u);
+
+    free(u.objects);
+    gc_resume(started);
+    return res;
+}
+
+Object *marshal_read(const Message *message)
+{
+    return read_message(message, false);
+}
+
+Object *marshal_read_file(const Message *message)
+{
+    return read_message(message, true);
+}
+
+void marshal_read_environment(const Message *message, Env *env)
+{
+    Unmarshal u = { message->data, 0, message->length, NULL, 0, 0, find_prelude(env), true };
+    const bool started = gc_suspend();
+
+    reserve(&u, (Object*)env);
+    read_bindings(&u, env);
+    free(u.objects);
+    gc_resume(started);
+}
+
+void marshal_delete(Message *message)
+{
+    size_t i;
+
+    if (message != NULL) {
+        for (i = 0; i < message->mailboxes_count; i++) {
+            actors_release(message->mailboxes[i]);
+        }
+        free(message->mailboxes);
+        free(message->data);
+        free(message);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ *    marshal.h
+ */
+
+
+#ifndef MARSHAL_H
+#define MARSHAL_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+struct mailbox;
+
+/*
+ * Objects serialized into a buffer which refers to no context, so it can
+ * be passed to another thread and read into the heap of its context.
+ * Sharing and cycles of vectors, tables and procedures are preserved.
+ */
+typedef struct message
+{
+    size_t length;
+    size_t capacity;
+    char *data;
+    // Mailboxes of the actor handles in the message, retained until the
+    // message is deleted
+    struct mailbox **mailboxes;
+    size_t mailboxes_count;
+    // Link of the mailbox holding the message
+    struct message *next;
+} Message;
+
+/*
+ * Procedures are written with the source of their lambdas and the values
+ * of the variables their bodies mention. Objects which can't be copied,
+ * as promises and ports, are errors naming the binding holding them.
+ */
+Message *marshal_write(Object *obj);
+
+/*
+ * Reads a copy of the objects into the current context. The GC is
+ * suspended while reading, so the caller has to root only the result.
+ */
+Object *marshal_read(const Message *message);
+
+/*
+ * Reads a message loaded from a file, which may be damaged or crafted.
+ * Natives, shared objects and actors are rejected, their tags hold
+ * addresses.
+ */
+Object *marshal_read_file(const Message *message);
+
+/*
+ * Bindings of the environment for another process of the program: natives
+ * of the prelude are written by name, other natives and actors can't be
+ * copied, record types are new types in the reading process. Reading
+ * defines the bindings in the given environment, which must extend the
+ * prelude. The message is read as loaded from a file.
+ */
+Message *marshal_write_environment(Env *env);
+
+void marshal_read_environment(const Message *message, Env *env);
+
+void marshal_delete(Message *message);
+
+#endif // MARSHAL_H
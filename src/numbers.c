@@ -0,0 +1,481 @@
+/*
+ *    numbers.c
+ */
+
+
+#include "numbers.h"
+#include "error.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+/*
+ * Unboxed number. Intermediate results of an operation stay unboxed and
+ * only the final one is allocated, so the GC can't run in between.
+ */
+typedef struct number
+{
+    Type type;
+    int64_t fixnum;
+    double flonum;
+    Big bignum;
+    bool owned;
+} Number;
+
+
+static void load(Number *num, Object *obj)
+{
+    if (obj == NULL) {
+        throw("Wrong type of argument #nil: expected numeric");
+    }
+    num->type = object_get_type(obj);
+    num->owned = false;
+
+    switch (num->type) {
+    case OBJECT_TYPE_INTEGER:
+        num->fixnum = ((Integer*)obj)->value;
+        break;
+    case OBJECT_TYPE_BIGNUM:
+        num->bignum = ((Bignum*)obj)->value;
+        break;
+    case OBJECT_TYPE_FLONUM:
+        num->flonum = ((Flonum*)obj)->value;
+        break;
+    default:
+        throw("Wrong type of argument %s: expected numeric", object_to_string(obj));
+    }
+}
+
+static void load_exact(Number *num, Object *obj)
+{
+    load(num, obj);
+    if (num->type == OBJECT_TYPE_FLONUM) {
+        throw("Wrong type of argument %s: expected integer", object_to_string(obj));
+    }
+}
+
+static void release(Number *num)
+{
+    if (num->type == OBJECT_TYPE_BIGNUM && num->owned) {
+        bignum_free(&num->bignum);
+    }
+}
+
+static double to_double(const Number *num)
+{
+    switch (num->type) {
+    case OBJECT_TYPE_INTEGER:
+        return (double)num->fixnum;
+    case OBJECT_TYPE_BIGNUM:
+        return bignum_to_double(&num->bignum);
+    default:
+        return num->flonum;
+    }
+}
+
+static void promote(Number *num)
+{
+    if (num->type == OBJECT_TYPE_INTEGER) {
+        bignum_from_integer(&num->bignum, num->fixnum);
+        num->type = OBJECT_TYPE_BIGNUM;
+        num->owned = true;
+    }
+}
+
+/*
+ * Bignum results which fit into 64 bits become fixnums again.
+ */
+static void demote(Number *num)
+{
+    int64_t value;
+
+    if (num->type == OBJECT_TYPE_BIGNUM && bignum_to_integer(&num->bignum, &value)) {
+        release(num);
+        num->type = OBJECT_TYPE_INTEGER;
+        num->fixnum = value;
+    }
+}
+
+static void set_flonum(Number *num, double value)
+{
+    num->type = OBJECT_TYPE_FLONUM;
+    num->flonum = value;
+    num->owned = false;
+}
+
+static void set_bignum(Number *num)
+{
+    num->type = OBJECT_TYPE_BIGNUM;
+    num->owned = true;
+}
+
+static void apply(Number *res, Number *a, Number *b, char operation)
+{
+    if (a->type == OBJECT_TYPE_FLONUM || b->type == OBJECT_TYPE_FLONUM) {
+        double x = to_double(a);
+        double y = to_double(b);
+        set_flonum(res, operation == '+' ? x + y : operation == '-' ? x - y : x * y);
+        return;
+    }
+    if (a->type == OBJECT_TYPE_INTEGER && b->type == OBJECT_TYPE_INTEGER) {
+        bool overflow;
+
+        switch (operation) {
+        case '+':
+            overflow = __builtin_add_overflow(a->fixnum, b->fixnum, &res->fixnum);
+            break;
+        case '-':
+            overflow = __builtin_sub_overflow(a->fixnum, b->fixnum, &res->fixnum);
+            break;
+        default:
+            overflow = __builtin_mul_overflow(a->fixnum, b->fixnum, &res->fixnum);
+            break;
+        }
+        if (!overflow) {
+            res->type = OBJECT_TYPE_INTEGER;
+            res->owned = false;
+            return;
+        }
+    }
+
+    promote(a);
+    promote(b);
+    set_bignum(res);
+    switch (operation) {
+    case '+':
+        bignum_add(&res->bignum, &a->bignum, &b->bignum);
+        break;
+    case '-':
+        bignum_subtract(&res->bignum, &a->bignum, &b->bignum);
+        break;
+    default:
+        bignum_multiply(&res->bignum, &a->bignum, &b->bignum);
+        break;
+    }
+    demote(res);
+}
+
+/*
+ * Truncating division of exact numbers, either of results may be NULL.
+ */
+static void divide(Number *quotient, Number *remainder, Number *a, Number *b)
+{
+    if ((b->type == OBJECT_TYPE_INTEGER && b->fixnum == 0)) {
+        throw("Division by zero");
+    }
+    if (a->type == OBJECT_TYPE_INTEGER && b->type == OBJECT_TYPE_INTEGER
+        && !(a->fixnum == INT64_MIN && b->fixnum == -1)) {
+        if (quotient != NULL) {
+            quotient->type = OBJECT_TYPE_INTEGER;
+            quotient->owned = false;
+            quotient->fixnum = a->fixnum / b->fixnum;
+        }
+        if (remainder != NULL) {
+            remainder->type = OBJECT_TYPE_INTEGER;
+            remainder->owned = false;
+            remainder->fixnum = a->fixnum % b->fixnum;
+        }
+        return;
+    }
+
+    promote(a);
+    promote(b);
+    if (quotient != NULL) {
+        set_bignum(quotient);
+    }
+    if (remainder != NULL) {
+        set_bignum(remainder);
+    }
+    bignum_divide(quotient != NULL ? &quotient->bignum : NULL,
+                  remainder != NULL ? &remainder->bignum : NULL, &a->bignum, &b->bignum);
+    if (quotient != NULL) {
+        demote(quotient);
+    }
+    if (remainder != NULL) {
+        demote(remainder);
+    }
+}
+
+static bool is_zero(const Number *num)
+{
+    return (num->type == OBJECT_TYPE_INTEGER && num->fixnum == 0)
+        || (num->type == OBJECT_TYPE_BIGNUM && num->bignum.size == 0);
+}
+
+static bool compare(Number *a, Number *b, char relation)
+{
+    int res;
+
+    if (a->type == OBJECT_TYPE_FLONUM || b->type == OBJECT_TYPE_FLONUM) {
+        double x = to_double(a);
+        double y = to_double(b);
+        return relation == '=' ? x == y : relation == '<' ? x < y : x > y;
+    }
+    if (a->type == OBJECT_TYPE_INTEGER && b->type == OBJECT_TYPE_INTEGER) {
+        res = a->fixnum < b->fixnum ? -1 : a->fixnum > b->fixnum;
+    }
+    else {
+        promote(a);
+        promote(b);
+        res = bignum_compare(&a->bignum, &b->bignum);
+    }
+    return relation == '=' ? res == 0 : relation == '<' ? res < 0 : res > 0;
+}
+
+static Object *box(Number *num)
+{
+    Object *obj;
+
+    switch (num->type) {
+    case OBJECT_TYPE_INTEGER:
+        return numbers_create_integer(num->fixnum);
+    case OBJECT_TYPE_FLONUM:
+        return numbers_create_flonum(num->flonum);
+    default:
+        if (!num->owned) {
+            bignum_copy(&num->bignum, &num->bignum);
+        }
+        obj = object_create(OBJECT_TYPE_BIGNUM);
+        ((Bignum*)obj)->value = num->bignum;
+        return obj;
+    }
+}
+
+/*
+ * Folds the list of arguments with the arithmetic operation.
+ */
+static Object *accumulate(List *list, char operation)
+{
+    Number acc;
+    Number arg;
+    Number res;
+
+    load(&acc, list->item);
+    for (list = list->next; list != NULL; list = list->next) {
+        load(&arg, list->item);
+        apply(&res, &acc, &arg, operation);
+        release(&acc);
+        release(&arg);
+        acc = res;
+    }
+    return box(&acc);
+}
+
+Object *numbers_create_integer(int64_t value)
+{
+    Integer *obj = (Integer*)object_create(OBJECT_TYPE_INTEGER);
+    obj->value = value;
+    return (Object*)obj;
+}
+
+Object *numbers_create_flonum(double value)
+{
+    Flonum *obj = (Flonum*)object_create(OBJECT_TYPE_FLONUM);
+    obj->value = value;
+    return (Object*)obj;
+}
+
+Object *numbers_create_exact(Big *value)
+{
+    Number num = { .type = OBJECT_TYPE_BIGNUM, .bignum = *value, .owned = true };
+
+    demote(&num);
+    return box(&num);
+}
+
+double numbers_to_double(Object *obj)
+{
+    Number num;
+
+    load(&num, obj);
+    return to_double(&num);
+}
+
+int64_t numbers_to_fixnum(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_INTEGER) {
+        throw("Wrong type of argument %s: expected fixnum",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return ((Integer*)obj)->value;
+}
+
+Object *numbers_parse(const char *str)
+{
+    Object *obj;
+    char *end;
+
+    if (strpbrk(str, ".eE") != NULL) {
+        double value = strtod(str, &end);
+
+        if (*end != 0) {
+            return NULL;
+        }
+        return numbers_create_flonum(value);
+    }
+    else {
+        int64_t value;
+        Big big;
+
+        errno = 0;
+        value = strtoll(str, &end, 10);
+        if (*end != 0) {
+            return NULL;
+        }
+        if (errno != ERANGE) {
+            return numbers_create_integer(value);
+        }
+        if (!bignum_from_cstr(&big, str)) {
+            return NULL;
+        }
+        obj = object_create(OBJECT_TYPE_BIGNUM);
+        ((Bignum*)obj)->value = big;
+        return obj;
+    }
+}
+
+Object *numbers_plus(Object *obj)
+{
+    return accumulate((List*)obj, '+');
+}
+
+Object *numbers_minus(Object *obj)
+{
+    List *list = (List*)obj;
+
+    if (list->next == NULL) {
+        Number zero = { .type = OBJECT_TYPE_INTEGER, .fixnum = 0 };
+        Number arg;
+        Number res;
+
+        load(&arg, list->item);
+        apply(&res, &zero, &arg, '-');
+        release(&arg);
+        return box(&res);
+    }
+    return accumulate(list, '-');
+}
+
+Object *numbers_multiply(Object *obj)
+{
+    return accumulate((List*)obj, '*');
+}
+
+/*
+ * Exact division stays exact when the dividend is a multiple of the
+ * divisor, otherwise the result is a flonum.
+ */
+Object *numbers_divide(Object *obj)
+{
+    List *list = (List*)obj;
+    Number acc = { .type = OBJECT_TYPE_INTEGER, .fixnum = 1 };
+    Number arg;
+    Number quotient;
+    Number remainder;
+
+    if (list->next != NULL) {
+        load(&acc, list->item);
+        list = list->next;
+    }
+    for (; list != NULL; list = list->next) {
+        load(&arg, list->item);
+        if (acc.type == OBJECT_TYPE_FLONUM || arg.type == OBJECT_TYPE_FLONUM) {
+            set_flonum(&quotient, to_double(&acc) / to_double(&arg));
+        }
+        else {
+            if (is_zero(&arg)) {
+                throw("Division by zero");
+            }
+            divide(&quotient, &remainder, &acc, &arg);
+            if (!is_zero(&remainder)) {
+                release(&quotient);
+                set_flonum(&quotient, to_double(&acc) / to_double(&arg));
+            }
+            release(&remainder);
+        }
+        release(&acc);
+        release(&arg);
+        acc = quotient;
+    }
+    return box(&acc);
+}
+
+static Object *divide_exact(Object *obj, bool quotient)
+{
+    List *list = (List*)obj;
+    Number a;
+    Number b;
+    Number res;
+
+    load_exact(&a, list->item);
+    load_exact(&b, list->next->item);
+    if (is_zero(&b)) {
+        throw("Division by zero");
+    }
+    divide(quotient ? &res : NULL, quotient ? NULL : &res, &a, &b);
+    release(&a);
+    release(&b);
+    return box(&res);
+}
+
+Object *numbers_quotient(Object *obj)
+{
+    return divide_exact(obj, true);
+}
+
+Object *numbers_remainder(Object *obj)
+{
+    return divide_exact(obj, false);
+}
+
+static Object *compare_arguments(List *list, char relation)
+{
+    Number prev;
+    Number next;
+    bool res = true;
+
+    load(&prev, list->item);
+    for (list = list->next; list != NULL && res; list = list->next) {
+        load(&next, list->item);
+        res = compare(&prev, &next, relation);
+        release(&prev);
+        prev = next;
+    }
+    release(&prev);
+    return object_boolean(res);
+}
+
+bool numbers_is_less(Object *a, Object *b)
+{
+    Number x;
+    Number y;
+    bool res;
+
+    load(&x, a);
+    load(&y, b);
+    res = compare(&x, &y, '<');
+    release(&x);
+    release(&y);
+    return res;
+}
+
+Object *numbers_equal(Object *obj)
+{
+    return compare_arguments((List*)obj, '=');
+}
+
+Object *numbers_greater(Object *obj)
+{
+    return compare_arguments((List*)obj, '>');
+}
+
+Object *numbers_less(Object *obj)
+{
+    return compare_arguments((List*)obj, '<');
+}
@@ -0,0 +1,60 @@
+/*
+ *    numbers.h
+ */
+
+
+#ifndef NUMBERS_H
+#define NUMBERS_H
+
+#include "types.h"
+
+/*
+ * Numbers are exact integers, which are fixnums or bignums depending on
+ * magnitude, and double precision flonums. Exact results which don't fit
+ * into 64 bits are promoted to bignums automatically.
+ */
+Object *numbers_create_integer(int64_t value);
+
+Object *numbers_create_flonum(double value);
+
+/*
+ * Takes ownership of the digits, the result is a fixnum if it fits.
+ */
+Object *numbers_create_exact(Big *value);
+
+/*
+ * Converts any number to double, throws on other objects.
+ */
+double numbers_to_double(Object *obj);
+
+/*
+ * Throws unless the object is a fixnum.
+ */
+int64_t numbers_to_fixnum(Object *obj);
+
+/*
+ * Parses decimal integer or flonum, returns NULL on invalid input.
+ */
+Object *numbers_parse(const char *str);
+
+Object *numbers_plus(Object *obj);
+
+Object *numbers_minus(Object *obj);
+
+Object *numbers_multiply(Object *obj);
+
+Object *numbers_divide(Object *obj);
+
+Object *numbers_quotient(Object *obj);
+
+Object *numbers_remainder(Object *obj);
+
+bool numbers_is_less(Object *a, Object *b);
+
+Object *numbers_equal(Object *obj);
+
+Object *numbers_greater(Object *obj);
+
+Object *numbers_less(Object *obj);
+
+#endif // NUMBERS_H
@@ -0,0 +1,577 @@
+/*
+ *    optimize.c
+ */
+
+
+#include "optimize.h"
+#include "context.h"
+#include "analyze.h"
+#include "numbers.h"
+#include "core.h"
+#include "env.h"
+#include "debug.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+static Object *optimize_expression(Object *exp, Scope *scope, Env *env, unsigned depth);
+
+static char _guard_name[] = "guard";
+
+/*
+ * Builtins without side effects which may be applied during optimization.
+ */
+static const NativeFunction _foldable[] = {
+    &numbers_plus,
+    &numbers_minus,
+    &numbers_multiply,
+    &numbers_equal,
+    &numbers_less,
+    &numbers_greater
+};
+
+
+static List *cons(Object *item, List *next)
+{
+    List *list = (List*)object_create(OBJECT_TYPE_LIST);
+    list->item = item;
+    list->next = next;
+    return list;
+}
+
+static Object *create_guard(Object *optimized, Object *original)
+{
+    Integer *version = (Integer*)object_create(OBJECT_TYPE_INTEGER);
+
+    if (_context->guard == NULL) {
+        _context->guard = (Unbound*)object_create_unmanaged(OBJECT_TYPE_VARIABLE);
+        _context->guard->cstr = _guard_name;
+    }
+    version->value = (int)_context->env_version;
+    return (Object*)cons((Object*)_context->guard, cons((Object*)version,
+                         cons(optimized, cons(original, NULL))));
+}
+
+static bool is_constant(Object *exp)
+{
+    return exp == NULL || (exp->type != OBJECT_TYPE_LIST && exp->type != OBJECT_TYPE_VARIABLE);
+}
+
+/*
+ * Looks through guards, remembering that the result relies on bindings.
+ */
+static Object *strip(Object *exp, bool *guarded)
+{
+    while (optimize_is_guard(exp)) {
+        *guarded = true;
+        exp = optimize_get_optimized(exp);
+    }
+    return exp;
+}
+
+static Object *resolve(Object *var, Scope *scope, Env *env)
+{
+    if (!analyze_is_variable(var) || analyze_is_bound(scope, ((Unbound*)var)->cstr)) {
+        return NULL;
+    }
+    return env_lookup_variable(env, (Unbound*)var);
+}
+
+static bool is_valid_arity(Native *native, unsigned argc)
+{
+    return !((native->rst == 0 && argc > native->req) || argc < native->req);
+}
+
+static bool is_referenced(Object *exp, const char *str)
+{
+    List *list = (List*)exp;
+
+    if (analyze_is_variable(exp)) {
+        return strcmp(((Unbound*)exp)->cstr, str) == 0;
+    }
+    while (list != NULL && object_get_type((Object*)list) == OBJECT_TYPE_LIST) {
+        if (is_referenced(list->item, str)) {
+            return true;
+        }
+        list = list->next;
+    }
+    return false;
+}
+
+static unsigned get_size(Object *exp)
+{
+    List *list = (List*)exp;
+    unsigned size = 1;
+
+    while (list != NULL && object_get_type((Object*)list) == OBJECT_TYPE_LIST) {
+        size += get_size(list->item);
+        list = list->next;
+    }
+    return size;
+}
+
+/*
+ * Optimizes items of the list, it is copied only if some of them change.
+ */
+static List *optimize_list(List *list, Scope *scope, Env *env, unsigned depth)
+{
+    Object *item;
+    List *next;
+
+    if (list == NULL) {
+        return NULL;
+    }
+    item = optimize_expression(list->item, scope, env, depth);
+    next = optimize_list(list->next, scope, env, depth);
+    if (item == list->item && next == list->next) {
+        return list;
+    }
+    return cons(item, next);
+}
+
+static const char *get_definition_name(Object *exp)
+{
+    List *list = (List*)exp;
+    Object *var;
+
+    if (!analyze_is_tagged_list(exp, "define") || analyze_get_list_size(exp) < 3) {
+        return NULL;
+    }
+    var = list->next->item;
+    if (analyze_is_variable(var)) {
+        return ((Unbound*)var)->cstr;
+    }
+    if (var != NULL && object_get_type(var) == OBJECT_TYPE_LIST
+        && analyze_is_variable(((List*)var)->item)) {
+        return ((Unbound*)((List*)var)->item)->cstr;
+    }
+    return NULL;
+}
+
+/*
+ * Internal definition of a procedure or a constant nobody refers to can be
+ * dropped. The last expression gives value of the body and stays.
+ */
+static bool is_unused_definition(List *body, List *item)
+{
+    const char *str = get_definition_name(item->item);
+    Object *value;
+    List *list;
+
+    if (str == NULL || item->next == NULL) {
+        return false;
+    }
+    value = ((List*)item->item)->next->next->item;
+    if (analyze_is_variable(((List*)item->item)->next->item)
+        && !is_constant(value) && !analyze_is_tagged_list(value, "lambda")) {
+        return false;
+    }
+    for (list = body; list != NULL; list = list->next) {
+        if (list != item && is_referenced(list->item, str)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static List *remove_unused_definitions(List *body)
+{
+    List *res = NULL;
+    List **ptr = &res;
+    List *list;
+    bool changed = false;
+
+    for (list = body; list != NULL; list = list->next) {
+        if (is_unused_definition(body, list)) {
+            changed = true;
+            continue;
+        }
+        *ptr = cons(list->item, NULL);
+        ptr = &(*ptr)->next;
+    }
+    return changed ? res : body;
+}
+
+static List *optimize_body(List *args, List *body, Scope *scope, Env *env, unsigned depth)
+{
+    Scope inner;
+    List *list;
+
+    if (analyze_get_list_size((Object*)args) < 0 || analyze_get_list_size((Object*)body) < 1) {
+        return body;
+    }
+    for (list = args; list != NULL; list = list->next) {
+        if (!analyze_is_variable(list->item)) {
+            return body;
+        }
+    }
+    analyze_enter_scope(&inner, scope, args, (Object*)body);
+    list = remove_unused_definitions(optimize_list(body, &inner, env, depth));
+    analyze_leave_scope(&inner);
+    return list;
+}
+
+static Object *optimize_lambda(Object *exp, Scope *scope, Env *env, unsigned depth)
+{
+    List *list = (List*)exp;
+    List *body;
+
+    if (analyze_get_list_size(exp) < 3) {
+        return exp;
+    }
+    body = optimize_body((List*)list->next->item, list->next->next, scope, env, depth);
+    return body == list->next->next ? exp
+        : (Object*)cons(list->item, cons(list->next->item, body));
+}
+
+static Object *optimize_definition(Object *exp, Scope *scope, Env *env, unsigned depth)
+{
+    List *list = (List*)exp;
+    Object *var;
+    List *rest;
+
+    if (analyze_get_list_size(exp) < 3) {
+        return exp;
+    }
+    var = list->next->item;
+    if (var != NULL && object_get_type(var) == OBJECT_TYPE_LIST) {
+        rest = optimize_body(((List*)var)->next, list->next->next, scope, env, depth);
+    }
+    else {
+        rest = optimize_list(list->next->next, scope, env, depth);
+    }
+    return rest == list->next->next ? exp
+        : (Object*)cons(list->item, cons(var, rest));
+}
+
+static Object *optimize_if(Object *exp, Scope *scope, Env *env, unsigned depth)
+{
+    List *list = (List*)exp;
+    List *branches;
+    Object *test;
+    Object *value;
+    Object *res;
+    bool guarded = false;
+
+    if (analyze_get_list_size(exp) != 4) {
+        return exp;
+    }
+    test = optimize_expression(list->next->item, scope, env, depth);
+    value = strip(test, &guarded);
+    if (is_constant(value)) {
+        res = optimize_expression(core_object_to_bool(value)
+                                  ? list->next->next->item : list->next->next->next->item,
+                                  scope, env, depth);
+        return guarded ? create_guard(res, exp) : res;
+    }
+    branches = optimize_list(list->next->next, scope, env, depth);
+    return test == list->next->item && branches == list->next->next ? exp
+        : (Object*)cons(list->item, cons(test, branches));
+}
+
+static bool is_else_clause(List *clause)
+{
+    return analyze_is_variable(clause->item) && strcmp(((Unbound*)clause->item)->cstr, "else") == 0;
+}
+
+static Object *optimize_cond(Object *exp, Scope *scope, Env *env, unsigned depth)
+{
+    List *list = (List*)exp;
+    List *clauses = NULL;
+    List **ptr = &clauses;
+    List *first;
+    Object *res;
+    bool changed = false;
+    bool guarded = false;
+
+    for (list = list->next; list != NULL; list = list->next) {
+        List *clause = (List*)list->item;
+        List *actions;
+        Object *test;
+        bool constant = false;
+
+        if (analyze_get_list_size((Object*)clause) < 2) {
+            return exp;
+        }
+        actions = optimize_list(clause->next, scope, env, depth);
+        test = clause->item;
+        if (!is_else_clause(clause)) {
+            bool dependent = false;
+            Object *value;
+
+            test = optimize_expression(test, scope, env, depth);
+            value = strip(test, &dependent);
+            if (is_constant(value)) {
+                guarded = guarded || dependent;
+                changed = true;
+                constant = true;
+                if (!core_object_to_bool(value)) {
+                    continue;
+                }
+                test = value;
+            }
+        }
+        if (test != clause->item || actions != clause->next) {
+            changed = true;
+            clause = cons(test, actions);
+        }
+        *ptr = cons((Object*)clause, NULL);
+        ptr = &(*ptr)->next;
+        if (constant) {
+            // The rest of clauses is unreachable
+            break;
+        }
+    }
+    if (!changed) {
+        return exp;
+    }
+    first = clauses != NULL ? (List*)clauses->item : NULL;
+    if (first == NULL) {
+        res = NULL;
+    }
+    else if ((is_else_clause(first) || is_constant(first->item)) && first->next->next == NULL) {
+        res = first->next->item;
+    }
+    else {
+        res = (Object*)cons(((List*)exp)->item, clauses);
+    }
+    return guarded ? create_guard(res, exp) : res;
+}
+
+/*
+ * Copies the expression replacing arguments of a procedure by values.
+ */
+static Object *substitute(Object *exp, List *args, List *values)
+{
+    List *list;
+    List *res = NULL;
+    List **ptr = &res;
+
+    if (exp == (Object*)_context->guard) {
+        return exp;
+    }
+    if (analyze_is_variable(exp)) {
+        for (; args != NULL; args = args->next, values = values->next) {
+            if (strcmp(((Unbound*)args->item)->cstr, ((Unbound*)exp)->cstr) == 0) {
+                return values->item;
+            }
+        }
+        return exp;
+    }
+    if (exp == NULL || object_get_type(exp) != OBJECT_TYPE_LIST) {
+        return exp;
+    }
+    for (list = (List*)exp; list != NULL; list = list->next) {
+        *ptr = cons(substitute(list->item, args, values), NULL);
+        ptr = &(*ptr)->next;
+    }
+    return (Object*)res;
+}
+
+/*
+ * Body of an inlined procedure can't bind variables and its free variables
+ * must refer to the top level environment at the call site as well.
+ */
+static bool is_inlinable(Object *exp, List *args, Scope *scope, const char *name)
+{
+    List *list = (List*)exp;
+
+    if (analyze_is_variable(exp)) {
+        for (; args != NULL; args = args->next) {
+            if (strcmp(((Unbound*)args->item)->cstr, ((Unbound*)exp)->cstr) == 0) {
+                return true;
+            }
+        }
+        return strcmp(((Unbound*)exp)->cstr, name) != 0
+            && !analyze_is_bound(scope, ((Unbound*)exp)->cstr);
+    }
+    if (exp == NULL || object_get_type(exp) != OBJECT_TYPE_LIST) {
+        return true;
+    }
+    if (optimize_is_guard(exp)) {
+        return is_inlinable(optimize_get_optimized(exp), args, scope, name)
+            && is_inlinable(optimize_get_original(exp), args, scope, name);
+    }
+    if (analyze_is_tagged_list(exp, "define") || analyze_is_tagged_list(exp, "set!")
+        || analyze_is_tagged_list(exp, "lambda") || analyze_is_tagged_list(exp, "delay")
+        || analyze_is_tagged_list(exp, "cons-stream")
+        || analyze_is_tagged_list(exp, "define-record-type")) {
+        return false;
+    }
+    for (; list != NULL; list = list->next) {
+        if (object_get_type((Object*)list) != OBJECT_TYPE_LIST
+            || !is_inlinable(list->item, args, scope, name)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Arguments are substituted into the body, so they have to be trivial:
+ * constants and variables which are surely bound.
+ */
+static bool is_trivial(Object *exp, Scope *scope, Env *env)
+{
+    bool guarded = false;
+
+    if (is_constant(strip(exp, &guarded))) {
+        return true;
+    }
+    return analyze_is_variable(exp)
+        && (analyze_is_bound(scope, ((Unbound*)exp)->cstr)
+            || env_lookup_variable(env, (Unbound*)exp) != NULL);
+}
+
+static Object *inline_call(Object *exp, Proc *proc, List *values, Scope *scope, Env *env,
+                           unsigned depth)
+{
+    Code *code = proc->code;
+    List *body = (List*)code->body;
+    List *list;
+
+    if (depth >= OPTIMIZE_INLINE_DEPTH || !env_is_top_level(proc->env)
+        || analyze_get_list_size((Object*)body) != 1
+        || analyze_get_list_size((Object*)code->args) != analyze_get_list_size((Object*)values)
+        || get_size(body->item) > OPTIMIZE_INLINE_SIZE
+        || !is_inlinable(body->item, (List*)code->args, scope,
+                         ((Unbound*)((List*)exp)->item)->cstr)) {
+        return NULL;
+    }
+    for (list = values; list != NULL; list = list->next) {
+        if (!is_trivial(list->item, scope, env)) {
+            return NULL;
+        }
+    }
+    _context->inlined += 1;
+    return optimize_expression(substitute(body->item, (List*)code->args, values),
+                               scope, env, depth + 1);
+}
+
+static Object *fold_call(Native *native, List *values)
+{
+    List *args = NULL;
+    List **ptr = &args;
+    bool guarded = false;
+    unsigned i;
+
+    for (i = 0; i < sizeof(_foldable) / sizeof(*_foldable); i++) {
+        if (_foldable[i] == native->native_function) {
+            break;
+        }
+    }
+    if (i == sizeof(_foldable) / sizeof(*_foldable)
+        || !is_valid_arity(native, analyze_get_list_size((Object*)values))) {
+        return NULL;
+    }
+    for (; values != NULL; values = values->next) {
+        Object *value = strip(values->item, &guarded);
+
+        if (value == NULL || object_get_type(value) != OBJECT_TYPE_INTEGER) {
+            return NULL;
+        }
+        *ptr = cons(value, NULL);
+        ptr = &(*ptr)->next;
+    }
+    _context->folded += 1;
+    return native->native_function((Object*)args);
+}
+
+static Object *optimize_application(Object *exp, Scope *scope, Env *env, unsigned depth)
+{
+    List *list;
+    Object *operator;
+    Object *res = NULL;
+
+    if (analyze_get_list_size(exp) < 1) {
+        return exp;
+    }
+    list = optimize_list((List*)exp, scope, env, depth);
+    operator = resolve(list->item, scope, env);
+
+    if (operator != NULL && object_get_type(operator) == OBJECT_TYPE_NATIVE) {
+        res = fold_call((Native*)operator, list->next);
+    }
+    else if (operator != NULL && object_get_type(operator) == OBJECT_TYPE_PROCEDURE) {
+        res = inline_call(exp, (Proc*)operator, list->next, scope, env, depth);
+    }
+    if (res != NULL) {
+        return create_guard(res, exp);
+    }
+    return (Object*)list;
+}
+
+static Object *optimize_expression(Object *exp, Scope *scope, Env *env, unsigned depth)
+{
+    if (exp == NULL || exp->type != OBJECT_TYPE_LIST || optimize_is_guard(exp)
+        || analyze_is_tagged_list(exp, "define-record-type")) {
+        return exp;
+    }
+    if (analyze_is_tagged_list(exp, "define")) {
+        return optimize_definition(exp, scope, env, depth);
+    }
+    else if (analyze_is_tagged_list(exp, "set!")) {
+        return optimize_definition(exp, scope, env, depth);
+    }
+    else if (analyze_is_tagged_list(exp, "if")) {
+        return optimize_if(exp, scope, env, depth);
+    }
+    else if (analyze_is_tagged_list(exp, "cond")) {
+        return optimize_cond(exp, scope, env, depth);
+    }
+    else if (analyze_is_tagged_list(exp, "begin")) {
+        List *list = optimize_list(((List*)exp)->next, scope, env, depth);
+        return list == ((List*)exp)->next ? exp : (Object*)cons(((List*)exp)->item, list);
+    }
+    else if (analyze_is_tagged_list(exp, "lambda")) {
+        return optimize_lambda(exp, scope, env, depth);
+    }
+    return optimize_application(exp, scope, env, depth);
+}
+
+Object *optimize(Object *exp, Env *env)
+{
+    return optimize_expression(exp, NULL, env, 0);
+}
+
+bool optimize_is_guard(Object *exp)
+{
+    return _context->guard != NULL && exp != NULL && object_get_type(exp) == OBJECT_TYPE_LIST
+        && ((List*)exp)->item == (Object*)_context->guard;
+}
+
+unsigned optimize_get_version(Object *guard)
+{
+    return (unsigned)((Integer*)((List*)guard)->next->item)->value;
+}
+
+Object *optimize_get_optimized(Object *guard)
+{
+    return ((List*)guard)->next->next->item;
+}
+
+Object *optimize_get_original(Object *guard)
+{
+    return ((List*)guard)->next->next->next->item;
+}
+
+Object *optimize_select(Object *exp)
+{
+    while (optimize_is_guard(exp)) {
+        exp = optimize_get_version(exp) == _context->env_version
+            ? optimize_get_optimized(exp) : optimize_get_original(exp);
+    }
+    return exp;
+}
+
+unsigned optimize_get_folded(void)
+{
+    return _context->folded;
+}
+
+unsigned optimize_get_inlined(void)
+{
+    return _context->inlined;
+}
@@ -0,0 +1,48 @@
+/*
+ *    optimize.h
+ */
+
+
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "types.h"
+
+#include <stdbool.h>
+
+#define OPTIMIZE_INLINE_SIZE 16
+#define OPTIMIZE_INLINE_DEPTH 4
+
+/*
+ * Rewrites the expression before the analysis. Small procedures of the top
+ * level environment are inlined, applications of builtin arithmetic to
+ * constants are folded, branches with constant tests and unused internal
+ * definitions are removed. Rewrites relying on the current bindings are
+ * wrapped into guards, see below. Must run while the GC is stopped.
+ */
+Object *optimize(Object *exp, Env *env);
+
+/*
+ * Guard is a list of the internal tag, version of bindings, optimized and
+ * original expressions. The optimized expression is valid only while no
+ * procedure binding is reassigned.
+ */
+bool optimize_is_guard(Object *exp);
+
+unsigned optimize_get_version(Object *guard);
+
+Object *optimize_get_optimized(Object *guard);
+
+Object *optimize_get_original(Object *guard);
+
+/*
+ * Returns expression of the guard valid for the current bindings or the
+ * expression itself if it is not a guard.
+ */
+Object *optimize_select(Object *exp);
+
+unsigned optimize_get_folded(void);
+
+unsigned optimize_get_inlined(void);
+
+#endif // OPTIMIZE_H
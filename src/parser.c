@@ -1,6 +1,8 @@
 
 
 #include "parser.h"
+#include "numbers.h"
+#include "text.h"
 #include "error.h"
 #include "debug.h"
 
@@ -45,7 +47,7 @@ static char *find_element(
 static Object *create_object_from_element(Element el, const char *str, unsigned len);
 static Object *create_object_pair_from_string(const char *str, unsigned len);
 static Object *create_object_string_from_string(const char *str, unsigned len);
-static Object *create_object_integer_from_string(const char *str, unsigned len);
+static Object *create_object_number_from_string(const char *str, unsigned len);
 static Object *create_object_unbound_from_string(const char *str, unsigned len);
 
 
@@ -99,7 +101,7 @@ static unsigned get_number_element_size(const char *begin, const char *end)
     char *it = (char*)begin;
 
     do {
-        if (!isdigit(*it)) {
+        if (!isdigit(*it) && (*it == 0 || strchr("+-.eE", *it) == NULL)) {
             throw_buf(begin, end, "invalid number representation");
         }
         size++;                
@@ -154,7 +156,8 @@ static char *find_element(const char *begin, const char *end, Element *el, unsig
             *size = 1;
             break;
         }
-        else if (isdigit(*it)) {
+        else if (isdigit(*it)
+                 || ((*it == '-' || *it == '+') && it + 1 != end && isdigit(it[1]))) {
             *el = ELEMENT_NUMBER;
             *size = get_number_element_size(it, end);
             break;
@@ -175,34 +178,25 @@ static char *find_element(const char *begin, const char *end, Element *el, unsig
 
 static Object *create_object_string_from_string(const char *str, unsigned size)
 {
-    Object *obj;
-    char **text;
-
     if (size < 2
-        || size > STRING_MAX_LENGTH
         || (str[0] != '\'' && str[0] != '"' && str[size - 2] != '"'))
         throw_str(str, size, "unexpected quote position");
 
-    obj = object_create(OBJECT_TYPE_STRING);
-    text = &((String*)obj)->cstr;
-
     size = (str[0] != '\'') ? size - 2 : size - 1;
-
-    *text = (char*)malloc(size + 1);
-    memcpy(*text, str + 1, size);
-    (*text)[size] = 0;
-    return obj;
+    return text_create_string(str + 1, size);
 }
 
-static Object *create_object_integer_from_string(const char *str, unsigned size)
+static Object *create_object_number_from_string(const char *str, unsigned size)
 {
     Object *obj;
     char buf[size + 1];
     memcpy(buf, str, size);
     buf[size] = 0;
 
-    obj = object_create(OBJECT_TYPE_INTEGER);
-    ((Integer*)obj)->value = atoi(buf);
+    obj = numbers_parse(buf);
+    if (obj == NULL) {
+        throw_str(str, size, "invalid number representation");
+    }
     return obj;
 }
 
@@ -232,7 +226,7 @@ static Object *create_object_from_special_string(const char *str, unsigned size)
     }
     else if (strncmp(str, "#false", size) == 0) {
         Boolean *obj = (Boolean*)object_create(OBJECT_TYPE_BOOLEAN);
-        obj->value = true;
+        obj->value = false;
         return (Object*)obj;
     }
     else {
@@ -294,7 +288,7 @@ static Object *create_object_from_element(Element el, const char *str, unsigned
     case ELEMENT_QUOTE:
         return create_object_string_from_string(str, size);
     case ELEMENT_NUMBER:
-        return create_object_integer_from_string(str, size);
+        return create_object_number_from_string(str, size);
     case ELEMENT_SPECIAL:
         return create_object_from_special_string(str, size);
     case ELEMENT_TEXT:
@@ -0,0 +1,230 @@
+/*
+ *    ports.c
+ */
+
+
+#include "ports.h"
+#include "numbers.h"
+#include "text.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+
+static const char *get_path(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_STRING) {
+        throw("Wrong type of argument %s: expected string",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return ((String*)obj)->cstr;
+}
+
+static Port *get_port(Object *obj, bool input)
+{
+    Port *port = (Port*)obj;
+
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_PORT
+        || (port->writer == NULL) != input) {
+        throw("Wrong type of argument %s: expected %s port",
+              obj != NULL ? object_to_string(obj) : "#nil", input ? "input" : "output");
+    }
+    if (port->fd < 0) {
+        throw("Port %s is closed", object_to_string(obj));
+    }
+    return port;
+}
+
+static Object *open_port(Object *obj, int flags)
+{
+    const char *path = get_path(((List*)obj)->item);
+    int fd = open(path, flags, 0666);
+    Port *port;
+
+    if (fd < 0) {
+        throw("Can't open file %s: %s", path, strerror(errno));
+    }
+    port = (Port*)object_create(OBJECT_TYPE_PORT);
+    port->fd = fd;
+    if (flags == O_RDONLY) {
+        port->buffer = malloc(PORTS_BUFFER_SIZE);
+        port->capacity = PORTS_BUFFER_SIZE;
+    }
+    else {
+        port->writer = malloc(sizeof(Writer));
+        writer_init(port->writer, fd);
+    }
+    return (Object*)port;
+}
+
+Object *ports_open_input_file(Object *obj)
+{
+    return open_port(obj, O_RDONLY);
+}
+
+Object *ports_open_output_file(Object *obj)
+{
+    return open_port(obj, O_WRONLY | O_CREAT | O_TRUNC);
+}
+
+/*
+ * Moves unread bytes to the front, grows the buffer if they fill it and
+ * reads more. Returns false at the end of the file.
+ */
+static bool fill(Port *port)
+{
+    ssize_t size;
+
+    if (port->start > 0) {
+        memmove(port->buffer, port->buffer + port->start, port->end - port->start);
+        port->end -= port->start;
+        port->start = 0;
+    }
+    if (port->end == port->capacity) {
+        char *buffer = realloc(port->buffer, 2 * port->capacity);
+
+        if (buffer == NULL) {
+            throw("Not enough memory for port buffer of size %zu", 2 * port->capacity);
+        }
+        port->buffer = buffer;
+        port->capacity *= 2;
+    }
+    do {
+        size = read(port->fd, port->buffer + port->end, port->capacity - port->end);
+    } while (size < 0 && errno == EINTR);
+
+    if (size < 0) {
+        throw("Can't read from port: %s", strerror(errno));
+    }
+    port->end += size;
+    return size > 0;
+}
+
+/*
+ * Strings are created from the buffer, the bytes are consumed afterwards.
+ */
+static Object *consume(Port *port, size_t length, size_t skip)
+{
+    Object *res = text_create_string(port->buffer + port->start, length);
+    port->start += length + skip;
+    return res;
+}
+
+Object *ports_read_line(Object *obj)
+{
+    Port *port = get_port(((List*)obj)->item, true);
+    size_t scanned = 0;
+
+    for (;;) {
+        const char *begin = port->buffer + port->start;
+        const char *newline = memchr(begin + scanned, '\n', port->end - port->start - scanned);
+
+        if (newline != NULL) {
+            return consume(port, newline - begin, 1);
+        }
+        scanned = port->end - port->start;
+        if (!fill(port)) {
+            break;
+        }
+    }
+    if (port->start == port->end) {
+        return object_boolean(false);
+    }
+    return consume(port, port->end - port->start, 0);
+}
+
+Object *ports_read_char(Object *obj)
+{
+    Port *port = get_port(((List*)obj)->item, true);
+
+    if (port->start == port->end && !fill(port)) {
+        return object_boolean(false);
+    }
+    return consume(port, 1, 0);
+}
+
+Object *ports_read_string(Object *obj)
+{
+    List *list = (List*)obj;
+    int64_t length = numbers_to_fixnum(list->item);
+    Port *port = get_port(list->next->item, true);
+
+    if (length < 0) {
+        throw("Invalid string length %s", object_to_string(list->item));
+    }
+    while (port->end - port->start < (uint64_t)length) {
+        if (!fill(port)) {
+            break;
+        }
+    }
+    if (port->start == port->end && length > 0) {
+        return object_boolean(false);
+    }
+    if (port->end - port->start < (uint64_t)length) {
+        length = port->end - port->start;
+    }
+    return consume(port, length, 0);
+}
+
+Object *ports_is_eof_object(Object *obj)
+{
+    Object *arg = ((List*)obj)->item;
+    return object_boolean(arg != NULL && object_get_type(arg) == OBJECT_TYPE_BOOLEAN
+                          && !((Boolean*)arg)->value);
+}
+
+Object *ports_write_string(Object *obj)
+{
+    List *list = (List*)obj;
+    Object *str = list->item;
+    Object *target = list->next != NULL ? list->next->item : NULL;
+
+    if (str == NULL || object_get_type(str) != OBJECT_TYPE_STRING) {
+        throw("Wrong type of argument %s: expected string",
+              str != NULL ? object_to_string(str) : "#nil");
+    }
+    if (target != NULL && object_get_type(target) == OBJECT_TYPE_STRING_BUILDER) {
+        text_builder_write((StringBuilder*)target, ((String*)str)->cstr, ((String*)str)->length);
+    }
+    else {
+        Writer *writer = target != NULL ? get_port(target, false)->writer : writer_stdout();
+        writer_write(writer, ((String*)str)->cstr, ((String*)str)->length);
+    }
+    return NULL;
+}
+
+Object *ports_close_port(Object *obj)
+{
+    Port *port = (Port*)((List*)obj)->item;
+    bool flushed = true;
+
+    if (port == NULL || object_get_type((Object*)port) != OBJECT_TYPE_PORT) {
+        throw("Wrong type of argument %s: expected port",
+              port != NULL ? object_to_string((Object*)port) : "#nil");
+    }
+    if (port->fd < 0) {
+        return NULL;
+    }
+    if (port->writer != NULL) {
+        flushed = writer_flush(port->writer);
+    }
+    if (close(port->fd) < 0) {
+        flushed = false;
+    }
+    port->fd = -1;
+    port->start = port->end = 0;
+    if (!flushed) {
+        throw("Can't write to port: %s", strerror(errno));
+    }
+    return NULL;
+}
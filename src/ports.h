@@ -0,0 +1,37 @@
+/*
+ *    ports.h
+ */
+
+
+#ifndef PORTS_H
+#define PORTS_H
+
+#include "types.h"
+
+#define PORTS_BUFFER_SIZE 65536
+
+/*
+ * File ports read and write through their own buffers over the file
+ * descriptors. read-line, read-char and read-string return #false at the
+ * end of the input, eof-object? tells it from empty strings. write-string writes to standard output by default
+ * and also accepts a string builder instead of a port. Output ports
+ * should be closed, buffered output of the others is written only when
+ * they are collected.
+ */
+Object *ports_open_input_file(Object *obj);
+
+Object *ports_open_output_file(Object *obj);
+
+Object *ports_read_line(Object *obj);
+
+Object *ports_read_char(Object *obj);
+
+Object *ports_read_string(Object *obj);
+
+Object *ports_is_eof_object(Object *obj);
+
+Object *ports_write_string(Object *obj);
+
+Object *ports_close_port(Object *obj);
+
+#endif // PORTS_H
@@ -0,0 +1,200 @@
+/*
+ *    records.c
+ */
+
+
+#include "records.h"
+#include "analyze.h"
+#include "env.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+
+static unsigned long _types = 0;
+
+
+static char *copy_string(const char *str)
+{
+    char *res = malloc(strlen(str) + 1);
+    strcpy(res, str);
+    return res;
+}
+
+static const char *get_name(Object *obj)
+{
+    return ((Unbound*)obj)->cstr;
+}
+
+static bool is_field_spec(Object *spec)
+{
+    int size = analyze_get_list_size(spec);
+    List *list = (List*)spec;
+
+    if (size < 2 || size > 3) {
+        return false;
+    }
+    for (; list != NULL; list = list->next) {
+        if (!analyze_is_variable(list->item)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int find_field(List *specs, const char *str)
+{
+    int index;
+
+    for (index = 0; specs != NULL; index++, specs = specs->next) {
+        if (strcmp(get_name(((List*)specs->item)->item), str) == 0) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+void records_check_definition(Object *exp)
+{
+    List *list = ((List*)exp)->next;
+    List *constructor;
+    List *specs;
+    List *args;
+    int index;
+
+    if (analyze_get_list_size(exp) < 4 || !analyze_is_variable(list->item)
+        || analyze_get_list_size(list->next->item) < 1
+        || !analyze_is_variable(list->next->next->item)) {
+        throw("Invalid define-record-type pattern %s", object_to_string(exp));
+    }
+    constructor = (List*)list->next->item;
+    specs = list->next->next->next;
+
+    for (index = 0, args = specs; args != NULL; index++, args = args->next) {
+        if (!is_field_spec(args->item)) {
+            throw("Invalid field %s of record type", object_to_string(args->item));
+        }
+        if (find_field(specs, get_name(((List*)args->item)->item)) != index) {
+            throw("Duplicate field %s of record type", get_name(((List*)args->item)->item));
+        }
+    }
+    for (args = constructor; args != NULL; args = args->next) {
+        if (!analyze_is_variable(args->item)
+            || (args != constructor && find_field(specs, get_name(args->item)) < 0)) {
+            throw("Invalid constructor %s of record type", object_to_string((Object*)constructor));
+        }
+    }
+}
+
+static void define_procedure(Env *env, Object *var, RecordOperation operation,
+                             RecordType *type, unsigned argc, unsigned *fields)
+{
+    RecordProc *proc = (RecordProc*)object_create(OBJECT_TYPE_RECORD_PROCEDURE);
+    proc->cstr = copy_string(get_name(var));
+    proc->operation = operation;
+    proc->type = type;
+    proc->argc = argc;
+    proc->fields = fields;
+
+    if (!env_define_variable(env, (Unbound*)var, (Object*)proc)) {
+        throw("Can't define variable %s", get_name(var));
+    }
+}
+
+static unsigned *create_fields(unsigned size)
+{
+    return malloc((size > 0 ? size : 1) * sizeof(unsigned));
+}
+
+Object *records_define(Object *exp, Env *env)
+{
+    List *list = ((List*)exp)->next;
+    List *constructor = (List*)list->next->item;
+    List *specs = list->next->next->next;
+    RecordType *type;
+    unsigned *fields;
+    List *args;
+    unsigned i;
+
+    type = (RecordType*)object_create(OBJECT_TYPE_RECORD_TYPE);
+    type->id = records_create_id();
+    type->cstr = copy_string(get_name(list->item));
+    type->fields = malloc(analyze_get_list_size((Object*)specs) * sizeof(char*));
+    for (args = specs; args != NULL; args = args->next) {
+        type->fields[type->size++] = copy_string(get_name(((List*)args->item)->item));
+    }
+    gc_push((Object*)type);
+
+    fields = create_fields(analyze_get_list_size((Object*)constructor->next));
+    for (i = 0, args = constructor->next; args != NULL; i++, args = args->next) {
+        fields[i] = find_field(specs, get_name(args->item));
+    }
+    define_procedure(env, constructor->item, RECORD_CONSTRUCTOR, type, i, fields);
+    define_procedure(env, list->next->next->item, RECORD_PREDICATE, type, 1, NULL);
+
+    for (i = 0, args = specs; args != NULL; i++, args = args->next) {
+        List *spec = (List*)args->item;
+
+        fields = create_fields(1);
+        fields[0] = i;
+        define_procedure(env, spec->next->item, RECORD_ACCESSOR, type, 1, fields);
+        if (spec->next->next != NULL) {
+            fields = create_fields(1);
+            fields[0] = i;
+            define_procedure(env, spec->next->next->item, RECORD_MODIFIER, type, 2, fields);
+        }
+    }
+    return gc_pop();
+}
+
+unsigned long records_create_id(void)
+{
+    return __atomic_add_fetch(&_types, 1, __ATOMIC_RELAXED);
+}
+
+bool records_is_instance(Object *obj, RecordType *type)
+{
+    return obj != NULL && obj->type == OBJECT_TYPE_RECORD
+        && (((Record*)obj)->type == type || ((Record*)obj)->type->id == type->id);
+}
+
+static Record *get_instance(RecordProc *proc, Object *obj)
+{
+    if (!records_is_instance(obj, proc->type)) {
+        throw("Wrong type of argument %s: expected record %s",
+              obj != NULL ? object_to_string(obj) : "#nil", proc->type->cstr);
+    }
+    return (Record*)obj;
+}
+
+Object *records_apply(RecordProc *proc, unsigned argc, Object **args)
+{
+    Record *record;
+    unsigned i;
+
+    if (argc != proc->argc) {
+        throw("Invalid args number %u", argc);
+    }
+    switch (proc->operation) {
+    case RECORD_CONSTRUCTOR:
+        record = (Record*)object_create_record(proc->type);
+        for (i = 0; i < argc; i++) {
+            record->slots[proc->fields[i]] = args[i];
+        }
+        return (Object*)record;
+    case RECORD_PREDICATE:
+        return object_boolean(records_is_instance(args[0], proc->type));
+    case RECORD_ACCESSOR:
+        return get_instance(proc, args[0])->slots[proc->fields[0]];
+    default:
+        get_instance(proc, args[0])->slots[proc->fields[0]] = args[1];
+        return NULL;
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ *    records.h
+ */
+
+
+#ifndef RECORDS_H
+#define RECORDS_H
+
+#include "types.h"
+
+/*
+ * Checks syntax of (define-record-type name (constructor field ...)
+ * predicate (field accessor [modifier]) ...), throws if it is invalid.
+ */
+void records_check_definition(Object *exp);
+
+/*
+ * Creates the record type and defines its procedures in the environment.
+ */
+Object *records_define(Object *exp, Env *env);
+
+/*
+ * Identifier of a new record type, unique in the process.
+ */
+unsigned long records_create_id(void);
+
+bool records_is_instance(Object *obj, RecordType *type);
+
+/*
+ * Applies the record procedure to the arguments on the GC stack.
+ */
+Object *records_apply(RecordProc *proc, unsigned argc, Object **args);
+
+#endif // RECORDS_H
@@ -0,0 +1,260 @@
+/*
+ *    sequences.c
+ */
+
+
+#include "sequences.h"
+#include "core.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+
+typedef struct cursor
+{
+    List *list;
+    Vector *vector;
+    size_t index;
+} Cursor;
+
+
+static void cursor_init(Cursor *cursor, Object *seq)
+{
+    cursor->list = NULL;
+    cursor->vector = NULL;
+    cursor->index = 0;
+
+    if (seq != NULL && object_get_type(seq) == OBJECT_TYPE_VECTOR) {
+        cursor->vector = (Vector*)seq;
+    }
+    else if (seq == NULL || object_get_type(seq) == OBJECT_TYPE_LIST) {
+        cursor->list = (List*)seq;
+    }
+    else {
+        throw("Wrong type of argument %s: expected list or vector", object_to_string(seq));
+    }
+}
+
+static bool cursor_next(Cursor *cursor, Object **value)
+{
+    if (cursor->vector != NULL) {
+        if (cursor->index == cursor->vector->length) {
+            return false;
+        }
+        *value = cursor->vector->items[cursor->index++];
+        return true;
+    }
+    if (cursor->list == NULL) {
+        return false;
+    }
+    if (object_get_type((Object*)cursor->list) != OBJECT_TYPE_LIST) {
+        throw("Improper list ends with %s", object_to_string((Object*)cursor->list));
+    }
+    *value = cursor->list->item;
+    cursor->list = cursor->list->next;
+    return true;
+}
+
+/*
+ * Argument list reused by the calls of a loop. It stays on the GC stack
+ * and its items root the values being passed.
+ */
+static List *create_args(unsigned argc)
+{
+    List *list;
+    unsigned i;
+
+    gc_push(NULL);
+    for (i = 0; i < argc; i++) {
+        list = (List*)object_create(OBJECT_TYPE_LIST);
+        list->item = NULL;
+        list->next = (List*)*gc_peek(1);
+        *gc_peek(1) = (Object*)list;
+    }
+    return (List*)*gc_peek(1);
+}
+
+/*
+ * Appends the value to the list kept in the GC stack slot at depth.
+ */
+static Pair *append(unsigned depth, Pair *tail, Object *value)
+{
+    Pair *pair;
+
+    gc_push(value);
+    pair = (Pair*)object_create(OBJECT_TYPE_PAIR);
+    pair->first = gc_pop();
+    pair->rest = NULL;
+    if (tail == NULL) {
+        *gc_peek(gc_depth() - depth) = (Object*)pair;
+    }
+    else {
+        tail->rest = (Object*)pair;
+    }
+    return pair;
+}
+
+Object *sequences_map(Object *obj)
+{
+    List *list = (List*)obj;
+    const unsigned depth = gc_depth();
+    Pair *tail = NULL;
+    Cursor cursor;
+    List *args;
+    Object *res;
+
+    cursor_init(&cursor, list->next->item);
+    gc_push(NULL);
+    args = create_args(1);
+    while (cursor_next(&cursor, &args->item)) {
+        tail = append(depth, tail, core_apply(list->item, 1, args));
+    }
+    res = *gc_peek(gc_depth() - depth);
+    gc_unwind(depth);
+    return res;
+}
+
+Object *sequences_filter(Object *obj)
+{
+    List *list = (List*)obj;
+    const unsigned depth = gc_depth();
+    Pair *tail = NULL;
+    Cursor cursor;
+    List *args;
+    Object *res;
+
+    cursor_init(&cursor, list->next->item);
+    gc_push(NULL);
+    args = create_args(1);
+    while (cursor_next(&cursor, &args->item)) {
+        if (core_object_to_bool(core_apply(list->item, 1, args))) {
+            tail = append(depth, tail, args->item);
+        }
+    }
+    res = *gc_peek(gc_depth() - depth);
+    gc_unwind(depth);
+    return res;
+}
+
+Object *sequences_fold(Object *obj)
+{
+    List *list = (List*)obj;
+    const unsigned depth = gc_depth();
+    Cursor cursor;
+    List *args;
+
+    cursor_init(&cursor, list->next->next->item);
+    args = create_args(2);
+    args->item = list->next->item;
+    while (cursor_next(&cursor, &args->next->item)) {
+        args->item = core_apply(list->item, 2, args);
+    }
+    gc_unwind(depth);
+    return args->item;
+}
+
+static Transducer *get_transducer(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_TRANSDUCER) {
+        throw("Wrong type of argument %s: expected transducer",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return (Transducer*)obj;
+}
+
+static Object *create_transducer(unsigned size)
+{
+    Transducer *transducer = (Transducer*)object_create(OBJECT_TYPE_TRANSDUCER);
+    transducer->stages = calloc(size > 0 ? size : 1, sizeof(Stage));
+    transducer->size = size;
+    return (Object*)transducer;
+}
+
+static Object *create_stage(StageKind kind, Object *proc)
+{
+    Transducer *transducer = (Transducer*)create_transducer(1);
+    transducer->stages[0].kind = kind;
+    transducer->stages[0].proc = proc;
+    return (Object*)transducer;
+}
+
+Object *sequences_mapping(Object *obj)
+{
+    return create_stage(STAGE_MAPPING, ((List*)obj)->item);
+}
+
+Object *sequences_filtering(Object *obj)
+{
+    return create_stage(STAGE_FILTERING, ((List*)obj)->item);
+}
+
+Object *sequences_compose(Object *obj)
+{
+    Transducer *res;
+    List *list;
+    unsigned size = 0;
+
+    for (list = (List*)obj; list != NULL; list = list->next) {
+        size += get_transducer(list->item)->size;
+    }
+    res = (Transducer*)create_transducer(size);
+    size = 0;
+    for (list = (List*)obj; list != NULL; list = list->next) {
+        Transducer *transducer = (Transducer*)list->item;
+        memcpy(res->stages + size, transducer->stages, transducer->size * sizeof(Stage));
+        size += transducer->size;
+    }
+    return (Object*)res;
+}
+
+/*
+ * Runs the value of the argument list through the stages. Mapped values
+ * replace it, false is returned if a stage filters it out.
+ */
+static bool run_stages(Transducer *transducer, List *args)
+{
+    unsigned i;
+
+    for (i = 0; i < transducer->size; i++) {
+        Object *res = core_apply(transducer->stages[i].proc, 1, args);
+
+        if (transducer->stages[i].kind == STAGE_MAPPING) {
+            args->item = res;
+        }
+        else if (!core_object_to_bool(res)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Object *sequences_transduce(Object *obj)
+{
+    List *list = (List*)obj;
+    Transducer *transducer = get_transducer(list->item);
+    Object *proc = list->next->item;
+    const unsigned depth = gc_depth();
+    Cursor cursor;
+    List *value;
+    List *args;
+
+    cursor_init(&cursor, list->next->next->next->item);
+    value = create_args(1);
+    args = create_args(2);
+    args->item = list->next->next->item;
+    while (cursor_next(&cursor, &value->item)) {
+        if (run_stages(transducer, value)) {
+            args->next->item = value->item;
+            args->item = core_apply(proc, 2, args);
+        }
+    }
+    gc_unwind(depth);
+    return args->item;
+}
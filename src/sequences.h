@@ -0,0 +1,35 @@
+/*
+ *    sequences.h
+ */
+
+
+#ifndef SEQUENCES_H
+#define SEQUENCES_H
+
+#include "types.h"
+
+/*
+ * Sequences are lists or vectors. map and filter return lists, fold calls
+ * the procedure with the accumulator and the value like stream-fold.
+ * Procedures are called without allocating argument lists.
+ */
+Object *sequences_map(Object *obj);
+
+Object *sequences_filter(Object *obj);
+
+Object *sequences_fold(Object *obj);
+
+/*
+ * Transducers made by mapping and filtering and joined by compose run
+ * their stages on each value in a single pass of sequence-transduce, no
+ * intermediate sequences are created.
+ */
+Object *sequences_mapping(Object *obj);
+
+Object *sequences_filtering(Object *obj);
+
+Object *sequences_compose(Object *obj);
+
+Object *sequences_transduce(Object *obj);
+
+#endif // SEQUENCES_H
@@ -0,0 +1,718 @@
+/*
+ *    server.c
+ */
+
+
+#define _DEFAULT_SOURCE
+
+#include "server.h"
+#include "parser.h"
+#include "core.h"
+#include "context.h"
+#include "env.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+#define SERVER_MAX_EVENTS 64
+
+#define SERVER_READ_SIZE 65536
+
+// Longest header line: a status, a length and the newline
+#define SERVER_MAX_HEADER 32
+
+
+typedef struct buffer
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+/*
+ * Requests are taken from the input as soon as they are complete, the
+ * responses wait in the output until the socket takes them.
+ */
+typedef struct connection
+{
+    int fd;
+    Buffer input;
+    Buffer output;
+    size_t sent;
+    uint32_t events;
+    // The peer sent everything or broke the frames, the connection is
+    // closed once the responses are sent
+    bool finished;
+    bool broken;
+    struct connection *next;
+} Connection;
+
+typedef struct server
+{
+    Env *env;
+    bool isolate;
+    int epoll;
+    Connection *connections;
+    // Text of the request being evaluated
+    Buffer text;
+} Server;
+
+struct client
+{
+    int fd;
+    FILE *input;
+    unsigned pending;
+};
+
+
+static volatile sig_atomic_t _stopping;
+
+static volatile sig_atomic_t _reporting;
+
+
+static void reserve(Buffer *buffer, size_t length)
+{
+    if (buffer->length + length > buffer->capacity) {
+        while (buffer->length + length > buffer->capacity) {
+            buffer->capacity = buffer->capacity > 0 ? 2 * buffer->capacity : SERVER_READ_SIZE;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+        if (buffer->data == NULL) {
+            FATAL("Not enough memory for connection");
+        }
+    }
+}
+
+static void append(Buffer *buffer, const char *data, size_t length)
+{
+    if (length > 0) {
+        reserve(buffer, length);
+        memcpy(buffer->data + buffer->length, data, length);
+        buffer->length += length;
+    }
+}
+
+static void respond(Connection *connection, const char *status, const char *data, size_t length)
+{
+    char header[SERVER_MAX_HEADER];
+
+    append(&connection->output, header,
+           snprintf(header, sizeof(header), "%s %zu\n", status, length));
+    append(&connection->output, data, length);
+}
+
+static void stop(int number)
+{
+    _stopping = 1;
+}
+
+static void request_report(int number)
+{
+    _reporting = 1;
+}
+
+static void wake(int number)
+{
+}
+
+/*
+ * Output and errors of the evaluation are captured by the writer of the
+ * context.
+ */
+static void evaluate(Server *server, Connection *connection, const char *data, size_t length)
+{
+    Writer *writer = writer_stdout();
+    const char *output;
+    size_t output_length;
+    Error error;
+
+    server->text.length = 0;
+    append(&server->text, data, length);
+    append(&server->text, "", 1);
+
+    error = try_and_catch_error();
+    if (error == ERROR_TYPE_NONE) {
+        Env *env = server->isolate ? env_extend(server->env) : server->env;
+
+        object_dump(core_eval(parser_create_object_from_string(server->text.data), env));
+    }
+    output = writer_captured(writer, &output_length);
+    respond(connection, error == ERROR_TYPE_NONE ? "ok" : "error", output, output_length);
+}
+
+/*
+ * A client which sends requests without reading the responses would make
+ * the output grow without limit.
+ */
+static bool is_overflowing(Connection *connection)
+{
+    return connection->input.length + connection->output.length - connection->sent > SERVER_MAX_BUFFERED;
+}
+
+/*
+ * Evaluates the complete requests of the input until the responses fill
+ * the buffers. A malformed header ends the connection after an error
+ * response.
+ */
+static void process(Server *server, Connection *connection)
+{
+    size_t start = 0;
+
+    while (!connection->broken && !is_overflowing(connection)) {
+        const char *header = connection->input.data + start;
+        const size_t left = connection->input.length - start;
+        const char *newline = memchr(header, '\n', left < SERVER_MAX_HEADER ? left : SERVER_MAX_HEADER);
+        unsigned long long length;
+        char *end;
+
+        if (newline == NULL) {
+            if (left >= SERVER_MAX_HEADER) {
+                respond(connection, "error", "Invalid request", strlen("Invalid request"));
+                connection->broken = true;
+            }
+            break;
+        }
+        length = strtoull(header, &end, 10);
+        if (end != newline || end == header || length > SERVER_MAX_REQUEST) {
+            respond(connection, "error", "Invalid request", strlen("Invalid request"));
+            connection->broken = true;
+            break;
+        }
+        if (left - (newline + 1 - header) < length) {
+            break;
+        }
+        evaluate(server, connection, newline + 1, length);
+        start += newline + 1 - header + length;
+    }
+    memmove(connection->input.data, connection->input.data + start, connection->input.length - start);
+    connection->input.length -= start;
+}
+
+/*
+ * A peer which is done would keep the socket readable, so its connection
+ * waits only for writing.
+ */
+static void watch(Server *server, Connection *connection, bool writing)
+{
+    struct epoll_event event;
+
+    event.events = (connection->finished || connection->broken ? 0 : EPOLLIN | EPOLLRDHUP)
+        | (writing ? EPOLLOUT : 0);
+    event.data.ptr = connection;
+    if (event.events != connection->events) {
+        epoll_ctl(server->epoll, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->events = event.events;
+    }
+}
+
+/*
+ * Returns false if the connection is to be closed.
+ */
+static bool flush(Server *server, Connection *connection)
+{
+    while (connection->sent < connection->output.length) {
+        ssize_t sent = send(connection->fd, connection->output.data + connection->sent,
+                            connection->output.length - connection->sent, MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(server, connection, true);
+                return true;
+            }
+            return false;
+        }
+        connection->sent += sent;
+    }
+    connection->output.length = 0;
+    connection->sent = 0;
+    watch(server, connection, false);
+    return !connection->finished && !connection->broken;
+}
+
+/*
+ * Evaluates the complete requests, sending responses whenever they pile up
+ * over the limit. Returns false if the client doesn't read them.
+ */
+static bool drain(Server *server, Connection *connection)
+{
+    process(server, connection);
+    while (is_overflowing(connection)) {
+        flush(server, connection);
+        if (is_overflowing(connection)) {
+            return false;
+        }
+        process(server, connection);
+    }
+    return true;
+}
+
+/*
+ * Requests are evaluated as they arrive, so the input holds at most one.
+ * Returns false if the connection is to be closed.
+ */
+static bool receive(Server *server, Connection *connection)
+{
+    while (!connection->finished && !connection->broken) {
+        ssize_t received;
+
+        reserve(&connection->input, SERVER_READ_SIZE);
+        received = recv(connection->fd, connection->input.data + connection->input.length,
+                        connection->input.capacity - connection->input.length, 0);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        if (received == 0) {
+            connection->finished = true;
+        }
+        connection->input.length += received;
+        if (!drain(server, connection)) {
+            return false;
+        }
+    }
+    return flush(server, connection);
+}
+
+static void close_connection(Server *server, Connection *connection)
+{
+    Connection **link = &server->connections;
+
+    while (*link != connection) {
+        link = &(*link)->next;
+    }
+    *link = connection->next;
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection->input.data);
+    free(connection->output.data);
+    free(connection);
+}
+
+static void accept_connections(Server *server, int listener)
+{
+    struct epoll_event event;
+    Connection *connection;
+    int fd;
+
+    while ((fd = accept(listener, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        connection = calloc(1, sizeof(Connection));
+        if (connection == NULL) {
+            FATAL("Not enough memory for connection");
+        }
+        connection->fd = fd;
+        connection->next = server->connections;
+        server->connections = connection;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = connection;
+        connection->events = event.events;
+        if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close_connection(server, connection);
+        }
+    }
+}
+
+/*
+ * A socket left by a previous server is replaced, other files are not.
+ */
+static int listen_on(const char *path)
+{
+    struct sockaddr_un address;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        throw("Socket path %s is too long", path);
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw("Can't create socket: %s", strerror(errno));
+    }
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+        const int problem = errno;
+
+        close(fd);
+        throw("Can't listen on %s: %s", path, strerror(problem));
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/*
+ * Answers requests until the process is stopped. Workers wait on the
+ * listener each in their own epoll, only one of them is woken by a new
+ * connection.
+ */
+static void serve(int listener, Env *env, bool isolate)
+{
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    struct epoll_event event;
+    Server server;
+    int count;
+    int i;
+
+    memset(&server, 0, sizeof(server));
+    server.env = env;
+    server.isolate = isolate;
+    server.epoll = epoll_create1(EPOLL_CLOEXEC);
+    event.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    event.events |= EPOLLEXCLUSIVE;
+#endif
+    event.data.ptr = NULL;
+    if (server.epoll < 0 || epoll_ctl(server.epoll, EPOLL_CTL_ADD, listener, &event) != 0) {
+        throw("Can't wait for requests: %s", strerror(errno));
+    }
+
+    writer_capture(writer_stdout());
+    while (!_stopping) {
+        count = epoll_wait(server.epoll, events, SERVER_MAX_EVENTS, -1);
+        if (count < 0 && errno != EINTR) {
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            Connection *connection = events[i].data.ptr;
+
+            if (connection == NULL) {
+                accept_connections(&server, listener);
+            }
+            else if (!(events[i].events & EPOLLERR)
+                     && (!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+                         || receive(&server, connection))
+                     && (!(events[i].events & EPOLLOUT) || flush(&server, connection))) {
+                continue;
+            }
+            else {
+                close_connection(&server, connection);
+            }
+        }
+    }
+    writer_release(writer_stdout(), STDOUT_FILENO);
+
+    while (server.connections != NULL) {
+        close_connection(&server, server.connections);
+    }
+    free(server.text.data);
+    close(server.epoll);
+}
+
+typedef struct worker
+{
+    Context *context;
+    int listener;
+    Env *env;
+    bool isolate;
+    const sigset_t *mask;
+} Worker;
+
+static void *run_worker(void *arg)
+{
+    Worker *worker = (Worker*)arg;
+
+    pthread_sigmask(SIG_SETMASK, worker->mask, NULL);
+    context_enter(worker->context);
+    serve(worker->listener, worker->env, worker->isolate);
+    return NULL;
+}
+
+/*
+ * The worker serves on a thread of its own, the allocator gives the
+ * thread a new arena, so new objects don't fill the holes between the
+ * shared ones. The signals stay blocked on the main thread, so they
+ * interrupt the one serving.
+ */
+static pid_t start_worker(int listener, Env *env, bool isolate, const sigset_t *mask)
+{
+    const pid_t pid = fork();
+
+    if (pid == 0) {
+        Worker worker = {_context, listener, env, isolate, mask};
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, &run_worker, &worker) != 0) {
+            FATAL("Can't start worker");
+        }
+        pthread_join(thread, NULL);
+        exit(EXIT_SUCCESS);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "Can't start worker: %s\n", strerror(errno));
+    }
+    return pid;
+}
+
+/*
+ * Memory of a worker from its proportional set size and the pages it
+ * doesn't share with the others.
+ */
+static void report(const pid_t *workers, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        unsigned long rss = 0, pss = 0, clean = 0, dirty = 0;
+        char path[64];
+        char line[256];
+        FILE *file;
+
+        snprintf(path, sizeof(path), "/proc/%ld/smaps_rollup", (long)workers[i]);
+        file = fopen(path, "r");
+        if (file == NULL) {
+            fprintf(stderr, "Worker %u (pid %ld): no memory statistics\n", i, (long)workers[i]);
+            continue;
+        }
+        while (fgets(line, sizeof(line), file) != NULL) {
+            sscanf(line, "Rss: %lu", &rss);
+            sscanf(line, "Pss: %lu", &pss);
+            sscanf(line, "Private_Clean: %lu", &clean);
+            sscanf(line, "Private_Dirty: %lu", &dirty);
+        }
+        fclose(file);
+        fprintf(stderr, "Worker %u (pid %ld): %lu kB resident, %lu kB proportional, %lu kB private\n",
+                i, (long)workers[i], rss, pss, clean + dirty);
+    }
+}
+
+/*
+ * Workers are forked after the heap is shared and restarted when they
+ * end. Signals are blocked except while the master waits for them, so
+ * none is missed between the checks and the wait.
+ */
+static void supervise(int listener, Env *env, bool isolate, unsigned count)
+{
+    pid_t *workers = calloc(count, sizeof(pid_t));
+    sigset_t blocked;
+    sigset_t mask;
+    pid_t pid;
+    int status;
+    unsigned i;
+
+    if (workers == NULL) {
+        FATAL("Not enough memory for workers");
+    }
+    gc_share((Object*)env);
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &blocked, &mask);
+    for (i = 0; i < count; i++) {
+        workers[i] = start_worker(listener, env, isolate, &mask);
+    }
+
+    while (!_stopping) {
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < count && workers[i] != pid; i++);
+            if (i == count) {
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "Worker %u (pid %ld) was killed by signal %d, restarting\n",
+                        i, (long)pid, WTERMSIG(status));
+            }
+            else {
+                fprintf(stderr, "Worker %u (pid %ld) exited with status %d, restarting\n",
+                        i, (long)pid, WEXITSTATUS(status));
+            }
+            workers[i] = start_worker(listener, env, isolate, &mask);
+        }
+        if (_reporting) {
+            _reporting = 0;
+            report(workers, count);
+        }
+        if (!_stopping) {
+            sigsuspend(&mask);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (workers[i] > 0) {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (workers[i] > 0) {
+            waitpid(workers[i], NULL, 0);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    free(workers);
+}
+
+void server_run(const char *path, Env *env, bool isolate, unsigned workers)
+{
+    struct sigaction action;
+    const int listener = listen_on(path);
+
+    // Signals interrupt the waits rather than restarting them
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = wake;
+    sigaction(SIGCHLD, &action, NULL);
+    action.sa_handler = request_report;
+    sigaction(SIGUSR1, &action, NULL);
+
+    if (workers > 0) {
+        supervise(listener, env, isolate, workers);
+    }
+    else {
+        serve(listener, env, isolate);
+    }
+    close(listener);
+    unlink(path);
+}
+
+Client *server_connect(const char *path)
+{
+    const struct timespec pause = {0, 10 * 1000 * 1000};
+    struct sockaddr_un address;
+    Client *client;
+    int attempts;
+    int fd;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return NULL;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Can't create socket: %s\n", strerror(errno));
+        return NULL;
+    }
+    // A server which is starting gets a second
+    for (attempts = 0; connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0; attempts++) {
+        if ((errno != ENOENT && errno != ECONNREFUSED) || attempts == 100) {
+            fprintf(stderr, "Can't connect to %s: %s\n", path, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    client = calloc(1, sizeof(Client));
+    if (client == NULL) {
+        FATAL("Not enough memory for client");
+    }
+    client->fd = fd;
+    client->input = fdopen(fd, "r");
+    if (client->input == NULL) {
+        FATAL("Can't read from %s", path);
+    }
+    return client;
+}
+
+bool server_send(Client *client, const char *text)
+{
+    char header[SERVER_MAX_HEADER];
+    const size_t length = strlen(text);
+    const int header_length = snprintf(header, sizeof(header), "%zu\n", length);
+    const char *data[] = {header, text};
+    const size_t lengths[] = {header_length, length};
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        size_t sent = 0;
+
+        while (sent < lengths[i]) {
+            ssize_t written = send(client->fd, data[i] + sent, lengths[i] - sent, MSG_NOSIGNAL);
+
+            if (written < 0 && errno != EINTR) {
+                fprintf(stderr, "Can't send request: %s\n", strerror(errno));
+                return false;
+            }
+            sent += written > 0 ? written : 0;
+        }
+    }
+    client->pending += 1;
+    return true;
+}
+
+bool server_receive(Client *client)
+{
+    Writer *writer = writer_stdout();
+    char header[SERVER_MAX_HEADER];
+    char status[SERVER_MAX_HEADER];
+    char data[SERVER_READ_SIZE];
+    size_t length;
+    char last = '\n';
+
+    if (fgets(header, sizeof(header), client->input) == NULL
+        || sscanf(header, "%31s %zu", status, &length) != 2) {
+        fprintf(stderr, "Server closed the connection\n");
+        client->pending = 0;
+        return false;
+    }
+    client->pending -= 1;
+    while (length > 0) {
+        size_t read = fread(data, 1, length < sizeof(data) ? length : sizeof(data), client->input);
+
+        if (read == 0) {
+            fprintf(stderr, "Server closed the connection\n");
+            client->pending = 0;
+            return false;
+        }
+        writer_write(writer, data, read);
+        last = data[read - 1];
+        length -= read;
+    }
+    if (last != '\n') {
+        writer_putc(writer, '\n');
+    }
+    writer_flush(writer);
+    return strcmp(status, "ok") == 0;
+}
+
+bool server_disconnect(Client *client)
+{
+    bool succeeded = true;
+
+    shutdown(client->fd, SHUT_WR);
+    while (client->pending > 0) {
+        succeeded = server_receive(client) && succeeded;
+    }
+    fclose(client->input);
+    free(client);
+    return succeeded;
+}
@@ -0,0 +1,68 @@
+/*
+ *    server.h
+ */
+
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "types.h"
+
+#include <stdbool.h>
+
+/*
+ * Largest expression the server takes in one request.
+ */
+#define SERVER_MAX_REQUEST (16 * 1024 * 1024)
+
+/*
+ * Most bytes a connection may keep buffered, requests waiting for their
+ * end and responses the client hasn't read. Connections over it are
+ * closed.
+ */
+#define SERVER_MAX_BUFFERED (4 * SERVER_MAX_REQUEST)
+
+/*
+ * Evaluates requests sent to a Unix domain socket in the environment,
+ * which stays loaded between them. Requests and responses are frames: the
+ * decimal length of the data on a line, then the data. A request is an
+ * expression, its response starts with "ok" or "error" before the length
+ * and holds the output of the evaluation followed by the printed result,
+ * or the error message. Clients may send further requests before reading
+ * the responses, they are answered in order.
+ *
+ * With isolation every request is evaluated in a new environment extending
+ * the given one, so its definitions don't outlive it. The server runs until
+ * it is interrupted or terminated.
+ *
+ * With workers the process forks them after loading and only supervises:
+ * the workers share the listener and the loaded heap copy-on-write, each
+ * keeps its own definitions. Crashed workers are restarted and SIGUSR1
+ * reports their memory on the standard error.
+ */
+void server_run(const char *path, Env *env, bool isolate, unsigned workers);
+
+/*
+ * Client sending the forms of a program to a server.
+ */
+typedef struct client Client;
+
+/*
+ * Waits a moment for a server which is starting. Failures of the client
+ * are reported on the standard error and return NULL or false.
+ */
+Client *server_connect(const char *path);
+
+bool server_send(Client *client, const char *text);
+
+/*
+ * Prints the next response and returns whether the request succeeded.
+ */
+bool server_receive(Client *client);
+
+/*
+ * Prints the remaining responses, returns false if any request failed.
+ */
+bool server_disconnect(Client *client);
+
+#endif // SERVER_H
@@ -0,0 +1,223 @@
+/*
+ *    streams.c
+ */
+
+
+#include "streams.h"
+#include "numbers.h"
+#include "core.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+
+static Pair *get_stream(Object *obj)
+{
+    if (obj != NULL && object_get_type(obj) != OBJECT_TYPE_PAIR) {
+        throw("Wrong type of argument %s: expected stream", object_to_string(obj));
+    }
+    return (Pair*)obj;
+}
+
+static Object *call(Object *proc, Object *arg)
+{
+    gc_push(proc);
+    gc_push(arg);
+    return core_call(1);
+}
+
+static Object *create_stream(Object *first, PromiseStep step, Object *a, Object *b)
+{
+    Pair *pair;
+
+    gc_push(first);
+    gc_push(core_create_promise(NULL, step, a, b));
+    pair = (Pair*)object_create(OBJECT_TYPE_PAIR);
+    pair->rest = gc_pop();
+    pair->first = gc_pop();
+    return (Object*)pair;
+}
+
+/*
+ * Moves the position kept in the promise to the rest of the stream.
+ */
+static Object *advance(Promise *promise)
+{
+    promise->second = core_force(((Pair*)promise->second)->rest);
+    return promise->second;
+}
+
+Object *streams_force(Object *obj)
+{
+    return core_force(((List*)obj)->item);
+}
+
+Object *streams_make_promise(Object *obj)
+{
+    Object *value = ((List*)obj)->item;
+    Promise *promise;
+
+    if (value != NULL && object_get_type(value) == OBJECT_TYPE_PROMISE) {
+        return value;
+    }
+    promise = (Promise*)object_create(OBJECT_TYPE_PROMISE);
+    promise->forced = true;
+    promise->value = value;
+    return (Object*)promise;
+}
+
+Object *streams_is_promise(Object *obj)
+{
+    Object *arg = ((List*)obj)->item;
+    return object_boolean(arg != NULL && object_get_type(arg) == OBJECT_TYPE_PROMISE);
+}
+
+Object *streams_stream_car(Object *obj)
+{
+    Pair *pair = get_stream(((List*)obj)->item);
+
+    if (pair == NULL) {
+        throw("Empty stream has no first element");
+    }
+    return pair->first;
+}
+
+Object *streams_stream_cdr(Object *obj)
+{
+    Pair *pair = get_stream(((List*)obj)->item);
+
+    if (pair == NULL) {
+        throw("Empty stream has no rest");
+    }
+    return core_force(pair->rest);
+}
+
+static Object *map_step(Promise *promise);
+
+static Object *map(Object *proc, Object *stream)
+{
+    Pair *pair = get_stream(stream);
+    const unsigned depth = gc_depth();
+    Object *res;
+
+    if (pair == NULL) {
+        return NULL;
+    }
+    gc_push(proc);
+    gc_push(stream);
+    res = call(proc, pair->first);
+    res = create_stream(res, &map_step, proc, stream);
+    gc_unwind(depth);
+    return res;
+}
+
+static Object *map_step(Promise *promise)
+{
+    return map(promise->first, advance(promise));
+}
+
+Object *streams_stream_map(Object *obj)
+{
+    List *list = (List*)obj;
+    return map(list->item, list->next->item);
+}
+
+static Object *filter_step(Promise *promise);
+
+/*
+ * Rejected values are skipped by replacing the position, which is rooted
+ * by the caller.
+ */
+static Object *filter(Object *pred, Object **position)
+{
+    Pair *pair;
+
+    while ((pair = get_stream(*position)) != NULL) {
+        if (core_object_to_bool(call(pred, pair->first))) {
+            return create_stream(pair->first, &filter_step, pred, (Object*)pair);
+        }
+        *position = core_force(pair->rest);
+    }
+    return NULL;
+}
+
+static Object *filter_step(Promise *promise)
+{
+    advance(promise);
+    return filter(promise->first, &promise->second);
+}
+
+Object *streams_stream_filter(Object *obj)
+{
+    List *list = (List*)obj;
+
+    core_release_arguments(obj);
+    return filter(list->item, &list->next->item);
+}
+
+static Object *take_step(Promise *promise);
+
+static Object *take(Object *count, Object *stream)
+{
+    int64_t n = numbers_to_fixnum(count);
+    Pair *pair = get_stream(stream);
+
+    if (n <= 0 || pair == NULL) {
+        return NULL;
+    }
+    gc_push(stream);
+    count = numbers_create_integer(n - 1);
+    stream = create_stream(pair->first, &take_step, count, stream);
+    gc_pop();
+    return stream;
+}
+
+/*
+ * The rest isn't forced after the last element is taken.
+ */
+static Object *take_step(Promise *promise)
+{
+    if (numbers_to_fixnum(promise->first) <= 0) {
+        return NULL;
+    }
+    return take(promise->first, advance(promise));
+}
+
+Object *streams_stream_take(Object *obj)
+{
+    List *list = (List*)obj;
+
+    if (numbers_to_fixnum(list->item) < 0) {
+        throw("Invalid stream length %s", object_to_string(list->item));
+    }
+    return take(list->item, list->next->item);
+}
+
+/*
+ * The accumulator and the position replace the arguments, so consumed
+ * elements are garbage as soon as the rest is forced.
+ */
+Object *streams_stream_fold(Object *obj)
+{
+    List *list = (List*)obj;
+    List *acc = list->next;
+    List *position = acc->next;
+    Pair *pair;
+
+    core_release_arguments(obj);
+    while ((pair = get_stream(position->item)) != NULL) {
+        gc_push(list->item);
+        gc_push(acc->item);
+        gc_push(pair->first);
+        acc->item = core_call(2);
+        position->item = core_force(pair->rest);
+    }
+    return acc->item;
+}
@@ -0,0 +1,40 @@
+/*
+ *    streams.h
+ */
+
+
+#ifndef STREAMS_H
+#define STREAMS_H
+
+#include "types.h"
+
+/*
+ * Promises are created by delay and cons-stream special forms or by
+ * make-promise, force returns other objects as they are.
+ */
+Object *streams_force(Object *obj);
+
+Object *streams_make_promise(Object *obj);
+
+Object *streams_is_promise(Object *obj);
+
+/*
+ * Streams are pairs of a value and a promise of the rest, #nil is the
+ * empty stream. stream-map, stream-filter and stream-take are lazy and
+ * keep only the current position of their input. stream-fold drops the
+ * elements it has consumed, so folding a long generated stream runs in
+ * constant memory.
+ */
+Object *streams_stream_car(Object *obj);
+
+Object *streams_stream_cdr(Object *obj);
+
+Object *streams_stream_map(Object *obj);
+
+Object *streams_stream_filter(Object *obj);
+
+Object *streams_stream_take(Object *obj);
+
+Object *streams_stream_fold(Object *obj);
+
+#endif // STREAMS_H
@@ -0,0 +1,160 @@
+/*
+ *    text.c
+ */
+
+
+#include "text.h"
+#include "numbers.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+
+static String *get_string(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_STRING) {
+        throw("Wrong type of argument %s: expected string",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return (String*)obj;
+}
+
+static StringBuilder *get_string_builder(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_STRING_BUILDER) {
+        throw("Wrong type of argument %s: expected string builder",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return (StringBuilder*)obj;
+}
+
+/*
+ * The string object is created first, so a failed allocation of the
+ * contents leaves nothing to clean up.
+ */
+static String *create_string(size_t length)
+{
+    String *res = (String*)object_create(OBJECT_TYPE_STRING);
+    char *cstr = malloc(length + 1);
+
+    if (cstr == NULL) {
+        throw("Not enough memory for string of length %zu", length);
+    }
+    cstr[length] = 0;
+    res->cstr = cstr;
+    res->length = length;
+    res->capacity = length;
+    return res;
+}
+
+Object *text_create_string(const char *str, size_t length)
+{
+    String *res = create_string(length);
+    if (length > 0) {
+        memcpy(res->cstr, str, length);
+    }
+    return (Object*)res;
+}
+
+Object *text_string_length(Object *obj)
+{
+    return numbers_create_integer(get_string(((List*)obj)->item)->length);
+}
+
+Object *text_string_append(Object *obj)
+{
+    List *list;
+    String *res;
+    size_t length = 0;
+    char *ptr;
+
+    for (list = (List*)obj; list != NULL; list = list->next) {
+        length += get_string(list->item)->length;
+    }
+    res = create_string(length);
+    ptr = res->cstr;
+    for (list = (List*)obj; list != NULL; list = list->next) {
+        String *str = (String*)list->item;
+        memcpy(ptr, str->cstr, str->length);
+        ptr += str->length;
+    }
+    return (Object*)res;
+}
+
+static void reserve(StringBuilder *builder, size_t length)
+{
+    size_t capacity = builder->capacity > 0 ? builder->capacity : TEXT_MIN_CAPACITY;
+    char *data;
+
+    if (length <= builder->capacity) {
+        return;
+    }
+    while (capacity < length) {
+        capacity *= 2;
+    }
+    data = realloc(builder->data, capacity);
+    if (data == NULL) {
+        throw("Not enough memory for string builder of length %zu", length);
+    }
+    builder->data = data;
+    builder->capacity = capacity;
+}
+
+void text_builder_write(StringBuilder *builder, const char *data, size_t length)
+{
+    reserve(builder, builder->length + length);
+    memcpy(builder->data + builder->length, data, length);
+    builder->length += length;
+}
+
+Object *text_make_string_builder(Object *obj)
+{
+    List *list = (List*)obj;
+    StringBuilder *builder = (StringBuilder*)object_create(OBJECT_TYPE_STRING_BUILDER);
+
+    if (list != NULL) {
+        int64_t capacity = numbers_to_fixnum(list->item);
+
+        if (capacity < 0) {
+            throw("Invalid string builder capacity %s", object_to_string(list->item));
+        }
+        reserve(builder, (size_t)capacity);
+    }
+    return (Object*)builder;
+}
+
+Object *text_string_builder_append(Object *obj)
+{
+    List *list = (List*)obj;
+    StringBuilder *builder = get_string_builder(list->item);
+    size_t length = builder->length;
+
+    for (list = list->next; list != NULL; list = list->next) {
+        length += get_string(list->item)->length;
+    }
+    reserve(builder, length);
+    for (list = ((List*)obj)->next; list != NULL; list = list->next) {
+        String *str = (String*)list->item;
+        memcpy(builder->data + builder->length, str->cstr, str->length);
+        builder->length += str->length;
+    }
+    return (Object*)builder;
+}
+
+Object *text_string_builder_length(Object *obj)
+{
+    return numbers_create_integer(get_string_builder(((List*)obj)->item)->length);
+}
+
+Object *text_string_builder_to_string(Object *obj)
+{
+    StringBuilder *builder = get_string_builder(((List*)obj)->item);
+    return text_create_string(builder->data, builder->length);
+}
@@ -0,0 +1,36 @@
+/*
+ *    text.h
+ */
+
+
+#ifndef TEXT_H
+#define TEXT_H
+
+#include "types.h"
+
+#define TEXT_MIN_CAPACITY 16
+
+/*
+ * Creates a string holding a copy of length bytes.
+ */
+Object *text_create_string(const char *str, size_t length);
+
+void text_builder_write(StringBuilder *builder, const char *data, size_t length);
+
+/*
+ * string-append sizes the result once. String builders grow geometrically,
+ * so a sequence of appends costs linear time in the length of the result.
+ */
+Object *text_string_length(Object *obj);
+
+Object *text_string_append(Object *obj);
+
+Object *text_make_string_builder(Object *obj);
+
+Object *text_string_builder_append(Object *obj);
+
+Object *text_string_builder_length(Object *obj);
+
+Object *text_string_builder_to_string(Object *obj);
+
+#endif // TEXT_H
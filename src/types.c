@@ -6,17 +6,39 @@
 
 
 #include "types.h"
+#include "context.h"
+#include "analyze.h"
+#include "jit.h"
+#include "futures.h"
+#include "actors.h"
 #include "gc.h"
 #include "error.h"
 #include "debug.h"
 
 #include <ctype.h>
+#include <inttypes.h>
+#include <math.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 
-static char string[STRING_MAX_LENGTH];
+#define WRITE_STACK_SIZE 64
+
+
+/*
+ * Elements of lists, vectors and records, #nil is written explicitly.
+ */
+static void write_element(Object *obj, Writer *writer)
+{
+    if (obj != NULL) {
+        obj->dump(obj, writer);
+    }
+    else {
+        writer_puts(writer, "#nil");
+    }
+}
 
 static void mark(Object *obj)
 {
@@ -30,13 +52,13 @@ static void finalize(Object *obj)
 
 static const char *integer_to_string(Object *obj)
 {
-    sprintf(string, "%d", ((Integer*)obj)->value);
-    return string;
+    sprintf(_context->string, "%" PRId64, ((Integer*)obj)->value);
+    return _context->string;
 }
 
-static void integer_dump(Object *obj)
+static void integer_dump(Object *obj, Writer *writer)
 {
-    printf("%d", ((Integer*)obj)->value);
+    writer_integer(writer, ((Integer*)obj)->value);
 }
 
 static Integer *integer_initialize()
@@ -50,17 +72,706 @@ static Integer *integer_initialize()
     return obj;
 }
 
+static const char *bignum_to_string(Object *obj)
+{
+    char *str = bignum_to_cstr(&((Bignum*)obj)->value);
+    snprintf(_context->string, STRING_MAX_LENGTH, "%s", str);
+    free(str);
+    return _context->string;
+}
+
+static void bignum_dump(Object *obj, Writer *writer)
+{
+    char *str = bignum_to_cstr(&((Bignum*)obj)->value);
+    writer_puts(writer, str);
+    free(str);
+}
+
+static void bignum_finalize(Object *obj)
+{
+    bignum_free(&((Bignum*)obj)->value);
+}
+
+static Bignum *bignum_initialize()
+{
+    Bignum *obj = malloc(sizeof(Bignum));
+    obj->object.to_string = &bignum_to_string;
+    obj->object.dump = &bignum_dump;
+    obj->object.mark = &mark;
+    obj->object.finalize = &bignum_finalize;
+    obj->value.negative = false;
+    obj->value.size = 0;
+    obj->value.digits = NULL;
+    return obj;
+}
+
+/*
+ * Shortest representation which reads back as the same double.
+ */
+static const char *format_double(char *buf, double value)
+{
+    int precision;
+
+    if (isnan(value)) {
+        return strcpy(buf, "+nan.0");
+    }
+    if (isinf(value)) {
+        return strcpy(buf, value > 0 ? "+inf.0" : "-inf.0");
+    }
+    for (precision = 15; precision < 17; precision++) {
+        sprintf(buf, "%.*g", precision, value);
+        if (strtod(buf, NULL) == value) {
+            break;
+        }
+    }
+    sprintf(buf, "%.*g", precision, value);
+    if (strpbrk(buf, ".en") == NULL) {
+        strcat(buf, ".0");
+    }
+    return buf;
+}
+
+static const char *flonum_to_string(Object *obj)
+{
+    return format_double(_context->string, ((Flonum*)obj)->value);
+}
+
+static void flonum_dump(Object *obj, Writer *writer)
+{
+    char buf[32];
+    writer_puts(writer, format_double(buf, ((Flonum*)obj)->value));
+}
+
+static Flonum *flonum_initialize()
+{
+    Flonum *obj = malloc(sizeof(Flonum));
+    obj->object.to_string = &flonum_to_string;
+    obj->object.dump = &flonum_dump;
+    obj->object.mark = &mark;
+    obj->object.finalize = &finalize;
+    obj->value = 0;
+    return obj;
+}
+
+/*
+ * Elements which don't fit into the string are elided.
+ */
+static const char *numeric_vector_to_string(const char *prefix, size_t length, const double *f64,
+                                            const int64_t *i64)
+{
+    char element[32];
+    size_t size = sprintf(_context->string, "%s(", prefix);
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        if (f64 != NULL) {
+            format_double(element, f64[i]);
+        }
+        else {
+            sprintf(element, "%" PRId64, i64[i]);
+        }
+        if (size + strlen(element) + 6 >= STRING_MAX_LENGTH) {
+            strcpy(_context->string + size, i > 0 ? " ...)" : "...)");
+            return _context->string;
+        }
+        size += sprintf(_context->string + size, i > 0 ? " %s" : "%s", element);
+    }
+    strcpy(_context->string + size, ")");
+    return _context->string;
+}
+
+static const char *f64vector_to_string(Object *obj)
+{
+    F64Vector *vector = (F64Vector*)obj;
+    return numeric_vector_to_string("#f64", vector->length, vector->data, NULL);
+}
+
+static void f64vector_dump(Object *obj, Writer *writer)
+{
+    F64Vector *vector = (F64Vector*)obj;
+    char element[32];
+    size_t i;
+
+    writer_puts(writer, "#f64(");
+    for (i = 0; i < vector->length; i++) {
+        if (i > 0) {
+            writer_putc(writer, ' ');
+        }
+        writer_puts(writer, format_double(element, vector->data[i]));
+    }
+    writer_putc(writer, ')');
+}
+
+static void f64vector_finalize(Object *obj)
+{
+    free(((F64Vector*)obj)->data);
+}
+
+static F64Vector *f64vector_initialize()
+{
+    F64Vector *obj = malloc(sizeof(F64Vector));
+    obj->object.to_string = &f64vector_to_string;
+    obj->object.dump = &f64vector_dump;
+    obj->object.mark = &mark;
+    obj->object.finalize = &f64vector_finalize;
+    obj->length = 0;
+    obj->data = NULL;
+    return obj;
+}
+
+static const char *i64vector_to_string(Object *obj)
+{
+    I64Vector *vector = (I64Vector*)obj;
+    return numeric_vector_to_string("#i64", vector->length, NULL, vector->data);
+}
+
+static void i64vector_dump(Object *obj, Writer *writer)
+{
+    I64Vector *vector = (I64Vector*)obj;
+    size_t i;
+
+    writer_puts(writer, "#i64(");
+    for (i = 0; i < vector->length; i++) {
+        if (i > 0) {
+            writer_putc(writer, ' ');
+        }
+        writer_integer(writer, vector->data[i]);
+    }
+    writer_putc(writer, ')');
+}
+
+static void i64vector_finalize(Object *obj)
+{
+    free(((I64Vector*)obj)->data);
+}
+
+static I64Vector *i64vector_initialize()
+{
+    I64Vector *obj = malloc(sizeof(I64Vector));
+    obj->object.to_string = &i64vector_to_string;
+    obj->object.dump = &i64vector_dump;
+    obj->object.mark = &mark;
+    obj->object.finalize = &i64vector_finalize;
+    obj->length = 0;
+    obj->data = NULL;
+    return obj;
+}
+
+static const char *vector_to_string(Object *obj)
+{
+    Vector *vector = (Vector*)obj;
+    char buf[STRING_MAX_LENGTH];
+    size_t size = sprintf(buf, "#(");
+    size_t i;
+
+    // Elements share the string, so the result is collected separately
+    for (i = 0; i < vector->length; i++) {
+        Object *item = vector->items[i];
+        const char *str = item != NULL ? object_to_string(item) : "#nil";
+
+        if (size + strlen(str) + 6 >= STRING_MAX_LENGTH) {
+            strcpy(buf + size, i > 0 ? " ...)" : "...)");
+            return strcpy(_context->string, buf);
+        }
+        size += sprintf(buf + size, i > 0 ? " %s" : "%s", str);
+    }
+    strcpy(buf + size, ")");
+    return strcpy(_context->string, buf);
+}
+
+static void vector_dump(Object *obj, Writer *writer)
+{
+    Vector *vector = (Vector*)obj;
+    size_t i;
+
+    writer_puts(writer, "#(");
+    for (i = 0; i < vector->length; i++) {
+        if (i > 0) {
+            writer_putc(writer, ' ');
+        }
+        write_element(vector->items[i], writer);
+    }
+    writer_putc(writer, ')');
+}
+
+static void vector_mark(Object *obj)
+{
+    Vector *vector = (Vector*)obj;
+    size_t i;
+
+    for (i = 0; i < vector->length; i++) {
+        object_mark(vector->items[i]);
+    }
+}
+
+static void vector_finalize(Object *obj)
+{
+    free(((Vector*)obj)->items);
+}
+
+static Vector *vector_initialize()
+{
+    Vector *obj = malloc(sizeof(Vector));
+    obj->object.to_string = &vector_to_string;
+    obj->object.dump = &vector_dump;
+    obj->object.mark = &vector_mark;
+    obj->object.finalize = &vector_finalize;
+    obj->length = 0;
+    obj->items = NULL;
+    return obj;
+}
+
+static const char *hash_table_to_string(Object *obj)
+{
+    sprintf(_context->string, "<hash-table %zu>", ((HashTable*)obj)->count);
+    return _context->string;
+}
+
+static void hash_table_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, hash_table_to_string(obj));
+}
+
+static void hash_table_mark(Object *obj)
+{
+    HashTable *table = (HashTable*)obj;
+    size_t i;
+
+    for (i = 0; i < table->capacity; i++) {
+        if (table->entries[i].hash != 0) {
+            object_mark(table->entries[i].key);
+            object_mark(table->entries[i].value);
+        }
+    }
+}
+
+static void hash_table_finalize(Object *obj)
+{
+    free(((HashTable*)obj)->entries);
+}
+
+static HashTable *hash_table_initialize()
+{
+    HashTable *obj = malloc(sizeof(HashTable));
+    obj->object.to_string = &hash_table_to_string;
+    obj->object.dump = &hash_table_dump;
+    obj->object.mark = &hash_table_mark;
+    obj->object.finalize = &hash_table_finalize;
+    obj->count = 0;
+    obj->capacity = 0;
+    obj->entries = NULL;
+    return obj;
+}
+
+static const char *map_to_string(Object *obj)
+{
+    sprintf(_context->string, "<map %zu>", ((Map*)obj)->count);
+    return _context->string;
+}
+
+static void map_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, map_to_string(obj));
+}
+
+static void map_mark(Object *obj)
+{
+    object_mark((Object*)((Map*)obj)->root);
+}
+
+static Map *map_initialize()
+{
+    Map *obj = malloc(sizeof(Map));
+    obj->object.to_string = &map_to_string;
+    obj->object.dump = &map_dump;
+    obj->object.mark = &map_mark;
+    obj->object.finalize = &finalize;
+    obj->count = 0;
+    obj->root = NULL;
+    return obj;
+}
+
+static const char *map_node_to_string(Object *obj)
+{
+    sprintf(_context->string, "<map node>");
+    return _context->string;
+}
+
+static void map_node_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, "<map node>");
+}
+
+static void map_node_mark(Object *obj)
+{
+    MapNode *node = (MapNode*)obj;
+    unsigned i;
+
+    for (i = 0; i < node->size; i++) {
+        object_mark(node->slots[i]);
+    }
+}
+
+static void map_node_finalize(Object *obj)
+{
+    free(((MapNode*)obj)->slots);
+}
+
+static MapNode *map_node_initialize()
+{
+    MapNode *obj = malloc(sizeof(MapNode));
+    obj->object.to_string = &map_node_to_string;
+    obj->object.dump = &map_node_dump;
+    obj->object.mark = &map_node_mark;
+    obj->object.finalize = &map_node_finalize;
+    obj->datamap = 0;
+    obj->nodemap = 0;
+    obj->size = 0;
+    obj->slots = NULL;
+    return obj;
+}
+
+static const char *record_type_to_string(Object *obj)
+{
+    snprintf(_context->string, STRING_MAX_LENGTH, "<record-type %s>", ((RecordType*)obj)->cstr);
+    return _context->string;
+}
+
+static void record_type_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, "<record-type ");
+    writer_puts(writer, ((RecordType*)obj)->cstr);
+    writer_putc(writer, '>');
+}
+
+static void record_type_finalize(Object *obj)
+{
+    RecordType *type = (RecordType*)obj;
+    unsigned i;
+
+    for (i = 0; i < type->size; i++) {
+        free(type->fields[i]);
+    }
+    free(type->fields);
+    free(type->cstr);
+}
+
+static RecordType *record_type_initialize()
+{
+    RecordType *obj = malloc(sizeof(RecordType));
+    obj->object.to_string = &record_type_to_string;
+    obj->object.dump = &record_type_dump;
+    obj->object.mark = &mark;
+    obj->object.finalize = &record_type_finalize;
+    obj->id = 0;
+    obj->cstr = NULL;
+    obj->size = 0;
+    obj->fields = NULL;
+    return obj;
+}
+
+static const char *record_to_string(Object *obj)
+{
+    snprintf(_context->string, STRING_MAX_LENGTH, "<%s>", ((Record*)obj)->type->cstr);
+    return _context->string;
+}
+
+static void record_dump(Object *obj, Writer *writer)
+{
+    Record *record = (Record*)obj;
+    unsigned i;
+
+    writer_putc(writer, '<');
+    writer_puts(writer, record->type->cstr);
+    for (i = 0; i < record->type->size; i++) {
+        writer_putc(writer, ' ');
+        write_element(record->slots[i], writer);
+    }
+    writer_putc(writer, '>');
+}
+
+static void record_mark(Object *obj)
+{
+    Record *record = (Record*)obj;
+    unsigned i;
+
+    object_mark((Object*)record->type);
+    for (i = 0; i < record->type->size; i++) {
+        object_mark(record->slots[i]);
+    }
+}
+
+static const char *record_procedure_to_string(Object *obj)
+{
+    snprintf(_context->string, STRING_MAX_LENGTH, "<record procedure %s>", ((RecordProc*)obj)->cstr);
+    return _context->string;
+}
+
+static void record_procedure_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, "<record procedure ");
+    writer_puts(writer, ((RecordProc*)obj)->cstr);
+    writer_putc(writer, '>');
+}
+
+static void record_procedure_mark(Object *obj)
+{
+    object_mark((Object*)((RecordProc*)obj)->type);
+}
+
+static void record_procedure_finalize(Object *obj)
+{
+    free(((RecordProc*)obj)->fields);
+    free(((RecordProc*)obj)->cstr);
+}
+
+static const char *string_builder_to_string(Object *obj)
+{
+    snprintf(_context->string, STRING_MAX_LENGTH, "<string-builder %zu>", ((StringBuilder*)obj)->length);
+    return _context->string;
+}
+
+static void string_builder_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, string_builder_to_string(obj));
+}
+
+static void string_builder_finalize(Object *obj)
+{
+    free(((StringBuilder*)obj)->data);
+}
+
+static StringBuilder *string_builder_initialize()
+{
+    StringBuilder *obj = malloc(sizeof(StringBuilder));
+    obj->object.to_string = &string_builder_to_string;
+    obj->object.dump = &string_builder_dump;
+    obj->object.mark = &mark;
+    obj->object.finalize = &string_builder_finalize;
+    obj->length = 0;
+    obj->capacity = 0;
+    obj->data = NULL;
+    return obj;
+}
+
+static const char *port_to_string(Object *obj)
+{
+    Port *port = (Port*)obj;
+    snprintf(_context->string, STRING_MAX_LENGTH, "<%s-port %d>",
+             port->writer != NULL ? "output" : "input", port->fd);
+    return _context->string;
+}
+
+static void port_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, port_to_string(obj));
+}
+
+/*
+ * Ports which weren't closed are flushed and closed by the collector.
+ */
+static void port_finalize(Object *obj)
+{
+    Port *port = (Port*)obj;
+
+    if (port->writer != NULL) {
+        writer_flush(port->writer);
+        free(port->writer);
+    }
+    if (port->fd >= 0) {
+        close(port->fd);
+    }
+    free(port->buffer);
+}
+
+static Port *port_initialize()
+{
+    Port *obj = malloc(sizeof(Port));
+    obj->object.to_string = &port_to_string;
+    obj->object.dump = &port_dump;
+    obj->object.mark = &mark;
+    obj->object.finalize = &port_finalize;
+    obj->fd = -1;
+    obj->start = 0;
+    obj->end = 0;
+    obj->capacity = 0;
+    obj->buffer = NULL;
+    obj->writer = NULL;
+    return obj;
+}
+
+static const char *promise_to_string(Object *obj)
+{
+    sprintf(_context->string, ((Promise*)obj)->forced ? "<promise forced>" : "<promise>");
+    return _context->string;
+}
+
+static void promise_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, promise_to_string(obj));
+}
+
+static void promise_mark(Object *obj)
+{
+    Promise *promise = (Promise*)obj;
+    object_mark(promise->value);
+    object_mark(promise->thunk);
+    object_mark(promise->first);
+    object_mark(promise->second);
+}
+
+static Promise *promise_initialize()
+{
+    Promise *obj = malloc(sizeof(Promise));
+    obj->object.to_string = &promise_to_string;
+    obj->object.dump = &promise_dump;
+    obj->object.mark = &promise_mark;
+    obj->object.finalize = &finalize;
+    obj->forced = false;
+    obj->value = NULL;
+    obj->thunk = NULL;
+    obj->step = NULL;
+    obj->first = NULL;
+    obj->second = NULL;
+    return obj;
+}
+
+static const char *transducer_to_string(Object *obj)
+{
+    sprintf(_context->string, "<transducer %u>", ((Transducer*)obj)->size);
+    return _context->string;
+}
+
+static void transducer_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, transducer_to_string(obj));
+}
+
+static void transducer_mark(Object *obj)
+{
+    Transducer *transducer = (Transducer*)obj;
+    unsigned i;
+
+    for (i = 0; i < transducer->size; i++) {
+        object_mark(transducer->stages[i].proc);
+    }
+}
+
+static void transducer_finalize(Object *obj)
+{
+    free(((Transducer*)obj)->stages);
+}
+
+static Transducer *transducer_initialize()
+{
+    Transducer *obj = malloc(sizeof(Transducer));
+    obj->object.to_string = &transducer_to_string;
+    obj->object.dump = &transducer_dump;
+    obj->object.mark = &transducer_mark;
+    obj->object.finalize = &transducer_finalize;
+    obj->size = 0;
+    obj->stages = NULL;
+    return obj;
+}
+
+static const char *future_to_string(Object *obj)
+{
+    sprintf(_context->string, ((Future*)obj)->touched ? "<future touched>" : "<future>");
+    return _context->string;
+}
+
+static void future_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, future_to_string(obj));
+}
+
+static void future_mark(Object *obj)
+{
+    object_mark(((Future*)obj)->value);
+}
+
+static void future_finalize(Object *obj)
+{
+    futures_release(((Future*)obj)->task);
+}
+
+static Future *future_initialize()
+{
+    Future *obj = malloc(sizeof(Future));
+    obj->object.to_string = &future_to_string;
+    obj->object.dump = &future_dump;
+    obj->object.mark = &future_mark;
+    obj->object.finalize = &future_finalize;
+    obj->task = NULL;
+    obj->touched = false;
+    obj->value = NULL;
+    return obj;
+}
+
+static const char *actor_to_string(Object *obj)
+{
+    sprintf(_context->string, "<actor>");
+    return _context->string;
+}
+
+static void actor_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, actor_to_string(obj));
+}
+
+static void actor_finalize(Object *obj)
+{
+    actors_release(((Actor*)obj)->mailbox);
+}
+
+static Actor *actor_initialize()
+{
+    Actor *obj = malloc(sizeof(Actor));
+    obj->object.to_string = &actor_to_string;
+    obj->object.dump = &actor_dump;
+    obj->object.mark = &mark;
+    obj->object.finalize = &actor_finalize;
+    obj->mailbox = NULL;
+    return obj;
+}
+
+static RecordProc *record_procedure_initialize()
+{
+    RecordProc *obj = malloc(sizeof(RecordProc));
+    obj->object.to_string = &record_procedure_to_string;
+    obj->object.dump = &record_procedure_dump;
+    obj->object.mark = &record_procedure_mark;
+    obj->object.finalize = &record_procedure_finalize;
+    obj->cstr = NULL;
+    obj->operation = RECORD_CONSTRUCTOR;
+    obj->type = NULL;
+    obj->argc = 0;
+    obj->fields = NULL;
+    return obj;
+}
+
 static const char *boolean_to_string(Object *obj)
 {
-    sprintf(string, "%s", ((Boolean*)obj)->value ? "#true" : "#false");
-    return string;
+    sprintf(_context->string, "%s", ((Boolean*)obj)->value ? "#true" : "#false");
+    return _context->string;
 }
 
-static void boolean_dump(Object *obj)
+static void boolean_dump(Object *obj, Writer *writer)
 {
-    printf("%s", ((Boolean*)obj)->value ? "#true" : "#false");
+    writer_puts(writer, ((Boolean*)obj)->value ? "#true" : "#false");
 }
 
+/*
+ * Booleans are immutable, so results of predicates share two objects of
+ * all contexts. They are created marked and never written by the GC.
+ */
+static Boolean _true = {
+    { OBJECT_TYPE_BOOLEAN, true, true, false, &boolean_to_string, &boolean_dump, &mark, &finalize }, true
+};
+static Boolean _false = {
+    { OBJECT_TYPE_BOOLEAN, true, true, false, &boolean_to_string, &boolean_dump, &mark, &finalize }, false
+};
+
 static Integer *boolean_initialize()
 {
     Integer *obj = malloc(sizeof(Integer));
@@ -76,32 +787,35 @@ static const char *string_to_string(Object *obj)
 {
     const char *str = ((String*)obj)->cstr;
     if (str) {
-        if (strstr(str, " ") != NULL) {
-            sprintf(string, "\"%s\"", str);
+        if (strchr(str, ' ') != NULL) {
+            snprintf(_context->string, STRING_MAX_LENGTH, "\"%s\"", str);
         }
         else {
-            sprintf(string, "\'%s", str);
+            snprintf(_context->string, STRING_MAX_LENGTH, "\'%s", str);
         }
     }
     else {
-        sprintf(string, "\"INVALID STRING\"");
+        sprintf(_context->string, "\"INVALID STRING\"");
     }
-    return string;
+    return _context->string;
 }
 
-static void string_dump(Object *obj)
+static void string_dump(Object *obj, Writer *writer)
 {
-    const char *str = ((String*)obj)->cstr;
-    if (str) {
-        if (strstr(str, " ") != NULL) {
-            printf("\"%s\"", str);
+    String *str = (String*)obj;
+    if (str->cstr) {
+        if (memchr(str->cstr, ' ', str->length) != NULL) {
+            writer_putc(writer, '"');
+            writer_write(writer, str->cstr, str->length);
+            writer_putc(writer, '"');
         }
         else {
-            printf("\'%s", str);
+            writer_putc(writer, '\'');
+            writer_write(writer, str->cstr, str->length);
         }
     }
     else {
-        printf("INVALID STRING");
+        writer_puts(writer, "INVALID STRING");
     }
 }
 
@@ -117,6 +831,8 @@ static String *string_initialize()
     obj->object.dump = &string_dump;
     obj->object.mark = &mark;
     obj->object.finalize = &string_finalize;
+    obj->length = 0;
+    obj->capacity = 0;
     obj->cstr = NULL;
     return obj;
 }
@@ -125,23 +841,18 @@ static const char *unbound_to_string(Object *obj)
 {
     const char *str = ((Unbound*)obj)->cstr;
     if (str != NULL) {
-        sprintf(string, "%s", str);
+        sprintf(_context->string, "%s", str);
     }
     else {
-        sprintf(string, "*unknown*");
+        sprintf(_context->string, "*unknown*");
     }
-    return string;
+    return _context->string;
 }
 
-static void unbound_dump(Object *obj)
+static void unbound_dump(Object *obj, Writer *writer)
 {
     const char *str = ((Unbound*)obj)->cstr;
-    if (str != NULL) {
-        printf("%s", str);
-    }
-    else {
-        printf("*unknown*");
-    }
+    writer_puts(writer, str != NULL ? str : "*unknown*");
 }
 
 static void unbound_finalize(Object *obj)
@@ -164,23 +875,26 @@ static const char *env_to_string(Object *obj)
 {
     Frame *frame = ((Env*)obj)->frame;
     if (frame != NULL) {
-        sprintf(string, "[Frame:@]");
+        sprintf(_context->string, "[Frame:@]");
     }
     else {
-        sprintf(string, "[Frame:NULL]");
+        sprintf(_context->string, "[Frame:NULL]");
     }
-    return string;
+    return _context->string;
 }
 
-static void env_dump(Object *obj)
+static void env_dump(Object *obj, Writer *writer)
 {
     Frame *frame = ((Env*)obj)->frame;
-    printf("[Frame:");
+    writer_puts(writer, "[Frame:");
     while (frame != NULL) {
-        printf("%s=%s,", frame->cstr, object_to_string(frame->object));
+        writer_puts(writer, frame->cstr);
+        writer_putc(writer, '=');
+        writer_puts(writer, object_to_string(frame->object));
+        writer_putc(writer, ',');
         frame = frame->next;
     }
-    printf("]");
+    writer_putc(writer, ']');
 }
 
 static void env_mark(Object *obj)
@@ -191,11 +905,13 @@ static void env_mark(Object *obj)
         object_mark((Object*)frame->object);
         frame = frame->next;
     }
+    object_mark((Object*)env->next);
 }
 
 static void env_finalize(Object *obj)
 {
-    Frame *frame = ((Env*)obj)->frame;
+    Env *env = (Env*)obj;
+    Frame *frame = env->frame;
     Frame *tmp;
     while (frame != NULL) {
         tmp = frame->next;
@@ -203,6 +919,11 @@ static void env_finalize(Object *obj)
         free(frame);
         frame = tmp;
     }
+    // Frames on the stack are finalized for reuse
+    free(env->index);
+    env->index = NULL;
+    env->capacity = 0;
+    env->count = 0;
 }
 
 Env *env_initialize()
@@ -214,49 +935,111 @@ Env *env_initialize()
     obj->object.finalize = &env_finalize;
     obj->frame = NULL;
     obj->next = NULL;
+    obj->index = NULL;
+    obj->capacity = 0;
+    obj->count = 0;
     return obj;
 }
 
 static const char *pair_to_string(Object *obj)
 {
-    sprintf(string, "*list*");
-    return string;
+    sprintf(_context->string, "*list*");
+    return _context->string;
 }
 
-static void pair_dump(Object *obj)
+/*
+ * Lists are written with an explicit stack of unfinished tails, so long
+ * and deeply nested lists don't recurse.
+ */
+static void write_list(Pair *pair, Writer *writer)
 {
-    Object *first = ((Pair*)obj)->first;
-    Object *rest = ((Pair*)obj)->rest;
+    Object *buffer[WRITE_STACK_SIZE];
+    Object **stack = buffer;
+    size_t capacity = WRITE_STACK_SIZE;
+    size_t depth = 0;
+    Object *obj = (Object*)pair;
+    bool first = true;
 
-    assert(first != obj);
-    assert(rest != obj);
+    writer_putc(writer, '(');
+    for (;;) {
+        if (obj != NULL && obj->type == OBJECT_TYPE_PAIR) {
+            Object *item = ((Pair*)obj)->first;
 
-    if (first != NULL) {
-        if (first->type == OBJECT_TYPE_PAIR) {
-            printf("(");
+            if (!first) {
+                writer_putc(writer, ' ');
+            }
+            first = false;
+            obj = ((Pair*)obj)->rest;
+            if (item == NULL || item->type != OBJECT_TYPE_PAIR) {
+                write_element(item, writer);
+                continue;
+            }
+            if (depth == capacity) {
+                Object **larger = malloc(2 * capacity * sizeof(Object*));
+                memcpy(larger, stack, capacity * sizeof(Object*));
+                if (stack != buffer) {
+                    free(stack);
+                }
+                stack = larger;
+                capacity *= 2;
+            }
+            stack[depth++] = obj;
+            obj = item;
+            first = true;
+            writer_putc(writer, '(');
+            continue;
         }
-        first->dump(first);
-    }
-    if (rest != NULL) {
-        if (first != NULL && first->type != OBJECT_TYPE_PAIR) {
-            printf(" ");
+        if (obj != NULL) {
+            writer_puts(writer, " . ");
+            obj->dump(obj, writer);
         }
-        if (rest->type != OBJECT_TYPE_PAIR) {
-            printf(". ");
+        writer_putc(writer, ')');
+        if (depth == 0) {
+            break;
         }
-        rest->dump(rest);
+        obj = stack[--depth];
+    }
+    if (stack != buffer) {
+        free(stack);
     }
+}
 
-    if (rest == NULL || (rest != NULL && rest->type != OBJECT_TYPE_PAIR)) {
-        printf(")");
+static void pair_dump(Object *obj, Writer *writer)
+{
+    write_list((Pair*)obj, writer);
+}
+
+/*
+ * Returns false if the object is marked already.
+ */
+static bool set_marked(Object *obj)
+{
+    if (obj->marked) {
+        return false;
     }
+    if (obj->shared) {
+        return gc_mark_shared(obj);
+    }
+    obj->marked = true;
+    return true;
 }
 
+/*
+ * Tails are marked in a loop, so long lists don't recurse.
+ */
 static void pair_mark(Object *obj)
 {
     Pair *pair = (Pair*)obj;
-    object_mark(pair->first);
-    object_mark(pair->rest);
+
+    for (;;) {
+        object_mark(pair->first);
+        obj = pair->rest;
+        if (obj == NULL || obj->type != OBJECT_TYPE_PAIR || !set_marked(obj)) {
+            break;
+        }
+        pair = (Pair*)obj;
+    }
+    object_mark(obj);
 }
 
 static Pair *pair_initialize()
@@ -273,33 +1056,76 @@ static Pair *pair_initialize()
 
 static const char *procedure_to_string(Object *obj)
 {
-    sprintf(string, "<procedure *unknown*>");
-    return string;
+    sprintf(_context->string, "<procedure *unknown*>");
+    return _context->string;
 }
 
-static void procedure_dump(Object *obj)
+static void procedure_dump(Object *obj, Writer *writer)
 {
-    printf("<procedure *unknown*>");
+    writer_puts(writer, "<procedure *unknown*>");
 }
 
 static void procedure_mark(Object *obj)
 {
     Proc *proc = (Proc*)obj;
-    object_mark((Object*)proc->args);
-    object_mark((Object*)proc->body);
+    object_mark((Object*)proc->code);
     object_mark((Object*)proc->env);
 }
 
+static void procedure_finalize(Object *obj)
+{
+    jit_delete(((Proc*)obj)->jit);
+}
+
 Proc *procedure_initialize()
 {
     Proc *obj = (Proc*)malloc(sizeof(Proc));
     obj->object.to_string = &procedure_to_string;
     obj->object.dump = &procedure_dump;
     obj->object.mark = &procedure_mark;
-    obj->object.finalize = &finalize;
+    obj->object.finalize = &procedure_finalize;
+    obj->code = NULL;
+    obj->env = NULL;
+    obj->calls = 0;
+    obj->jit = NULL;
+    return obj;
+}
+
+static const char *code_to_string(Object *obj)
+{
+    sprintf(_context->string, "<code>");
+    return _context->string;
+}
+
+static void code_dump(Object *obj, Writer *writer)
+{
+    writer_puts(writer, "<code>");
+}
+
+static void code_mark(Object *obj)
+{
+    Code *code = (Code*)obj;
+    object_mark((Object*)code->args);
+    object_mark(code->body);
+    node_mark(code->node);
+}
+
+static void code_finalize(Object *obj)
+{
+    node_delete(((Code*)obj)->node);
+}
+
+Code *code_initialize()
+{
+    Code *obj = (Code*)malloc(sizeof(Code));
+    obj->object.to_string = &code_to_string;
+    obj->object.dump = &code_dump;
+    obj->object.mark = &code_mark;
+    obj->object.finalize = &code_finalize;
     obj->args = NULL;
     obj->body = NULL;
-    obj->env = NULL;
+    obj->node = NULL;
+    obj->storage = STORAGE_UNKNOWN;
     return obj;
 }
 
@@ -307,23 +1133,20 @@ static const char *native_to_string(Object *obj)
 {
     const char *str = ((Native*)obj)->cstr;
     if (str != NULL) {
-        sprintf(string, "<native function %s>", str);
+        sprintf(_context->string, "<native function %s>", str);
     }
     else {
-        sprintf(string, "<native function *unknown*>");
+        sprintf(_context->string, "<native function *unknown*>");
     }
-    return string;
+    return _context->string;
 }
 
-static void native_dump(Object *obj)
+static void native_dump(Object *obj, Writer *writer)
 {
     const char *str = ((Native*)obj)->cstr;
-    if (str != NULL) {
-        printf("<native function %s>", str);
-    }
-    else {
-        printf("<native function *unknown*>");
-    }
+    writer_puts(writer, "<native function ");
+    writer_puts(writer, str != NULL ? str : "*unknown*");
+    writer_putc(writer, '>');
 }
 
 static void native_finalize(Object *obj)
@@ -346,7 +1169,7 @@ Native *native_initialize()
 }
 
 
-Object *object_create(Type type)
+Object *object_create_unmanaged(Type type)
 {
     Object *obj = NULL;
 
@@ -354,6 +1177,12 @@ Object *object_create(Type type)
     case OBJECT_TYPE_INTEGER:
         obj = (Object*)integer_initialize();
         break;
+    case OBJECT_TYPE_BIGNUM:
+        obj = (Object*)bignum_initialize();
+        break;
+    case OBJECT_TYPE_FLONUM:
+        obj = (Object*)flonum_initialize();
+        break;
     case OBJECT_TYPE_BOOLEAN:
         obj = (Object*)boolean_initialize();
         break;
@@ -375,15 +1204,95 @@ Object *object_create(Type type)
     case OBJECT_TYPE_NATIVE:
         obj = (Object*)native_initialize();
         break;
+    case OBJECT_TYPE_CODE:
+        obj = (Object*)code_initialize();
+        break;
+    case OBJECT_TYPE_F64VECTOR:
+        obj = (Object*)f64vector_initialize();
+        break;
+    case OBJECT_TYPE_I64VECTOR:
+        obj = (Object*)i64vector_initialize();
+        break;
+    case OBJECT_TYPE_VECTOR:
+        obj = (Object*)vector_initialize();
+        break;
+    case OBJECT_TYPE_HASH_TABLE:
+        obj = (Object*)hash_table_initialize();
+        break;
+    case OBJECT_TYPE_MAP:
+        obj = (Object*)map_initialize();
+        break;
+    case OBJECT_TYPE_MAP_NODE:
+        obj = (Object*)map_node_initialize();
+        break;
+    case OBJECT_TYPE_RECORD_TYPE:
+        obj = (Object*)record_type_initialize();
+        break;
+    case OBJECT_TYPE_RECORD_PROCEDURE:
+        obj = (Object*)record_procedure_initialize();
+        break;
+    case OBJECT_TYPE_STRING_BUILDER:
+        obj = (Object*)string_builder_initialize();
+        break;
+    case OBJECT_TYPE_PORT:
+        obj = (Object*)port_initialize();
+        break;
+    case OBJECT_TYPE_PROMISE:
+        obj = (Object*)promise_initialize();
+        break;
+    case OBJECT_TYPE_TRANSDUCER:
+        obj = (Object*)transducer_initialize();
+        break;
+    case OBJECT_TYPE_FUTURE:
+        obj = (Object*)future_initialize();
+        break;
+    case OBJECT_TYPE_ACTOR:
+        obj = (Object*)actor_initialize();
+        break;
     default:
         FATAL("Invalid object type");
     }
 
     obj->type = type;
+    obj->marked = false;
+    obj->frozen = false;
+    obj->shared = false;
+    return obj;
+}
+
+Object *object_create(Type type)
+{
+    Object *obj = object_create_unmanaged(type);
     gc_add(obj);
     return obj;
 }
 
+Object *object_create_record(RecordType *type)
+{
+    Record *obj = malloc(sizeof(Record) + type->size * sizeof(Object*));
+    unsigned i;
+
+    obj->object.type = OBJECT_TYPE_RECORD;
+    obj->object.marked = false;
+    obj->object.frozen = false;
+    obj->object.shared = false;
+    obj->object.to_string = &record_to_string;
+    obj->object.dump = &record_dump;
+    obj->object.mark = &record_mark;
+    obj->object.finalize = &finalize;
+    obj->type = type;
+    for (i = 0; i < type->size; i++) {
+        obj->slots[i] = NULL;
+    }
+    gc_add((Object*)obj);
+    return (Object*)obj;
+}
+
+Object *object_boolean(bool value)
+{
+    return (Object*)(value ? &_true : &_false);
+}
+
 void object_delete(Object *obj)
 {
     if (obj != NULL) {
@@ -404,20 +1313,21 @@ const char* object_to_string(Object *obj)
     return obj->to_string(obj);
 }
 
-void object_dump(Object *obj)
+void object_write(Object *obj, Writer *writer)
 {
     if (obj != NULL) {
-        if (obj->type == OBJECT_TYPE_PAIR) {
-            printf("(");
-        }
-        obj->dump(obj);
+        obj->dump(obj, writer);
     }
 }
 
+void object_dump(Object *obj)
+{
+    object_write(obj, writer_stdout());
+}
+
 void object_mark(Object *obj)
 {
-    if (obj && !obj->marked) {
-        obj->marked = true;
+    if (obj && set_marked(obj)) {
         obj->mark(obj);
     }
 }
@@ -8,7 +8,12 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include "bignum.h"
+#include "writer.h"
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define STRING_MAX_LENGTH 256
 
@@ -16,6 +21,8 @@ typedef enum type
 {
     OBJECT_TYPE_NONE,
     OBJECT_TYPE_INTEGER,
+    OBJECT_TYPE_BIGNUM,
+    OBJECT_TYPE_FLONUM,
     OBJECT_TYPE_BOOLEAN,
     OBJECT_TYPE_STRING,
     OBJECT_TYPE_PAIR,
@@ -25,6 +32,22 @@ typedef enum type
     OBJECT_TYPE_ENVIRONMENT,
     OBJECT_TYPE_PROCEDURE,
     OBJECT_TYPE_NATIVE,
+    OBJECT_TYPE_CODE,
+    OBJECT_TYPE_F64VECTOR,
+    OBJECT_TYPE_I64VECTOR,
+    OBJECT_TYPE_VECTOR,
+    OBJECT_TYPE_HASH_TABLE,
+    OBJECT_TYPE_MAP,
+    OBJECT_TYPE_MAP_NODE,
+    OBJECT_TYPE_RECORD_TYPE,
+    OBJECT_TYPE_RECORD,
+    OBJECT_TYPE_RECORD_PROCEDURE,
+    OBJECT_TYPE_STRING_BUILDER,
+    OBJECT_TYPE_PORT,
+    OBJECT_TYPE_PROMISE,
+    OBJECT_TYPE_TRANSDUCER,
+    OBJECT_TYPE_FUTURE,
+    OBJECT_TYPE_ACTOR,
     OBJECT_TYPE_LAST
 } Type;
 
@@ -32,14 +55,26 @@ typedef struct object
 {
     Type type;
     bool marked;
+    // Frozen objects are shared, they stay marked and out of any heap
+    bool frozen;
+    // Objects inherited from the process which forked this one, their
+    // marks are kept aside so collections don't write to them
+    bool shared;
     const char *(*to_string)(struct object*);
-    void (*dump)(struct object*);
+    void (*dump)(struct object*, Writer*);
     void (*mark)(struct object*);
     void (*finalize)(struct object*);
 } Object;
 
 typedef Object *(*NativeFunction)(Object *);
 
+typedef enum storage
+{
+    STORAGE_UNKNOWN,
+    STORAGE_STACK,
+    STORAGE_HEAP
+} Storage;
+
 typedef struct frame {
     char *cstr;
     Object *object;
@@ -49,21 +84,254 @@ typedef struct frame {
 typedef struct integer
 {
     Object object;
-    int value;
+    int64_t value;
 } Integer;
 
+/*
+ * Integer which doesn't fit into 64 bits. Results of arithmetic that fit
+ * are always represented by Integer.
+ */
+typedef struct bignum
+{
+    Object object;
+    Big value;
+} Bignum;
+
+typedef struct flonum
+{
+    Object object;
+    double value;
+} Flonum;
+
+/*
+ * Homogeneous vectors keep unboxed elements in one contiguous block, which
+ * the GC never scans.
+ */
+typedef struct f64vector
+{
+    Object object;
+    size_t length;
+    double *data;
+} F64Vector;
+
+typedef struct i64vector
+{
+    Object object;
+    size_t length;
+    int64_t *data;
+} I64Vector;
+
+/*
+ * Elements of a vector are stored in one contiguous array.
+ */
+typedef struct vector
+{
+    Object object;
+    size_t length;
+    Object **items;
+} Vector;
+
+/*
+ * Slot of a hash table. Hash of the key is stored with it, zero marks an
+ * empty slot.
+ */
+typedef struct hash_entry
+{
+    uint64_t hash;
+    Object *key;
+    Object *value;
+} HashEntry;
+
+/*
+ * Open addressing table with Robin Hood probing, capacity is a power of two.
+ */
+typedef struct hash_table
+{
+    Object object;
+    size_t count;
+    size_t capacity;
+    HashEntry *entries;
+} HashTable;
+
+/*
+ * Node of a hash array mapped trie. Bits of the maps tell which of 32
+ * hash fragments have an entry or a child node. Slots hold keys and
+ * values of entries followed by children, both in order of fragments.
+ * Nodes below the last fragment hold colliding entries only.
+ */
+typedef struct map_node
+{
+    Object object;
+    uint32_t datamap;
+    uint32_t nodemap;
+    unsigned size;
+    Object **slots;
+} MapNode;
+
+/*
+ * Persistent map, updates create new maps sharing unchanged nodes.
+ */
+typedef struct map
+{
+    Object object;
+    size_t count;
+    MapNode *root;
+} Map;
+
+/*
+ * Copies of a type in other threads keep its identifier, so their
+ * instances are of the same type.
+ */
+typedef struct record_type
+{
+    Object object;
+    unsigned long id;
+    char *cstr;
+    unsigned size;
+    char **fields;
+} RecordType;
+
+/*
+ * Instance of a record type, slots are allocated together with it.
+ */
+typedef struct record
+{
+    Object object;
+    RecordType *type;
+    Object *slots[];
+} Record;
+
+typedef enum record_operation
+{
+    RECORD_CONSTRUCTOR,
+    RECORD_PREDICATE,
+    RECORD_ACCESSOR,
+    RECORD_MODIFIER
+} RecordOperation;
+
+/*
+ * Procedure defined by define-record-type. Constructor stores its
+ * arguments into the listed fields, accessor and modifier use one field.
+ */
+typedef struct record_procedure
+{
+    Object object;
+    char *cstr;
+    RecordOperation operation;
+    RecordType *type;
+    unsigned argc;
+    unsigned *fields;
+} RecordProc;
+
 typedef struct boolean
 {
     Object object;
     bool value;
 } Boolean;
 
+/*
+ * Strings keep the terminating zero after length bytes, capacity counts
+ * allocated bytes without it.
+ */
 typedef struct string
 {
     Object object;
+    size_t length;
+    size_t capacity;
     char *cstr;
 } String;
 
+typedef struct string_builder
+{
+    Object object;
+    size_t length;
+    size_t capacity;
+    char *data;
+} StringBuilder;
+
+/*
+ * Input ports keep unread bytes between start and end of the buffer,
+ * output ports write through their writer.
+ */
+typedef struct port
+{
+    Object object;
+    int fd;
+    size_t start;
+    size_t end;
+    size_t capacity;
+    char *buffer;
+    Writer *writer;
+} Port;
+
+struct promise;
+
+typedef struct object *(*PromiseStep)(struct promise*);
+
+/*
+ * A promise calls its thunk or its step on the first force. The value is
+ * kept and the references to the rest are dropped. Steps may replace the
+ * arguments while they run, so consumed values aren't kept alive.
+ */
+typedef struct promise
+{
+    Object object;
+    bool forced;
+    Object *value;
+    Object *thunk;
+    PromiseStep step;
+    Object *first;
+    Object *second;
+} Promise;
+
+typedef enum stage_kind
+{
+    STAGE_MAPPING,
+    STAGE_FILTERING
+} StageKind;
+
+typedef struct stage
+{
+    StageKind kind;
+    Object *proc;
+} Stage;
+
+/*
+ * Stages of a transducer are applied to each value in order.
+ */
+typedef struct transducer
+{
+    Object object;
+    unsigned size;
+    Stage *stages;
+} Transducer;
+
+struct task;
+
+/*
+ * Result of a procedure running on the pool of worker threads. The task is
+ * shared with the pool until both release it, the value is read into the
+ * heap on the first touch.
+ */
+typedef struct future
+{
+    Object object;
+    struct task *task;
+    bool touched;
+    Object *value;
+} Future;
+
+struct mailbox;
+
+/*
+ * Handle of an actor, which may be sent to other actors.
+ */
+typedef struct actor
+{
+    Object object;
+    struct mailbox *mailbox;
+} Actor;
+
 typedef struct pair
 {
     Object object;
@@ -91,14 +359,28 @@ typedef struct environment
     Object object;
     Frame *frame;
     struct environment *next;
+    // Frames by name once there are many of them, see env.c
+    Frame **index;
+    unsigned capacity;
+    unsigned count;
 } Env;
 
-typedef struct procedure
+typedef struct code
 {
     Object object;
     Pair *args;
-    Pair *body;
+    Object *body;
+    struct node *node;
+    Storage storage;
+} Code;
+
+typedef struct procedure
+{
+    Object object;
+    Code *code;
     Env *env;
+    unsigned calls;
+    struct jit *jit;
 } Proc;
 
 typedef struct native
@@ -113,12 +395,27 @@ typedef struct native
 
 Object *object_create(Type type);
 
+Object *object_create_unmanaged(Type type);
+
+/*
+ * Records have a size depending on the type, so they aren't created with
+ * object_create.
+ */
+Object *object_create_record(RecordType *type);
+
+Object *object_boolean(bool value);
+
 void object_delete(Object *obj);
 
 Type object_get_type(Object *obj);
 
 const char* object_to_string(Object *obj);
 
+void object_write(Object *obj, Writer *writer);
+
+/*
+ * Writes to the buffered standard output.
+ */
 void object_dump(Object *obj);
 
 void object_mark(Object *obj);
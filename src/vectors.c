@@ -0,0 +1,625 @@
+/*
+ *    vectors.c
+ */
+
+
+#include "vectors.h"
+#include "kernels.h"
+#include "numbers.h"
+#include "core.h"
+#include "gc.h"
+#include "error.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define throw(format,args...) throw_exception(ERROR_TYPE_CORE, format, ##args);
+
+
+/*
+ * Lengths whose size in bytes overflows fail as allocations do.
+ */
+static void *allocate_data(size_t length, size_t size)
+{
+    void *data = length <= SIZE_MAX / size ? malloc(length > 0 ? length * size : 1) : NULL;
+
+    if (data == NULL) {
+        throw("Not enough memory for vector of length %zu", length);
+    }
+    return data;
+}
+
+/*
+ * Data is allocated first, so a failure doesn't leave half-built vector.
+ */
+static F64Vector *create_f64vector(size_t length)
+{
+    double *data = allocate_data(length, sizeof(double));
+    F64Vector *vector = (F64Vector*)object_create(OBJECT_TYPE_F64VECTOR);
+    vector->data = data;
+    vector->length = length;
+    return vector;
+}
+
+static I64Vector *create_i64vector(size_t length)
+{
+    int64_t *data = allocate_data(length, sizeof(int64_t));
+    I64Vector *vector = (I64Vector*)object_create(OBJECT_TYPE_I64VECTOR);
+    vector->data = data;
+    vector->length = length;
+    return vector;
+}
+
+static F64Vector *get_f64vector(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_F64VECTOR) {
+        throw("Wrong type of argument %s: expected f64vector",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return (F64Vector*)obj;
+}
+
+static I64Vector *get_i64vector(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_I64VECTOR) {
+        throw("Wrong type of argument %s: expected i64vector",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return (I64Vector*)obj;
+}
+
+static size_t get_length(Object *obj)
+{
+    int64_t length = numbers_to_fixnum(obj);
+
+    if (length < 0) {
+        throw("Invalid vector length %s", object_to_string(obj));
+    }
+    return (size_t)length;
+}
+
+static size_t get_index(Object *obj, size_t length)
+{
+    int64_t index = numbers_to_fixnum(obj);
+
+    if (index < 0 || (uint64_t)index >= length) {
+        throw("Index %s out of range", object_to_string(obj));
+    }
+    return (size_t)index;
+}
+
+static void check_lengths(size_t a, size_t b)
+{
+    if (a != b) {
+        throw("Vectors of different length %zu and %zu", a, b);
+    }
+}
+
+static void check_not_empty(size_t length)
+{
+    if (length == 0) {
+        throw("Empty vector");
+    }
+}
+
+static size_t count_numbers(List *list, bool exact)
+{
+    size_t res = 0;
+
+    for (; list != NULL; list = list->next, res++) {
+        if (exact) {
+            numbers_to_fixnum(list->item);
+        }
+        else {
+            numbers_to_double(list->item);
+        }
+    }
+    return res;
+}
+
+/*
+ * Exact sum of elements or of their products when the 64-bit one
+ * overflows.
+ */
+static Object *exact_sum(const int64_t *a, const int64_t *b, size_t n)
+{
+    Big acc;
+    Big term;
+    Big factor;
+    Big tmp;
+    size_t i;
+
+    bignum_from_integer(&acc, 0);
+    for (i = 0; i < n; i++) {
+        bignum_from_integer(&term, a[i]);
+        if (b != NULL) {
+            bignum_from_integer(&factor, b[i]);
+            bignum_multiply(&tmp, &term, &factor);
+            bignum_free(&term);
+            bignum_free(&factor);
+            term = tmp;
+        }
+        bignum_add(&tmp, &acc, &term);
+        bignum_free(&acc);
+        bignum_free(&term);
+        acc = tmp;
+    }
+    return numbers_create_exact(&acc);
+}
+
+Object *vectors_make_f64vector(Object *obj)
+{
+    List *list = (List*)obj;
+    size_t length = get_length(list->item);
+    double fill = list->next != NULL ? numbers_to_double(list->next->item) : 0;
+    F64Vector *vector = create_f64vector(length);
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        vector->data[i] = fill;
+    }
+    return (Object*)vector;
+}
+
+Object *vectors_f64vector(Object *obj)
+{
+    List *list = (List*)obj;
+    size_t length = count_numbers(list, false);
+    double *data = allocate_data(length, sizeof(double));
+    F64Vector *vector;
+    size_t i;
+
+    // Elements are converted before the allocation of the vector object
+    for (i = 0; i < length; i++, list = list->next) {
+        data[i] = numbers_to_double(list->item);
+    }
+    vector = (F64Vector*)object_create(OBJECT_TYPE_F64VECTOR);
+    vector->data = data;
+    vector->length = length;
+    return (Object*)vector;
+}
+
+Object *vectors_f64vector_length(Object *obj)
+{
+    return numbers_create_integer(get_f64vector(((List*)obj)->item)->length);
+}
+
+Object *vectors_f64vector_ref(Object *obj)
+{
+    List *list = (List*)obj;
+    F64Vector *vector = get_f64vector(list->item);
+    return numbers_create_flonum(vector->data[get_index(list->next->item, vector->length)]);
+}
+
+Object *vectors_f64vector_set(Object *obj)
+{
+    List *list = (List*)obj;
+    F64Vector *vector = get_f64vector(list->item);
+    size_t index = get_index(list->next->item, vector->length);
+
+    vector->data[index] = numbers_to_double(list->next->next->item);
+    return NULL;
+}
+
+Object *vectors_f64vector_sum(Object *obj)
+{
+    F64Vector *vector = get_f64vector(((List*)obj)->item);
+    return numbers_create_flonum(kernels_get()->f64_sum(vector->data, vector->length));
+}
+
+Object *vectors_f64vector_dot(Object *obj)
+{
+    List *list = (List*)obj;
+    F64Vector *a = get_f64vector(list->item);
+    F64Vector *b = get_f64vector(list->next->item);
+
+    check_lengths(a->length, b->length);
+    return numbers_create_flonum(kernels_get()->f64_dot(a->data, b->data, a->length));
+}
+
+Object *vectors_f64vector_add(Object *obj)
+{
+    List *list = (List*)obj;
+    F64Vector *a = get_f64vector(list->item);
+    F64Vector *b = get_f64vector(list->next->item);
+    F64Vector *res;
+
+    check_lengths(a->length, b->length);
+    res = create_f64vector(a->length);
+    kernels_get()->f64_add(res->data, a->data, b->data, a->length);
+    return (Object*)res;
+}
+
+Object *vectors_f64vector_mul(Object *obj)
+{
+    List *list = (List*)obj;
+    F64Vector *a = get_f64vector(list->item);
+    F64Vector *b = get_f64vector(list->next->item);
+    F64Vector *res;
+
+    check_lengths(a->length, b->length);
+    res = create_f64vector(a->length);
+    kernels_get()->f64_mul(res->data, a->data, b->data, a->length);
+    return (Object*)res;
+}
+
+Object *vectors_f64vector_scale(Object *obj)
+{
+    List *list = (List*)obj;
+    F64Vector *a = get_f64vector(list->item);
+    double k = numbers_to_double(list->next->item);
+    F64Vector *res = create_f64vector(a->length);
+
+    kernels_get()->f64_scale(res->data, a->data, k, a->length);
+    return (Object*)res;
+}
+
+Object *vectors_f64vector_min(Object *obj)
+{
+    F64Vector *vector = get_f64vector(((List*)obj)->item);
+
+    check_not_empty(vector->length);
+    return numbers_create_flonum(kernels_get()->f64_min(vector->data, vector->length));
+}
+
+Object *vectors_f64vector_max(Object *obj)
+{
+    F64Vector *vector = get_f64vector(((List*)obj)->item);
+
+    check_not_empty(vector->length);
+    return numbers_create_flonum(kernels_get()->f64_max(vector->data, vector->length));
+}
+
+Object *vectors_f64vector_prefix_sum(Object *obj)
+{
+    F64Vector *a = get_f64vector(((List*)obj)->item);
+    F64Vector *res = create_f64vector(a->length);
+
+    kernels_get()->f64_prefix_sum(res->data, a->data, a->length);
+    return (Object*)res;
+}
+
+Object *vectors_make_i64vector(Object *obj)
+{
+    List *list = (List*)obj;
+    size_t length = get_length(list->item);
+    int64_t fill = list->next != NULL ? numbers_to_fixnum(list->next->item) : 0;
+    I64Vector *vector = create_i64vector(length);
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        vector->data[i] = fill;
+    }
+    return (Object*)vector;
+}
+
+Object *vectors_i64vector(Object *obj)
+{
+    List *list = (List*)obj;
+    size_t length = count_numbers(list, true);
+    int64_t *data = allocate_data(length, sizeof(int64_t));
+    I64Vector *vector;
+    size_t i;
+
+    for (i = 0; i < length; i++, list = list->next) {
+        data[i] = numbers_to_fixnum(list->item);
+    }
+    vector = (I64Vector*)object_create(OBJECT_TYPE_I64VECTOR);
+    vector->data = data;
+    vector->length = length;
+    return (Object*)vector;
+}
+
+Object *vectors_i64vector_length(Object *obj)
+{
+    return numbers_create_integer(get_i64vector(((List*)obj)->item)->length);
+}
+
+Object *vectors_i64vector_ref(Object *obj)
+{
+    List *list = (List*)obj;
+    I64Vector *vector = get_i64vector(list->item);
+    return numbers_create_integer(vector->data[get_index(list->next->item, vector->length)]);
+}
+
+Object *vectors_i64vector_set(Object *obj)
+{
+    List *list = (List*)obj;
+    I64Vector *vector = get_i64vector(list->item);
+    size_t index = get_index(list->next->item, vector->length);
+
+    vector->data[index] = numbers_to_fixnum(list->next->next->item);
+    return NULL;
+}
+
+Object *vectors_i64vector_sum(Object *obj)
+{
+    I64Vector *vector = get_i64vector(((List*)obj)->item);
+    int64_t res;
+
+    if (!kernels_get()->i64_sum(&res, vector->data, vector->length)) {
+        return exact_sum(vector->data, NULL, vector->length);
+    }
+    return numbers_create_integer(res);
+}
+
+Object *vectors_i64vector_dot(Object *obj)
+{
+    List *list = (List*)obj;
+    I64Vector *a = get_i64vector(list->item);
+    I64Vector *b = get_i64vector(list->next->item);
+    int64_t res;
+
+    check_lengths(a->length, b->length);
+    if (!kernels_get()->i64_dot(&res, a->data, b->data, a->length)) {
+        return exact_sum(a->data, b->data, a->length);
+    }
+    return numbers_create_integer(res);
+}
+
+static void check_overflow(bool success)
+{
+    if (!success) {
+        throw("Element of i64vector overflows");
+    }
+}
+
+Object *vectors_i64vector_add(Object *obj)
+{
+    List *list = (List*)obj;
+    I64Vector *a = get_i64vector(list->item);
+    I64Vector *b = get_i64vector(list->next->item);
+    I64Vector *res;
+
+    check_lengths(a->length, b->length);
+    res = create_i64vector(a->length);
+    check_overflow(kernels_get()->i64_add(res->data, a->data, b->data, a->length));
+    return (Object*)res;
+}
+
+Object *vectors_i64vector_mul(Object *obj)
+{
+    List *list = (List*)obj;
+    I64Vector *a = get_i64vector(list->item);
+    I64Vector *b = get_i64vector(list->next->item);
+    I64Vector *res;
+
+    check_lengths(a->length, b->length);
+    res = create_i64vector(a->length);
+    check_overflow(kernels_get()->i64_mul(res->data, a->data, b->data, a->length));
+    return (Object*)res;
+}
+
+Object *vectors_i64vector_scale(Object *obj)
+{
+    List *list = (List*)obj;
+    I64Vector *a = get_i64vector(list->item);
+    int64_t k = numbers_to_fixnum(list->next->item);
+    I64Vector *res = create_i64vector(a->length);
+
+    check_overflow(kernels_get()->i64_scale(res->data, a->data, k, a->length));
+    return (Object*)res;
+}
+
+Object *vectors_i64vector_min(Object *obj)
+{
+    I64Vector *vector = get_i64vector(((List*)obj)->item);
+
+    check_not_empty(vector->length);
+    return numbers_create_integer(kernels_get()->i64_min(vector->data, vector->length));
+}
+
+Object *vectors_i64vector_max(Object *obj)
+{
+    I64Vector *vector = get_i64vector(((List*)obj)->item);
+
+    check_not_empty(vector->length);
+    return numbers_create_integer(kernels_get()->i64_max(vector->data, vector->length));
+}
+
+Object *vectors_i64vector_prefix_sum(Object *obj)
+{
+    I64Vector *a = get_i64vector(((List*)obj)->item);
+    I64Vector *res = create_i64vector(a->length);
+
+    check_overflow(kernels_get()->i64_prefix_sum(res->data, a->data, a->length));
+    return (Object*)res;
+}
+
+static Vector *create_vector(size_t length, Object *fill)
+{
+    Object **items = allocate_data(length, sizeof(Object*));
+    Vector *vector;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        items[i] = fill;
+    }
+    vector = (Vector*)object_create(OBJECT_TYPE_VECTOR);
+    vector->items = items;
+    vector->length = length;
+    return vector;
+}
+
+Object *vectors_create(Type type, size_t length)
+{
+    switch (type) {
+    case OBJECT_TYPE_F64VECTOR:
+        return (Object*)create_f64vector(length);
+    case OBJECT_TYPE_I64VECTOR:
+        return (Object*)create_i64vector(length);
+    default:
+        assert(type == OBJECT_TYPE_VECTOR);
+        return (Object*)create_vector(length, NULL);
+    }
+}
+
+static Vector *get_vector(Object *obj)
+{
+    if (obj == NULL || object_get_type(obj) != OBJECT_TYPE_VECTOR) {
+        throw("Wrong type of argument %s: expected vector",
+              obj != NULL ? object_to_string(obj) : "#nil");
+    }
+    return (Vector*)obj;
+}
+
+Object *vectors_make_vector(Object *obj)
+{
+    List *list = (List*)obj;
+    size_t length = get_length(list->item);
+    return (Object*)create_vector(length, list->next != NULL ? list->next->item : NULL);
+}
+
+Object *vectors_vector(Object *obj)
+{
+    List *list;
+    size_t length = 0;
+    Vector *vector;
+    size_t i;
+
+    for (list = (List*)obj; list != NULL; list = list->next) {
+        length++;
+    }
+    vector = create_vector(length, NULL);
+    for (list = (List*)obj, i = 0; i < length; list = list->next, i++) {
+        vector->items[i] = list->item;
+    }
+    return (Object*)vector;
+}
+
+Object *vectors_vector_length(Object *obj)
+{
+    return numbers_create_integer(get_vector(((List*)obj)->item)->length);
+}
+
+Object *vectors_vector_ref(Object *obj)
+{
+    List *list = (List*)obj;
+    Vector *vector = get_vector(list->item);
+    return vector->items[get_index(list->next->item, vector->length)];
+}
+
+Object *vectors_vector_set(Object *obj)
+{
+    List *list = (List*)obj;
+    Vector *vector = get_vector(list->item);
+
+    vector->items[get_index(list->next->item, vector->length)] = list->next->next->item;
+    return NULL;
+}
+
+Object *vectors_list_to_vector(Object *obj)
+{
+    Object *head = ((List*)obj)->item;
+    Object *rest;
+    size_t length = 0;
+    Vector *vector;
+    size_t i;
+
+    for (rest = head; rest != NULL; rest = ((Pair*)rest)->rest) {
+        if (object_get_type(rest) != OBJECT_TYPE_PAIR) {
+            throw("Wrong type of argument %s: expected list", object_to_string(head));
+        }
+        length++;
+    }
+    vector = create_vector(length, NULL);
+    for (rest = head, i = 0; i < length; rest = ((Pair*)rest)->rest, i++) {
+        vector->items[i] = ((Pair*)rest)->first;
+    }
+    return (Object*)vector;
+}
+
+/*
+ * The list is built from the end, its head stays on the stack while
+ * pairs are allocated.
+ */
+Object *vectors_vector_to_list(Object *obj)
+{
+    Vector *vector = get_vector(((List*)obj)->item);
+    Pair *pair;
+    size_t i;
+
+    gc_push(NULL);
+    for (i = vector->length; i > 0; i--) {
+        pair = (Pair*)object_create(OBJECT_TYPE_PAIR);
+        pair->first = vector->items[i - 1];
+        pair->rest = *gc_peek(1);
+        *gc_peek(1) = (Object*)pair;
+    }
+    return gc_pop();
+}
+
+static bool is_less(Object *less, Object *a, Object *b)
+{
+    if (less == NULL) {
+        return numbers_is_less(a, b);
+    }
+    gc_push(less);
+    gc_push(a);
+    gc_push(b);
+    return core_object_to_bool(core_call(2));
+}
+
+/*
+ * Merges sorted runs [lo, mid) and [mid, hi) of src into dst.
+ */
+static void merge(Object *less, Object **dst, Object **src, size_t lo, size_t mid, size_t hi)
+{
+    size_t i = lo;
+    size_t j = mid;
+    size_t k = lo;
+
+    // Runs which are already in order are copied as is
+    if (mid == hi || !is_less(less, src[mid], src[mid - 1])) {
+        memcpy(dst + lo, src + lo, (hi - lo) * sizeof(Object*));
+        return;
+    }
+    while (i < mid && j < hi) {
+        dst[k++] = is_less(less, src[j], src[i]) ? src[j++] : src[i++];
+    }
+    while (i < mid) {
+        dst[k++] = src[i++];
+    }
+    while (j < hi) {
+        dst[k++] = src[j++];
+    }
+}
+
+/*
+ * Stable bottom-up merge sort. Runs alternate between the vector and a
+ * scratch vector, which is a GC object itself, so elements moved into it
+ * stay reachable while the comparison procedure runs.
+ */
+Object *vectors_vector_sort(Object *obj)
+{
+    List *list = (List*)obj;
+    Vector *vector = get_vector(list->item);
+    Object *less = list->next != NULL ? list->next->item : NULL;
+    size_t length = vector->length;
+    Vector *scratch = create_vector(length, NULL);
+    Object **src = vector->items;
+    Object **dst = scratch->items;
+    Object **tmp;
+    size_t width;
+    size_t lo;
+
+    gc_push((Object*)scratch);
+    for (width = 1; width < length; width *= 2) {
+        for (lo = 0; lo < length; lo += 2 * width) {
+            size_t mid = lo + width < length ? lo + width : length;
+            size_t hi = mid + width < length ? mid + width : length;
+            merge(less, dst, src, lo, mid, hi);
+        }
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != vector->items) {
+        memcpy(vector->items, src, length * sizeof(Object*));
+    }
+    gc_pop();
+    return NULL;
+}
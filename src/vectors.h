@@ -0,0 +1,95 @@
+/*
+ *    vectors.h
+ */
+
+
+#ifndef VECTORS_H
+#define VECTORS_H
+
+#include "types.h"
+
+/*
+ * Creates a vector of the type and length. Elements of a vector are #nil,
+ * elements of homogeneous vectors are not initialized.
+ */
+Object *vectors_create(Type type, size_t length);
+
+/*
+ * Homogeneous f64 and i64 vectors. Whole-vector operations run on the
+ * SIMD kernels selected at startup. Sums and dot products of i64 vectors
+ * fall back to bignums on overflow, elementwise results which don't fit
+ * into 64 bits are errors.
+ */
+Object *vectors_make_f64vector(Object *obj);
+
+Object *vectors_f64vector(Object *obj);
+
+Object *vectors_f64vector_length(Object *obj);
+
+Object *vectors_f64vector_ref(Object *obj);
+
+Object *vectors_f64vector_set(Object *obj);
+
+Object *vectors_f64vector_sum(Object *obj);
+
+Object *vectors_f64vector_dot(Object *obj);
+
+Object *vectors_f64vector_add(Object *obj);
+
+Object *vectors_f64vector_mul(Object *obj);
+
+Object *vectors_f64vector_scale(Object *obj);
+
+Object *vectors_f64vector_min(Object *obj);
+
+Object *vectors_f64vector_max(Object *obj);
+
+Object *vectors_f64vector_prefix_sum(Object *obj);
+
+Object *vectors_make_i64vector(Object *obj);
+
+Object *vectors_i64vector(Object *obj);
+
+Object *vectors_i64vector_length(Object *obj);
+
+Object *vectors_i64vector_ref(Object *obj);
+
+Object *vectors_i64vector_set(Object *obj);
+
+Object *vectors_i64vector_sum(Object *obj);
+
+Object *vectors_i64vector_dot(Object *obj);
+
+Object *vectors_i64vector_add(Object *obj);
+
+Object *vectors_i64vector_mul(Object *obj);
+
+Object *vectors_i64vector_scale(Object *obj);
+
+Object *vectors_i64vector_min(Object *obj);
+
+Object *vectors_i64vector_max(Object *obj);
+
+Object *vectors_i64vector_prefix_sum(Object *obj);
+
+/*
+ * Heterogeneous vectors. vector-sort! takes an optional less procedure,
+ * numbers are compared with < by default.
+ */
+Object *vectors_make_vector(Object *obj);
+
+Object *vectors_vector(Object *obj);
+
+Object *vectors_vector_length(Object *obj);
+
+Object *vectors_vector_ref(Object *obj);
+
+Object *vectors_vector_set(Object *obj);
+
+Object *vectors_list_to_vector(Object *obj);
+
+Object *vectors_vector_to_list(Object *obj);
+
+Object *vectors_vector_sort(Object *obj);
+
+#endif // VECTORS_H
@@ -0,0 +1,147 @@
+/*
+ *    writer.c
+ */
+
+
+#include "writer.h"
+#include "context.h"
+
+#include "debug.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+Writer *writer_stdout(void)
+{
+    return &_context->output;
+}
+
+void writer_init(Writer *writer, int fd)
+{
+    writer->fd = fd;
+    writer->length = 0;
+    writer->captured = NULL;
+    writer->captured_length = 0;
+    writer->captured_capacity = 0;
+}
+
+static void capture(Writer *writer)
+{
+    const size_t length = writer->captured_length + writer->length;
+
+    if (writer->length == 0) {
+        return;
+    }
+    if (length > writer->captured_capacity) {
+        while (length > writer->captured_capacity) {
+            writer->captured_capacity = writer->captured_capacity > 0
+                ? 2 * writer->captured_capacity : WRITER_BUFFER_SIZE;
+        }
+        writer->captured = realloc(writer->captured, writer->captured_capacity);
+        if (writer->captured == NULL) {
+            FATAL("Not enough memory for output");
+        }
+    }
+    memcpy(writer->captured + writer->captured_length, writer->data, writer->length);
+    writer->captured_length = length;
+    writer->length = 0;
+}
+
+bool writer_flush(Writer *writer)
+{
+    const char *ptr = writer->data;
+    size_t left = writer->length;
+
+    if (writer->fd == WRITER_CAPTURE) {
+        capture(writer);
+        return true;
+    }
+    writer->length = 0;
+    while (left > 0) {
+        ssize_t written = write(writer->fd, ptr, left);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += written;
+        left -= written;
+    }
+    return true;
+}
+
+void writer_capture(Writer *writer)
+{
+    writer_flush(writer);
+    writer->fd = WRITER_CAPTURE;
+}
+
+const char *writer_captured(Writer *writer, size_t *length)
+{
+    capture(writer);
+    *length = writer->captured_length;
+    writer->captured_length = 0;
+    return writer->captured;
+}
+
+void writer_release(Writer *writer, int fd)
+{
+    writer_flush(writer);
+    free(writer->captured);
+    writer_init(writer, fd);
+}
+
+void writer_write(Writer *writer, const char *data, size_t length)
+{
+    while (length > 0) {
+        size_t size = WRITER_BUFFER_SIZE - writer->length;
+
+        if (size == 0) {
+            writer_flush(writer);
+            size = WRITER_BUFFER_SIZE;
+        }
+        if (size > length) {
+            size = length;
+        }
+        memcpy(writer->data + writer->length, data, size);
+        writer->length += size;
+        data += size;
+        length -= size;
+    }
+}
+
+void writer_puts(Writer *writer, const char *str)
+{
+    writer_write(writer, str, strlen(str));
+}
+
+void writer_putc(Writer *writer, char c)
+{
+    if (writer->length == WRITER_BUFFER_SIZE) {
+        writer_flush(writer);
+    }
+    writer->data[writer->length++] = c;
+}
+
+void writer_integer(Writer *writer, int64_t value)
+{
+    char buf[24];
+    char *ptr = buf + sizeof(buf);
+    // Negative values are converted digit by digit to handle INT64_MIN
+    bool negative = value < 0;
+
+    do {
+        int digit = (int)(value % 10);
+        *--ptr = '0' + (negative ? -digit : digit);
+        value /= 10;
+    } while (value != 0);
+    if (negative) {
+        *--ptr = '-';
+    }
+    writer_write(writer, ptr, buf + sizeof(buf) - ptr);
+}
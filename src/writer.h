@@ -0,0 +1,70 @@
+/*
+ *    writer.h
+ */
+
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WRITER_BUFFER_SIZE 65536
+
+/*
+ * Descriptor of a writer keeping its output in memory.
+ */
+#define WRITER_CAPTURE -1
+
+/*
+ * Output buffered in user space and written to the file descriptor only
+ * when the buffer is full or on an explicit flush. Code printing to the
+ * same descriptor with stdio flushes the writer first.
+ */
+typedef struct writer
+{
+    int fd;
+    size_t length;
+    char data[WRITER_BUFFER_SIZE];
+    // Output flushed while capturing
+    char *captured;
+    size_t captured_length;
+    size_t captured_capacity;
+} Writer;
+
+/*
+ * Standard output of the current context.
+ */
+Writer *writer_stdout(void);
+
+void writer_init(Writer *writer, int fd);
+
+void writer_write(Writer *writer, const char *data, size_t length);
+
+void writer_puts(Writer *writer, const char *str);
+
+void writer_putc(Writer *writer, char c);
+
+void writer_integer(Writer *writer, int64_t value);
+
+/*
+ * Returns false if the descriptor failed, the buffered output is dropped.
+ */
+bool writer_flush(Writer *writer);
+
+/*
+ * Flushes the writer and keeps its further output in memory, until it is
+ * released to a descriptor again.
+ */
+void writer_capture(Writer *writer);
+
+/*
+ * Returns the output captured since the last call, it is valid until the
+ * next write.
+ */
+const char *writer_captured(Writer *writer, size_t *length);
+
+void writer_release(Writer *writer, int fd);
+
+#endif // WRITER_H